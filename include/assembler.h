@@ -86,12 +86,49 @@ int chip8asm_emit(struct chip8asm *chipasm, struct chip8asm_program *prog);
  */
 int chip8asm_eval(const struct chip8asm *chipasm, const char *expr, int line,
     uint16_t *value);
+/**
+ * Returns the name of a file which has been processed by the assembler.
+ *
+ * These are the files passed to `chip8asm_process_file` and those included
+ * from them, each listed once, in the order they were first processed.  This
+ * can be used to generate a list of dependencies for a build system.
+ *
+ * @param i The index of the file.
+ * @return The name of the file, or NULL if `i` is past the last file.
+ */
+const char *chip8asm_file(const struct chip8asm *chipasm, size_t i);
+/**
+ * Processes the given buffer of assembly code as part of the first pass.
+ *
+ * This is equivalent to calling `chip8asm_process_line` on each line of the
+ * buffer in turn, but the lines are parsed in place, so the buffer (which may
+ * be a memory-mapped file) need not be null-terminated and is not copied.
+ * Lines may be of any length, and the last line need not end with a newline.
+ *
+ * @param len The length of the buffer, in bytes.
+ * @return An error code.
+ */
+int chip8asm_process_buffer(
+    struct chip8asm *chipasm, const char *buf, size_t len);
+/**
+ * Processes the assembly code in the given file as part of the first pass.
+ *
+ * The file is mapped into memory if possible and processed using
+ * `chip8asm_process_buffer`.  Line numbers in error messages count from the
+ * start of the file, and `INCLUDE` directives in the file are resolved
+ * relative to the directory containing it.
+ *
+ * @param fname The name of the file, or '-' for standard input.
+ * @return An error code.
+ */
+int chip8asm_process_file(struct chip8asm *chipasm, const char *fname);
 /**
  * Processes the given line of assembly code as part of the first pass.
  *
  * More specifically, the line will be parsed into an internal "instruction"
  * format and added to the list of instructions to be processed during the
- * second pass (which can be triggered using `chip8_emit`).
+ * second pass (which can be triggered using `chip8_emit`).  The line ends at
+ * the first newline or null byte.
  *
  * @return An error code.
  */
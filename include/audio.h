@@ -12,31 +12,43 @@
 #ifndef CHIP8_AUDIO_H
 #define CHIP8_AUDIO_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 /**
- * A simple audio ring buffer.
+ * A buzzer which plays a square wave while it is turned on.
  *
- * This struct just holds some audio data (like a square wave) and can be used
- * repeatedly to fill an audio callback buffer with data. Right now, we use
- * signed 16-bit samples with native endianness and mono output.
+ * One thread (the emulator) turns the buzzer on and off by pushing timestamped
+ * edges, and another (the audio callback) synthesizes the output from them,
+ * a fixed delay later.  The wave is band-limited and the buzzer fades in and
+ * out over a couple of milliseconds, so neither the wave itself nor the edges
+ * cause clicks.  Right now, we use signed 16-bit samples with native
+ * endianness and mono output.
  */
-struct audio_ring_buffer;
+struct audio_tone;
 
-void audio_ring_buffer_free(struct audio_ring_buffer *ring);
 /**
- * Fills the given buffer with data from the ring buffer.
+ * Creates a new buzzer, which is initially off.
+ */
+struct audio_tone *audio_tone_new(
+    int sample_rate, int frequency, int16_t volume);
+void audio_tone_free(struct audio_tone *tone);
+/**
+ * Turns the buzzer on or off at the given time.
  *
- * @param len The length of the buffer to fill, in samples.
+ * Edges must be pushed in order of time.  If the two threads' clocks drift
+ * apart by too much, the output skips to the time of the next edge.
+ *
+ * @param time The time of the edge, in samples since the buzzer was created.
+ * @return Whether the edge was queued (false if too many edges are pending).
  */
-void audio_ring_buffer_fill(
-    struct audio_ring_buffer *ring, int16_t *buf, size_t len);
-
+bool audio_tone_push(struct audio_tone *tone, uint64_t time, bool on);
 /**
- * Returns a ring buffer containing a square wave.
+ * Fills the given buffer with the next samples of output.
+ *
+ * @param len The length of the buffer to fill, in samples.
  */
-struct audio_ring_buffer *audio_square_wave(
-    int sample_rate, int frequency, int16_t volume);
+void audio_tone_fill(struct audio_tone *tone, int16_t *buf, size_t len);
 
 #endif
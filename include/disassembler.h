@@ -13,6 +13,7 @@
 #define CHIP8_DISASSEMBLER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /**
@@ -48,6 +49,15 @@ void chip8disasm_destroy(struct chip8disasm *disasm);
  * @return An error code.
  */
 int chip8disasm_dump(const struct chip8disasm *disasm, FILE *out);
+/**
+ * Returns whether the disassembly has a label at the given address.
+ *
+ * The address is a memory address (starting from `CHIP8_PROG_START` for the
+ * first byte of the program), and the name of the label, as it appears in the
+ * disassembly, is `L` followed by the three hexadecimal digits of the address
+ * minus `CHIP8_PROG_START`.
+ */
+bool chip8disasm_has_label(const struct chip8disasm *disasm, uint16_t addr);
 
 /**
  * Returns the default set of options for the disassembler.
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Passing completed frames from an emulation thread to a display thread.
+ *
+ * The frames are triple-buffered: the emulation thread fills one buffer while
+ * the display thread reads another, and the third holds the newest completed
+ * frame.  Publishing and acquiring a frame only swap pointers under a lock, so
+ * neither thread ever waits for the other to finish with a frame; if the
+ * display falls behind, intermediate frames are simply skipped.
+ */
+#ifndef CHIP8_FRAMES_H
+#define CHIP8_FRAMES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "interpreter.h"
+
+/**
+ * The state of the interpreter needed to present a frame.
+ */
+struct chip8_frame {
+    /**
+     * The contents of the display, in the same format as `chip8.display`.
+     */
+    uint64_t display[CHIP8_DISPLAY_HEIGHT][CHIP8_DISPLAY_ROW_WORDS];
+    /**
+     * Whether the display is in high-resolution mode.
+     */
+    bool highres;
+    /**
+     * The rows of the display which have changed since the previously
+     * acquired frame, as a bitmask (bit `y` corresponds to row `y`).
+     *
+     * All rows are marked as changed in the first frame.
+     */
+    uint64_t dirty_rows;
+    /**
+     * The number of frames published before this one.
+     */
+    uint64_t number;
+};
+
+/**
+ * A triple buffer of frames.
+ *
+ * There must be only one thread publishing frames and one acquiring them.
+ */
+struct chip8_frames;
+
+/**
+ * Creates a new triple buffer.
+ *
+ * Until a frame is published, the acquired frame is blank.
+ *
+ * @return The buffer, or NULL if its lock could not be created.
+ */
+struct chip8_frames *chip8_frames_new(void);
+void chip8_frames_destroy(struct chip8_frames *frames);
+
+/**
+ * Publishes the current state of the interpreter as the newest frame.
+ *
+ * @param dirty_rows The rows of the display which have changed since the last
+ * frame was published, as reported to the interpreter's draw callback.
+ */
+void chip8_frames_publish(
+    struct chip8_frames *frames, const struct chip8 *chip, uint64_t dirty_rows);
+/**
+ * Acquires the newest published frame, replacing the previously acquired one.
+ *
+ * If no frame has been published since the last call, this waits for one for
+ * up to the given time, and then returns the previously acquired frame.  The
+ * returned frame remains valid until the next call.
+ *
+ * @param wait_nanos The maximum time to wait, in nanoseconds (0 not to wait at
+ * all).
+ * @param fresh Set to whether the returned frame is a new one.
+ */
+const struct chip8_frame *chip8_frames_acquire(
+    struct chip8_frames *frames, long wait_nanos, bool *fresh);
+/**
+ * Returns whether the pixel at the given position in the frame is on.
+ */
+bool chip8_frame_pixel(const struct chip8_frame *frame, int x, int y);
+
+#endif
@@ -28,6 +28,26 @@
  * The maximum size of a Chip-8 program, in bytes.
  */
 #define CHIP8_PROG_SIZE (CHIP8_MEM_SIZE - CHIP8_PROG_START)
+/**
+ * Returns the `Vx` part of the given opcode.
+ */
+#define OPCODE2VX(opcode) (((opcode)&0xF00) >> 8)
+/**
+ * Returns the `Vy` part of the given opcode.
+ */
+#define OPCODE2VY(opcode) (((opcode)&0xF0) >> 4)
+/**
+ * Returns the `addr` part of the given opcode.
+ */
+#define OPCODE2ADDR(opcode) ((opcode)&0xFFF)
+/**
+ * Returns the `byte` part of the given opcode.
+ */
+#define OPCODE2BYTE(opcode) ((opcode)&0xFF)
+/**
+ * Returns the `nibble` part of the given opcode.
+ */
+#define OPCODE2NIBBLE(opcode) ((opcode)&0xF)
 
 /**
  * A Chip-8 register.
@@ -424,6 +444,11 @@ struct chip8_instruction chip8_instruction_from_opcode(uint16_t opcode, bool shi
  * @param instr The instruction to convert.
  */
 uint16_t chip8_instruction_to_opcode(struct chip8_instruction instr);
+/**
+ * Returns whether the given instruction may transfer control somewhere other
+ * than the instruction following it (jumps, calls, returns, skips and EXIT).
+ */
+bool chip8_instruction_is_control(struct chip8_instruction instr);
 /**
  * Returns whether the given instruction takes an address operand.
  */
@@ -21,11 +21,85 @@
 
 #define CHIP8_DISPLAY_WIDTH 128
 #define CHIP8_DISPLAY_HEIGHT 64
+/**
+ * The number of 64-bit words in a row of the display.
+ */
+#define CHIP8_DISPLAY_ROW_WORDS (CHIP8_DISPLAY_WIDTH / 64)
+/**
+ * A dirty row mask with every row of the display set.
+ */
+#define CHIP8_DISPLAY_ALL_ROWS UINT64_MAX
+
+/**
+ * The maximum number of instructions in a block (see `struct chip8`).
+ */
+#define CHIP8_BLOCK_MAX 32
 
+#ifndef CHIP8_STACK_DEPTH
 /**
- * A node in a linked list which functions as a call stack.
+ * The maximum depth of the call stack (default 16).
+ *
+ * This can be changed using the `stack_depth` build option.
  */
-struct chip8_call_node;
+#define CHIP8_STACK_DEPTH 16
+#endif
+
+#ifndef CHIP8_DEFAULT_DISPATCH
+/**
+ * The dispatch method used by default (see `enum chip8_dispatch`).
+ *
+ * This can be changed using the `dispatch` build option.
+ */
+#define CHIP8_DEFAULT_DISPATCH CHIP8_DISPATCH_SWITCH
+#endif
+
+/**
+ * The reason why a call to `chip8_run_cycles` or `chip8_run_until_frame`
+ * returned.
+ */
+enum chip8_run_status {
+    /**
+     * An error occurred during execution.
+     */
+    CHIP8_RUN_ERROR = -1,
+    /**
+     * The requested number of instructions were executed.
+     */
+    CHIP8_RUN_CYCLES_DONE,
+    /**
+     * A timer tick (frame boundary) was reached.
+     *
+     * If no timer is enabled, a frame is `instrs_per_tick` instructions.
+     */
+    CHIP8_RUN_FRAME_DONE,
+    /**
+     * The interpreter is halted.
+     */
+    CHIP8_RUN_HALTED,
+    /**
+     * The interpreter is waiting for a key press (`LD Vx, K`).
+     *
+     * When using the virtual timer, the instructions which would otherwise be
+     * spent waiting are skipped, so the interpreter stops at the end of the
+     * frame (or after the number of requested cycles, if that comes first).
+     */
+    CHIP8_RUN_WAITING_KEY,
+};
+
+/**
+ * The ways in which the interpreter can dispatch instructions to their
+ * implementations.  Both give exactly the same results.
+ */
+enum chip8_dispatch {
+    /**
+     * A switch on the operation of the decoded instruction.
+     */
+    CHIP8_DISPATCH_SWITCH,
+    /**
+     * Tables indexed by the fields of the opcode, which isn't decoded first.
+     */
+    CHIP8_DISPATCH_TABLE,
+};
 
 /**
  * Options which can be given to the interpreter.
@@ -65,8 +139,48 @@ struct chip8_options {
      * The frequency at which to run the game (default 60Hz).
      */
     unsigned long timer_freq;
+    /**
+     * Whether to use a virtual timer rather than the system clock (default
+     * false).
+     *
+     * When the virtual timer is used, the delay and sound timers tick once
+     * every `instrs_per_tick` instructions, and the interpreter never sleeps
+     * or reads the system clock, so programs run as fast as possible (and
+     * deterministically).  Delayed draws skip ahead to the next tick instead
+     * of waiting for it.  If this is set, `enable_timer` is ignored.
+     */
+    bool virtual_timer;
+    /**
+     * The number of instructions to execute per tick when using the virtual
+     * timer (default 100).
+     */
+    unsigned long instrs_per_tick;
+    /**
+     * Whether to skip idle loops and waits for a key (default true).
+     *
+     * Skipping only happens with the virtual timer or no timer, and never
+     * while profiling or tracing.  The resulting state is exactly what
+     * running the skipped instructions would give, but they take no time, so
+     * this should be turned off when timing the interpreter.
+     */
+    bool skip_idle;
+    /**
+     * How to dispatch instructions (default `CHIP8_DEFAULT_DISPATCH`).
+     */
+    enum chip8_dispatch dispatch;
+    /**
+     * The seed for the random number generator used by `RND` (default 0).
+     *
+     * The generator is entirely determined by its seed, so two interpreters
+     * with the same seed and options, given the same key presses at the same
+     * points, always behave identically.
+     */
+    uint32_t seed;
 };
 
+struct chip8_profile;
+struct chip8_trace;
+
 /**
  * Contains the state of the interpreter.
  */
@@ -80,12 +194,13 @@ struct chip8 {
      */
     uint8_t mem[CHIP8_MEM_SIZE];
     /**
-     * The display.
+     * The display, stored as a packed bitmap.
      *
-     * Each element in the display array is a boolean value specifying whether
-     * that pixel is on or off.
+     * Element `[y][w]` holds the pixels from `x = 64 * w` to `x = 64 * w + 63`
+     * on row `y`, with the leftmost pixel in the most significant bit.  Use
+     * `chip8_display_pixel` to get the state of a single pixel.
      */
-    bool display[CHIP8_DISPLAY_WIDTH][CHIP8_DISPLAY_HEIGHT];
+    uint64_t display[CHIP8_DISPLAY_HEIGHT][CHIP8_DISPLAY_ROW_WORDS];
     /**
      * The general-purpose registers `V0`-`VF`.
      */
@@ -119,34 +234,106 @@ struct chip8 {
      */
     bool highres;
     /**
-     * The function to be called every time a pixel needs to be redrawn.  It
-     * accepts as parameters the x and y coordinates of the pixel, whether the
-     * pixel should be turned on and whether it should be drawn in
-     * high-resolution mode.
+     * The function to be called when the display needs to be redrawn.
+     *
+     * It is called by `chip8_display_flush`, which the interpreter calls on
+     * every timer tick, and is given the interpreter (whose `display` and
+     * `highres` fields should be used to draw) and a bitmask of the rows which
+     * have changed since the last call (bit `y` corresponds to row `y`).
      */
-    void (*draw_callback)(int x, int y, bool on, bool high);
+    void (*draw_callback)(const struct chip8 *chip, uint64_t dirty_rows);
     /**
-     * Whether the external display needs to be completely redrawn (e.g. after
-     * changing between high- and low-resolution modes.
+     * The rows of the display which have changed since the last call to
+     * `chip8_display_flush`, as a bitmask (bit `y` corresponds to row `y`).
+     *
+     * Set this to `CHIP8_DISPLAY_ALL_ROWS` if the external display needs to
+     * be completely redrawn (e.g. because its window was resized).
      */
-    bool needs_full_redraw;
+    uint64_t dirty_rows;
     /**
      * The internal timer, in ticks.
      *
      * The frequency of these ticks is configured in the options passed to the
-     * `chip8_new` function.
+     * `chip8_new` function.  When using the virtual timer, this is the number
+     * of ticks that have elapsed since the interpreter was created.
      */
     unsigned long timer_ticks;
+    /**
+     * The number of instructions executed since the last tick.
+     *
+     * This is only used by the virtual timer.
+     */
+    unsigned long tick_instrs;
+    /**
+     * The total number of instructions executed.
+     */
+    uint64_t cycles;
     /**
      * The call stack (for returning from subroutines).
+     *
+     * Each element is the address of a `CALL` instruction; only the first
+     * `stack_size` elements are meaningful.
+     */
+    uint16_t call_stack[CHIP8_STACK_DEPTH];
+    /**
+     * The number of elements in the call stack.
      */
-    struct chip8_call_node *call_stack;
+    int stack_size;
     /**
      * Which keys are currently being pressed.
      *
      * Each bit (0x0-0xF) represents the state of the corresponding key 0-F.
      */
     uint16_t key_states;
+    /**
+     * The state of the random number generator used by `RND`.
+     *
+     * This is derived from `opts.seed` by `chip8_new`, and must never be zero.
+     * Each interpreter has its own generator, so separate instances never
+     * affect each other.
+     */
+    uint32_t rand_state;
+    /**
+     * Where to collect execution statistics, or NULL (the default) not to
+     * collect them.
+     *
+     * Instructions are executed one at a time (rather than in blocks) while
+     * profiling, so the interpreter runs somewhat slower.
+     */
+    struct chip8_profile *profile;
+    /**
+     * Where to record a binary trace of the executed instructions, or NULL
+     * (the default) not to record one.
+     *
+     * Unlike profiling, tracing does not prevent instructions from being
+     * executed in blocks.
+     */
+    struct chip8_trace *trace;
+    /**
+     * The decoded instruction cache.
+     *
+     * Element `n` holds the decoded form of the instruction at address `2 * n`,
+     * and is only meaningful if `instr_valid[n]` is set.  Entries are filled
+     * lazily by `chip8_current_instr` and invalidated whenever the interpreter
+     * writes to the corresponding memory.  If you write to `mem` yourself, you
+     * must call `chip8_mem_invalidate` afterwards.
+     */
+    struct chip8_instruction instr_cache[CHIP8_MEM_SIZE / 2];
+    /**
+     * Whether each entry of `instr_cache` is valid.
+     */
+    bool instr_valid[CHIP8_MEM_SIZE / 2];
+    /**
+     * The lengths of the blocks starting at each instruction.
+     *
+     * A block is a run of at most `CHIP8_BLOCK_MAX` instructions which don't
+     * affect control flow, timing or memory, and which can therefore be
+     * executed back to back without any of the usual checks between them.
+     * Element `n` is one more than the number of instructions in the block
+     * starting at address `2 * n`, or 0 if that hasn't been computed yet.
+     * Like `instr_cache`, this is invalidated by `chip8_mem_invalidate`.
+     */
+    uint8_t block_len[CHIP8_MEM_SIZE / 2];
 };
 
 /**
@@ -155,12 +342,68 @@ struct chip8 {
 struct chip8_options chip8_options_default(void);
 
 struct chip8 *chip8_new(struct chip8_options opts);
+/**
+ * Initializes an interpreter in storage provided by the caller (such as an
+ * element of an array), as `chip8_new` would.
+ *
+ * The interpreter holds no other resources, so it need not be destroyed; it
+ * must not be passed to `chip8_destroy` unless it was allocated with
+ * `malloc`.
+ */
+void chip8_init_in_place(struct chip8 *chip, struct chip8_options opts);
 void chip8_destroy(struct chip8 *chip);
+/**
+ * Resets an interpreter to a copy of the given template.
+ *
+ * The template is typically an interpreter which has just been created and
+ * had a game loaded, so that many runs of the game can start from it without
+ * another allocation or load.  Everything is copied, including the options,
+ * the state of the random number generator and the `profile`, `trace` and
+ * `draw_callback` fields.
+ */
+void chip8_reset(struct chip8 *chip, const struct chip8 *templ);
+/**
+ * Reseeds the interpreter's random number generator, as if it had been
+ * created with the given seed.
+ */
+void chip8_seed(struct chip8 *chip, uint32_t seed);
 
+/**
+ * Returns a hash of the contents of the display.
+ *
+ * The hash covers every pixel and the resolution mode, so two interpreters
+ * showing the same image (in the same mode) have the same hash.
+ */
+uint64_t chip8_display_hash(const struct chip8 *chip);
+/**
+ * Returns a hash of the memory and registers.
+ *
+ * This covers the memory, all registers (including the timers), the program
+ * counter and the call stack, so together with `chip8_display_hash` it
+ * identifies the state of the interpreter as far as a program can tell,
+ * apart from the state of the random number generator.
+ */
+uint64_t chip8_state_hash(const struct chip8 *chip);
+/**
+ * Returns whether the given pixel on the display is on.
+ */
+bool chip8_display_pixel(const struct chip8 *chip, int x, int y);
+/**
+ * Calls the draw callback if any rows of the display have changed since the
+ * last flush, and marks them as clean.
+ */
+void chip8_display_flush(struct chip8 *chip);
 /**
  * Returns the current instruction.
  */
 struct chip8_instruction chip8_current_instr(struct chip8 *chip);
+/**
+ * Invalidates any cached instructions overlapping the given memory range.
+ *
+ * This must be called after modifying `chip->mem` directly if the modified
+ * memory might later be executed.
+ */
+void chip8_mem_invalidate(struct chip8 *chip, uint16_t addr, size_t len);
 /**
  * Inserts and executes the given opcode at the current program location.
  *
@@ -170,12 +413,19 @@ int chip8_execute_opcode(struct chip8 *chip, uint16_t opcode);
 /**
  * Loads a program in binary format from the given byte array.
  *
+ * If the program is too big, nothing is loaded.
+ *
  * @return An error code.
  */
-int chip8_load_from_bytes(struct chip8 *chip, uint8_t *bytes, size_t len);
+int chip8_load_from_bytes(struct chip8 *chip, const uint8_t *bytes, size_t len);
 /**
  * Loads a program in binary format from the given file.
  *
+ * The file is read in a single call.  To load the same game into many
+ * interpreters, it is faster to open it once with `chip8_rom_open`.
+ *
+ * If the file can't be read or the program is too big, nothing is loaded.
+ *
  * @return An error code.
  */
 int chip8_load_from_file(struct chip8 *chip, FILE *file);
@@ -185,5 +435,19 @@ int chip8_load_from_file(struct chip8 *chip, FILE *file);
  * @return An error code.
  */
 int chip8_step(struct chip8 *chip);
+/**
+ * Executes up to the given number of instructions.
+ *
+ * Execution stops early if the interpreter halts, encounters an error or
+ * starts waiting for a key press.
+ */
+enum chip8_run_status chip8_run_cycles(struct chip8 *chip, unsigned long n);
+/**
+ * Executes instructions until the next timer tick.
+ *
+ * Execution stops early if the interpreter halts, encounters an error or
+ * starts waiting for a key press.
+ */
+enum chip8_run_status chip8_run_until_frame(struct chip8 *chip);
 
 #endif
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Lockstep execution of several interpreters running the same program.
+ *
+ * When many instances of a program are run at once, most of them spend most
+ * of their time at the same program counter.  A `struct chip8_lanes` groups up
+ * to `CHIP8_LANES` interpreters (the "lanes") and keeps their registers in
+ * structure-of-arrays form while running, so that an instruction which is
+ * shared by several lanes is decoded once and executed for all of them by a
+ * single loop over the lanes, which the compiler can turn into vector
+ * instructions.  Lanes which have diverged are masked out and run separately,
+ * and instructions which aren't simple register operations (such as drawing or
+ * memory access) are run on each lane's own interpreter, so the results are
+ * always exactly the same as running each interpreter on its own.
+ *
+ * Only the virtual timer is supported.
+ */
+#ifndef CHIP8_LANES_H
+#define CHIP8_LANES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "interpreter.h"
+
+/**
+ * The maximum number of lanes in a group.
+ */
+#define CHIP8_LANES 32
+
+/**
+ * A group of interpreters which are run in lockstep.
+ *
+ * Outside of `chip8_lanes_run_frame`, the interpreters in `chips` hold the
+ * complete state of each lane and can be inspected or modified as usual (for
+ * example, to set `key_states` before each frame).  The other fields are
+ * internal.
+ */
+struct chip8_lanes {
+    /**
+     * The number of lanes in use.
+     */
+    int n_lanes;
+    /**
+     * The interpreters for each lane.
+     *
+     * These must all use the virtual timer and the same options.
+     */
+    struct chip8 *chips[CHIP8_LANES];
+    /**
+     * Whether each lane has stopped because of an error.
+     *
+     * A stopped lane is never run again.
+     */
+    bool stopped[CHIP8_LANES];
+
+    /*
+     * The state of each lane while a frame is being run; element [l] belongs
+     * to lane l.
+     */
+    uint8_t regs[16][CHIP8_LANES];
+    uint16_t reg_i[CHIP8_LANES];
+    uint16_t pc[CHIP8_LANES];
+    uint8_t reg_dt[CHIP8_LANES];
+    uint8_t reg_st[CHIP8_LANES];
+    uint16_t key_states[CHIP8_LANES];
+    uint32_t tick_instrs[CHIP8_LANES];
+    uint64_t cycles[CHIP8_LANES];
+    /**
+     * Whether each lane still has instructions to run in the current frame.
+     */
+    bool active[CHIP8_LANES];
+
+    /**
+     * The decoded instruction at each (even) address, together with the
+     * opcode it was decoded from.
+     *
+     * Since the lanes may have different memory contents, an entry is only
+     * used if its opcode matches the one in memory.
+     */
+    struct chip8_instruction instr_cache[CHIP8_MEM_SIZE / 2];
+    uint16_t instr_opcode[CHIP8_MEM_SIZE / 2];
+    bool instr_valid[CHIP8_MEM_SIZE / 2];
+};
+
+/**
+ * Creates a new lane group with the given interpreters.
+ *
+ * The interpreters remain owned by the caller, and must outlive the group.
+ *
+ * @param chips The interpreters to use, which must all use the virtual timer.
+ * @param n_chips The number of interpreters (at most `CHIP8_LANES`).
+ */
+struct chip8_lanes *chip8_lanes_new(struct chip8 **chips, int n_chips);
+void chip8_lanes_destroy(struct chip8_lanes *lanes);
+
+/**
+ * Runs each lane until its next timer tick.
+ *
+ * This is equivalent to calling `chip8_run_until_frame` on each interpreter,
+ * except for lanes which have stopped with an error, which are not run again.
+ *
+ * @param[out] status The result of each lane (as returned by
+ * `chip8_run_until_frame`).
+ */
+void chip8_lanes_run_frame(
+    struct chip8_lanes *lanes, enum chip8_run_status status[]);
+
+#endif
@@ -66,10 +66,15 @@ void log_set_output(FILE *output);
  * family of functions, but the final newline and other niceties will be
  * provided for you (so in particular you shouldn't be putting any newlines in
  * yourself).
+ *
+ * This is safe to call from multiple threads at once, as long as the logging
+ * system isn't being reconfigured at the same time.
  */
 void log_message(enum log_level level, const char *fmt, ...);
 /**
  * Begins a multi-part log message.
+ *
+ * Unlike `log_message`, multi-part messages are not thread-safe.
  */
 void log_message_begin(enum log_level level);
 /**
@@ -19,4 +19,45 @@ void *xmalloc(size_t sz);
 void *xrealloc(void *ptr, size_t sz);
 char *xstrdup(const char *s);
 
+/**
+ * A region from which memory can be allocated quickly and then freed all at
+ * once.
+ *
+ * Allocations are carved out of large blocks, so an arena is useful for many
+ * small objects which all live as long as some larger object.  A
+ * zero-initialized arena is empty and ready to use.
+ */
+struct arena {
+    /**
+     * The blocks allocated so far, most recent (and current) first.
+     */
+    struct arena_block *blocks;
+};
+
+/**
+ * Allocates memory from the given arena, suitably aligned for any object.
+ *
+ * The memory remains valid until the arena is cleared.
+ */
+void *arena_alloc(struct arena *arena, size_t sz);
+/**
+ * Returns a copy of the first `len` characters of the given string, allocated
+ * from the given arena and terminated by a null byte.
+ */
+char *arena_strndup(struct arena *arena, const char *s, size_t len);
+/**
+ * Frees all the memory allocated from the given arena, leaving it empty.
+ */
+void arena_clear(struct arena *arena);
+
+#ifdef CHIP8_COUNT_ALLOCS
+/**
+ * Returns the number of allocations made using the functions above.
+ *
+ * This is only available when building with `CHIP8_COUNT_ALLOCS` defined, and
+ * the count is not thread-safe.
+ */
+unsigned long xalloc_count(void);
+#endif
+
 #endif
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * A work-stealing thread pool for running many independent jobs.
+ */
+#ifndef CHIP8_POOL_H
+#define CHIP8_POOL_H
+
+#include <stddef.h>
+
+/**
+ * A function which processes a single item of work.
+ *
+ * @param item The index of the item to process.
+ * @param worker The index of the thread processing the item (between 0 and
+ * one less than the number of threads).  This can be used to index per-thread
+ * state without any locking.
+ * @param data The data pointer given to `pool_run`.
+ */
+typedef void (*pool_func)(size_t item, int worker, void *data);
+
+/**
+ * Processes the items `0` through `n_items - 1` using the given number of
+ * threads, returning once they have all been processed.
+ *
+ * The items are initially split evenly between the threads; whenever a thread
+ * runs out of items, it steals half of the remaining items of another
+ * thread, so the work stays balanced even if some items take much longer than
+ * others.  The order in which items are processed is unspecified.  The calling
+ * thread is used as the first worker.
+ *
+ * @return An error code.
+ */
+int pool_run(int n_threads, size_t n_items, pool_func func, void *data);
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Collecting and reporting statistics about the execution of a program.
+ */
+#ifndef CHIP8_PROFILE_H
+#define CHIP8_PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "disassembler.h"
+#include "instruction.h"
+#include "interpreter.h"
+
+/**
+ * The number of operations (including `OP_INVALID`).
+ */
+#define CHIP8_PROFILE_OPS (OP_LD_REG_R - OP_INVALID + 1)
+
+/**
+ * Execution statistics collected by the interpreter.
+ *
+ * To collect statistics, set the `profile` field of an interpreter to point to
+ * one of these; every instruction it executes from then on is counted.
+ */
+struct chip8_profile {
+    /**
+     * The number of times the instruction at each address was executed.
+     */
+    uint64_t pc_counts[CHIP8_MEM_SIZE];
+    /**
+     * The number of times each operation was executed, indexed by
+     * `op - OP_INVALID`.
+     */
+    uint64_t op_counts[CHIP8_PROFILE_OPS];
+    /**
+     * The time (in nanoseconds) spent executing `DRW` instructions, not
+     * counting any time spent waiting for the timer.
+     */
+    uint64_t draw_nanos;
+    /**
+     * The number of times the interpreter waited for the timer (because of a
+     * delayed draw or scroll).
+     */
+    uint64_t waits;
+    /**
+     * The time (in nanoseconds) spent waiting for the timer.
+     */
+    uint64_t wait_nanos;
+};
+
+struct chip8_profile *chip8_profile_new(void);
+void chip8_profile_destroy(struct chip8_profile *profile);
+
+/**
+ * Writes a report of the collected statistics.
+ *
+ * The report lists the number of times each operation was executed, the most
+ * frequently executed instructions, and every executed instruction in address
+ * order, using the contents of the interpreter's memory.
+ *
+ * @param disasm The disassembly of the program, whose label names are used to
+ * annotate the report, or NULL to use plain addresses.
+ * @return An error code.
+ */
+int chip8_profile_report(const struct chip8_profile *profile,
+    const struct chip8 *chip, const struct chip8disasm *disasm, FILE *out);
+
+#endif
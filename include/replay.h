@@ -0,0 +1,128 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Recording and replaying the key presses of a game.
+ *
+ * With the virtual timer and a fixed seed, the behavior of the interpreter is
+ * determined entirely by its options, the game and the key states at each
+ * instruction, so a run can be reproduced exactly from a log of the changes to
+ * the key states, keyed by instruction count.
+ *
+ * A log starts with a 24-byte header: the magic bytes "C8RP", a version byte,
+ * a flags byte (bit 0 for load quirks, bit 1 for shift quirks), two reserved
+ * bytes, the seed and the instructions per tick (each 4 bytes) and a hash of
+ * the game (8 bytes), with all values big-endian.  It is followed by a
+ * sequence of records, each consisting of the number of instructions since
+ * the previous record (as a variable-length integer, 7 bits per byte, least
+ * significant first) and a type byte: 0 is followed by the new key states (2
+ * bytes), and 1 marks the end of the log.
+ */
+#ifndef CHIP8_REPLAY_H
+#define CHIP8_REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "interpreter.h"
+#include "rom.h"
+
+/**
+ * A log which is being recorded.
+ */
+struct chip8_recorder;
+/**
+ * A log which is being replayed.
+ */
+struct chip8_replay;
+
+/**
+ * Starts recording a log to the given file.
+ *
+ * The options must use the virtual timer, since otherwise the run can't be
+ * reproduced.  The file remains owned by the caller.
+ *
+ * @return The recorder, or NULL if the header could not be written.
+ */
+struct chip8_recorder *chip8_recorder_new(
+    FILE *file, struct chip8_options opts, const struct chip8_rom *rom);
+/**
+ * Runs the interpreter until its next timer tick, recording any changes to its
+ * key states since the last call.
+ *
+ * This is equivalent to `chip8_run_until_frame`; all instructions must be run
+ * through it while recording.  Since the interpreter may change its own key
+ * states (when `LD Vx, K` reads a key), the recorder compares the key states
+ * against those at the end of the last frame rather than those last recorded.
+ *
+ * @return The result of running the frame (`CHIP8_RUN_ERROR` if the log
+ * could not be written).
+ */
+enum chip8_run_status chip8_recorder_run_frame(
+    struct chip8_recorder *rec, struct chip8 *chip);
+/**
+ * Finishes the log at the interpreter's current instruction count and
+ * destroys the recorder.
+ *
+ * @return An error code.
+ */
+int chip8_recorder_finish(struct chip8_recorder *rec, const struct chip8 *chip);
+
+/**
+ * Reads a log from the given file.
+ *
+ * @return The log, or NULL if it could not be read.
+ */
+struct chip8_replay *chip8_replay_open(FILE *file);
+void chip8_replay_close(struct chip8_replay *replay);
+/**
+ * Returns the interpreter options with which the log was recorded.
+ *
+ * These are the given options, with those affecting the outcome of the run
+ * replaced by the ones from the log.
+ */
+struct chip8_options chip8_replay_options(
+    const struct chip8_replay *replay, struct chip8_options opts);
+/**
+ * Returns whether the log was recorded with the given game.
+ */
+bool chip8_replay_matches(
+    const struct chip8_replay *replay, const struct chip8_rom *rom);
+/**
+ * Runs the interpreter through the whole log, as fast as possible.
+ *
+ * The interpreter must have been created with the options returned by
+ * `chip8_replay_options` and have the game loaded.
+ *
+ * @return The status of the interpreter at the end of the log
+ * (`CHIP8_RUN_CYCLES_DONE` if it reached the end normally).
+ */
+enum chip8_run_status chip8_replay_run(
+    const struct chip8_replay *replay, struct chip8 *chip);
+/**
+ * Runs the interpreter until its next timer tick, applying the key changes
+ * in the log along the way.
+ *
+ * The interpreter must be prepared as for `chip8_replay_run`.  Each call
+ * continues where the last one stopped; once the end of the log has been
+ * reached, the key states are left as they were, so the game can be run for
+ * any number of frames.
+ *
+ * @return The result of running the frame.
+ */
+enum chip8_run_status chip8_replay_run_frame(
+    struct chip8_replay *replay, struct chip8 *chip);
+/**
+ * Returns whether the interpreter has reached the end of the log through
+ * `chip8_replay_run_frame`.
+ */
+bool chip8_replay_finished(
+    const struct chip8_replay *replay, const struct chip8 *chip);
+
+#endif
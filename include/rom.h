@@ -0,0 +1,65 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Read-only game images which can be shared between interpreters.
+ */
+#ifndef CHIP8_ROM_H
+#define CHIP8_ROM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interpreter.h"
+
+/**
+ * The contents of a game file.
+ *
+ * A ROM is never modified once it has been opened, so the same ROM can be
+ * loaded into any number of interpreters (including from several threads at
+ * once).
+ */
+struct chip8_rom {
+    /**
+     * The contents of the file.
+     *
+     * This is NULL if the file is empty.
+     */
+    const uint8_t *data;
+    /**
+     * The length of the file, which is at most `CHIP8_PROG_SIZE`.
+     */
+    size_t len;
+    /**
+     * Whether `data` is mapped from the file (rather than allocated).
+     */
+    bool mapped;
+};
+
+/**
+ * Opens the given game file.
+ *
+ * Regular files are mapped into memory rather than read, so opening even a
+ * large file is cheap, and its size is checked before anything is loaded.
+ * Other files (such as pipes) are read in full instead.
+ *
+ * @return The ROM, or NULL if the file could not be opened or is too big.
+ */
+struct chip8_rom *chip8_rom_open(const char *fname);
+void chip8_rom_close(struct chip8_rom *rom);
+
+/**
+ * Loads the given ROM into the interpreter.
+ *
+ * This is equivalent to `chip8_load_from_bytes` with the contents of the ROM,
+ * but it can't fail, since the size of the ROM has already been checked.
+ */
+void chip8_load_from_rom(struct chip8 *chip, const struct chip8_rom *rom);
+
+#endif
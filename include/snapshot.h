@@ -0,0 +1,101 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Saving and restoring the state of the interpreter.
+ */
+#ifndef CHIP8_SNAPSHOT_H
+#define CHIP8_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interpreter.h"
+
+/**
+ * The size (in bytes) of the header at the start of a snapshot.
+ */
+#define CHIP8_SNAPSHOT_HEADER_SIZE 8
+/**
+ * The size (in bytes) of a snapshot.
+ *
+ * This is the memory, the packed display and the registers and other state,
+ * along with a short header identifying the format.
+ */
+#define CHIP8_SNAPSHOT_SIZE                                                    \
+    (CHIP8_SNAPSHOT_HEADER_SIZE + CHIP8_MEM_SIZE +                             \
+        CHIP8_DISPLAY_HEIGHT * CHIP8_DISPLAY_ROW_WORDS * 8 + 16 + 8 + 2 + 1 +  \
+        1 + 2 + 1 + 1 + 8 + 8 + 8 + 2 + 2 * CHIP8_STACK_DEPTH + 2 + 4)
+
+/**
+ * Saves the state of the interpreter into the given buffer.
+ *
+ * The state includes everything needed to continue execution exactly where it
+ * left off, but not the options or draw callback.  No memory is allocated.
+ *
+ * @param buf The buffer in which to save the state.
+ * @param len The length of the buffer, which must be at least
+ * `CHIP8_SNAPSHOT_SIZE`.
+ * @return An error code.
+ */
+int chip8_snapshot_save(const struct chip8 *chip, uint8_t *buf, size_t len);
+/**
+ * Restores the state of the interpreter from the given buffer.
+ *
+ * The snapshot is checked before anything is restored, so if it is invalid (or
+ * was saved by an interpreter built with a different call stack depth), the
+ * interpreter is left unchanged.  The whole display is marked as needing to be
+ * redrawn.
+ *
+ * @return An error code.
+ */
+int chip8_snapshot_load(struct chip8 *chip, const uint8_t *buf, size_t len);
+
+/**
+ * A fixed-size history of snapshots, for rewinding.
+ *
+ * To save memory, a snapshot is only stored in full once every few frames (a
+ * "keyframe"); the others are stored as the difference from the preceding
+ * keyframe, which is usually very small.  All snapshots are also run-length
+ * encoded.  When the history is full, the oldest snapshots are discarded to
+ * make room.
+ */
+struct chip8_rewind;
+
+/**
+ * Creates a new rewind history.
+ *
+ * All the memory needed is allocated here, so saving and restoring snapshots
+ * never allocates anything.
+ *
+ * @param max_frames The maximum number of snapshots to keep.
+ * @param capacity The maximum size (in bytes) of the encoded snapshots.
+ * @param keyframe_interval How often (in snapshots) to store a keyframe.
+ */
+struct chip8_rewind *chip8_rewind_new(
+    size_t max_frames, size_t capacity, unsigned keyframe_interval);
+void chip8_rewind_destroy(struct chip8_rewind *rw);
+
+/**
+ * Returns the number of snapshots in the history.
+ */
+size_t chip8_rewind_frames(const struct chip8_rewind *rw);
+/**
+ * Saves the state of the interpreter as the newest snapshot in the history.
+ *
+ * @return An error code.
+ */
+int chip8_rewind_push(struct chip8_rewind *rw, const struct chip8 *chip);
+/**
+ * Restores the newest snapshot in the history, and removes it.
+ *
+ * @return An error code (which is also returned if the history is empty).
+ */
+int chip8_rewind_pop(struct chip8_rewind *rw, struct chip8 *chip);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/**
+ * @file
+ * Recording a binary trace of the executed instructions.
+ *
+ * Unlike the text trace logged at `LOG_TRACE`, the binary trace is cheap
+ * enough to leave on all the time: each instruction appends one small
+ * fixed-size record to a ring buffer, overwriting the oldest one when the
+ * buffer is full, and the records are only formatted after the fact.
+ *
+ * A saved trace starts with a 16-byte header: the magic bytes "C8TR", a
+ * version byte, a flags byte (bit 0 for shift quirks), two reserved bytes and
+ * the index of the first record (8 bytes).  It is followed by the records,
+ * oldest first, each consisting of the program counter, the opcode, the value
+ * of I before the instruction was executed and a mask of the registers
+ * changed by it (bit n for Vn), each 2 bytes.  All values are big-endian.
+ */
+#ifndef CHIP8_TRACE_H
+#define CHIP8_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * A single executed instruction.
+ */
+struct chip8_trace_record {
+    /**
+     * The address of the instruction.
+     */
+    uint16_t pc;
+    /**
+     * The opcode of the instruction.
+     */
+    uint16_t opcode;
+    /**
+     * The value of I before the instruction was executed.
+     */
+    uint16_t reg_i;
+    /**
+     * The registers whose values were changed by the instruction (bit n for
+     * Vn).
+     */
+    uint16_t changed;
+};
+
+/**
+ * A ring buffer of the most recently executed instructions.
+ *
+ * The buffer has a single writer (the interpreter, when its `trace` field
+ * points to it), which never blocks or allocates; it should only be read
+ * while the interpreter is not running.
+ */
+struct chip8_trace {
+    /**
+     * The records, of which there are `mask + 1` (a power of 2).
+     */
+    struct chip8_trace_record *records;
+    /**
+     * The mask to apply to a record index to get its position in `records`.
+     */
+    size_t mask;
+    /**
+     * The total number of records ever written.
+     *
+     * The next record is written at position `count & mask`.
+     */
+    uint64_t count;
+};
+
+/**
+ * Creates a new trace buffer.
+ *
+ * @param capacity The number of records to keep, which is rounded up to a
+ * power of 2.
+ */
+struct chip8_trace *chip8_trace_new(size_t capacity);
+void chip8_trace_destroy(struct chip8_trace *trace);
+
+/**
+ * Returns the number of records currently in the buffer.
+ */
+size_t chip8_trace_len(const struct chip8_trace *trace);
+/**
+ * Saves the records in the buffer to the given file.
+ *
+ * @param shift_quirks Whether the interpreter uses shift quirks mode, which is
+ * needed to decode the opcodes correctly.
+ * @return An error code.
+ */
+int chip8_trace_write(
+    const struct chip8_trace *trace, bool shift_quirks, FILE *out);
+/**
+ * Reads a trace saved by `chip8_trace_write` and writes it as text, one
+ * instruction per line.
+ *
+ * @return An error code.
+ */
+int chip8_trace_format(FILE *in, FILE *out);
+
+#endif
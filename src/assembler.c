@@ -8,21 +8,40 @@
 #include "assembler.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "memory.h"
 
-#define LTABLE_SIZE 256
-
+/**
+ * The initial capacity of a label table (a power of 2).
+ */
+#define LTABLE_INITIAL_CAP 64
+/**
+ * The number of instructions in each block of an instruction list.
+ */
+#define INSTRUCTION_BLOCK_SIZE 256
+/**
+ * The maximum nesting level of included files.
+ */
+#define MAX_INCLUDE_DEPTH 16
 /**
  * The maximum number of operands for any instruction.
  */
 #define MAX_OPERANDS 3
+/**
+ * The initial size of the buffer used to read a file which can't be mapped.
+ */
+#define SOURCE_BUFSIZE 4096
 /**
  * The maximum size of the stacks in the 'chip8asm_eval' method.
  */
@@ -78,6 +97,91 @@ enum instruction_type {
     IT_DW,
 };
 
+/**
+ * The type of a token in a compiled expression.
+ */
+enum token_type {
+    /**
+     * A number, which is pushed onto the stack.
+     */
+    TOKEN_NUMBER,
+    /**
+     * An identifier, whose value is pushed onto the stack.
+     */
+    TOKEN_IDENT,
+    /**
+     * An operator, which is applied to the top of the stack.
+     */
+    TOKEN_OPERATOR,
+};
+
+/**
+ * A token in a compiled expression.
+ */
+struct token {
+    /**
+     * The type of the token.
+     */
+    enum token_type type;
+    /**
+     * If the type is 'TOKEN_OPERATOR', the operator (with '_' being the unary
+     * '-').
+     */
+    char op;
+    /**
+     * If the type is 'TOKEN_NUMBER', the number.
+     */
+    uint16_t value;
+    /**
+     * If the type is 'TOKEN_IDENT', the identifier (which is not
+     * null-terminated).
+     */
+    const char *name;
+    /**
+     * If the type is 'TOKEN_IDENT', the length of 'name'.
+     */
+    size_t len;
+    /**
+     * If the type is 'TOKEN_IDENT', the hash of 'name'.
+     */
+    unsigned long hash;
+};
+
+/**
+ * An expression compiled into postfix (reverse Polish) order.
+ *
+ * Compiling an expression checks its syntax, so evaluating it only needs to
+ * look up the identifiers and do the arithmetic.
+ */
+struct expr {
+    /**
+     * The tokens, in the order they are to be evaluated.
+     */
+    const struct token *tokens;
+    /**
+     * The number of tokens.
+     */
+    int len;
+};
+
+/**
+ * An operand of an assembler instruction.
+ */
+struct operand {
+    /**
+     * The text of the operand.
+     */
+    const char *text;
+    /**
+     * If the operand is a register, its number; otherwise -1.
+     */
+    int reg;
+    /**
+     * If the operand is not a register, the compiled expression.
+     */
+    struct expr expr;
+};
+
 /**
  * An assembler instruction.
  *
@@ -101,7 +205,7 @@ struct instruction {
      * already contained in 'chipop', and would make several aspects of
      * processing these instructions more complicated.
      */
-    char *operands[MAX_OPERANDS];
+    struct operand operands[MAX_OPERANDS];
     /**
      * The number of operands.
      */
@@ -110,6 +214,11 @@ struct instruction {
      * The line on which this instruction was found.
      */
     int line;
+    /**
+     * The file in which this instruction was found (NULL if it was not read
+     * from a file).
+     */
+    const char *file;
     /**
      * The location in memory for the final instruction after processing.
      */
@@ -117,49 +226,99 @@ struct instruction {
 };
 
 /**
- * A growable list of instructions.
+ * A block of instructions in an instruction list.
  */
-struct instructions {
+struct instruction_block {
     /**
-     * The length.
+     * The next block.
+     */
+    struct instruction_block *next;
+    /**
+     * The number of instructions in this block.
      */
     size_t len;
     /**
-     * The capacity.
+     * The instructions themselves.
      */
-    size_t cap;
+    struct instruction data[INSTRUCTION_BLOCK_SIZE];
+};
+
+/**
+ * A list of instructions, allocated in blocks from an arena.
+ *
+ * Clearing the list keeps its blocks around for reuse.
+ */
+struct instructions {
+    /**
+     * The first block, or NULL if none has been allocated.
+     */
+    struct instruction_block *head;
     /**
-     * The underlying data.
+     * The block to which instructions are being added.
      */
-    struct instruction *data;
+    struct instruction_block *tail;
+};
+
+/**
+ * The contents of a source file.
+ */
+struct source {
+    /**
+     * The contents of the file (NULL if it is empty).
+     */
+    char *data;
+    /**
+     * The length of the file.
+     */
+    size_t len;
+    /**
+     * Whether 'data' is mapped from the file (rather than allocated).
+     */
+    bool mapped;
 };
 
 /**
  * A label table, for associating labels with addresses.
  *
- * This is just a hash table that uses a linked list for each bucket. It's not
- * the most efficient, but it works.
+ * This is a hash table using open addressing with linear probing, which is
+ * resized to keep it at most three-quarters full.
  */
 struct ltable {
-    struct ltable_bucket *buckets[LTABLE_SIZE];
+    /**
+     * The entries, of which those with a NULL label are empty.
+     */
+    struct ltable_entry *entries;
+    /**
+     * The capacity of 'entries' (a power of 2, or 0 if nothing has been
+     * added yet).
+     */
+    size_t cap;
+    /**
+     * The number of labels in the table.
+     */
+    size_t len;
 };
 
 /**
- * A bucket in a label table.
+ * An entry in a label table.
  */
-struct ltable_bucket {
+struct ltable_entry {
     /**
      * The label name.
      */
-    char *label;
+    const char *label;
     /**
-     * The associated address in Chip-8 memory.
+     * The length of the label name.
      */
-    uint16_t addr;
+    size_t len;
+    /**
+     * The hash of the label name.
+     */
+    unsigned long hash;
     /**
-     * The next entry in this bucket.
+     * The associated address in Chip-8 memory.
      */
-    struct ltable_bucket *next;
+    uint16_t addr;
 };
 
 struct chip8asm {
@@ -167,6 +326,19 @@ struct chip8asm {
      * The given assembler options.
      */
     struct chip8asm_options opts;
+    /**
+     * The arena from which all strings, expressions and instructions are
+     * allocated.
+     */
+    struct arena arena;
+    /**
+     * Scratch space for compiling expressions.
+     */
+    struct token *scratch;
+    /**
+     * The capacity of 'scratch'.
+     */
+    size_t scratch_cap;
     /**
      * The labels that have been found by the assembler.
      */
@@ -181,11 +353,33 @@ struct chip8asm {
     /**
      * The label that should be associated with the next instruction processed.
      */
-    char *line_label;
+    const char *line_label;
     /**
      * The current line being processed.
      */
     int line;
+    /**
+     * The name of the file being processed, or NULL if lines are being
+     * processed directly.
+     */
+    const char *file;
+    /**
+     * The number of files currently being processed (including the one being
+     * processed by the outermost 'chip8asm_process_file').
+     */
+    int include_depth;
+    /**
+     * The names of all the files which have been processed.
+     */
+    const char **files;
+    /**
+     * The number of files in 'files'.
+     */
+    size_t n_files;
+    /**
+     * The capacity of 'files'.
+     */
+    size_t files_cap;
     /**
      * The current program counter (address in Chip-8 memory).
      */
@@ -234,7 +428,9 @@ struct chip8asm {
  * Adds the instruction to the internal list, completing its first pass.
  *
  * This will also process any label that might be associated with this
- * instruction.
+ * instruction, and compile the instruction's operands.
+ *
+ * @return An error code.
  */
 static int chip8asm_add_instruction(
     struct chip8asm *chipasm, struct instruction instr);
@@ -251,6 +447,29 @@ static int chip8asm_add_instruction(
  */
 static int chip8asm_compile_chip8op(const struct chip8asm *chipasm,
     const struct instruction *instr, uint16_t *opcode);
+/**
+ * Compiles the given expression, storing the result in the arena.
+ *
+ * @return An error code.
+ */
+static int chip8asm_compile_expr(
+    struct chip8asm *chipasm, const char *text, struct expr *expr);
+/**
+ * Compiles the operands of the given instruction, looking up register names
+ * and compiling expressions.
+ *
+ * @return An error code.
+ */
+static int chip8asm_compile_operands(
+    struct chip8asm *chipasm, struct instruction *instr);
+/**
+ * Evaluates the given (non-register) operand of an instruction.
+ *
+ * @param[out] value The result of the evaluation.
+ * @return An error code.
+ */
+static int chip8asm_eval_operand(const struct chip8asm *chipasm,
+    const struct instruction *instr, int n, uint16_t *value);
 /**
  * Processes the assignment with the given operands.
  *
@@ -259,8 +478,14 @@ static int chip8asm_compile_chip8op(const struct chip8asm *chipasm,
  *
  * @return An error code.
  */
-static int chip8asm_process_assignment(struct chip8asm *chipasm, char *label,
-    char *operands[MAX_OPERANDS], int n_operands);
+static int chip8asm_process_assignment(struct chip8asm *chipasm,
+    const char *label, char *operands[MAX_OPERANDS], int n_operands);
+/**
+ * Processes the file named by the operand of an 'INCLUDE' directive.
+ *
+ * @return An error code.
+ */
+static int chip8asm_process_include(struct chip8asm *chipasm, const char *name);
 /**
  * Processes the given operation with the given operands.
  *
@@ -270,8 +495,8 @@ static int chip8asm_process_assignment(struct chip8asm *chipasm, char *label,
  *
  * @return An error code.
  */
-static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
-    char *operands[MAX_OPERANDS], int n_operands);
+static int chip8asm_process_instruction(struct chip8asm *chipasm,
+    const char *op, char *operands[MAX_OPERANDS], int n_operands);
 /**
  * Returns whether the assembler should process anything right now.
  *
@@ -281,47 +506,92 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
  */
 static bool chip8asm_should_process(struct chip8asm *chipasm);
 
+/**
+ * Compiles the given expression into postfix order.
+ *
+ * We use the shunting-yard algorithm
+ * (https://en.wikipedia.org/wiki/Shunting-yard_algorithm) here, since it's
+ * simple and does what we need.  Identifiers are not looked up until the
+ * expression is evaluated, so they need not be defined yet.
+ *
+ * @param[out] tokens The compiled tokens, which must have room for at least as
+ * many tokens as there are characters in the expression.
+ * @param[out] len The number of compiled tokens.
+ * @return An error code.
+ */
+static int expr_compile(
+    const char *text, int line, struct token *tokens, int *len);
+/**
+ * Evaluates the given compiled expression.
+ *
+ * The current state of the assembler will be used to access label addresses
+ * and constant values.
+ *
+ * @param[out] value The result of the evaluation.
+ * @return An error code.
+ */
+static int expr_eval(const struct chip8asm *chipasm, const struct expr *expr,
+    int line, uint16_t *value);
+
 /**
  * Returns the hash of the given string.
  */
-static unsigned long hash_str(const char *str);
+static unsigned long hash_str(const char *str, size_t len);
 
 /**
- * Initializes a new instruction list with the given capacity.
+ * Returns the path of a file included from the given file.
+ *
+ * A relative name is taken to be relative to the directory containing the
+ * including file.  The returned string is allocated on the heap.
  *
- * The capacity may be zero.
+ * @param from The name of the including file, or NULL for the current
+ * directory.
+ * @param name The name given to 'INCLUDE', optionally in double quotes.
  */
-static void instructions_init(struct instructions *lst, size_t cap);
+static char *include_path(const char *from, const char *name);
 
+/**
+ * Returns whether the given operand of the instruction is the name of a
+ * register (rather than an expression).
+ */
+static bool instruction_operand_is_register(
+    const struct instruction *instr, int n);
 /**
  * Adds an instruction to the instruction list.
+ *
+ * @param arena The arena from which to allocate any new block.
  */
 static void instructions_add(
-    struct instructions *lst, struct instruction instr);
+    struct instructions *lst, struct arena *arena, struct instruction instr);
 /**
  * Clears the given instruction list.
- *
- * This also frees the underlying data, so it should be used for cleanup too.
  */
 static void instructions_clear(struct instructions *lst);
-/**
- * Grows the list, doubling its capacity.
- */
-static void instructions_grow(struct instructions *lst);
 /**
  * Adds the given label/address pair to the table.
  *
  * The label name will not be copied for you, since it should have already been
- * heap-allocated by a parser function (see below).
+ * allocated from the arena by a parser function (see below).  If the label is
+ * already present, its address is replaced.
  *
  * @return Whether the label was already present in the table.
  */
-static bool ltable_add(struct ltable *tab, char *label, uint16_t addr);
+static bool ltable_add(struct ltable *tab, const char *label, uint16_t addr);
 /**
  * Clears the given table.
  * This also frees the underlying data, so it should be used for cleanup too.
  */
 static void ltable_clear(struct ltable *tab);
+/**
+ * Finds the entry for the given label in the table.
+ *
+ * @param key The label name, which need not be null-terminated.
+ * @param len The length of the label name.
+ * @param hash The hash of the label name.
+ * @return The entry, or NULL if the label is not in the table.
+ */
+static const struct ltable_entry *ltable_find(
+    const struct ltable *tab, const char *key, size_t len, unsigned long hash);
 /**
  * Gets the value corresponding to the given label in the table.
  *
@@ -330,10 +600,22 @@ static void ltable_clear(struct ltable *tab);
  */
 static bool ltable_get(
     const struct ltable *tab, const char *key, uint16_t *value);
+/**
+ * Doubles the capacity of the given table (or gives it its initial capacity).
+ */
+static void ltable_grow(struct ltable *tab);
 /**
  * Applies the given operator to the given stack of numbers.
  */
 static int operator_apply(char op, uint16_t *numstack, int *numpos, int line);
+/**
+ * Appends the given operator to a compiled expression.
+ *
+ * @param[in,out] depth The number of values which will be on the stack at this
+ * point of the evaluation, which is checked and updated.
+ */
+static int operator_emit(
+    char op, struct token *tokens, int *len, int *depth, int line);
 /**
  * Returns the precedence of the given operator.
  * A higher precedence means the operator is more tightly binding.
@@ -344,16 +626,26 @@ static int precedence(char op);
  * Returns -1 if the register name is invalid.
  */
 static int register_num(const char *name);
+/**
+ * Reads the given source file ('-' for standard input).
+ *
+ * Regular files are mapped into memory; anything else (such as a pipe) is read
+ * in full.
+ *
+ * @return An error code.
+ */
+static int source_open(const char *fname, struct source *source);
+static void source_close(struct source *source);
 
 /*
  * Parsing functions:
  *
  * These parsing functions follow a simple set of conventions.  The ones
- * beginning with 'parse' which parse strings return a heap-allocated string
- * upon a successful parse, containing the thing that was parsed, or NULL if
- * the parse was unsuccessful.  The parsing functions which return things other
- * than strings return an error code to indicate success or failure, with an
- * output argument for the result.
+ * beginning with 'parse' which parse strings return a string allocated from
+ * the given arena upon a successful parse, containing the thing that was
+ * parsed, or NULL if the parse was unsuccessful.  The parsing functions which
+ * return things other than strings return an error code to indicate success
+ * or failure, with an output argument for the result.
  *
  * All parsing functions advance the given input string past the end of
  * whatever was parsed, if successful; if unsuccessful, the input string is
@@ -364,13 +656,13 @@ static int register_num(const char *name);
  *
  * @return The identifier, or NULL if none was found.
  */
-static char *parse_ident(const char **str);
+static char *parse_ident(struct arena *arena, const char **str);
 /**
  * Parses an operand, returning it if one was found.
  *
  * @return The operand, or NULL if none was found.
  */
-static char *parse_operand(const char **str);
+static char *parse_operand(struct arena *arena, const char **str);
 /**
  * Parses a binary number.
  *
@@ -390,7 +682,8 @@ static int parse_num_dec(const char **str, uint16_t *num);
  */
 static int parse_num_hex(const char **str, uint16_t *num);
 /**
- * Consumes whitespace until a non-whitespace character is reached.
+ * Consumes whitespace until a non-whitespace character or the end of the line
+ * is reached.
  */
 static void skip_spaces(const char **str);
 
@@ -400,8 +693,6 @@ struct chip8asm *chip8asm_new(struct chip8asm_options opts)
 
     chipasm->opts = opts;
     chipasm->pc = CHIP8_PROG_START;
-    /* There's a good chance we'll need space for at least 128 instructions */
-    instructions_init(&chipasm->instructions, 128);
 
     return chipasm;
 }
@@ -411,49 +702,59 @@ void chip8asm_destroy(struct chip8asm *chipasm)
     if (!chipasm)
         return;
     ltable_clear(&chipasm->labels);
-    instructions_clear(&chipasm->instructions);
-    free(chipasm->line_label);
+    arena_clear(&chipasm->arena);
+    free(chipasm->scratch);
+    free(chipasm->files);
     free(chipasm);
 }
 
 int chip8asm_emit(struct chip8asm *chipasm, struct chip8asm_program *prog)
 {
-    for (size_t i = 0; i < chipasm->instructions.len; i++) {
-        const struct instruction *instr = &chipasm->instructions.data[i];
-        uint16_t opcode;
-        size_t mempos = instr->pc - CHIP8_PROG_START;
-        int err;
-
-        switch (instr->type) {
-        case IT_INVALID:
-            FAIL_MSG(
-                instr->line, "invalid instruction (this should never happen)");
-            return 1;
-        case IT_DB:
-            if ((err = chip8asm_eval(
-                     chipasm, instr->operands[0], instr->line, &opcode)))
-                return err;
-            prog->mem[mempos] = opcode & 0xFF;
-            if (mempos + 1 > prog->len)
-                prog->len = mempos + 1;
-            break;
-        case IT_DW:
-            if ((err = chip8asm_eval(
-                     chipasm, instr->operands[0], instr->line, &opcode)))
-                return err;
-            prog->mem[mempos] = (opcode >> 8) & 0xFF;
-            prog->mem[mempos + 1] = opcode & 0xFF;
-            if (mempos + 2 > prog->len)
-                prog->len = mempos + 2;
-            break;
-        case IT_CHIP8_OP:
-            if ((err = chip8asm_compile_chip8op(chipasm, instr, &opcode)))
+    for (const struct instruction_block *block = chipasm->instructions.head;
+         block != NULL; block = block->next) {
+        for (size_t i = 0; i < block->len; i++) {
+            const struct instruction *instr = &block->data[i];
+            uint16_t opcode;
+            size_t mempos = instr->pc - CHIP8_PROG_START;
+            int err = 0;
+
+            switch (instr->type) {
+            case IT_INVALID:
+                FAIL_MSG(instr->line,
+                    "invalid instruction (this should never happen)");
+                err = 1;
+                break;
+            case IT_DB:
+                if ((err = chip8asm_eval_operand(chipasm, instr, 0, &opcode)))
+                    break;
+                prog->mem[mempos] = opcode & 0xFF;
+                if (mempos + 1 > prog->len)
+                    prog->len = mempos + 1;
+                break;
+            case IT_DW:
+                if ((err = chip8asm_eval_operand(chipasm, instr, 0, &opcode)))
+                    break;
+                prog->mem[mempos] = (opcode >> 8) & 0xFF;
+                prog->mem[mempos + 1] = opcode & 0xFF;
+                if (mempos + 2 > prog->len)
+                    prog->len = mempos + 2;
+                break;
+            case IT_CHIP8_OP:
+                if ((err = chip8asm_compile_chip8op(chipasm, instr, &opcode)))
+                    break;
+                prog->mem[mempos] = (opcode >> 8) & 0xFF;
+                prog->mem[mempos + 1] = opcode & 0xFF;
+                if (mempos + 2 > prog->len)
+                    prog->len = mempos + 2;
+                break;
+            }
+            if (err) {
+                /* The line number alone is ambiguous with included files */
+                if (instr->file)
+                    log_error("Line %d is in file '%s'", instr->line,
+                        instr->file);
                 return err;
-            prog->mem[mempos] = (opcode >> 8) & 0xFF;
-            prog->mem[mempos + 1] = opcode & 0xFF;
-            if (mempos + 2 > prog->len)
-                prog->len = mempos + 2;
-            break;
+            }
         }
     }
 
@@ -469,164 +770,93 @@ int chip8asm_emit(struct chip8asm *chipasm, struct chip8asm_program *prog)
 int chip8asm_eval(
     const struct chip8asm *chipasm, const char *expr, int line, uint16_t *value)
 {
-    /*
-     * We use the shunting-yard algorithm
-     * (https://en.wikipedia.org/wiki/Shunting-yard_algorithm) here, since it's
-     * simple and does what we need. We do need to be a bit careful about the
-     * unary '-' operator: if the last token read was an operator, then any '-'
-     * should be parsed as the unary operator, but otherwise it is the binary
-     * operator. Internally, we will use '_' to represent the unary '-'.
-     */
-    char opstack[STACK_SIZE];
-    int oppos = 0; /* Where to put the next operator on the stack. */
-    uint16_t numstack[STACK_SIZE];
-    int numpos = 0; /* Where to put the next number on the stack. */
-    bool expecting_num = true;
-
-    while (*expr != '\0') {
-        if (expecting_num && *expr == '-') {
-            int p = precedence('_');
-            /* The unary - operator is right-associative */
-            while (oppos > 0 && precedence(opstack[oppos - 1]) > p)
-                if (operator_apply(opstack[--oppos], numstack, &numpos, line)) {
-                    FAIL_MSG(line, "could not evaluate expression");
-                    return 1;
-                }
-            opstack[oppos++] = '_';
-            expr++;
-        } else if (*expr == '#') {
-            /* Parse hex number */
-            uint16_t n;
+    /* An expression can't have more tokens than characters */
+    struct token *tokens = xmalloc((strlen(expr) + 1) * sizeof *tokens);
+    struct expr compiled = {tokens, 0};
+    int retval;
+
+    retval = expr_compile(expr, line, tokens, &compiled.len) ||
+        expr_eval(chipasm, &compiled, line, value);
+    free(tokens);
+    return retval;
+}
 
-            expr++;
-            if (parse_num_hex(&expr, &n)) {
-                FAIL_MSG(line, "expected hexadecimal number");
-                return 1;
-            }
-            numstack[numpos++] = n;
-            expecting_num = false;
-        } else if (*expr == '$') {
-            /* Parse binary number */
-            uint16_t n;
+const char *chip8asm_file(const struct chip8asm *chipasm, size_t i)
+{
+    return i < chipasm->n_files ? chipasm->files[i] : NULL;
+}
 
-            expr++;
-            if (parse_num_bin(&expr, &n)) {
-                FAIL_MSG(line, "expected binary number");
-                return 1;
-            }
-            numstack[numpos++] = n;
-            expecting_num = false;
-        } else if (isdigit(*expr)) {
-            /* Parse decimal number */
-            uint16_t n;
+int chip8asm_process_buffer(
+    struct chip8asm *chipasm, const char *buf, size_t len)
+{
+    const char *end = buf + len;
 
-            if (parse_num_dec(&expr, &n)) {
-                FAIL_MSG(line, "expected decimal number");
-                return 1;
-            }
-            numstack[numpos++] = n;
-            expecting_num = false;
-        } else if (isidentstart(*expr)) {
-            /* Parse identifier */
-            char *ident = parse_ident(&expr);
-            uint16_t val;
-
-            if (!ltable_get(&chipasm->labels, ident, &val)) {
-                FAIL_MSG(line, "unknown identifier '%s'", ident);
-                free(ident);
-                return 1;
-            }
-            free(ident);
-            numstack[numpos++] = val;
-            expecting_num = false;
-        } else if (*expr == '(') {
-            opstack[oppos++] = *expr++;
-            expecting_num = true;
-        } else if (*expr == ')') {
-            while (oppos > 0 && opstack[oppos - 1] != '(')
-                if (operator_apply(opstack[--oppos], numstack, &numpos, line)) {
-                    FAIL_MSG(line, "could not evaluate expression");
-                    return 1;
-                }
-            /* Get rid of the '(' pseudo-operator on the stack */
-            if (oppos == 0) {
-                FAIL_MSG(line, "found ')' with no matching '('");
-                return 1;
-            }
-            oppos--;
-            expecting_num = false;
-            expr++;
-        } else if (*expr == '~') {
-            /*
-             * We need to treat any unary operators a little differently, since
-             * they should be right-associative instead of left-associative like
-             * the binary operators, and we should only process them when
-             * 'expecting_num == true', since otherwise an expression like '1 ~'
-             * would be parsed the same as '~ 1'.
-             */
-            int p = precedence(*expr);
-            if (!expecting_num) {
-                FAIL_MSG(line, "did not expect unary operator '~'");
-                return 1;
-            }
-            /*
-             * Note the 'precedence(...) > p' instead of >=; this is what makes
-             * the operator right-associative.
-             */
-            while (oppos > 0 && precedence(opstack[oppos - 1]) > p)
-                if (operator_apply(opstack[--oppos], numstack, &numpos, line)) {
-                    FAIL_MSG(line, "could not evaluate expression");
-                    return 1;
-                }
-            opstack[oppos++] = *expr++;
-        } else {
-            /* Must be a binary operator */
-            int p = precedence(*expr);
+    while (buf < end) {
+        const char *eol = memchr(buf, '\n', end - buf);
+        char *last;
+        int err;
 
-            if (p < 0) {
-                FAIL_MSG(line, "unknown operator '%c'", *expr);
-                return 1;
-            }
-            while (oppos > 0 && precedence(opstack[oppos - 1]) >= p)
-                if (operator_apply(opstack[--oppos], numstack, &numpos, line)) {
-                    FAIL_MSG(line, "could not evaluate expression");
-                    return 1;
-                }
-            opstack[oppos++] = *expr++;
-            expecting_num = true;
+        if (eol) {
+            /* The newline stops the parser, so the line can be used in place */
+            if ((err = chip8asm_process_line(chipasm, buf)))
+                return err;
+            buf = eol + 1;
+            continue;
         }
+        /*
+         * The parser would run off the end of an unterminated last line, so
+         * that one has to be copied.
+         */
+        last = xmalloc(end - buf + 1);
+        memcpy(last, buf, end - buf);
+        last[end - buf] = '\0';
+        err = chip8asm_process_line(chipasm, last);
+        free(last);
+        return err;
+    }
+    return 0;
+}
 
-        if (oppos == STACK_SIZE) {
-            FAIL_MSG(line, "operator stack overflowed (too many operators)");
-            return 1;
-        }
-        if (numpos == STACK_SIZE) {
-            FAIL_MSG(
-                line, "number stack overflowed (too many numbers/identifiers)");
-            return 1;
-        }
-        skip_spaces(&expr);
+int chip8asm_process_file(struct chip8asm *chipasm, const char *fname)
+{
+    const char *outer_file = chipasm->file;
+    int outer_line = chipasm->line;
+    struct source source;
+    size_t i;
+    int err;
+
+    if (chipasm->include_depth >= MAX_INCLUDE_DEPTH) {
+        log_error("Files are nested too deeply (does '%s' include itself?)",
+            fname);
+        return 1;
     }
+    if (source_open(fname, &source))
+        return 1;
 
-    /* Now that we're done here, we need to use the remaining operators */
-    while (oppos > 0) {
-        if (opstack[--oppos] == '(') {
-            FAIL_MSG(line, "found '(' with no matching ')'");
-            return 1;
-        }
-        if (operator_apply(opstack[oppos], numstack, &numpos, line)) {
-            FAIL_MSG(line, "could not evaluate expression");
-            return 1;
+    for (i = 0; i < chipasm->n_files; i++)
+        if (!strcmp(chipasm->files[i], fname))
+            break;
+    if (i == chipasm->n_files) {
+        if (chipasm->n_files == chipasm->files_cap) {
+            chipasm->files_cap =
+                chipasm->files_cap == 0 ? 8 : 2 * chipasm->files_cap;
+            chipasm->files = xrealloc(chipasm->files,
+                chipasm->files_cap * sizeof *chipasm->files);
         }
+        chipasm->files[chipasm->n_files++] =
+            arena_strndup(&chipasm->arena, fname, strlen(fname));
     }
 
-    if (numpos != 1) {
-        FAIL_MSG(line, "expected operation");
-        return 1;
-    }
-    if (value)
-        *value = numstack[0];
-    return 0;
+    chipasm->file = chipasm->files[i];
+    chipasm->line = 0;
+    chipasm->include_depth++;
+    err = chip8asm_process_buffer(chipasm, source.data, source.len);
+    chipasm->include_depth--;
+    chipasm->file = outer_file;
+    chipasm->line = outer_line;
+
+    source_close(&source);
+    return err;
 }
 
 int chip8asm_process_line(struct chip8asm *chipasm, const char *line)
@@ -635,7 +865,7 @@ int chip8asm_process_line(struct chip8asm *chipasm, const char *line)
     /* The name of the operation */
     char *op;
     /* The operands to the instruction */
-    char *operands[MAX_OPERANDS];
+    char *operands[MAX_OPERANDS] = {NULL};
     /* The current operand being processed */
     int n_op;
     /* Whether we should process a constant assignment */
@@ -649,7 +879,7 @@ int chip8asm_process_line(struct chip8asm *chipasm, const char *line)
      */
     skip_spaces(&line);
     op = NULL;
-    while ((tmp = parse_ident(&line))) {
+    while ((tmp = parse_ident(&chipasm->arena, &line))) {
         if (*line != ':') {
             /* Found an operation, not a label. */
             op = tmp;
@@ -660,7 +890,6 @@ int chip8asm_process_line(struct chip8asm *chipasm, const char *line)
                     "cannot associate more than one label with a statement; "
                     "already found label '%s'",
                     chipasm->line_label);
-                free(tmp);
                 return 1;
             } else {
                 chipasm->line_label = tmp;
@@ -684,21 +913,18 @@ int chip8asm_process_line(struct chip8asm *chipasm, const char *line)
 
     /* Get the operands */
     n_op = 0;
-    tmp = parse_operand(&line);
-    if (*tmp == '\0' && *line != ',') {
-        /* No operands. */
-        free(tmp);
-    } else {
+    tmp = parse_operand(&chipasm->arena, &line);
+    if (*tmp != '\0' || *line == ',') {
         operands[n_op++] = tmp;
         while (*line++ == ',') {
             skip_spaces(&line);
-            tmp = parse_operand(&line);
+            tmp = parse_operand(&chipasm->arena, &line);
             if (*tmp == '\0') {
                 FAIL_MSG(chipasm->line, "empty operand");
-                goto FAIL;
+                return 1;
             } else if (n_op >= MAX_OPERANDS) {
                 FAIL_MSG(chipasm->line, "too many operands");
-                goto FAIL;
+                return 1;
             } else {
                 operands[n_op++] = tmp;
             }
@@ -710,13 +936,6 @@ int chip8asm_process_line(struct chip8asm *chipasm, const char *line)
     } else {
         return chip8asm_process_instruction(chipasm, op, operands, n_op);
     }
-
-FAIL:
-    free(op);
-    free(tmp);
-    for (int i = 0; i < n_op; i++)
-        free(operands[i]);
-    return 1;
 }
 
 struct chip8asm_options chip8asm_options_default(void)
@@ -745,6 +964,8 @@ uint16_t chip8asm_program_opcode(
 static int chip8asm_add_instruction(
     struct chip8asm *chipasm, struct instruction instr)
 {
+    int err;
+
     /* Add label to ltable, if any */
     if (chipasm->line_label) {
         if (ltable_add(&chipasm->labels, chipasm->line_label, instr.pc)) {
@@ -754,7 +975,9 @@ static int chip8asm_add_instruction(
         }
         chipasm->line_label = NULL;
     }
-    instructions_add(&chipasm->instructions, instr);
+    if ((err = chip8asm_compile_operands(chipasm, &instr)))
+        return err;
+    instructions_add(&chipasm->instructions, &chipasm->arena, instr);
 
     return 0;
 }
@@ -765,8 +988,6 @@ static int chip8asm_compile_chip8op(const struct chip8asm *chipasm,
     struct chip8_instruction ci;
     /* Temporary variable for storing eval result */
     uint16_t value;
-    /* Temporary variable for storing register numbers */
-    int regno;
 
     ci.op = instr->chipop;
     /* Initialize fields so 'scan-build' doesn't complain */
@@ -780,6 +1001,7 @@ static int chip8asm_compile_chip8op(const struct chip8asm *chipasm,
      * decision not to include pseudo-operands in the instruction operands
      * array ('instr->operands'), so in 'LD K, Vx', 'Vx' is the first operand
      * in the array, reducing the number of distinct cases to check below.
+     * Register names were already checked during the first pass.
      */
     switch (instr->chipop) {
     case OP_INVALID:
@@ -796,11 +1018,8 @@ static int chip8asm_compile_chip8op(const struct chip8asm *chipasm,
         break;
     /* Nibble as first operand */
     case OP_SCD:
-        if (chip8asm_eval(chipasm, instr->operands[0], instr->line, &value)) {
-            FAIL_MSG(instr->line, "could not evaluate operand '%s'",
-                instr->operands[0]);
+        if (chip8asm_eval_operand(chipasm, instr, 0, &value))
             return 1;
-        }
         ci.nibble = value;
         break;
     /* Address as first operand */
@@ -808,11 +1027,8 @@ static int chip8asm_compile_chip8op(const struct chip8asm *chipasm,
     case OP_CALL:
     case OP_LD_I:
     case OP_JP_V0:
-        if (chip8asm_eval(chipasm, instr->operands[0], instr->line, &value)) {
-            FAIL_MSG(instr->line, "could not evaluate operand '%s'",
-                instr->operands[0]);
+        if (chip8asm_eval_operand(chipasm, instr, 0, &value))
             return 1;
-        }
         ci.addr = value;
         break;
     /* Register first, then byte */
@@ -821,16 +1037,9 @@ static int chip8asm_compile_chip8op(const struct chip8asm *chipasm,
     case OP_LD_BYTE:
     case OP_ADD_BYTE:
     case OP_RND:
-        if ((regno = register_num(instr->operands[0])) == -1) {
-            FAIL_MSG(instr->line, "'%s' is not the name of a register",
-                instr->operands[0]);
-        }
-        if (chip8asm_eval(chipasm, instr->operands[1], instr->line, &value)) {
-            FAIL_MSG(instr->line, "could not evaluate operand '%s'",
-                instr->operands[1]);
+        if (chip8asm_eval_operand(chipasm, instr, 1, &value))
             return 1;
-        }
-        ci.vx = regno;
+        ci.vx = instr->operands[0].reg;
         ci.byte = value;
         break;
     /* Two register operands */
@@ -845,18 +1054,8 @@ static int chip8asm_compile_chip8op(const struct chip8asm *chipasm,
     case OP_SUBN:
     case OP_SHL_QUIRK:
     case OP_SNE_REG:
-        if ((regno = register_num(instr->operands[0])) == -1) {
-            FAIL_MSG(instr->line, "'%s' is not the name of a register",
-                instr->operands[0]);
-            return 1;
-        }
-        ci.vx = regno;
-        if ((regno = register_num(instr->operands[1])) == -1) {
-            FAIL_MSG(instr->line, "'%s' is not the name of a register",
-                instr->operands[1]);
-            return 1;
-        }
-        ci.vy = regno;
+        ci.vx = instr->operands[0].reg;
+        ci.vy = instr->operands[1].reg;
         break;
     /* Single register operand */
     case OP_SHR:
@@ -875,32 +1074,14 @@ static int chip8asm_compile_chip8op(const struct chip8asm *chipasm,
     case OP_LD_REG_DEREF_I:
     case OP_LD_R_REG:
     case OP_LD_REG_R:
-        if ((regno = register_num(instr->operands[0])) == -1) {
-            FAIL_MSG(instr->line, "'%s' is not the name of a register",
-                instr->operands[0]);
-            return 1;
-        }
-        ci.vx = regno;
+        ci.vx = instr->operands[0].reg;
         break;
     /* Two registers then a nibble */
-    case OP_DRW:
-        if ((regno = register_num(instr->operands[0])) == -1) {
-            FAIL_MSG(instr->line, "'%s' is not the name of a register",
-                instr->operands[0]);
-            return 1;
-        }
-        ci.vx = regno;
-        if ((regno = register_num(instr->operands[1])) == -1) {
-            FAIL_MSG(instr->line, "'%s' is not the name of a register",
-                instr->operands[1]);
-            return 1;
-        }
-        ci.vy = regno;
-        if (chip8asm_eval(chipasm, instr->operands[2], instr->line, &value)) {
-            FAIL_MSG(instr->line, "could not evaluate operand '%s'",
-                instr->operands[2]);
+    case OP_DRW:
+        if (chip8asm_eval_operand(chipasm, instr, 2, &value))
             return 1;
-        }
+        ci.vx = instr->operands[0].reg;
+        ci.vy = instr->operands[1].reg;
         ci.nibble = value;
         break;
     }
@@ -912,36 +1093,95 @@ static int chip8asm_compile_chip8op(const struct chip8asm *chipasm,
     return 0;
 }
 
-static int chip8asm_process_assignment(struct chip8asm *chipasm, char *label,
-    char *operands[MAX_OPERANDS], int n_operands)
+static int chip8asm_compile_expr(
+    struct chip8asm *chipasm, const char *text, struct expr *expr)
+{
+    size_t max_len = strlen(text) + 1;
+    struct token *tokens;
+
+    if (max_len > chipasm->scratch_cap) {
+        chipasm->scratch =
+            xrealloc(chipasm->scratch, max_len * sizeof *chipasm->scratch);
+        chipasm->scratch_cap = max_len;
+    }
+    if (expr_compile(text, chipasm->line, chipasm->scratch, &expr->len))
+        return 1;
+    tokens = arena_alloc(&chipasm->arena, expr->len * sizeof *tokens);
+    memcpy(tokens, chipasm->scratch, expr->len * sizeof *tokens);
+    expr->tokens = tokens;
+    return 0;
+}
+
+static int chip8asm_compile_operands(
+    struct chip8asm *chipasm, struct instruction *instr)
+{
+    for (int i = 0; i < instr->n_operands; i++) {
+        struct operand *operand = &instr->operands[i];
+
+        if (instruction_operand_is_register(instr, i)) {
+            if ((operand->reg = register_num(operand->text)) == -1) {
+                FAIL_MSG(chipasm->line, "'%s' is not the name of a register",
+                    operand->text);
+                return 1;
+            }
+        } else {
+            operand->reg = -1;
+            if (chip8asm_compile_expr(chipasm, operand->text, &operand->expr)) {
+                FAIL_MSG(chipasm->line, "could not parse operand '%s'",
+                    operand->text);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int chip8asm_eval_operand(const struct chip8asm *chipasm,
+    const struct instruction *instr, int n, uint16_t *value)
+{
+    if (expr_eval(chipasm, &instr->operands[n].expr, instr->line, value)) {
+        FAIL_MSG(instr->line, "could not evaluate operand '%s'",
+            instr->operands[n].text);
+        return 1;
+    }
+    return 0;
+}
+
+static int chip8asm_process_assignment(struct chip8asm *chipasm,
+    const char *label, char *operands[MAX_OPERANDS], int n_operands)
 {
     uint16_t value;
-    int retval = 0;
 
     /* Don't process this assignment if we're skipping things */
-    if (chip8asm_should_process(chipasm)) {
-        if (n_operands != 1) {
-            FAIL_MSG(chipasm->line, "wrong number of operands given to '='");
-            free(label);
-            retval = 1;
-        } else if (chip8asm_eval(chipasm, operands[0], chipasm->line, &value)) {
-            FAIL_MSG(chipasm->line, "failed to evaluate expression");
-            free(label);
-            retval = 1;
-        } else if (ltable_add(&chipasm->labels, label, value)) {
-            FAIL_MSG(
-                chipasm->line, "duplicate label or variable '%s' found", label);
-            free(label);
-            retval = 1;
-        }
+    if (!chip8asm_should_process(chipasm))
+        return 0;
+    if (n_operands != 1) {
+        FAIL_MSG(chipasm->line, "wrong number of operands given to '='");
+        return 1;
+    } else if (chip8asm_eval(chipasm, operands[0], chipasm->line, &value)) {
+        FAIL_MSG(chipasm->line, "failed to evaluate expression");
+        return 1;
+    } else if (ltable_add(&chipasm->labels, label, value)) {
+        FAIL_MSG(
+            chipasm->line, "duplicate label or variable '%s' found", label);
+        return 1;
     }
-    for (int i = 0; i < n_operands; i++)
-        free(operands[i]);
-    return retval;
+    return 0;
 }
 
-static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
-    char *operands[MAX_OPERANDS], int n_operands)
+static int chip8asm_process_include(struct chip8asm *chipasm, const char *name)
+{
+    char *path = include_path(chipasm->file, name);
+    int err;
+
+    if ((err = chip8asm_process_file(chipasm, path)))
+        FAIL_MSG(chipasm->line, "could not process included file '%s'", path);
+    free(path);
+    return err;
+}
+
+static int chip8asm_process_instruction(struct chip8asm *chipasm,
+    const char *op, char *operands[MAX_OPERANDS], int n_operands)
 {
 /* This is probably bordering on preprocessor abuse... */
 #define CHIPOP(name, it, nops)                                                 \
@@ -952,8 +1192,7 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
         instr.n_operands = (nops);                                             \
         instr.chipop = (it);                                                   \
         for (int i = 0; i < (nops); i++)                                       \
-            instr.operands[i] = operands[i];                                   \
-        operands_used = (nops);                                                \
+            instr.operands[i].text = operands[i];                              \
     }
 
 #define EXPECT_OPERANDS(line, op, want, got)                                   \
@@ -961,24 +1200,20 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
         if ((want) > (got)) {                                                  \
             FAIL_MSG((line), "too few operands to %s", (op));                  \
             retval = 1;                                                        \
-            goto OUT_FREE_STRINGS;                                             \
+            goto OUT;                                                          \
         } else if ((got) > (want)) {                                           \
             FAIL_MSG((line), "too many operands to %s", (op));                 \
             retval = 1;                                                        \
-            goto OUT_FREE_STRINGS;                                             \
+            goto OUT;                                                          \
         }                                                                      \
     } while (0)
     /* End preprocessor abuse */
 
     struct instruction instr;
-    /*
-     * The number of operands which were used in an instruction, and thus
-     * should not be freed.
-     */
-    int operands_used = 0;
     int retval = 0;
 
     instr.line = chipasm->line;
+    instr.file = chipasm->file;
 
     /*
      * We need to try processing IF, ELSE, and ENDIF first, since they will
@@ -1001,7 +1236,7 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
             !ltable_get(&chipasm->labels, operands[0], NULL)) {
             chipasm->if_skip_else = chipasm->if_level;
         }
-        goto OUT_FREE_STRINGS;
+        goto OUT;
     } else if (!strcasecmp(op, "IFNDEF")) {
         EXPECT_OPERANDS(chipasm->line, op, 1, n_operands);
         chipasm->if_level++;
@@ -1009,13 +1244,13 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
             ltable_get(&chipasm->labels, operands[0], NULL)) {
             chipasm->if_skip_else = chipasm->if_level;
         }
-        goto OUT_FREE_STRINGS;
+        goto OUT;
     } else if (!strcasecmp(op, "ELSE")) {
         EXPECT_OPERANDS(chipasm->line, op, 0, n_operands);
         if (chipasm->if_level == 0) {
             FAIL_MSG(chipasm->line, "unexpected ELSE");
             retval = 1;
-            goto OUT_FREE_STRINGS;
+            goto OUT;
         }
         /*
          * Here, we need to check if we've reached the ELSE corresponding to
@@ -1030,13 +1265,13 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
             chipasm->if_skip_else = 0;
         else if (chip8asm_should_process(chipasm))
             chipasm->if_skip_endif = chipasm->if_level;
-        goto OUT_FREE_STRINGS;
+        goto OUT;
     } else if (!strcasecmp(op, "ENDIF")) {
         EXPECT_OPERANDS(chipasm->line, op, 0, n_operands);
         if (chipasm->if_level == 0) {
             FAIL_MSG(chipasm->line, "unexpected ENDIF");
             retval = 1;
-            goto OUT_FREE_STRINGS;
+            goto OUT;
         }
         /*
          * Note that we also check if_skip_else here, since an IF block
@@ -1049,45 +1284,46 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
         if (chipasm->if_level == chipasm->if_skip_endif)
             chipasm->if_skip_endif = 0;
         chipasm->if_level--;
-        goto OUT_FREE_STRINGS;
+        goto OUT;
     }
 
     /* Now we can determine whether we should skip the rest of this */
     if (!chip8asm_should_process(chipasm))
-        goto OUT_FREE_STRINGS;
+        goto OUT;
 
     /* Handle special assembler instructions */
     if (!strcasecmp(op, "DEFINE")) {
         EXPECT_OPERANDS(chipasm->line, op, 1, n_operands);
         ltable_add(&chipasm->labels, operands[0], 0);
-        operands_used = 1;
-        goto OUT_FREE_STRINGS;
+        goto OUT;
+    } else if (!strcasecmp(op, "INCLUDE")) {
+        EXPECT_OPERANDS(chipasm->line, op, 1, n_operands);
+        retval = chip8asm_process_include(chipasm, operands[0]);
+        goto OUT;
     } else if (!strcasecmp(op, "DB")) {
         EXPECT_OPERANDS(chipasm->line, op, 1, n_operands);
         instr.type = IT_DB;
         instr.n_operands = 1;
-        instr.operands[0] = operands[0];
-        operands_used = 1;
+        instr.operands[0].text = operands[0];
         /* We don't have to worry about aligning pc here */
         instr.pc = chipasm->pc;
-        chip8asm_add_instruction(chipasm, instr);
+        retval = chip8asm_add_instruction(chipasm, instr);
         chipasm->pc++;
-        goto OUT_FREE_STRINGS;
+        goto OUT;
     } else if (!strcasecmp(op, "DW")) {
         EXPECT_OPERANDS(chipasm->line, op, 1, n_operands);
         instr.type = IT_DW;
         instr.n_operands = 1;
-        instr.operands[0] = operands[0];
-        operands_used = 1;
+        instr.operands[0].text = operands[0];
         /* We don't have to worry about aligning pc here */
         instr.pc = chipasm->pc;
-        chip8asm_add_instruction(chipasm, instr);
+        retval = chip8asm_add_instruction(chipasm, instr);
         chipasm->pc += 2;
-        goto OUT_FREE_STRINGS;
+        goto OUT;
     } else if (!strcasecmp(op, "OPTION")) {
         EXPECT_OPERANDS(chipasm->line, op, 1, n_operands);
         WARN(chipasm->line, "ignoring unrecognized option '%s'", operands[0]);
-        goto OUT_FREE_STRINGS;
+        goto OUT;
     }
 
     /*
@@ -1118,13 +1354,14 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
         /* Figure out which 'JP' we're using */
         if (n_operands == 1) {
             instr.chipop = OP_JP;
-            instr.operands[0] = operands[0];
-            operands_used = 1;
+            instr.operands[0].text = operands[0];
         } else if (n_operands == 2 && !strcasecmp(operands[0], "V0")) {
             instr.chipop = OP_JP_V0;
-            free(operands[0]);
-            instr.operands[0] = operands[1];
-            operands_used = 2;
+            instr.operands[0].text = operands[1];
+        } else {
+            FAIL_MSG(chipasm->line, "invalid operands to JP");
+            retval = 1;
+            goto OUT;
         }
     }
     CHIPOP("CALL", OP_CALL, 1)
@@ -1133,9 +1370,8 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
         EXPECT_OPERANDS(chipasm->line, op, 2, n_operands);
         instr.type = IT_CHIP8_OP;
         instr.n_operands = 2;
-        instr.operands[0] = operands[0];
-        instr.operands[1] = operands[1];
-        operands_used = 2;
+        instr.operands[0].text = operands[0];
+        instr.operands[1].text = operands[1];
         /* Figure out which 'SE' we're using */
         if (register_num(operands[1]) != -1)
             instr.chipop = OP_SE_REG;
@@ -1147,9 +1383,8 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
         EXPECT_OPERANDS(chipasm->line, op, 2, n_operands);
         instr.type = IT_CHIP8_OP;
         instr.n_operands = 2;
-        instr.operands[0] = operands[0];
-        instr.operands[1] = operands[1];
-        operands_used = 2;
+        instr.operands[0].text = operands[0];
+        instr.operands[1].text = operands[1];
         /* Figure out which 'SNE' we're using */
         if (register_num(operands[1]) != -1)
             instr.chipop = OP_SNE_REG;
@@ -1160,7 +1395,6 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
     {
         EXPECT_OPERANDS(chipasm->line, op, 2, n_operands);
         instr.type = IT_CHIP8_OP;
-        operands_used = 2;
         /*
          * Figure out which 'LD' we're using.
          * This is very ugly, owing to the large number of overloads for
@@ -1172,73 +1406,61 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
         if (!strcasecmp(operands[0], "I")) {
             instr.chipop = OP_LD_I;
             instr.n_operands = 1;
-            free(operands[0]);
-            instr.operands[0] = operands[1];
+            instr.operands[0].text = operands[1];
         } else if (!strcasecmp(operands[0], "DT")) {
             instr.chipop = OP_LD_DT_REG;
             instr.n_operands = 1;
-            free(operands[0]);
-            instr.operands[0] = operands[1];
+            instr.operands[0].text = operands[1];
         } else if (!strcasecmp(operands[0], "ST")) {
             instr.chipop = OP_LD_ST;
             instr.n_operands = 1;
-            free(operands[0]);
-            instr.operands[0] = operands[1];
+            instr.operands[0].text = operands[1];
         } else if (!strcasecmp(operands[0], "F")) {
             instr.chipop = OP_LD_F;
             instr.n_operands = 1;
-            free(operands[0]);
-            instr.operands[0] = operands[1];
+            instr.operands[0].text = operands[1];
         } else if (!strcasecmp(operands[0], "HF")) {
             instr.chipop = OP_LD_HF;
             instr.n_operands = 1;
-            free(operands[0]);
-            instr.operands[0] = operands[1];
+            instr.operands[0].text = operands[1];
         } else if (!strcasecmp(operands[0], "B")) {
             instr.chipop = OP_LD_B;
             instr.n_operands = 1;
-            free(operands[0]);
-            instr.operands[0] = operands[1];
+            instr.operands[0].text = operands[1];
         } else if (!strcasecmp(operands[0], "[I]")) {
             instr.chipop = OP_LD_DEREF_I_REG;
             instr.n_operands = 1;
-            free(operands[0]);
-            instr.operands[0] = operands[1];
+            instr.operands[0].text = operands[1];
         } else if (!strcasecmp(operands[0], "R")) {
             instr.chipop = OP_LD_R_REG;
             instr.n_operands = 1;
-            free(operands[0]);
-            instr.operands[0] = operands[1];
+            instr.operands[0].text = operands[1];
         } else if (register_num(operands[1]) != -1) {
             instr.chipop = OP_LD_REG;
             instr.n_operands = 2;
-            instr.operands[0] = operands[0];
-            instr.operands[1] = operands[1];
+            instr.operands[0].text = operands[0];
+            instr.operands[1].text = operands[1];
         } else if (!strcasecmp(operands[1], "DT")) {
             instr.chipop = OP_LD_REG_DT;
             instr.n_operands = 1;
-            instr.operands[0] = operands[0];
-            operands_used = 1;
+            instr.operands[0].text = operands[0];
         } else if (!strcasecmp(operands[1], "K")) {
             instr.chipop = OP_LD_KEY;
             instr.n_operands = 1;
-            instr.operands[0] = operands[0];
-            operands_used = 1;
+            instr.operands[0].text = operands[0];
         } else if (!strcasecmp(operands[1], "[I]")) {
             instr.chipop = OP_LD_REG_DEREF_I;
             instr.n_operands = 1;
-            instr.operands[0] = operands[0];
-            operands_used = 1;
+            instr.operands[0].text = operands[0];
         } else if (!strcasecmp(operands[1], "R")) {
             instr.chipop = OP_LD_REG_R;
             instr.n_operands = 1;
-            instr.operands[0] = operands[0];
-            operands_used = 1;
+            instr.operands[0].text = operands[0];
         } else {
             instr.chipop = OP_LD_BYTE;
             instr.n_operands = 2;
-            instr.operands[0] = operands[0];
-            instr.operands[1] = operands[1];
+            instr.operands[0].text = operands[0];
+            instr.operands[1].text = operands[1];
         }
     }
     else if (!strcasecmp(op, "ADD"))
@@ -1246,22 +1468,20 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
         EXPECT_OPERANDS(chipasm->line, op, 2, n_operands);
         instr.type = IT_CHIP8_OP;
         /* Figure out which 'ADD' we're using */
-        operands_used = 2;
         if (!strcasecmp(operands[0], "I")) {
             instr.chipop = OP_ADD_I;
             instr.n_operands = 1;
-            free(operands[0]);
-            instr.operands[0] = operands[1];
+            instr.operands[0].text = operands[1];
         } else if (register_num(operands[1]) != -1) {
             instr.chipop = OP_ADD_REG;
             instr.n_operands = 2;
-            instr.operands[0] = operands[0];
-            instr.operands[1] = operands[1];
+            instr.operands[0].text = operands[0];
+            instr.operands[1].text = operands[1];
         } else {
             instr.chipop = OP_ADD_BYTE;
             instr.n_operands = 2;
-            instr.operands[0] = operands[0];
-            instr.operands[1] = operands[1];
+            instr.operands[0].text = operands[0];
+            instr.operands[1].text = operands[1];
         }
     }
     CHIPOP("OR", OP_OR, 2)
@@ -1274,16 +1494,14 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
             EXPECT_OPERANDS(chipasm->line, op, 2, n_operands);
             instr.chipop = OP_SHR_QUIRK;
             instr.n_operands = 2;
-            operands_used = 2;
-            instr.operands[1] = operands[1];
+            instr.operands[1].text = operands[1];
         } else {
             EXPECT_OPERANDS(chipasm->line, op, 1, n_operands);
             instr.chipop = OP_SHR;
             instr.n_operands = 1;
-            operands_used = 2;
         }
         instr.type = IT_CHIP8_OP;
-        instr.operands[0] = operands[0];
+        instr.operands[0].text = operands[0];
     }
     CHIPOP("SUBN", OP_SUBN, 2)
     else if (!strcasecmp(op, "SHL"))
@@ -1292,16 +1510,14 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
             EXPECT_OPERANDS(chipasm->line, op, 2, n_operands);
             instr.chipop = OP_SHL_QUIRK;
             instr.n_operands = 2;
-            operands_used = 2;
-            instr.operands[1] = operands[1];
+            instr.operands[1].text = operands[1];
         } else {
             EXPECT_OPERANDS(chipasm->line, op, 1, n_operands);
             instr.chipop = OP_SHL;
             instr.n_operands = 1;
-            operands_used = 1;
         }
         instr.type = IT_CHIP8_OP;
-        instr.operands[0] = operands[0];
+        instr.operands[0].text = operands[0];
     }
     CHIPOP("RND", OP_RND, 2)
     CHIPOP("DRW", OP_DRW, 3)
@@ -1311,16 +1527,13 @@ static int chip8asm_process_instruction(struct chip8asm *chipasm, char *op,
     {
         FAIL_MSG(chipasm->line, "invalid instruction (operation '%s')", op);
         retval = 1;
-        goto OUT_FREE_STRINGS;
+        goto OUT;
     }
 
     /* Every Chip-8 instruction is exactly 2 bytes long */
     chipasm->pc += 2;
-    chip8asm_add_instruction(chipasm, instr);
-OUT_FREE_STRINGS:
-    free(op);
-    for (int i = operands_used; i < n_operands; i++)
-        free(operands[i]);
+    retval = chip8asm_add_instruction(chipasm, instr);
+OUT:
     return retval;
 
 /* Nobody has to know about this */
@@ -1332,119 +1545,376 @@ static bool chip8asm_should_process(struct chip8asm *chipasm)
     return chipasm->if_skip_else == 0 && chipasm->if_skip_endif == 0;
 }
 
-static unsigned long hash_str(const char *str)
+static int expr_compile(
+    const char *text, int line, struct token *tokens, int *len)
+{
+    /*
+     * We do need to be a bit careful about the unary '-' operator: if the
+     * last token read was an operator, then any '-' should be parsed as the
+     * unary operator, but otherwise it is the binary operator. Internally, we
+     * will use '_' to represent the unary '-'.
+     */
+    char opstack[STACK_SIZE];
+    int oppos = 0; /* Where to put the next operator on the stack. */
+    /* The number of values on the stack when evaluating up to this point */
+    int depth = 0;
+    bool expecting_num = true;
+
+    *len = 0;
+    while (*text != '\0') {
+        if (expecting_num && *text == '-') {
+            int p = precedence('_');
+            /* The unary - operator is right-associative */
+            while (oppos > 0 && precedence(opstack[oppos - 1]) > p)
+                if (operator_emit(opstack[--oppos], tokens, len, &depth, line))
+                    return 1;
+            opstack[oppos++] = '_';
+            text++;
+        } else if (*text == '#') {
+            /* Parse hex number */
+            uint16_t n;
+
+            text++;
+            if (parse_num_hex(&text, &n)) {
+                FAIL_MSG(line, "expected hexadecimal number");
+                return 1;
+            }
+            tokens[(*len)++] = (struct token){.type = TOKEN_NUMBER, .value = n};
+            depth++;
+            expecting_num = false;
+        } else if (*text == '$') {
+            /* Parse binary number */
+            uint16_t n;
+
+            text++;
+            if (parse_num_bin(&text, &n)) {
+                FAIL_MSG(line, "expected binary number");
+                return 1;
+            }
+            tokens[(*len)++] = (struct token){.type = TOKEN_NUMBER, .value = n};
+            depth++;
+            expecting_num = false;
+        } else if (isdigit(*text)) {
+            /* Parse decimal number */
+            uint16_t n;
+
+            if (parse_num_dec(&text, &n)) {
+                FAIL_MSG(line, "expected decimal number");
+                return 1;
+            }
+            tokens[(*len)++] = (struct token){.type = TOKEN_NUMBER, .value = n};
+            depth++;
+            expecting_num = false;
+        } else if (isidentstart(*text)) {
+            /* Parse identifier (which is looked up during evaluation) */
+            const char *start = text;
+
+            while (isidentbody(*text))
+                text++;
+            tokens[(*len)++] = (struct token){
+                .type = TOKEN_IDENT,
+                .name = start,
+                .len = text - start,
+                .hash = hash_str(start, text - start),
+            };
+            depth++;
+            expecting_num = false;
+        } else if (*text == '(') {
+            opstack[oppos++] = *text++;
+            expecting_num = true;
+        } else if (*text == ')') {
+            while (oppos > 0 && opstack[oppos - 1] != '(')
+                if (operator_emit(opstack[--oppos], tokens, len, &depth, line))
+                    return 1;
+            /* Get rid of the '(' pseudo-operator on the stack */
+            if (oppos == 0) {
+                FAIL_MSG(line, "found ')' with no matching '('");
+                return 1;
+            }
+            oppos--;
+            expecting_num = false;
+            text++;
+        } else if (*text == '~') {
+            /*
+             * We need to treat any unary operators a little differently, since
+             * they should be right-associative instead of left-associative like
+             * the binary operators, and we should only process them when
+             * 'expecting_num == true', since otherwise an expression like '1 ~'
+             * would be parsed the same as '~ 1'.
+             */
+            int p = precedence(*text);
+            if (!expecting_num) {
+                FAIL_MSG(line, "did not expect unary operator '~'");
+                return 1;
+            }
+            /*
+             * Note the 'precedence(...) > p' instead of >=; this is what makes
+             * the operator right-associative.
+             */
+            while (oppos > 0 && precedence(opstack[oppos - 1]) > p)
+                if (operator_emit(opstack[--oppos], tokens, len, &depth, line))
+                    return 1;
+            opstack[oppos++] = *text++;
+        } else {
+            /* Must be a binary operator */
+            int p = precedence(*text);
+
+            if (p < 0) {
+                FAIL_MSG(line, "unknown operator '%c'", *text);
+                return 1;
+            }
+            while (oppos > 0 && precedence(opstack[oppos - 1]) >= p)
+                if (operator_emit(opstack[--oppos], tokens, len, &depth, line))
+                    return 1;
+            opstack[oppos++] = *text++;
+            expecting_num = true;
+        }
+
+        if (oppos == STACK_SIZE) {
+            FAIL_MSG(line, "operator stack overflowed (too many operators)");
+            return 1;
+        }
+        if (depth == STACK_SIZE) {
+            FAIL_MSG(
+                line, "number stack overflowed (too many numbers/identifiers)");
+            return 1;
+        }
+        skip_spaces(&text);
+    }
+
+    /* Now that we're done here, we need to use the remaining operators */
+    while (oppos > 0) {
+        if (opstack[--oppos] == '(') {
+            FAIL_MSG(line, "found '(' with no matching ')'");
+            return 1;
+        }
+        if (operator_emit(opstack[oppos], tokens, len, &depth, line))
+            return 1;
+    }
+
+    if (depth != 1) {
+        FAIL_MSG(line, "expected operation");
+        return 1;
+    }
+    return 0;
+}
+
+static int expr_eval(const struct chip8asm *chipasm, const struct expr *expr,
+    int line, uint16_t *value)
+{
+    /* Compilation made sure that the stack can neither overflow nor underflow */
+    uint16_t numstack[STACK_SIZE];
+    int numpos = 0; /* Where to put the next number on the stack. */
+
+    for (int i = 0; i < expr->len; i++) {
+        const struct token *token = &expr->tokens[i];
+        const struct ltable_entry *entry;
+
+        switch (token->type) {
+        case TOKEN_NUMBER:
+            numstack[numpos++] = token->value;
+            break;
+        case TOKEN_IDENT:
+            if (!(entry = ltable_find(
+                      &chipasm->labels, token->name, token->len, token->hash))) {
+                FAIL_MSG(line, "unknown identifier '%.*s'", (int)token->len,
+                    token->name);
+                return 1;
+            }
+            numstack[numpos++] = entry->addr;
+            break;
+        case TOKEN_OPERATOR:
+            if (operator_apply(token->op, numstack, &numpos, line)) {
+                FAIL_MSG(line, "could not evaluate expression");
+                return 1;
+            }
+            break;
+        }
+    }
+
+    if (value)
+        *value = numstack[0];
+    return 0;
+}
+
+static unsigned long hash_str(const char *str, size_t len)
 {
     /*
      * This is the "djb2" algorithm given on
      * http://www.cse.yorku.ca/~oz/hash.html
      */
     unsigned long hash = 5381;
-    int c;
 
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    while (len--)
+        hash = ((hash << 5) + hash) + (unsigned char)*str++; /* hash * 33 + c */
 
     return hash;
 }
 
-static void instructions_init(struct instructions *lst, size_t cap)
+static char *include_path(const char *from, const char *name)
 {
-    if (cap == 0)
-        lst->data = NULL;
-    else
-        lst->data = xmalloc(cap * sizeof *lst->data);
+    size_t len = strlen(name);
+    size_t dirlen = 0;
+    char *path;
+
+    if (len >= 2 && name[0] == '"' && name[len - 1] == '"') {
+        name++;
+        len -= 2;
+    }
+    if (from && name[0] != '/') {
+        const char *slash = strrchr(from, '/');
+
+        if (slash)
+            dirlen = slash - from + 1;
+    }
 
-    lst->cap = cap;
-    lst->len = 0;
+    path = xmalloc(dirlen + len + 1);
+    if (dirlen > 0)
+        memcpy(path, from, dirlen);
+    memcpy(path + dirlen, name, len);
+    path[dirlen + len] = '\0';
+    return path;
 }
 
-static void instructions_add(struct instructions *lst, struct instruction instr)
+static bool instruction_operand_is_register(
+    const struct instruction *instr, int n)
 {
-    if (lst->len >= lst->cap)
-        instructions_grow(lst);
+    if (instr->type != IT_CHIP8_OP)
+        return false;
 
-    lst->data[lst->len++] = instr;
+    switch (instr->chipop) {
+    case OP_SCD:
+    case OP_JP:
+    case OP_CALL:
+    case OP_LD_I:
+    case OP_JP_V0:
+        return false;
+    /* The last operand of these is a value, and the rest are registers */
+    case OP_SE_BYTE:
+    case OP_SNE_BYTE:
+    case OP_LD_BYTE:
+    case OP_ADD_BYTE:
+    case OP_RND:
+    case OP_DRW:
+        return n < instr->n_operands - 1;
+    default:
+        return true;
+    }
 }
 
-static void instructions_clear(struct instructions *lst)
+static void instructions_add(
+    struct instructions *lst, struct arena *arena, struct instruction instr)
 {
-    for (size_t i = 0; i < lst->len; i++)
-        for (int j = 0; j < lst->data[i].n_operands; j++)
-            free(lst->data[i].operands[j]);
+    if (!lst->tail || lst->tail->len == INSTRUCTION_BLOCK_SIZE) {
+        struct instruction_block *next = lst->tail ? lst->tail->next : lst->head;
+
+        /* Reuse a block left over from before the list was cleared */
+        if (!next) {
+            next = arena_alloc(arena, sizeof *next);
+            next->next = NULL;
+            next->len = 0;
+            if (lst->tail)
+                lst->tail->next = next;
+            else
+                lst->head = next;
+        }
+        lst->tail = next;
+    }
 
-    free(lst->data);
-    lst->data = NULL;
-    lst->len = lst->cap = 0;
+    lst->tail->data[lst->tail->len++] = instr;
 }
 
-static void instructions_grow(struct instructions *lst)
+static void instructions_clear(struct instructions *lst)
 {
-    size_t new_cap = lst->cap == 0 ? 1 : 2 * lst->cap;
-    struct instruction *new_data =
-        xrealloc(lst->data, new_cap * sizeof *new_data);
-
-    lst->cap = new_cap;
-    lst->data = new_data;
+    for (struct instruction_block *block = lst->head; block != NULL;
+         block = block->next)
+        block->len = 0;
+    lst->tail = NULL;
 }
 
-static bool ltable_add(struct ltable *tab, char *label, uint16_t addr)
+static bool ltable_add(struct ltable *tab, const char *label, uint16_t addr)
 {
-    size_t n_bucket = hash_str(label) % LTABLE_SIZE;
-    struct ltable_bucket *b;
-
-    /* Create a new bucket list if necessary */
-    if (!tab->buckets[n_bucket]) {
-        b = xmalloc(sizeof *b);
-        b->label = label;
-        b->addr = addr;
-        b->next = NULL;
-        tab->buckets[n_bucket] = b;
-        return false;
-    }
+    size_t len = strlen(label);
+    unsigned long hash = hash_str(label, len);
+    size_t pos;
+
+    /* Keep the table at most three-quarters full */
+    if (4 * (tab->len + 1) > 3 * tab->cap)
+        ltable_grow(tab);
+
+    for (pos = hash & (tab->cap - 1); tab->entries[pos].label;
+         pos = (pos + 1) & (tab->cap - 1)) {
+        struct ltable_entry *entry = &tab->entries[pos];
 
-    b = tab->buckets[n_bucket];
-    while (b->next) {
         /* Check for entry already present */
-        if (!strcmp(label, b->label)) {
-            b->addr = addr;
+        if (entry->hash == hash && entry->len == len &&
+            !memcmp(entry->label, label, len)) {
+            entry->addr = addr;
             return true;
         }
     }
-    b->next = xmalloc(sizeof *b->next);
-    b->next->label = xstrdup(label);
-    b->next->addr = addr;
-    b->next->next = NULL;
+    tab->entries[pos] = (struct ltable_entry){label, len, hash, addr};
+    tab->len++;
     return false;
 }
 
 static void ltable_clear(struct ltable *tab)
 {
-    for (int i = 0; i < LTABLE_SIZE; i++) {
-        struct ltable_bucket *b = tab->buckets[i];
-        while (b) {
-            struct ltable_bucket *next = b->next;
-            free(b->label);
-            free(b);
-            b = next;
-        }
-        tab->buckets[i] = NULL;
+    free(tab->entries);
+    tab->entries = NULL;
+    tab->cap = tab->len = 0;
+}
+
+static const struct ltable_entry *ltable_find(
+    const struct ltable *tab, const char *key, size_t len, unsigned long hash)
+{
+    if (tab->len == 0)
+        return NULL;
+
+    for (size_t pos = hash & (tab->cap - 1); tab->entries[pos].label;
+         pos = (pos + 1) & (tab->cap - 1)) {
+        const struct ltable_entry *entry = &tab->entries[pos];
+
+        if (entry->hash == hash && entry->len == len &&
+            !memcmp(entry->label, key, len))
+            return entry;
     }
+    return NULL;
 }
 
 static bool ltable_get(
     const struct ltable *tab, const char *key, uint16_t *value)
 {
-    size_t n_bucket = hash_str(key) % LTABLE_SIZE;
+    size_t len = strlen(key);
+    const struct ltable_entry *entry =
+        ltable_find(tab, key, len, hash_str(key, len));
 
-    for (struct ltable_bucket *b = tab->buckets[n_bucket]; b != NULL;
-         b = b->next) {
-        if (!strcmp(key, b->label)) {
-            if (value)
-                *value = b->addr;
-            return true;
-        }
+    if (!entry)
+        return false;
+    if (value)
+        *value = entry->addr;
+    return true;
+}
+
+static void ltable_grow(struct ltable *tab)
+{
+    size_t new_cap = tab->cap == 0 ? LTABLE_INITIAL_CAP : 2 * tab->cap;
+    struct ltable_entry *new_entries = xcalloc(new_cap, sizeof *new_entries);
+
+    /* The labels are known to be distinct, so they can just be reinserted */
+    for (size_t i = 0; i < tab->cap; i++) {
+        size_t pos;
+
+        if (!tab->entries[i].label)
+            continue;
+        for (pos = tab->entries[i].hash & (new_cap - 1);
+             new_entries[pos].label; pos = (pos + 1) & (new_cap - 1))
+            ;
+        new_entries[pos] = tab->entries[i];
     }
-    return false;
+    free(tab->entries);
+    tab->entries = new_entries;
+    tab->cap = new_cap;
 }
 
 static int operator_apply(char op, uint16_t *numstack, int *numpos, int line)
@@ -1495,11 +1965,15 @@ static int operator_apply(char op, uint16_t *numstack, int *numpos, int line)
         (*numpos)--;
         break;
     case '/':
-        numstack[*numpos - 2] /= numstack[*numpos - 1];
-        (*numpos)--;
-        break;
     case '%':
-        numstack[*numpos - 2] %= numstack[*numpos - 1];
+        if (numstack[*numpos - 1] == 0) {
+            FAIL_MSG(line, "division by zero");
+            return 1;
+        }
+        if (op == '/')
+            numstack[*numpos - 2] /= numstack[*numpos - 1];
+        else
+            numstack[*numpos - 2] %= numstack[*numpos - 1];
         (*numpos)--;
         break;
     case '~':
@@ -1516,6 +1990,26 @@ static int operator_apply(char op, uint16_t *numstack, int *numpos, int line)
     return 0;
 }
 
+static int operator_emit(
+    char op, struct token *tokens, int *len, int *depth, int line)
+{
+    if (op == '~' || op == '_') {
+        if (*depth == 0) {
+            FAIL_MSG(line, "expected argument to operator");
+            return 1;
+        }
+    } else {
+        if (*depth <= 1) {
+            FAIL_MSG(line, "expected argument to operator");
+            return 1;
+        }
+        (*depth)--;
+    }
+
+    tokens[(*len)++] = (struct token){.type = TOKEN_OPERATOR, .op = op};
+    return 0;
+}
+
 static int precedence(char op)
 {
     switch (op) {
@@ -1559,7 +2053,85 @@ static int register_num(const char *name)
     return -1;
 }
 
-static char *parse_ident(const char **str)
+static int source_open(const char *fname, struct source *source)
+{
+    bool is_stdin = !strcmp(fname, "-");
+    struct stat st;
+    size_t cap = 0;
+    ssize_t n;
+    int fd;
+
+    source->data = NULL;
+    source->len = 0;
+    source->mapped = false;
+
+    if (is_stdin) {
+        fd = STDIN_FILENO;
+    } else if ((fd = open(fname, O_RDONLY)) == -1) {
+        log_error("Could not open '%s' for reading: %s", fname, strerror(errno));
+        return 1;
+    }
+    if (fstat(fd, &st) == -1) {
+        log_error("Could not get information about '%s': %s", fname,
+            strerror(errno));
+        goto ERROR_FILE_OPENED;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        void *map;
+
+        if (st.st_size == 0)
+            goto DONE;
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            source->data = map;
+            source->len = st.st_size;
+            source->mapped = true;
+            goto DONE;
+        }
+        /* Some file systems don't support mapping, so we can still read */
+        log_debug("Could not map '%s' (%s); reading it instead", fname,
+            strerror(errno));
+    }
+
+    for (;;) {
+        if (source->len == cap) {
+            cap = cap == 0 ? SOURCE_BUFSIZE : 2 * cap;
+            source->data = xrealloc(source->data, cap);
+        }
+        if ((n = read(fd, source->data + source->len, cap - source->len)) == 0)
+            break;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error("Error reading from '%s': %s", fname, strerror(errno));
+            free(source->data);
+            source->data = NULL;
+            goto ERROR_FILE_OPENED;
+        }
+        source->len += n;
+    }
+
+DONE:
+    if (!is_stdin)
+        close(fd);
+    return 0;
+
+ERROR_FILE_OPENED:
+    if (!is_stdin)
+        close(fd);
+    return 1;
+}
+
+static void source_close(struct source *source)
+{
+    if (source->mapped)
+        munmap(source->data, source->len);
+    else
+        free(source->data);
+}
+
+static char *parse_ident(struct arena *arena, const char **str)
 {
     const char *tmp = *str;
 
@@ -1572,22 +2144,17 @@ static char *parse_ident(const char **str)
     if (tmp == *str) {
         return NULL;
     } else {
-        size_t len = tmp - *str;
-        char *ret = xmalloc(len + 1);
+        char *ret = arena_strndup(arena, *str, tmp - *str);
 
-        memcpy(ret, *str, len);
-        ret[len] = '\0';
         *str = tmp;
-
         return ret;
     }
 }
 
-static char *parse_operand(const char **str)
+static char *parse_operand(struct arena *arena, const char **str)
 {
     const char *tmp = *str;
     const char *end;
-    size_t len;
     char *ret;
 
     while (*tmp != '\0' && *tmp != '\n' && *tmp != ';' && *tmp != ',')
@@ -1597,11 +2164,8 @@ static char *parse_operand(const char **str)
     end = tmp;
     while (end > *str && isspace(end[-1]))
         end--;
-    len = end - *str;
 
-    ret = xmalloc(len + 1);
-    memcpy(ret, *str, len);
-    ret[len] = '\0';
+    ret = arena_strndup(arena, *str, end - *str);
     *str = tmp;
 
     return ret;
@@ -1673,6 +2237,6 @@ static int parse_num_hex(const char **str, uint16_t *num)
 
 static void skip_spaces(const char **str)
 {
-    while (isspace(**str))
+    while (**str != '\n' && isspace(**str))
         (*str)++;
 }
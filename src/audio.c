@@ -8,55 +8,232 @@
 #include "audio.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "memory.h"
 
-struct audio_ring_buffer {
+/**
+ * The maximum number of pending edges (a power of 2).
+ */
+#define AUDIO_QUEUE_SIZE 64
+/**
+ * The delay between the time of an edge and when it is heard, in seconds.
+ *
+ * This needs to cover the time between an edge and when it is pushed (up to a
+ * frame) plus some jitter.
+ */
+#define AUDIO_DELAY 0.030
+/**
+ * How far (in seconds) an edge can be from where it is expected before the
+ * output skips to it.
+ */
+#define AUDIO_RESYNC 0.100
+/**
+ * The time (in seconds) taken to fade in or out.
+ */
+#define AUDIO_FADE 0.002
+
+/**
+ * A change in the state of the buzzer.
+ */
+struct audio_edge {
+    /**
+     * The time of the edge, in samples.
+     */
+    int64_t time;
+    /**
+     * Whether the buzzer is turned on.
+     */
+    bool on;
+};
+
+struct audio_tone {
+    /**
+     * The pending edges, from `tail` (inclusive) to `head` (exclusive),
+     * modulo `AUDIO_QUEUE_SIZE`.
+     *
+     * Only the pushing thread writes to the queue, and only outside of the
+     * pending range.  Each index is written by one thread only: a release
+     * store publishes the edges (or free slots) before it, and the other
+     * thread reads the index with an acquire load.  So the audio callback
+     * never waits on a lock.
+     */
+    struct audio_edge edges[AUDIO_QUEUE_SIZE];
+    /**
+     * The number of edges pushed so far, written by the pushing thread.
+     */
+    size_t head;
+    /**
+     * The number of edges consumed so far, written by the audio callback.
+     */
+    size_t tail;
+    /**
+     * The edge time corresponding to the next sample of output.
+     */
+    int64_t clock;
+    /**
+     * The delay applied to edges, in samples.
+     */
+    int64_t delay;
+    /**
+     * The maximum drift before the output skips, in samples.
+     */
+    int64_t resync;
+    /**
+     * The phase of the wave, from 0 to 1.
+     */
+    float phase;
+    /**
+     * The change in phase per sample.
+     */
+    float phase_step;
     /**
-     * The current buffer position.
+     * The current gain, from 0 to 1.
      */
-    size_t pos;
+    float gain;
     /**
-     * The size of the audio buffer, in bytes.
+     * The change in gain per sample while fading.
      */
-    size_t size;
+    float gain_step;
     /**
-     * The audio buffer itself (flexible array member).
+     * Whether the buzzer is on (so that the gain is fading towards 1).
      */
-    int16_t buf[];
+    bool on;
+    /**
+     * The peak amplitude of the output.
+     */
+    float volume;
 };
 
-void audio_ring_buffer_free(struct audio_ring_buffer *ring)
+/**
+ * Returns the PolyBLEP correction for a rising edge at phase 0.
+ *
+ * Adding this to a naive square wave around its rising edge (and subtracting
+ * it around its falling edge) removes most of the aliasing the edges would
+ * otherwise cause.
+ */
+static float polyblep(float phase, float step);
+/**
+ * Synthesizes the given number of samples without processing any edges.
+ */
+static void audio_tone_render(struct audio_tone *tone, int16_t *buf, size_t len);
+
+struct audio_tone *audio_tone_new(
+    int sample_rate, int frequency, int16_t volume)
 {
-    free(ring);
+    struct audio_tone *tone = xcalloc(1, sizeof *tone);
+
+    tone->delay = AUDIO_DELAY * sample_rate;
+    tone->resync = AUDIO_RESYNC * sample_rate;
+    tone->phase_step = (float)frequency / sample_rate;
+    tone->gain_step = 1.0f / (AUDIO_FADE * sample_rate);
+    tone->volume = volume;
+    return tone;
 }
 
-void audio_ring_buffer_fill(
-    struct audio_ring_buffer *ring, int16_t *buf, size_t len)
+void audio_tone_free(struct audio_tone *tone)
 {
-    while (len--) {
-        *buf++ = ring->buf[ring->pos++];
-        if (ring->pos >= ring->size)
-            ring->pos = 0;
+    free(tone);
+}
+
+bool audio_tone_push(struct audio_tone *tone, uint64_t time, bool on)
+{
+    size_t head = __atomic_load_n(&tone->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&tone->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail == AUDIO_QUEUE_SIZE)
+        return false;
+
+    tone->edges[head % AUDIO_QUEUE_SIZE] = (struct audio_edge){
+        .time = (int64_t)time,
+        .on = on,
+    };
+    __atomic_store_n(&tone->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void audio_tone_fill(struct audio_tone *tone, int16_t *buf, size_t len)
+{
+    size_t head = __atomic_load_n(&tone->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&tone->tail, __ATOMIC_RELAXED);
+    size_t pos = 0;
+
+    while (pos < len) {
+        size_t end = len;
+
+        if (tail != head) {
+            const struct audio_edge *edge =
+                &tone->edges[tail % AUDIO_QUEUE_SIZE];
+            int64_t at = edge->time + tone->delay - tone->clock;
+
+            if (at < (int64_t)pos - tone->resync ||
+                at > (int64_t)len + tone->resync) {
+                /* The clocks have drifted apart; catch up to the edge */
+                tone->clock = edge->time + tone->delay - (int64_t)pos;
+                at = pos;
+            }
+            if (at <= (int64_t)pos) {
+                tone->on = edge->on;
+                tail++;
+                continue;
+            }
+            if (at < (int64_t)len)
+                end = at;
+        }
+        audio_tone_render(tone, buf + pos, end - pos);
+        pos = end;
     }
+    tone->clock += len;
+
+    __atomic_store_n(&tone->tail, tail, __ATOMIC_RELEASE);
 }
 
-struct audio_ring_buffer *audio_square_wave(
-    int sample_rate, int frequency, int16_t volume)
+static float polyblep(float phase, float step)
+{
+    if (phase < step) {
+        phase /= step;
+        return phase + phase - phase * phase - 1.0f;
+    }
+    if (phase > 1.0f - step) {
+        phase = (phase - 1.0f) / step;
+        return phase * phase + phase + phase + 1.0f;
+    }
+    return 0.0f;
+}
+
+static void audio_tone_render(struct audio_tone *tone, int16_t *buf, size_t len)
 {
-    struct audio_ring_buffer *ring;
-    int period = sample_rate / frequency;
+    if (!tone->on && tone->gain == 0.0f) {
+        /* Silence is by far the most common case */
+        memset(buf, 0, len * sizeof *buf);
+        return;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        float half = tone->phase < 0.5f ? tone->phase + 0.5f : tone->phase - 0.5f;
+        float sample = tone->phase < 0.5f ? 1.0f : -1.0f;
 
-    /* We only need our audio buffer to hold a single period */
-    ring = xmalloc(sizeof *ring + period * sizeof ring->buf[0]);
-    ring->size = period;
-    ring->pos = 0;
+        sample += polyblep(tone->phase, tone->phase_step);
+        sample -= polyblep(half, tone->phase_step);
+        if (tone->on && tone->gain < 1.0f)
+            tone->gain = tone->gain + tone->gain_step < 1.0f
+                ? tone->gain + tone->gain_step
+                : 1.0f;
+        else if (!tone->on && tone->gain > 0.0f)
+            tone->gain = tone->gain - tone->gain_step > 0.0f
+                ? tone->gain - tone->gain_step
+                : 0.0f;
 
-    /* Populate the buffer with the square wave data */
-    for (int i = 0; i < period / 2; i++)
-        ring->buf[i] = volume;
-    for (int i = period / 2; i < (int)ring->size; i++)
-        ring->buf[i] = -volume;
+        sample *= tone->gain * tone->volume;
+        /* The corrections can overshoot slightly */
+        if (sample > INT16_MAX)
+            sample = INT16_MAX;
+        else if (sample < -INT16_MAX)
+            sample = -INT16_MAX;
+        buf[i] = (int16_t)sample;
 
-    return ring;
+        tone->phase += tone->phase_step;
+        if (tone->phase >= 1.0f)
+            tone->phase -= 1.0f;
+    }
 }
@@ -9,7 +9,8 @@
 
 #include <errno.h>
 #include <getopt.h>
-#include <sched.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -18,18 +19,35 @@
 #include <SDL_audio.h>
 
 #include "audio.h"
+#include "disassembler.h"
+#include "frames.h"
 #include "interpreter.h"
 #include "log.h"
+#include "profile.h"
+#include "replay.h"
+#include "rom.h"
+#include "snapshot.h"
+#include "trace.h"
 
 static const char *HELP =
     "A Chip-8/Super-Chip interpreter.\n"
     "\n"
     "Options:\n"
+    "  -c, --cycles=CYCLES         set instructions executed per timer tick\n"
+    "  -F, --frames=FRAMES         set number of frames to run with --hash\n"
     "  -f, --frequency=FREQ        set game timer frequency (in Hz)\n"
+    "  -g, --gpu                   render using the GPU\n"
+    "  -H, --hash                  print display hashes without a window\n"
     "  -h, --help                  show this help message and exit\n"
     "  -l, --load-quirks           enable load quirks mode\n"
+    "  -P, --replay=FILE           replay a recording without displaying it\n"
+    "  -p, --profile=FILE          write an execution profile to FILE\n"
     "  -q, --shift-quirks          enable shift quirks mode\n"
+    "  -R, --record=FILE           record key presses to FILE\n"
+    "  -r, --rewind=SECONDS        set how far back the game can be rewound\n"
+    "  -S, --seed=SEED             set random seed\n"
     "  -s, --scale=SCALE           set game display scale\n"
+    "  -T, --trace=FILE            write a trace of the last instructions to FILE\n"
     "  -t, --tone=FREQ             set game buzzer tone (in Hz)\n"
     "  -u, --volume=VOL            set game buzzer volume (0-100)\n"
     "  -V, --version               show version information and exit\n"
@@ -54,10 +72,34 @@ struct progopts {
      * One Super-Chip pixel will be displayed as a square of width `scale`.
      */
     int scale;
+    /**
+     * The number of instructions to execute per timer tick (default 100).
+     */
+    unsigned long cycles;
+    /**
+     * The number of frames to run in hash mode (default 0).
+     *
+     * If this is 0, a replay is run until the end of the log.
+     */
+    unsigned long frames;
     /**
      * The frequency (in Hz) of the game timer (default 60).
      */
     long game_freq;
+    /**
+     * Whether to render using an SDL renderer (default false).
+     *
+     * This lets the GPU (if there is one) do the scaling, and paces frames
+     * using vsync.
+     */
+    bool gpu;
+    /**
+     * Whether to run in hash mode (default false).
+     *
+     * In this case, the game is run as fast as possible without a window,
+     * printing a hash of the display after each frame.
+     */
+    bool hash;
     /**
      * Whether to use load quirks mode (default false).
      */
@@ -66,6 +108,39 @@ struct progopts {
      * Whether to use shift quirks mode (default false).
      */
     bool shift_quirks;
+    /**
+     * How many seconds of gameplay to keep for rewinding (default 30).
+     *
+     * If this is 0, rewinding is disabled.
+     */
+    unsigned long rewind_secs;
+    /**
+     * The random seed to use (default based on the current time).
+     */
+    uint32_t seed;
+    /**
+     * Whether `seed` was given by the user.
+     */
+    bool seed_given;
+    /**
+     * The file to which to record key presses, if any.
+     */
+    char *record;
+    /**
+     * The recording to replay, if any.
+     *
+     * In this case, the game is run as fast as possible without a window.
+     */
+    char *replay;
+    /**
+     * The file to which to write an execution profile on exit, if any.
+     */
+    char *profile;
+    /**
+     * The file to which to write a trace of the most recently executed
+     * instructions on exit, if any.
+     */
+    char *trace;
     /**
      * The frequency (in Hz) of the game beeper (default 440).
      */
@@ -98,9 +173,14 @@ struct surface {
      */
     int yscale;
     /**
-     * Whether the surface has been changed (set to true on every draw).
+     * The regions of the surface which have been changed since it was last
+     * copied to the window.
      */
-    bool changed;
+    SDL_Rect changed[CHIP8_DISPLAY_HEIGHT];
+    /**
+     * The number of elements in `changed`.
+     */
+    int n_changed;
 };
 
 /**
@@ -125,6 +205,11 @@ SDL_Keycode keymap[16] = {
     SDLK_4, SDLK_r, SDLK_f, SDLK_v,
 };
 
+/**
+ * The key which rewinds the game while it is held down.
+ */
+#define REWIND_KEY SDLK_BACKSPACE
+
 /**
  * The underlying surface of the game window.
  */
@@ -138,16 +223,170 @@ static uint32_t oncolor;
  */
 static uint32_t offcolor;
 
+/**
+ * The rows of the display which have changed since the last frame was
+ * published.
+ *
+ * This is collected by the interpreter's draw callback, so it is only used by
+ * the emulation thread.
+ */
+static uint64_t frame_dirty_rows;
+
+/**
+ * The renderer used when rendering with the GPU.
+ */
+static SDL_Renderer *renderer;
+/**
+ * The streaming texture holding the Chip-8 display when rendering with the GPU.
+ */
+static SDL_Texture *texture;
+/**
+ * The contents of `texture`, which are uploaded to it once per frame.
+ */
+static uint32_t texture_pixels[CHIP8_DISPLAY_HEIGHT][CHIP8_DISPLAY_WIDTH];
+/**
+ * The rows of `texture_pixels` which have changed since the last upload.
+ */
+static uint64_t texture_dirty_rows;
+/**
+ * Whether `texture` contains a high-resolution image.
+ */
+static bool texture_highres;
+
+/**
+ * The state shared between the main thread and the emulation thread.
+ */
+struct emulator {
+    /**
+     * The interpreter, which is only used by the emulation thread once it has
+     * started.
+     */
+    struct chip8 *chip;
+    /**
+     * The rewind history, or NULL if rewinding is disabled.
+     */
+    struct chip8_rewind *rewind;
+    /**
+     * The recorder, or NULL if the game isn't being recorded.
+     */
+    struct chip8_recorder *recorder;
+    /**
+     * The buffer through which completed frames are passed to the main thread.
+     */
+    struct chip8_frames *frames;
+    /**
+     * The frame frequency (in Hz).
+     */
+    long game_freq;
+    /**
+     * The buzzer, which is turned on and off at the end of each frame.
+     */
+    struct audio_tone *tone;
+    /**
+     * The sample rate of the buzzer (in Hz).
+     */
+    int sample_rate;
+    /**
+     * The emulation thread.
+     */
+    pthread_t thread;
+    /**
+     * Protects the fields below.
+     */
+    pthread_mutex_t lock;
+    /**
+     * Signalled by the main thread whenever it updates the fields below, to
+     * wake the emulation thread if it is idle.
+     */
+    pthread_cond_t wake;
+    /**
+     * The keys currently held down, as a bitmask.
+     */
+    uint16_t key_states;
+    /**
+     * Whether the rewind key is held down.
+     */
+    bool rewinding;
+    /**
+     * Set by the main thread to stop the emulation thread.
+     */
+    bool quit;
+    /**
+     * Set by the emulation thread while it is waiting for the key states to
+     * change, in which case no new frames will be published until they do.
+     */
+    bool idle;
+    /**
+     * Set by the emulation thread once it has stopped on its own.
+     */
+    bool finished;
+    /**
+     * The status with which the interpreter stopped.
+     */
+    enum chip8_run_status status;
+};
+
+/**
+ * The number of nanoseconds in a second.
+ */
+#define NANOS_IN_SECOND 1000000000L
+/**
+ * The number of bytes of rewind history to allocate for each second of
+ * gameplay.
+ *
+ * Most frames only change a few bytes, so this is plenty even with a keyframe
+ * every second.
+ */
+#define REWIND_BYTES_PER_SECOND 65536
+/**
+ * The number of instructions to keep in the trace.
+ *
+ * Each instruction takes 8 bytes, so this is 8 MiB, or nearly 3 minutes of
+ * gameplay at the default speed.
+ */
+#define TRACE_RECORDS (1 << 20)
+/**
+ * The initial value of the rolling display hash in hash mode.
+ */
+#define HASH_OFFSET_BASIS 0xCBF29CE484222325
+/**
+ * The multiplier of the rolling display hash in hash mode, which is combined
+ * with each display hash in the manner of FNV-1a.
+ */
+#define HASH_PRIME 0x100000001B3
+
 /**
  * The SDL audio callback function.
  */
 static void audio_callback(void *userdata, uint8_t *stream, int len);
 /**
- * Turns on or off the given pixel on the display.  The fourth parameter
- * specifies whether the pixel should be drawn in high-resolution mode (in
- * low-resolution mode, in-game pixels are twice the size).
+ * The draw callback of the interpreter, which collects the changed rows into
+ * `frame_dirty_rows`.
+ */
+static void collect_dirty_rows(const struct chip8 *chip, uint64_t dirty_rows);
+/**
+ * Redraws the given rows of the Chip-8 display onto the window surface.
+ *
+ * Each row is drawn as one background fill plus one fill for each horizontal
+ * run of pixels which are on.
+ */
+static void draw_rows(const struct chip8_frame *frame, uint64_t dirty_rows);
+/**
+ * Redraws the given rows of the Chip-8 display into `texture_pixels`.
+ */
+static void draw_rows_gpu(const struct chip8_frame *frame, uint64_t dirty_rows);
+/**
+ * The body of the emulation thread.
+ *
+ * The thread runs one frame of the game at a time, paced by its own timer,
+ * publishing each completed frame and picking up the latest key states
+ * between frames, until it is told to quit or the interpreter stops.  While
+ * the game is waiting for a key with both timers stopped, nothing can happen
+ * until the key states change, so the thread sleeps until they do.
+ *
+ * @param data The `struct emulator`.
  */
-static void draw_pixel(int x, int y, bool on, bool high);
+static void *emulate(void *data);
 /**
  * Returns the surface corresponding to the window surface of the given window.
  */
@@ -157,21 +396,70 @@ static struct surface get_window_surface(SDL_Window *window);
  */
 static struct progopts progopts_default(void);
 /**
- * Completely redraws the Chip-8 display onto the window surface.
+ * Uploads any changes to the display texture and renders it to the window.
+ *
+ * If the renderer uses vsync, this will wait until the next vertical blank.
  */
-static void redraw_all(struct chip8 *chip);
+static void render_texture(void);
 static int run(struct progopts opts);
+/**
+ * Runs the game (or the recording given in the options) in hash mode.
+ *
+ * For each frame, this prints the instruction count, a hash of the display and
+ * a rolling hash of all the display hashes so far; at the end, it prints how
+ * the run finished and a hash of the memory and registers.
+ *
+ * @return An error code.
+ */
+static int run_hash(struct progopts opts);
+/**
+ * Writes the interpreter's execution profile to the file given in the options.
+ *
+ * The game is disassembled so that the report can use its label names.
+ *
+ * @return An error code.
+ */
+static int write_profile(struct progopts opts, const struct chip8 *chip);
+/**
+ * Writes the interpreter's trace to the file given in the options.
+ *
+ * @return An error code.
+ */
+static int write_trace(struct progopts opts, const struct chip8 *chip);
+/**
+ * Replays the recording given in the options and prints the final state.
+ */
+static int run_replay(struct progopts opts);
+/**
+ * Sleeps until the start of the next frame.
+ *
+ * @param deadline The time at which the current frame started, which will be
+ * updated to the start of the next frame.  If we have fallen more than a frame
+ * behind, the deadline is reset to the current time instead.
+ * @param freq The frame frequency (in Hz).
+ */
+static void wait_frame(struct timespec *deadline, long freq);
 
 int main(int argc, char **argv)
 {
     struct progopts opts = progopts_default();
     int option;
     const struct option options[] = {
+        {"cycles", required_argument, NULL, 'c'},
+        {"frames", required_argument, NULL, 'F'},
         {"frequency", required_argument, NULL, 'f'},
+        {"gpu", no_argument, NULL, 'g'},
+        {"hash", no_argument, NULL, 'H'},
         {"help", no_argument, NULL, 'h'},
         {"load-quirks", no_argument, NULL, 'l'},
+        {"replay", required_argument, NULL, 'P'},
+        {"profile", required_argument, NULL, 'p'},
         {"shift-quirks", no_argument, NULL, 'q'},
+        {"record", required_argument, NULL, 'R'},
+        {"rewind", required_argument, NULL, 'r'},
+        {"seed", required_argument, NULL, 'S'},
         {"scale", required_argument, NULL, 's'},
+        {"trace", required_argument, NULL, 'T'},
         {"tone", required_argument, NULL, 't'},
         {"volume", required_argument, NULL, 'u'},
         {"version", no_argument, NULL, 'V'},
@@ -180,22 +468,85 @@ int main(int argc, char **argv)
 
     log_init(argc >= 1 ? argv[0] : "chip8", stderr, LOG_WARNING);
 
-    while ((option = getopt_long(argc, argv, "f:hlqs:t:u:Vv", options, NULL)) != -1) {
+    while ((option = getopt_long(argc, argv, "c:F:f:gHhlP:p:qR:r:S:s:T:t:u:Vv", options, NULL)) != -1) {
         char *numend;
 
         switch (option) {
+        case 'c':
+            errno = 0;
+            opts.cycles = strtoul(optarg, &numend, 10);
+            if (errno != 0) {
+                log_error("Error processing cycles: %s", strerror(errno));
+                return 2;
+            } else if (*numend != '\0' || opts.cycles == 0) {
+                log_error("Cycles argument '%s' is invalid", optarg);
+                return 2;
+            }
+            break;
+        case 'F':
+            errno = 0;
+            opts.frames = strtoul(optarg, &numend, 10);
+            if (errno != 0) {
+                log_error("Error processing frames: %s", strerror(errno));
+                return 2;
+            } else if (*numend != '\0' || opts.frames == 0) {
+                log_error("Frames argument '%s' is invalid", optarg);
+                return 2;
+            }
+            break;
         case 'f':
             opts.game_freq = atol(optarg);
             break;
+        case 'g':
+            opts.gpu = true;
+            break;
+        case 'H':
+            opts.hash = true;
+            break;
         case 'h':
             printf("%s%s", USAGE, HELP);
             return 0;
         case 'l':
             opts.load_quirks = true;
             break;
+        case 'P':
+            opts.replay = optarg;
+            break;
+        case 'p':
+            opts.profile = optarg;
+            break;
         case 'q':
             opts.shift_quirks = true;
             break;
+        case 'R':
+            opts.record = optarg;
+            break;
+        case 'r':
+            errno = 0;
+            opts.rewind_secs = strtoul(optarg, &numend, 10);
+            if (errno != 0) {
+                log_error("Error processing rewind time: %s", strerror(errno));
+                return 2;
+            } else if (*numend != '\0') {
+                log_error("Rewind time argument '%s' is invalid", optarg);
+                return 2;
+            }
+            break;
+        case 'S': {
+            unsigned long seed;
+
+            errno = 0;
+            seed = strtoul(optarg, &numend, 0);
+            if (errno != 0) {
+                log_error("Error processing seed: %s", strerror(errno));
+                return 2;
+            } else if (*optarg == '\0' || *numend != '\0' || seed > UINT32_MAX) {
+                log_error("Seed argument '%s' is invalid", optarg);
+                return 2;
+            }
+            opts.seed = seed;
+            opts.seed_given = true;
+        } break;
         case 's':
             errno = 0;
             opts.scale = strtoul(optarg, &numend, 10);
@@ -207,6 +558,9 @@ int main(int argc, char **argv)
                 return 2;
             }
             break;
+        case 'T':
+            opts.trace = optarg;
+            break;
         case 't':
             errno = 0;
             opts.tone_freq = strtoul(optarg, &numend, 10);
@@ -239,23 +593,192 @@ int main(int argc, char **argv)
     }
     opts.fname = argv[optind];
 
-    return run(opts);
+    /* Set correct log level */
+    if (opts.verbosity == 1)
+        log_set_level(LOG_INFO);
+    else if (opts.verbosity == 2)
+        log_set_level(LOG_DEBUG);
+    else if (opts.verbosity >= 3)
+        log_set_level(LOG_TRACE);
+
+    if (opts.hash)
+        return run_hash(opts);
+    return opts.replay ? run_replay(opts) : run(opts);
 }
 
 static void audio_callback(void *userdata, uint8_t *stream, int len)
 {
-    struct audio_ring_buffer *ring = (struct audio_ring_buffer *)userdata;
+    struct audio_tone *tone = (struct audio_tone *)userdata;
+
+    audio_tone_fill(tone, (int16_t *)stream, len / 2);
+}
+
+static void collect_dirty_rows(const struct chip8 *chip, uint64_t dirty_rows)
+{
+    (void)chip;
+    frame_dirty_rows |= dirty_rows;
+}
+
+static void draw_rows(const struct chip8_frame *frame, uint64_t dirty_rows)
+{
+    /* In low-resolution mode, only the top-left quarter is visible */
+    int width = frame->highres ? CHIP8_DISPLAY_WIDTH : CHIP8_DISPLAY_WIDTH / 2;
+    int height =
+        frame->highres ? CHIP8_DISPLAY_HEIGHT : CHIP8_DISPLAY_HEIGHT / 2;
+    int xscale = frame->highres ? win_surface.xscale : win_surface.xscale * 2;
+    int yscale = frame->highres ? win_surface.yscale : win_surface.yscale * 2;
 
-    audio_ring_buffer_fill(ring, (int16_t *)stream, len / 2);
+    for (int y = 0; y < height; y++) {
+        SDL_Rect row_rect = {0, y * yscale, width * xscale, yscale};
+        SDL_Rect *last;
+
+        if (!(dirty_rows & ((uint64_t)1 << y)))
+            continue;
+        SDL_FillRect(win_surface.surface, &row_rect, offcolor);
+        for (int x = 0; x < width;) {
+            int start;
+
+            if (!chip8_frame_pixel(frame, x, y)) {
+                x++;
+                continue;
+            }
+            for (start = x; x < width && chip8_frame_pixel(frame, x, y); x++)
+                ;
+            SDL_FillRect(win_surface.surface,
+                &(SDL_Rect){start * xscale, y * yscale, (x - start) * xscale,
+                    yscale},
+                oncolor);
+        }
+
+        /* Merge adjacent rows into a single update region */
+        last = win_surface.n_changed > 0
+            ? &win_surface.changed[win_surface.n_changed - 1]
+            : NULL;
+        if (last && last->y + last->h == row_rect.y && last->w == row_rect.w) {
+            last->h += row_rect.h;
+        } else if (win_surface.n_changed == CHIP8_DISPLAY_HEIGHT) {
+            /* Too many regions; just update everything */
+            win_surface.changed[0] = (SDL_Rect){
+                0, 0, win_surface.surface->w, win_surface.surface->h};
+            win_surface.n_changed = 1;
+        } else {
+            win_surface.changed[win_surface.n_changed++] = row_rect;
+        }
+    }
+}
+
+static void draw_rows_gpu(const struct chip8_frame *frame, uint64_t dirty_rows)
+{
+    for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++) {
+        if (!(dirty_rows & ((uint64_t)1 << y)))
+            continue;
+        for (int x = 0; x < CHIP8_DISPLAY_WIDTH; x++)
+            texture_pixels[y][x] =
+                chip8_frame_pixel(frame, x, y) ? 0xFFFFFFFF : 0xFF000000;
+    }
+    texture_dirty_rows |= dirty_rows;
+    texture_highres = frame->highres;
 }
 
-static void draw_pixel(int x, int y, bool on, bool high)
+static void *emulate(void *data)
 {
-    int xscale = high ? win_surface.xscale : win_surface.xscale * 2;
-    int yscale = high ? win_surface.yscale : win_surface.yscale * 2;
-    SDL_Rect draw_rect = {x * xscale, y * yscale, xscale, yscale};
-    SDL_FillRect(win_surface.surface, &draw_rect, on ? oncolor : offcolor);
-    win_surface.changed = true;
+    struct emulator *emu = data;
+    struct chip8 *chip = emu->chip;
+    struct timespec deadline;
+    enum chip8_run_status status = CHIP8_RUN_FRAME_DONE;
+    uint16_t last_keys = 0;
+    uint64_t n_frames = 0;
+    bool buzzing = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    for (;;) {
+        uint16_t keys;
+        bool rewinding, quit;
+
+        pthread_mutex_lock(&emu->lock);
+        keys = emu->key_states;
+        rewinding = emu->rewinding;
+        quit = emu->quit;
+        pthread_mutex_unlock(&emu->lock);
+        if (quit)
+            break;
+        /*
+         * Only the keys pressed or released since the last frame are applied,
+         * since the interpreter may have changed its own key states.
+         */
+        chip->key_states =
+            (chip->key_states | (keys & ~last_keys)) & ~(last_keys & ~keys);
+        last_keys = keys;
+
+        if (rewinding && emu->rewind) {
+            /* The keys being held now shouldn't be rewound */
+            uint16_t key_states = chip->key_states;
+
+            if (chip8_rewind_frames(emu->rewind) > 0)
+                chip8_rewind_pop(emu->rewind, chip);
+            chip->key_states = key_states;
+        } else {
+            if (emu->rewind)
+                chip8_rewind_push(emu->rewind, chip);
+            status = emu->recorder
+                ? chip8_recorder_run_frame(emu->recorder, chip)
+                : chip8_run_until_frame(chip);
+            if (status == CHIP8_RUN_ERROR) {
+                log_error("Shutting down interpreter");
+                break;
+            }
+        }
+        /*
+         * The sound timer only counts down on timer ticks, so the buzzer can be
+         * driven at frame granularity; edges are timed from the start of the
+         * game so that they are evenly spaced even if this thread is delayed.
+         */
+        n_frames++;
+        if ((chip->reg_st != 0) != buzzing &&
+            audio_tone_push(emu->tone,
+                n_frames * emu->sample_rate / emu->game_freq, !buzzing))
+            buzzing = !buzzing;
+        /* Rewinding or halting leaves rows which haven't been flushed yet */
+        chip8_display_flush(chip);
+        chip8_frames_publish(emu->frames, chip, frame_dirty_rows);
+        frame_dirty_rows = 0;
+        if (status == CHIP8_RUN_HALTED) {
+            log_info("Interpreter was halted");
+            break;
+        }
+        if (!rewinding && status == CHIP8_RUN_WAITING_KEY &&
+            chip->reg_dt == 0 && chip->reg_st == 0) {
+            struct timespec now;
+
+            pthread_mutex_lock(&emu->lock);
+            emu->idle = true;
+            while (emu->key_states == last_keys && !emu->rewinding &&
+                !emu->quit)
+                pthread_cond_wait(&emu->wake, &emu->lock);
+            emu->idle = false;
+            pthread_mutex_unlock(&emu->lock);
+            /*
+             * The buzzer is timed by frame number, so the frames we slept
+             * through must still be counted.
+             */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            n_frames += ((now.tv_sec - deadline.tv_sec) * NANOS_IN_SECOND +
+                            (now.tv_nsec - deadline.tv_nsec)) *
+                emu->game_freq / NANOS_IN_SECOND;
+            deadline = now;
+            continue;
+        }
+        wait_frame(&deadline, emu->game_freq);
+    }
+
+    if (buzzing)
+        audio_tone_push(emu->tone, n_frames * emu->sample_rate / emu->game_freq,
+            false);
+    pthread_mutex_lock(&emu->lock);
+    emu->finished = true;
+    emu->status = status;
+    pthread_mutex_unlock(&emu->lock);
+    return NULL;
 }
 
 static struct surface get_window_surface(SDL_Window *window)
@@ -264,7 +787,7 @@ static struct surface get_window_surface(SDL_Window *window)
     int xscale = surface->w / CHIP8_DISPLAY_WIDTH;
     int yscale = surface->h / CHIP8_DISPLAY_HEIGHT;
 
-    return (struct surface){ surface, xscale, yscale };
+    return (struct surface){ surface, xscale, yscale, {{0}}, 0 };
 }
 
 static struct progopts progopts_default(void)
@@ -272,21 +795,47 @@ static struct progopts progopts_default(void)
     return (struct progopts){
         .verbosity = 0,
         .scale = 6,
+        .cycles = 100,
+        .frames = 0,
         .game_freq = 60,
+        .gpu = false,
+        .hash = false,
         .load_quirks = false,
         .shift_quirks = false,
+        .rewind_secs = 30,
+        .seed = 0,
+        .seed_given = false,
+        .record = NULL,
+        .replay = NULL,
+        .profile = NULL,
+        .trace = NULL,
         .tone_freq = 440,
         .tone_vol = 10,
         .fname = NULL,
     };
 }
 
-static void redraw_all(struct chip8 *chip)
+static void render_texture(void)
 {
-    for (int i = 0; i < CHIP8_DISPLAY_WIDTH; i++)
-        for (int j = 0; j < CHIP8_DISPLAY_HEIGHT; j++) {
-            draw_pixel(i, j, chip->display[i][j], chip->highres);
-        }
+    /* In low-resolution mode, only the top-left quarter is visible */
+    SDL_Rect lowres_rect = {
+        0, 0, CHIP8_DISPLAY_WIDTH / 2, CHIP8_DISPLAY_HEIGHT / 2};
+
+    if (texture_dirty_rows != 0) {
+        int first = 0, last = CHIP8_DISPLAY_HEIGHT - 1;
+
+        while (!(texture_dirty_rows & ((uint64_t)1 << first)))
+            first++;
+        while (!(texture_dirty_rows & ((uint64_t)1 << last)))
+            last--;
+        SDL_UpdateTexture(texture,
+            &(SDL_Rect){0, first, CHIP8_DISPLAY_WIDTH, last - first + 1},
+            texture_pixels[first], sizeof texture_pixels[0]);
+        texture_dirty_rows = 0;
+    }
+    SDL_RenderCopy(renderer, texture, texture_highres ? NULL : &lowres_rect,
+        NULL);
+    SDL_RenderPresent(renderer);
 }
 
 static int run(struct progopts opts)
@@ -296,26 +845,36 @@ static int run(struct progopts opts)
     SDL_Window *win;
     SDL_AudioDeviceID audio_device;
     SDL_AudioSpec as_want, as_got;
-    struct audio_ring_buffer *audio_ring;
+    struct audio_tone *audio_tone;
     struct chip8_options chipopts = chip8_options_default();
+    struct emulator emu = {0};
     struct chip8 *chip;
-    FILE *input;
+    struct chip8_rom *rom;
+    FILE *record_file = NULL;
     SDL_Event e;
+    SDL_RendererInfo renderer_info;
+    const struct chip8_frame *frame;
+    uint16_t key_states = 0;
+    bool vsync = false;
+    bool rewinding = false;
+    bool redraw = true;
     bool should_exit = false;
+    bool idle = false;
+    int err;
     int retval = 0;
 
-    /* Set correct log level */
-    if (opts.verbosity == 1)
-        log_set_level(LOG_INFO);
-    else if (opts.verbosity == 2)
-        log_set_level(LOG_DEBUG);
-    else if (opts.verbosity >= 3)
-        log_set_level(LOG_TRACE);
-
     /* Set options for the interpreter */
     chipopts.load_quirks = opts.load_quirks;
     chipopts.shift_quirks = opts.shift_quirks;
     chipopts.timer_freq = opts.game_freq;
+    /*
+     * The interpreter runs one frame at a time, and the emulation thread does
+     * the pacing itself.
+     */
+    chipopts.virtual_timer = true;
+    chipopts.instrs_per_tick = opts.cycles;
+    chipopts.seed = opts.seed_given ? opts.seed : (uint32_t)time(NULL);
+    log_info("Using random seed %" PRIu32, chipopts.seed);
 
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
         log_error("Could not initialize SDL: %s", SDL_GetError());
@@ -329,111 +888,446 @@ static int run(struct progopts opts)
         retval = 1;
         goto ERROR_SDL_INITIALIZED;
     }
+    if (opts.gpu) {
+        /* Keep the pixels sharp when scaling */
+        SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+        if (!(renderer = SDL_CreateRenderer(win, -1,
+                  SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC))) {
+            log_error("Could not create SDL renderer: %s", SDL_GetError());
+            retval = 1;
+            goto ERROR_WINDOW_CREATED;
+        }
+        if (!(texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                  SDL_TEXTUREACCESS_STREAMING, CHIP8_DISPLAY_WIDTH,
+                  CHIP8_DISPLAY_HEIGHT))) {
+            log_error("Could not create SDL texture: %s", SDL_GetError());
+            retval = 1;
+            goto ERROR_RENDERER_CREATED;
+        }
+        if (SDL_GetRendererInfo(renderer, &renderer_info) == 0)
+            vsync = renderer_info.flags & SDL_RENDERER_PRESENTVSYNC;
+        if (!vsync)
+            log_info("Renderer does not support vsync; using timed frames");
+    }
 
     /* Set up audio */
-    audio_ring = audio_square_wave(48000, opts.tone_freq, opts.tone_vol * INT16_MAX / 100);
+    audio_tone = audio_tone_new(48000, opts.tone_freq, opts.tone_vol * INT16_MAX / 100);
     SDL_zero(as_want);
     as_want.freq = 48000;
     as_want.format = AUDIO_S16SYS;
     as_want.channels = 1;
-    as_want.samples = 4096;
+    /* The buzzer is synthesized on demand, so a short buffer is enough */
+    as_want.samples = 512;
     as_want.callback = audio_callback;
-    as_want.userdata = audio_ring;
+    as_want.userdata = audio_tone;
     if (!(audio_device = SDL_OpenAudioDevice(NULL, 0, &as_want, &as_got, 0))) {
         log_error("Could not initialize SDL audio: %s", SDL_GetError());
         retval = 1;
-        goto ERROR_AUDIO_RING_CREATED;
+        goto ERROR_AUDIO_TONE_CREATED;
     }
 
-    chip = chip8_new(chipopts);
-    chip->draw_callback = draw_pixel;
-    win_surface = get_window_surface(win);
-    oncolor = SDL_MapRGB(win_surface.surface->format, 255, 255, 255);
-    offcolor = SDL_MapRGB(win_surface.surface->format, 0, 0, 0);
-    redraw_all(chip);
-    SDL_UpdateWindowSurface(win);
-
-    if (!(input = fopen(opts.fname, "r"))) {
-        log_error("Failed to open game file; aborting");
-        retval = 1;
-        goto ERROR_CHIP8_CREATED;
+    emu.chip = chip = chip8_new(chipopts);
+    chip->draw_callback = collect_dirty_rows;
+    emu.game_freq = opts.game_freq;
+    emu.tone = audio_tone;
+    emu.sample_rate = as_got.freq;
+    if (opts.profile)
+        chip->profile = chip8_profile_new();
+    if (opts.trace)
+        chip->trace = chip8_trace_new(TRACE_RECORDS);
+    if (!renderer) {
+        win_surface = get_window_surface(win);
+        oncolor = SDL_MapRGB(win_surface.surface->format, 255, 255, 255);
+        offcolor = SDL_MapRGB(win_surface.surface->format, 0, 0, 0);
+        SDL_FillRect(win_surface.surface, NULL, offcolor);
+        SDL_UpdateWindowSurface(win);
     }
-    if (chip8_load_from_file(chip, input)) {
+
+    if (!(rom = chip8_rom_open(opts.fname))) {
         log_error("Could not load game; aborting");
-        fclose(input);
         retval = 1;
         goto ERROR_CHIP8_CREATED;
     }
-    fclose(input);
+    chip8_load_from_rom(chip, rom);
+    if (opts.record) {
+        if (!(record_file = fopen(opts.record, "wb"))) {
+            log_error("Could not open recording file '%s': %s", opts.record,
+                strerror(errno));
+            chip8_rom_close(rom);
+            retval = 1;
+            goto ERROR_CHIP8_CREATED;
+        }
+        if (!(emu.recorder = chip8_recorder_new(record_file, chipopts, rom))) {
+            chip8_rom_close(rom);
+            retval = 1;
+            goto ERROR_RECORD_FILE_OPENED;
+        }
+        /* A rewound game can't be replayed */
+        opts.rewind_secs = 0;
+    }
+    chip8_rom_close(rom);
+
+    if (opts.rewind_secs > 0 && opts.game_freq > 0)
+        emu.rewind = chip8_rewind_new(opts.rewind_secs * opts.game_freq,
+            opts.rewind_secs * REWIND_BYTES_PER_SECOND, opts.game_freq);
+
+    if (!(emu.frames = chip8_frames_new())) {
+        retval = 1;
+        goto ERROR_RECORDER_CREATED;
+    }
+    if ((err = pthread_mutex_init(&emu.lock, NULL)) != 0) {
+        log_error("Could not create emulator lock: %s", strerror(err));
+        retval = 1;
+        goto ERROR_FRAMES_CREATED;
+    }
+    if ((err = pthread_cond_init(&emu.wake, NULL)) != 0) {
+        log_error("Could not create emulator condition: %s", strerror(err));
+        retval = 1;
+        goto ERROR_EMULATOR_LOCK_CREATED;
+    }
+    if ((err = pthread_create(&emu.thread, NULL, emulate, &emu)) != 0) {
+        log_error("Could not start emulation thread: %s", strerror(err));
+        retval = 1;
+        goto ERROR_EMULATOR_COND_CREATED;
+    }
+    /* The buzzer is silent until the game turns it on */
+    SDL_PauseAudioDevice(audio_device, 0);
 
     while (!should_exit) {
+        bool fresh;
+
+        /*
+         * If the emulation thread is idle, nothing will change until the next
+         * event, so there's no point in going around the loop until then.
+         */
+        if (idle)
+            SDL_WaitEvent(NULL);
         while (SDL_PollEvent(&e)) {
             switch (e.type) {
             case SDL_QUIT:
                 should_exit = true;
                 break;
             case SDL_WINDOWEVENT:
+                /* The renderer takes care of this itself */
+                if (renderer)
+                    break;
                 log_debug("Window changed; getting new surface and refreshing");
                 /*
                  * We need to force the window to refresh when something
                  * happens to it (e.g. it gets moved or resized) even if the
                  * interpreter hasn't gotten any new display information.
                  */
-                chip->needs_full_redraw = true;
+                redraw = true;
                 /*
                  * We also need to get a new window surface, since the old one
                  * is now invalid.
                  */
                 win_surface = get_window_surface(win);
+                SDL_FillRect(win_surface.surface, NULL, offcolor);
                 break;
             case SDL_KEYDOWN: {
                 SDL_Keycode key = e.key.keysym.sym;
 
+                if (key == REWIND_KEY)
+                    rewinding = true;
                 for (int i = 0; i < 16; i++)
                     if (key == keymap[i])
-                        chip->key_states |= 1 << i;
+                        key_states |= 1 << i;
             } break;
             case SDL_KEYUP: {
                 SDL_Keycode key = e.key.keysym.sym;
 
+                if (key == REWIND_KEY)
+                    rewinding = false;
                 for (int i = 0; i < 16; i++)
                     if (key == keymap[i])
-                        chip->key_states &= ~(1 << i);
+                        key_states &= ~(1 << i);
             } break;
             }
         }
-        if (chip8_step(chip) != 0) {
-            log_error("Shutting down interpreter");
-            retval = 1;
-            goto ERROR_CHIP8_CREATED;
-        }
-        /* Pause/unpause the audio track as needed */
-        SDL_PauseAudioDevice(audio_device, chip->reg_st == 0);
-        /* Refresh display as needed */
-        if (chip->needs_full_redraw) {
-            redraw_all(chip);
-            chip->needs_full_redraw = false;
-        }
-        if (win_surface.changed) {
-            SDL_UpdateWindowSurface(win);
-            win_surface.changed = false;
-        }
-        if (chip->halted) {
-            log_info("Interpreter was halted");
+        pthread_mutex_lock(&emu.lock);
+        emu.key_states = key_states;
+        emu.rewinding = rewinding;
+        if (emu.finished)
             should_exit = true;
-        }
+        idle = emu.idle;
+        pthread_cond_signal(&emu.wake);
+        pthread_mutex_unlock(&emu.lock);
+
+        /*
+         * With vsync, presenting the frame does the waiting; otherwise, we
+         * wait for the emulation thread to finish a frame, but not for so long
+         * that input goes unhandled.
+         */
+        frame = chip8_frames_acquire(emu.frames,
+            vsync ? 0 : NANOS_IN_SECOND / opts.game_freq, &fresh);
+        if (fresh || redraw) {
+            uint64_t dirty_rows =
+                redraw ? CHIP8_DISPLAY_ALL_ROWS : frame->dirty_rows;
 
-        sched_yield();
+            if (renderer)
+                draw_rows_gpu(frame, dirty_rows);
+            else
+                draw_rows(frame, dirty_rows);
+            redraw = false;
+        }
+        if (renderer) {
+            render_texture();
+        } else if (win_surface.n_changed > 0) {
+            SDL_UpdateWindowSurfaceRects(
+                win, win_surface.changed, win_surface.n_changed);
+            win_surface.n_changed = 0;
+        }
     }
 
+    pthread_mutex_lock(&emu.lock);
+    emu.quit = true;
+    pthread_cond_signal(&emu.wake);
+    pthread_mutex_unlock(&emu.lock);
+    pthread_join(emu.thread, NULL);
+    if (emu.status == CHIP8_RUN_ERROR)
+        retval = 1;
+
+ERROR_EMULATOR_COND_CREATED:
+    pthread_cond_destroy(&emu.wake);
+ERROR_EMULATOR_LOCK_CREATED:
+    pthread_mutex_destroy(&emu.lock);
+ERROR_FRAMES_CREATED:
+    chip8_frames_destroy(emu.frames);
+ERROR_RECORDER_CREATED:
+    if (emu.recorder && chip8_recorder_finish(emu.recorder, chip))
+        retval = 1;
+    if (chip->profile && write_profile(opts, chip))
+        retval = 1;
+    if (chip->trace && write_trace(opts, chip))
+        retval = 1;
+ERROR_RECORD_FILE_OPENED:
+    if (record_file)
+        fclose(record_file);
+    chip8_rewind_destroy(emu.rewind);
 ERROR_CHIP8_CREATED:
+    chip8_profile_destroy(chip->profile);
+    chip8_trace_destroy(chip->trace);
     chip8_destroy(chip);
     SDL_CloseAudioDevice(audio_device);
-ERROR_AUDIO_RING_CREATED:
-    audio_ring_buffer_free(audio_ring);
+ERROR_AUDIO_TONE_CREATED:
+    audio_tone_free(audio_tone);
+    if (texture)
+        SDL_DestroyTexture(texture);
+ERROR_RENDERER_CREATED:
+    if (renderer)
+        SDL_DestroyRenderer(renderer);
+ERROR_WINDOW_CREATED:
     SDL_DestroyWindow(win);
 ERROR_SDL_INITIALIZED:
     SDL_Quit();
 ERROR_NOTHING_INITIALIZED:
     return retval;
 }
+
+static int run_hash(struct progopts opts)
+{
+    struct chip8_options chipopts = chip8_options_default();
+    struct chip8_replay *replay = NULL;
+    struct chip8_rom *rom;
+    struct chip8 *chip;
+    enum chip8_run_status status = CHIP8_RUN_FRAME_DONE;
+    uint64_t rolling = HASH_OFFSET_BASIS;
+    int retval = 0;
+
+    if (opts.replay) {
+        FILE *file;
+
+        if (!(file = fopen(opts.replay, "rb"))) {
+            log_error("Could not open recording file '%s': %s", opts.replay,
+                strerror(errno));
+            return 1;
+        }
+        replay = chip8_replay_open(file);
+        fclose(file);
+        if (!replay)
+            return 1;
+        chipopts = chip8_replay_options(replay, chipopts);
+    } else if (opts.frames == 0) {
+        log_error("The number of frames must be given without a recording");
+        return 2;
+    } else {
+        chipopts.load_quirks = opts.load_quirks;
+        chipopts.shift_quirks = opts.shift_quirks;
+        chipopts.timer_freq = opts.game_freq;
+        chipopts.virtual_timer = true;
+        chipopts.instrs_per_tick = opts.cycles;
+        /* The run must be reproducible, so the seed is not based on the time */
+        chipopts.seed = opts.seed;
+    }
+
+    if (!(rom = chip8_rom_open(opts.fname))) {
+        log_error("Could not load game; aborting");
+        retval = 1;
+        goto EXIT_REPLAY_OPENED;
+    }
+    if (replay && !chip8_replay_matches(replay, rom))
+        log_warning("Recording was made with a different game");
+    chip = chip8_new(chipopts);
+    chip8_load_from_rom(chip, rom);
+    chip8_rom_close(rom);
+
+    printf("# frame cycles display rolling\n");
+    for (unsigned long frame = 1;
+         opts.frames != 0 ? frame <= opts.frames
+                          : !chip8_replay_finished(replay, chip);
+         frame++) {
+        uint64_t display;
+
+        status = replay ? chip8_replay_run_frame(replay, chip)
+                        : chip8_run_until_frame(chip);
+        if (status == CHIP8_RUN_ERROR)
+            break;
+        display = chip8_display_hash(chip);
+        rolling = (rolling ^ display) * HASH_PRIME;
+        printf("%lu %" PRIu64 " %016" PRIX64 " %016" PRIX64 "\n", frame,
+            chip->cycles, display, rolling);
+        if (status == CHIP8_RUN_HALTED)
+            break;
+    }
+    printf("%s %" PRIu64 " %016" PRIX64 "\n",
+        status == CHIP8_RUN_ERROR ? "error"
+            : status == CHIP8_RUN_HALTED ? "halted" : "done",
+        chip->cycles, chip8_state_hash(chip));
+    if (status == CHIP8_RUN_ERROR)
+        retval = 1;
+
+    chip8_destroy(chip);
+EXIT_REPLAY_OPENED:
+    chip8_replay_close(replay);
+    return retval;
+}
+
+static int run_replay(struct progopts opts)
+{
+    FILE *file;
+    struct chip8_replay *replay;
+    struct chip8_rom *rom;
+    struct chip8 *chip;
+    enum chip8_run_status status;
+    struct timespec start, end;
+    double elapsed;
+    int retval = 0;
+
+    if (!(file = fopen(opts.replay, "rb"))) {
+        log_error("Could not open recording file '%s': %s", opts.replay,
+            strerror(errno));
+        return 1;
+    }
+    replay = chip8_replay_open(file);
+    fclose(file);
+    if (!replay)
+        return 1;
+    if (!(rom = chip8_rom_open(opts.fname))) {
+        log_error("Could not load game; aborting");
+        retval = 1;
+        goto EXIT_REPLAY_OPENED;
+    }
+    if (!chip8_replay_matches(replay, rom))
+        log_warning("Recording was made with a different game");
+
+    chip = chip8_new(chip8_replay_options(replay, chip8_options_default()));
+    if (opts.profile)
+        chip->profile = chip8_profile_new();
+    if (opts.trace)
+        chip->trace = chip8_trace_new(TRACE_RECORDS);
+    chip8_load_from_rom(chip, rom);
+    chip8_rom_close(rom);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = chip8_replay_run(replay, chip);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%s %" PRIu64 " %016" PRIX64 "\n",
+        status == CHIP8_RUN_ERROR ? "error"
+            : status == CHIP8_RUN_HALTED ? "halted" : "done",
+        chip->cycles, chip8_display_hash(chip));
+    log_info("Finished in %.3f seconds (%.1f million instructions per second)",
+        elapsed, elapsed > 0 ? chip->cycles / elapsed / 1e6 : 0.0);
+    if (status == CHIP8_RUN_ERROR)
+        retval = 1;
+    if (chip->profile && write_profile(opts, chip))
+        retval = 1;
+    if (chip->trace && write_trace(opts, chip))
+        retval = 1;
+
+    chip8_profile_destroy(chip->profile);
+    chip8_trace_destroy(chip->trace);
+    chip8_destroy(chip);
+EXIT_REPLAY_OPENED:
+    chip8_replay_close(replay);
+    return retval;
+}
+
+static int write_profile(struct progopts opts, const struct chip8 *chip)
+{
+    struct chip8disasm_options disasm_opts = chip8disasm_options_default();
+    struct chip8disasm *disasm;
+    FILE *out;
+    int retval = 0;
+
+    if (!(out = fopen(opts.profile, "w"))) {
+        log_error("Could not open profile file '%s': %s", opts.profile,
+            strerror(errno));
+        return 1;
+    }
+    disasm_opts.shift_quirks = chip->opts.shift_quirks;
+    /* The report is still useful without label names */
+    if (!(disasm = chip8disasm_from_file(disasm_opts, opts.fname)))
+        log_warning("Could not disassemble game; reporting plain addresses");
+    if (chip8_profile_report(chip->profile, chip, disasm, out))
+        retval = 1;
+    if (fclose(out) != 0) {
+        log_error("Could not write profile file '%s': %s", opts.profile,
+            strerror(errno));
+        retval = 1;
+    }
+    chip8disasm_destroy(disasm);
+    return retval;
+}
+
+static int write_trace(struct progopts opts, const struct chip8 *chip)
+{
+    FILE *out;
+    int retval = 0;
+
+    if (!(out = fopen(opts.trace, "wb"))) {
+        log_error("Could not open trace file '%s': %s", opts.trace,
+            strerror(errno));
+        return 1;
+    }
+    if (chip8_trace_write(chip->trace, chip->opts.shift_quirks, out))
+        retval = 1;
+    if (fclose(out) != 0) {
+        log_error("Could not write trace file '%s': %s", opts.trace,
+            strerror(errno));
+        retval = 1;
+    }
+    return retval;
+}
+
+static void wait_frame(struct timespec *deadline, long freq)
+{
+    struct timespec now;
+    long frame_nanos = NANOS_IN_SECOND / freq;
+
+    deadline->tv_nsec += frame_nanos;
+    deadline->tv_sec += deadline->tv_nsec / NANOS_IN_SECOND;
+    deadline->tv_nsec %= NANOS_IN_SECOND;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - deadline->tv_sec) * NANOS_IN_SECOND +
+            (now.tv_nsec - deadline->tv_nsec) > frame_nanos) {
+        log_debug("Fell behind by more than a frame; skipping ahead");
+        *deadline = now;
+        return;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR)
+        ;
+}
@@ -13,6 +13,7 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,10 +22,6 @@
 #include "log.h"
 #include "memory.h"
 
-/**
- * The size of the temporary input line buffer.
- */
-#define MAXLINE 500
 /**
  * The output extension to use by default.
  */
@@ -36,6 +33,7 @@ static const char *HELP =
     "FILE is provided, or if FILE is '-'.\n"
     "\n"
     "Options:\n"
+    "  -d, --depfile=DEPFILE  write the files used to a dependency file\n"
     "  -o, --output=OUTPUT    set output file name\n"
     "  -q, --shift-quirks     enable shift quirks mode\n"
     "  -v, --verbose          increase verbosity\n"
@@ -71,6 +69,12 @@ struct progopts {
      * For consistency, this should be heap-allocated memory.
      */
     char *input;
+    /**
+     * The name of the dependency file to write, or NULL if none.
+     *
+     * For consistency, this should be heap-allocated memory.
+     */
+    char *depfile;
 };
 
 static struct progopts progopts_default(void);
@@ -82,12 +86,26 @@ static struct progopts progopts_default(void);
  */
 static char *replace_extension(const char *fname);
 static int run(struct progopts opts);
+/**
+ * Writes a Makefile-style dependency file, listing the files processed by the
+ * assembler as prerequisites of the output file.
+ *
+ * @return An error code.
+ */
+static int write_depfile(
+    const char *fname, const char *target, const struct chip8asm *chipasm);
+/**
+ * Writes the given file name to a dependency file, escaping the characters
+ * which are special to make.
+ */
+static void write_depfile_name(const char *name, FILE *out);
 
 int main(int argc, char **argv)
 {
     int option;
     struct progopts opts = progopts_default();
-    const struct option options[] = {{"output", required_argument, NULL, 'o'},
+    const struct option options[] = {{"depfile", required_argument, NULL, 'd'},
+        {"output", required_argument, NULL, 'o'},
         {"shift-quirks", no_argument, NULL, 'q'},
         {"verbose", no_argument, NULL, 'v'}, {"help", no_argument, NULL, 'h'},
         {"version", no_argument, NULL, 'V'}, {0, 0, 0, 0}};
@@ -95,8 +113,12 @@ int main(int argc, char **argv)
 
     log_init(argc >= 1 ? argv[0] : "chip8asm", stderr, LOG_WARNING);
 
-    while ((option = getopt_long(argc, argv, "o:qvhV", options, NULL)) != -1) {
+    while ((option = getopt_long(argc, argv, "d:o:qvhV", options, NULL)) != -1) {
         switch (option) {
+        case 'd':
+            free(opts.depfile);
+            opts.depfile = xstrdup(optarg);
+            break;
         case 'o':
             free(opts.output);
             opts.output = xstrdup(optarg);
@@ -141,13 +163,18 @@ int main(int argc, char **argv)
 EXIT:
     free(opts.output);
     free(opts.input);
+    free(opts.depfile);
     return retval;
 }
 
 static struct progopts progopts_default(void)
 {
     return (struct progopts){
-        .verbosity = 0, .shift_quirks = false, .input = NULL, .output = NULL};
+        .verbosity = 0,
+        .shift_quirks = false,
+        .input = NULL,
+        .output = NULL,
+        .depfile = NULL};
 }
 
 static char *replace_extension(const char *fname)
@@ -170,8 +197,7 @@ static int run(struct progopts opts)
     struct chip8asm *chipasm;
     struct chip8asm_options asmopts;
     struct chip8asm_program *prog;
-    FILE *input, *output;
-    char str[MAXLINE];
+    FILE *output;
     int err;
     int retval = 0;
 
@@ -187,32 +213,16 @@ static int run(struct progopts opts)
     chipasm = chip8asm_new(asmopts);
     prog = chip8asm_program_new();
 
-    if (!strcmp(opts.input, "-")) {
-        input = stdin;
-    } else if (!(input = fopen(opts.input, "r"))) {
-        log_error("Could not open input file for reading: %s", strerror(errno));
+    if ((err = chip8asm_process_file(chipasm, opts.input))) {
+        log_error("Could not process input file; aborting");
         retval = 1;
         goto EXIT_PROG_CREATED;
     }
 
-    while (fgets(str, MAXLINE, input)) {
-        if ((err = chip8asm_process_line(chipasm, str))) {
-            log_error("Could not process input file; aborting");
-            retval = 1;
-            goto EXIT_INPUT_OPENED;
-        }
-    }
-    /* Make sure there wasn't an error in reading */
-    if (ferror(input)) {
-        log_error("Error reading from input file: %s", strerror(errno));
-        retval = 1;
-        goto EXIT_INPUT_OPENED;
-    }
-
     if ((err = chip8asm_emit(chipasm, prog))) {
         log_error("Assembler second pass failed; aborting");
         retval = 1;
-        goto EXIT_INPUT_OPENED;
+        goto EXIT_PROG_CREATED;
     }
 
     if (!strcmp(opts.output, "-")) {
@@ -221,7 +231,7 @@ static int run(struct progopts opts)
         log_error(
             "Could not open output file for writing: %s", strerror(errno));
         retval = 1;
-        goto EXIT_INPUT_OPENED;
+        goto EXIT_PROG_CREATED;
     }
 
     fwrite(prog->mem, 1, prog->len, output);
@@ -230,15 +240,57 @@ static int run(struct progopts opts)
         retval = 1;
         goto EXIT_OUTPUT_OPENED;
     }
+    if (opts.depfile && write_depfile(opts.depfile, opts.output, chipasm))
+        retval = 1;
 
 EXIT_OUTPUT_OPENED:
     if (output != stdout)
         fclose(output);
-EXIT_INPUT_OPENED:
-    if (input != stdin)
-        fclose(input);
 EXIT_PROG_CREATED:
     chip8asm_program_destroy(prog);
     chip8asm_destroy(chipasm);
     return retval;
 }
+
+static int write_depfile(
+    const char *fname, const char *target, const struct chip8asm *chipasm)
+{
+    FILE *out;
+    const char *dep;
+    int retval = 0;
+
+    if (!(out = fopen(fname, "w"))) {
+        log_error(
+            "Could not open dependency file for writing: %s", strerror(errno));
+        return 1;
+    }
+
+    write_depfile_name(target, out);
+    fputc(':', out);
+    for (size_t i = 0; (dep = chip8asm_file(chipasm, i)); i++) {
+        /* Standard input can't be a prerequisite */
+        if (!strcmp(dep, "-"))
+            continue;
+        fputs(" \\\n  ", out);
+        write_depfile_name(dep, out);
+    }
+    fputc('\n', out);
+
+    if (ferror(out)) {
+        log_error("Error writing to dependency file: %s", strerror(errno));
+        retval = 1;
+    }
+    fclose(out);
+    return retval;
+}
+
+static void write_depfile_name(const char *name, FILE *out)
+{
+    for (; *name != '\0'; name++) {
+        if (*name == '$')
+            fputc('$', out);
+        else if (*name == ' ' || *name == '#')
+            fputc('\\', out);
+        fputc(*name, out);
+    }
+}
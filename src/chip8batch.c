@@ -0,0 +1,695 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include <config.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "interpreter.h"
+#include "lanes.h"
+#include "log.h"
+#include "memory.h"
+#include "pool.h"
+#include "rom.h"
+
+static const char *HELP =
+    "Runs many instances of a Chip-8/Super-Chip program in parallel.\n"
+    "\n"
+    "Options:\n"
+    "  -c, --cycles=CYCLES         set instructions executed per frame\n"
+    "  -f, --frames=FRAMES         set number of frames to run each instance\n"
+    "  -i, --inputs=FILE           read input scripts from FILE\n"
+    "  -j, --jobs=JOBS             set number of threads to use\n"
+    "  -L, --lanes                 run instances in lockstep groups\n"
+    "  -l, --load-quirks           enable load quirks mode\n"
+    "  -n, --instances=N           set number of instances to run\n"
+    "  -q, --shift-quirks          enable shift quirks mode\n"
+    "  -s, --seed=SEED             set base random seed\n"
+    "  -v, --verbose               increase verbosity\n"
+    "  -h, --help                  show this help message and exit\n"
+    "  -V, --version               show version information and exit\n";
+static const char *USAGE = "Usage: chip8batch [OPTION...] FILE\n";
+static const char *VERSION_STRING = "chip8batch " PROJECT_VERSION "\n";
+
+/**
+ * Options that can be passed to the program.
+ */
+struct progopts {
+    /**
+     * The output verbosity (default 0).
+     */
+    int verbosity;
+    /**
+     * The number of instructions to execute per frame (default 100).
+     */
+    unsigned long cycles;
+    /**
+     * The number of frames to run each instance for (default 600).
+     */
+    unsigned long frames;
+    /**
+     * The number of instances to run (default 1).
+     */
+    unsigned long instances;
+    /**
+     * The number of threads to use (default: the number of processors).
+     */
+    unsigned long jobs;
+    /**
+     * The base random seed (default 1).
+     *
+     * Each instance gets its own seed, derived from this one and its index.
+     */
+    unsigned long seed;
+    /**
+     * Whether to run instances in lockstep groups (default false).
+     *
+     * See `lanes.h` for details; the results are the same either way.
+     */
+    bool lanes;
+    /**
+     * Whether to use load quirks mode (default false).
+     */
+    bool load_quirks;
+    /**
+     * Whether to use shift quirks mode (default false).
+     */
+    bool shift_quirks;
+    /**
+     * The name of the input script file, or NULL if there is none.
+     */
+    char *inputs;
+    /**
+     * The filename of the game to load.
+     */
+    char *fname;
+};
+
+/**
+ * An input script, giving the state of the keys on each frame.
+ */
+struct script {
+    /**
+     * The key states for each frame, in the same format as
+     * `chip8.key_states`.
+     */
+    uint16_t *keys;
+    /**
+     * The number of frames in `keys`.
+     *
+     * After the script ends, no keys are pressed.
+     */
+    size_t len;
+};
+
+/**
+ * The final state of a single instance.
+ */
+struct result {
+    /**
+     * The seed given to the interpreter.
+     */
+    uint32_t seed;
+    /**
+     * How the instance finished.
+     */
+    enum chip8_run_status status;
+    /**
+     * The number of instructions executed.
+     */
+    uint64_t cycles;
+    uint8_t regs[16];
+    uint16_t reg_i;
+    uint16_t pc;
+    /**
+     * The value of `chip8_display_hash` at the end of the run.
+     */
+    uint64_t display_hash;
+};
+
+/**
+ * Everything shared by the workers running the batch.
+ *
+ * Apart from `results` (where each instance has its own element) and `chips`
+ * (where each worker has its own elements), this is never modified while the
+ * batch is running.
+ */
+struct batch {
+    struct chip8_options chip_opts;
+    unsigned long frames;
+    unsigned long seed;
+    unsigned long instances;
+    const struct chip8_rom *rom;
+    /**
+     * An interpreter with the ROM loaded, from which each instance starts.
+     */
+    const struct chip8 *templ;
+    struct script *scripts;
+    size_t n_scripts;
+    struct result *results;
+    /**
+     * The interpreters used by each worker (`worker_chips` each), which are
+     * reset from `templ` for every instance rather than reallocated.
+     */
+    struct chip8 *chips;
+    int worker_chips;
+};
+
+static struct progopts progopts_default(void);
+static void progopts_free(struct progopts *opts);
+static int run(struct progopts opts);
+
+/**
+ * Parses a positive integer argument.
+ *
+ * @param what A description of the argument to use in error messages.
+ * @return An error code.
+ */
+static int parse_count(const char *arg, const char *what, unsigned long *n);
+/**
+ * Reads input scripts from a file.
+ *
+ * Each non-blank line not starting with `#` is a script, consisting of
+ * whitespace-separated key states (as hexadecimal bitmasks), one for each
+ * frame.  A key state may be followed by `*COUNT` to repeat it `COUNT` times.
+ *
+ * @return An error code.
+ */
+static int read_scripts(
+    const char *fname, struct script **scripts, size_t *n_scripts);
+/**
+ * Parses a single input script line.
+ *
+ * @return An error code.
+ */
+static int parse_script(const char *line, struct script *script);
+/**
+ * Returns the random seed to use for the given instance.
+ */
+static uint32_t instance_seed(unsigned long base, size_t instance);
+/**
+ * Resets the given interpreter to the start of the given instance, with the
+ * ROM loaded.
+ */
+static void instance_start(
+    const struct batch *batch, size_t instance, struct chip8 *chip);
+/**
+ * Sets the key states of an instance for the given frame.
+ */
+static void instance_set_keys(const struct batch *batch, size_t instance,
+    struct chip8 *chip, unsigned long frame);
+/**
+ * Records the result of an instance.
+ */
+static void instance_finish(struct batch *batch, size_t instance,
+    struct chip8 *chip, enum chip8_run_status status);
+/**
+ * Runs a single instance of the batch.
+ *
+ * This has the signature required by `pool_run`.
+ */
+static void run_instance(size_t instance, int worker, void *data);
+/**
+ * Runs a group of up to `CHIP8_LANES` consecutive instances in lockstep.
+ *
+ * This has the signature required by `pool_run`.
+ */
+static void run_group(size_t group, int worker, void *data);
+/**
+ * Returns a short description of how an instance finished.
+ */
+static const char *status_string(enum chip8_run_status status);
+
+int main(int argc, char **argv)
+{
+    int option;
+    struct progopts opts = progopts_default();
+    const struct option options[] = {{"cycles", required_argument, NULL, 'c'},
+        {"frames", required_argument, NULL, 'f'},
+        {"inputs", required_argument, NULL, 'i'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"lanes", no_argument, NULL, 'L'},
+        {"load-quirks", no_argument, NULL, 'l'},
+        {"instances", required_argument, NULL, 'n'},
+        {"shift-quirks", no_argument, NULL, 'q'},
+        {"seed", required_argument, NULL, 's'},
+        {"verbose", no_argument, NULL, 'v'}, {"help", no_argument, NULL, 'h'},
+        {"version", no_argument, NULL, 'V'}, {0, 0, 0, 0}};
+    int retval = 0;
+
+    log_init(argc >= 1 ? argv[0] : "chip8batch", stderr, LOG_WARNING);
+
+    while ((option = getopt_long(
+                argc, argv, "c:f:i:j:Lln:qs:vhV", options, NULL)) != -1) {
+        switch (option) {
+        case 'c':
+            if (parse_count(optarg, "cycles", &opts.cycles)) {
+                retval = 2;
+                goto EXIT;
+            }
+            break;
+        case 'f':
+            if (parse_count(optarg, "frames", &opts.frames)) {
+                retval = 2;
+                goto EXIT;
+            }
+            break;
+        case 'i':
+            free(opts.inputs);
+            opts.inputs = xstrdup(optarg);
+            break;
+        case 'j':
+            if (parse_count(optarg, "jobs", &opts.jobs)) {
+                retval = 2;
+                goto EXIT;
+            }
+            break;
+        case 'L':
+            opts.lanes = true;
+            break;
+        case 'l':
+            opts.load_quirks = true;
+            break;
+        case 'n':
+            if (parse_count(optarg, "instances", &opts.instances)) {
+                retval = 2;
+                goto EXIT;
+            }
+            break;
+        case 'q':
+            opts.shift_quirks = true;
+            break;
+        case 's': {
+            char *numend;
+
+            errno = 0;
+            opts.seed = strtoul(optarg, &numend, 0);
+            if (errno != 0) {
+                log_error("Error processing seed: %s", strerror(errno));
+                retval = 2;
+                goto EXIT;
+            } else if (*optarg == '\0' || *numend != '\0') {
+                log_error("Seed argument '%s' is invalid", optarg);
+                retval = 2;
+                goto EXIT;
+            }
+            break;
+        }
+        case 'v':
+            opts.verbosity++;
+            break;
+        case 'h':
+            printf("%s%s", USAGE, HELP);
+            goto EXIT;
+        case 'V':
+            printf("%s", VERSION_STRING);
+            goto EXIT;
+        case '?':
+            fprintf(stderr, "%s", USAGE);
+            retval = 2;
+            goto EXIT;
+        }
+    }
+
+    if (optind == argc - 1) {
+        opts.fname = xstrdup(argv[optind]);
+    } else {
+        fprintf(stderr, "%s", USAGE);
+        retval = 2;
+        goto EXIT;
+    }
+
+    retval = run(opts);
+
+EXIT:
+    progopts_free(&opts);
+    return retval;
+}
+
+static struct progopts progopts_default(void)
+{
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (struct progopts){
+        .verbosity = 0,
+        .cycles = 100,
+        .frames = 600,
+        .instances = 1,
+        .jobs = nprocs > 0 ? (unsigned long)nprocs : 1,
+        .seed = 1,
+        .lanes = false,
+        .load_quirks = false,
+        .shift_quirks = false,
+        .inputs = NULL,
+        .fname = NULL,
+    };
+}
+
+static void progopts_free(struct progopts *opts)
+{
+    free(opts->inputs);
+    free(opts->fname);
+}
+
+static int run(struct progopts opts)
+{
+    struct batch batch;
+    struct chip8_rom *rom;
+    struct chip8 *templ;
+    struct timespec start, end;
+    double elapsed;
+    uint64_t total_cycles = 0;
+    unsigned long n_halted = 0, n_errors = 0;
+    int err;
+    int retval = 0;
+
+    if (opts.verbosity == 1)
+        log_set_level(LOG_INFO);
+    else if (opts.verbosity >= 2)
+        log_set_level(LOG_DEBUG);
+
+    /*
+     * Instances always run with the virtual timer, so that they finish as fast
+     * as possible and their results depend only on their inputs.  Tracing is
+     * deliberately not offered, since the output of thousands of interpreters
+     * would be useless anyways.
+     */
+    batch.chip_opts = chip8_options_default();
+    batch.chip_opts.virtual_timer = true;
+    batch.chip_opts.instrs_per_tick = opts.cycles;
+    batch.chip_opts.load_quirks = opts.load_quirks;
+    batch.chip_opts.shift_quirks = opts.shift_quirks;
+    batch.frames = opts.frames;
+    batch.seed = opts.seed;
+    batch.instances = opts.instances;
+    batch.scripts = NULL;
+    batch.n_scripts = 0;
+
+    if ((batch.rom = rom = chip8_rom_open(opts.fname)) == NULL) {
+        retval = 1;
+        goto EXIT_NOTHING_DONE;
+    }
+    if (opts.inputs && read_scripts(opts.inputs, &batch.scripts, &batch.n_scripts)) {
+        retval = 1;
+        goto EXIT_ROM_OPENED;
+    }
+    batch.results = xcalloc(opts.instances, sizeof *batch.results);
+    batch.templ = templ = chip8_new(batch.chip_opts);
+    chip8_load_from_rom(templ, rom);
+    batch.worker_chips = opts.lanes ? CHIP8_LANES : 1;
+    batch.chips =
+        xcalloc(opts.jobs * batch.worker_chips, sizeof *batch.chips);
+
+    log_info("Running %lu instances of '%s' on %lu threads", opts.instances,
+        opts.fname, opts.jobs);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (opts.lanes)
+        err = pool_run(opts.jobs,
+            (opts.instances + CHIP8_LANES - 1) / CHIP8_LANES, run_group, &batch);
+    else
+        err = pool_run(opts.jobs, opts.instances, run_instance, &batch);
+    if (err) {
+        log_error("Could not run batch");
+        retval = 1;
+        goto EXIT_RESULTS_CREATED;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("# instance seed status cycles pc i v0-vf display_hash\n");
+    for (size_t i = 0; i < opts.instances; i++) {
+        struct result *res = &batch.results[i];
+
+        printf("%zu %" PRIu32 " %s %" PRIu64 " %03X %03X ", i, res->seed,
+            status_string(res->status), res->cycles, res->pc, res->reg_i);
+        for (int r = 0; r < 16; r++)
+            printf("%02X", res->regs[r]);
+        printf(" %016" PRIX64 "\n", res->display_hash);
+
+        total_cycles += res->cycles;
+        if (res->status == CHIP8_RUN_HALTED)
+            n_halted++;
+        else if (res->status == CHIP8_RUN_ERROR)
+            n_errors++;
+    }
+    printf("# instances %lu halted %lu errors %lu cycles %" PRIu64 "\n",
+        opts.instances, n_halted, n_errors, total_cycles);
+    log_info("Finished in %.3f seconds (%.1f million instructions per second)",
+        elapsed, elapsed > 0 ? total_cycles / elapsed / 1e6 : 0.0);
+
+EXIT_RESULTS_CREATED:
+    free(batch.chips);
+    chip8_destroy(templ);
+    free(batch.results);
+    for (size_t i = 0; i < batch.n_scripts; i++)
+        free(batch.scripts[i].keys);
+    free(batch.scripts);
+EXIT_ROM_OPENED:
+    chip8_rom_close(rom);
+EXIT_NOTHING_DONE:
+    return retval;
+}
+
+static int parse_count(const char *arg, const char *what, unsigned long *n)
+{
+    char *numend;
+
+    errno = 0;
+    *n = strtoul(arg, &numend, 10);
+    if (errno != 0) {
+        log_error("Error processing %s: %s", what, strerror(errno));
+        return 1;
+    } else if (*arg == '\0' || *numend != '\0' || *n == 0) {
+        log_error("Argument '%s' for %s is invalid", arg, what);
+        return 1;
+    }
+    return 0;
+}
+
+static int read_scripts(
+    const char *fname, struct script **scripts, size_t *n_scripts)
+{
+    FILE *file;
+    char *line = NULL;
+    size_t linesz = 0;
+    int lineno = 0;
+    size_t cap = 0;
+    int retval = 0;
+
+    *scripts = NULL;
+    *n_scripts = 0;
+    if ((file = fopen(fname, "r")) == NULL) {
+        log_error("Could not open input file '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+
+    while (getline(&line, &linesz, file) != -1) {
+        const char *p = line;
+
+        lineno++;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        if (*n_scripts == cap) {
+            cap = cap ? 2 * cap : 16;
+            *scripts = xrealloc(*scripts, cap * sizeof **scripts);
+        }
+        if (parse_script(p, &(*scripts)[*n_scripts])) {
+            log_error("Invalid input script on line %d of '%s'", lineno, fname);
+            retval = 1;
+            goto EXIT;
+        }
+        (*n_scripts)++;
+    }
+    if (ferror(file)) {
+        log_error("Error reading from input file: %s", strerror(errno));
+        retval = 1;
+    } else if (*n_scripts == 0) {
+        log_error("No input scripts found in '%s'", fname);
+        retval = 1;
+    }
+
+EXIT:
+    if (retval != 0) {
+        for (size_t i = 0; i < *n_scripts; i++)
+            free((*scripts)[i].keys);
+        free(*scripts);
+        *scripts = NULL;
+        *n_scripts = 0;
+    }
+    free(line);
+    fclose(file);
+    return retval;
+}
+
+static int parse_script(const char *line, struct script *script)
+{
+    size_t cap = 64;
+
+    script->keys = xmalloc(cap * sizeof *script->keys);
+    script->len = 0;
+
+    for (;;) {
+        unsigned long keys, count = 1;
+        char *end;
+
+        while (isspace((unsigned char)*line))
+            line++;
+        if (*line == '\0')
+            break;
+        if (!isxdigit((unsigned char)*line))
+            goto ERROR;
+        keys = strtoul(line, &end, 16);
+        if (keys > 0xFFFF)
+            goto ERROR;
+        line = end;
+        if (*line == '*') {
+            line++;
+            if (!isdigit((unsigned char)*line))
+                goto ERROR;
+            errno = 0;
+            count = strtoul(line, &end, 10);
+            if (errno != 0)
+                goto ERROR;
+            line = end;
+        }
+        if (*line != '\0' && !isspace((unsigned char)*line))
+            goto ERROR;
+
+        while (count--) {
+            if (script->len == cap) {
+                cap *= 2;
+                script->keys = xrealloc(script->keys, cap * sizeof *script->keys);
+            }
+            script->keys[script->len++] = keys;
+        }
+    }
+    return 0;
+
+ERROR:
+    free(script->keys);
+    script->keys = NULL;
+    return 1;
+}
+
+static uint32_t instance_seed(unsigned long base, size_t instance)
+{
+    /* The interpreter hashes its seed, so consecutive seeds are fine */
+    return (uint32_t)(base + instance);
+}
+
+static void instance_start(
+    const struct batch *batch, size_t instance, struct chip8 *chip)
+{
+    chip8_reset(chip, batch->templ);
+    chip8_seed(chip, instance_seed(batch->seed, instance));
+}
+
+static void instance_set_keys(const struct batch *batch, size_t instance,
+    struct chip8 *chip, unsigned long frame)
+{
+    const struct script *script;
+
+    if (batch->n_scripts == 0)
+        return;
+    script = &batch->scripts[instance % batch->n_scripts];
+    chip->key_states = frame < script->len ? script->keys[frame] : 0;
+}
+
+static void instance_finish(struct batch *batch, size_t instance,
+    struct chip8 *chip, enum chip8_run_status status)
+{
+    struct result *res = &batch->results[instance];
+
+    res->seed = instance_seed(batch->seed, instance);
+    res->status = status;
+    res->cycles = chip->cycles;
+    memcpy(res->regs, chip->regs, sizeof res->regs);
+    res->reg_i = chip->reg_i;
+    res->pc = chip->pc;
+    res->display_hash = chip8_display_hash(chip);
+}
+
+static void run_instance(size_t instance, int worker, void *data)
+{
+    struct batch *batch = data;
+    enum chip8_run_status status = CHIP8_RUN_FRAME_DONE;
+    struct chip8 *chip = &batch->chips[worker * batch->worker_chips];
+
+    instance_start(batch, instance, chip);
+    for (unsigned long frame = 0;
+         status != CHIP8_RUN_ERROR && frame < batch->frames; frame++) {
+        instance_set_keys(batch, instance, chip, frame);
+        status = chip8_run_until_frame(chip);
+        if (status == CHIP8_RUN_HALTED)
+            break;
+    }
+    instance_finish(batch, instance, chip, status);
+}
+
+static void run_group(size_t group, int worker, void *data)
+{
+    struct batch *batch = data;
+    size_t first = group * CHIP8_LANES;
+    int n = batch->instances - first < CHIP8_LANES ? batch->instances - first
+                                                   : CHIP8_LANES;
+    struct chip8 *chips[CHIP8_LANES];
+    enum chip8_run_status status[CHIP8_LANES];
+    struct chip8_lanes *lanes;
+
+    for (int l = 0; l < n; l++) {
+        status[l] = CHIP8_RUN_FRAME_DONE;
+        chips[l] = &batch->chips[worker * batch->worker_chips + l];
+        instance_start(batch, first + l, chips[l]);
+    }
+    if ((lanes = chip8_lanes_new(chips, n)) == NULL) {
+        for (int l = 0; l < n; l++)
+            instance_finish(batch, first + l, chips[l], CHIP8_RUN_ERROR);
+        return;
+    }
+    for (unsigned long frame = 0; frame < batch->frames; frame++) {
+        bool running = false;
+
+        for (int l = 0; l < n; l++)
+            instance_set_keys(batch, first + l, chips[l], frame);
+        chip8_lanes_run_frame(lanes, status);
+        for (int l = 0; l < n; l++)
+            if (status[l] != CHIP8_RUN_ERROR && status[l] != CHIP8_RUN_HALTED)
+                running = true;
+        if (!running)
+            break;
+    }
+
+    for (int l = 0; l < n; l++)
+        instance_finish(batch, first + l, chips[l], status[l]);
+    chip8_lanes_destroy(lanes);
+}
+
+static const char *status_string(enum chip8_run_status status)
+{
+    switch (status) {
+    case CHIP8_RUN_ERROR:
+        return "error";
+    case CHIP8_RUN_HALTED:
+        return "halted";
+    case CHIP8_RUN_WAITING_KEY:
+        return "waiting";
+    default:
+        return "running";
+    }
+}
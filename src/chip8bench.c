@@ -0,0 +1,505 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "interpreter.h"
+#include "log.h"
+#include "memory.h"
+#include "profile.h"
+#include "rom.h"
+
+static const char *HELP =
+    "Measures the speed of the Chip-8/Super-Chip interpreter.\n"
+    "\n"
+    "Options:\n"
+    "  -c, --cycles=CYCLES         set instructions executed per frame\n"
+    "  -f, --frames=FRAMES         set number of frames to run each benchmark\n"
+    "  -K, --no-kernels            don't run the built-in kernels\n"
+    "  -r, --repeat=N              set number of timed runs of each benchmark\n"
+    "  -v, --verbose               increase verbosity\n"
+    "  -h, --help                  show this help message and exit\n"
+    "  -V, --version               show version information and exit\n";
+static const char *USAGE = "Usage: chip8bench [OPTION...] [FILE...]\n";
+static const char *VERSION_STRING = "chip8bench " PROJECT_VERSION "\n";
+
+/**
+ * The maximum depth of recursion in the `call` kernel.
+ */
+#define CALL_DEPTH (CHIP8_STACK_DEPTH < 8 ? CHIP8_STACK_DEPTH : 8)
+
+/**
+ * Options that can be passed to the program.
+ */
+struct progopts {
+    /**
+     * The output verbosity (default 0).
+     */
+    int verbosity;
+    /**
+     * The number of instructions to execute per frame (default 1000).
+     */
+    unsigned long cycles;
+    /**
+     * The number of frames to run each benchmark for (default 600).
+     */
+    unsigned long frames;
+    /**
+     * The number of timed runs of each benchmark (default 3).
+     *
+     * The fastest run is reported.
+     */
+    unsigned long repeat;
+    /**
+     * Whether to run the built-in kernels (default true).
+     */
+    bool kernels;
+};
+
+/**
+ * A built-in program exercising one part of the interpreter.
+ */
+struct kernel {
+    const char *name;
+    const uint8_t *prog;
+    size_t len;
+};
+
+/**
+ * A tight loop of arithmetic and logic instructions, which can run in blocks.
+ */
+static const uint8_t kernel_alu[] = {
+    0x60, 0x00, /* 200: LD V0, 0 */
+    0x61, 0x01, /* 202: LD V1, 1 */
+    0x80, 0x14, /* 204: ADD V0, V1 */
+    0x81, 0x03, /* 206: XOR V1, V0 */
+    0x80, 0x15, /* 208: SUB V0, V1 */
+    0x71, 0x03, /* 20A: ADD V1, 3 */
+    0x82, 0x06, /* 20C: SHR V2 */
+    0x82, 0x11, /* 20E: OR V2, V1 */
+    0x12, 0x04, /* 210: JP #204 */
+};
+/**
+ * Draws a 15-row sprite all over the low-resolution display.
+ */
+static const uint8_t kernel_drw[] = {
+    0xA2, 0x10, /* 200: LD I, #210 */
+    0xD0, 0x1F, /* 202: DRW V0, V1, 15 */
+    0x70, 0x03, /* 204: ADD V0, 3 */
+    0x71, 0x05, /* 206: ADD V1, 5 */
+    0x12, 0x02, /* 208: JP #202 */
+    0x00, 0x00, /* 20A */
+    0x00, 0x00, /* 20C */
+    0x00, 0x00, /* 20E */
+    /* 210: a hollow box */
+    0xFF, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81,
+    0x81, 0x81, 0xFF,
+};
+/**
+ * Scrolls the high-resolution display in every direction, redrawing a sprite
+ * each time so that there is something to scroll.
+ */
+static const uint8_t kernel_scroll[] = {
+    0x00, 0xFF, /* 200: HIGH */
+    0xA2, 0x10, /* 202: LD I, #210 */
+    0xD0, 0x10, /* 204: DRW V0, V1, 0 */
+    0x00, 0xC3, /* 206: SCD 3 */
+    0x00, 0xFB, /* 208: SCR */
+    0x00, 0xFC, /* 20A: SCL */
+    0x70, 0x0B, /* 20C: ADD V0, 11 */
+    0x12, 0x04, /* 20E: JP #204 */
+    /* 210: a 16x16 checkerboard */
+    0xAA, 0xAA, 0x55, 0x55, 0xAA, 0xAA, 0x55, 0x55, 0xAA, 0xAA, 0x55, 0x55,
+    0xAA, 0xAA, 0x55, 0x55, 0xAA, 0xAA, 0x55, 0x55, 0xAA, 0xAA, 0x55, 0x55,
+    0xAA, 0xAA, 0x55, 0x55, 0xAA, 0xAA, 0x55, 0x55,
+};
+/**
+ * Recurses `CALL_DEPTH` levels deep over and over.
+ */
+static const uint8_t kernel_call[] = {
+    0x60, 0x00, /* 200: LD V0, 0 */
+    0x22, 0x06, /* 202: CALL #206 */
+    0x12, 0x00, /* 204: JP #200 */
+    0x70, 0x01, /* 206: ADD V0, 1 */
+    0x30, CALL_DEPTH, /* 208: SE V0, CALL_DEPTH */
+    0x22, 0x06, /* 20A: CALL #206 */
+    0x00, 0xEE, /* 20C: RET */
+};
+
+static const struct kernel kernels[] = {
+    {"kernel:alu", kernel_alu, sizeof kernel_alu},
+    {"kernel:drw", kernel_drw, sizeof kernel_drw},
+    {"kernel:scroll", kernel_scroll, sizeof kernel_scroll},
+    {"kernel:call", kernel_call, sizeof kernel_call},
+};
+
+/**
+ * The measurements taken for a single benchmark.
+ */
+struct result {
+    /**
+     * How the runs finished.
+     */
+    enum chip8_run_status status;
+    /**
+     * The number of instructions executed in each run.
+     *
+     * This includes the instructions spent waiting for a key, since idle
+     * skipping is turned off.
+     */
+    uint64_t instrs;
+    /**
+     * The time taken by the fastest run, in seconds.
+     */
+    double seconds;
+    /**
+     * The number of DRW instructions executed in each run.
+     */
+    uint64_t draws;
+    /**
+     * The average time taken by a DRW instruction, in nanoseconds.
+     */
+    double draw_nanos;
+    /**
+     * The number of allocations made while running (not counting setting up
+     * the interpreter).
+     */
+    unsigned long allocs;
+};
+
+static struct progopts progopts_default(void);
+static int run(struct progopts opts, char **files, int n_files);
+
+/**
+ * Parses a positive integer argument.
+ *
+ * @param what A description of the argument to use in error messages.
+ * @return An error code.
+ */
+static int parse_count(const char *arg, const char *what, unsigned long *n);
+/**
+ * Runs a benchmark of the given program and prints the results.
+ *
+ * @param kernel Whether the program is a built-in kernel rather than a game.
+ * Kernels don't wait for the timer when drawing, so that they measure the
+ * drawing code itself.
+ * @return An error code.
+ */
+static int bench(struct progopts opts, const char *name, const uint8_t *prog,
+    size_t len, bool kernel);
+/**
+ * Runs a benchmark of the game in the given file and prints the results.
+ *
+ * @return An error code.
+ */
+static int bench_file(struct progopts opts, const char *fname);
+/**
+ * Runs a benchmark of every game in the given directory.
+ *
+ * Subdirectories and files whose names contain a dot (such as
+ * documentation) are skipped.
+ *
+ * @return An error code.
+ */
+static int bench_dir(struct progopts opts, const char *dname);
+/**
+ * Runs the interpreter for the number of frames given in the options.
+ *
+ * The keys are pressed in a fixed pattern, so that games which wait for input
+ * keep going.
+ *
+ * @return How the run finished (`CHIP8_RUN_FRAME_DONE` if it lasted for all
+ * the frames).
+ */
+static enum chip8_run_status bench_run(
+    struct progopts opts, struct chip8 *chip);
+/**
+ * Returns a short description of how a run finished.
+ */
+static const char *status_string(enum chip8_run_status status);
+/**
+ * Returns the current value of the monotonic clock, in seconds.
+ */
+static double bench_now(void);
+/**
+ * Compares strings for `qsort`.
+ */
+static int compare_strings(const void *a, const void *b);
+
+int main(int argc, char **argv)
+{
+    int option;
+    struct progopts opts = progopts_default();
+    const struct option options[] = {{"cycles", required_argument, NULL, 'c'},
+        {"frames", required_argument, NULL, 'f'},
+        {"no-kernels", no_argument, NULL, 'K'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"verbose", no_argument, NULL, 'v'}, {"help", no_argument, NULL, 'h'},
+        {"version", no_argument, NULL, 'V'}, {0, 0, 0, 0}};
+
+    log_init(argc >= 1 ? argv[0] : "chip8bench", stderr, LOG_WARNING);
+
+    while ((option = getopt_long(argc, argv, "c:f:Kr:vhV", options, NULL)) !=
+        -1) {
+        switch (option) {
+        case 'c':
+            if (parse_count(optarg, "cycles", &opts.cycles))
+                return 2;
+            break;
+        case 'f':
+            if (parse_count(optarg, "frames", &opts.frames))
+                return 2;
+            break;
+        case 'K':
+            opts.kernels = false;
+            break;
+        case 'r':
+            if (parse_count(optarg, "repeat", &opts.repeat))
+                return 2;
+            break;
+        case 'v':
+            opts.verbosity++;
+            break;
+        case 'h':
+            printf("%s%s", USAGE, HELP);
+            return 0;
+        case 'V':
+            printf("%s", VERSION_STRING);
+            return 0;
+        case '?':
+            fprintf(stderr, "%s", USAGE);
+            return 2;
+        }
+    }
+
+    return run(opts, argv + optind, argc - optind);
+}
+
+static struct progopts progopts_default(void)
+{
+    return (struct progopts){
+        .verbosity = 0,
+        .cycles = 1000,
+        .frames = 600,
+        .repeat = 3,
+        .kernels = true,
+    };
+}
+
+static int run(struct progopts opts, char **files, int n_files)
+{
+    int retval = 0;
+
+    if (opts.verbosity == 1)
+        log_set_level(LOG_INFO);
+    else if (opts.verbosity >= 2)
+        log_set_level(LOG_DEBUG);
+
+    printf("# name status instructions seconds instrs_per_sec draws "
+           "ns_per_draw allocs_per_minstr\n");
+    if (opts.kernels)
+        for (size_t i = 0; i < sizeof kernels / sizeof kernels[0]; i++)
+            if (bench(opts, kernels[i].name, kernels[i].prog, kernels[i].len,
+                    true))
+                retval = 1;
+    for (int i = 0; i < n_files; i++) {
+        struct stat stats;
+
+        if (stat(files[i], &stats) != 0) {
+            log_error("Could not stat '%s': %s", files[i], strerror(errno));
+            retval = 1;
+        } else if (S_ISDIR(stats.st_mode) ? bench_dir(opts, files[i])
+                                          : bench_file(opts, files[i])) {
+            retval = 1;
+        }
+    }
+
+    return retval;
+}
+
+static int parse_count(const char *arg, const char *what, unsigned long *n)
+{
+    char *numend;
+
+    errno = 0;
+    *n = strtoul(arg, &numend, 10);
+    if (errno != 0) {
+        log_error("Error processing %s: %s", what, strerror(errno));
+        return 1;
+    } else if (*arg == '\0' || *numend != '\0' || *n == 0) {
+        log_error("Argument '%s' for %s is invalid", arg, what);
+        return 1;
+    }
+    return 0;
+}
+
+static int bench(struct progopts opts, const char *name, const uint8_t *prog,
+    size_t len, bool kernel)
+{
+    struct chip8_options chipopts = chip8_options_default();
+    struct result res = {0};
+    struct chip8_profile *profile;
+    struct chip8 *chip;
+
+    chipopts.virtual_timer = true;
+    chipopts.instrs_per_tick = opts.cycles;
+    chipopts.delay_draws = !kernel;
+    /* Skipped instructions would be counted but take no time */
+    chipopts.skip_idle = false;
+    chipopts.seed = 1;
+
+    log_info("Running benchmark %s", name);
+    for (unsigned long i = 0; i < opts.repeat; i++) {
+        unsigned long allocs;
+        double start, seconds;
+
+        chip = chip8_new(chipopts);
+        if (chip8_load_from_bytes(chip, prog, len)) {
+            log_error("Could not load %s", name);
+            chip8_destroy(chip);
+            return 1;
+        }
+        allocs = xalloc_count();
+        start = bench_now();
+        res.status = bench_run(opts, chip);
+        seconds = bench_now() - start;
+        res.allocs = xalloc_count() - allocs;
+        if (i == 0 || seconds < res.seconds)
+            res.seconds = seconds;
+        chip8_destroy(chip);
+    }
+
+    /*
+     * Profiling runs instructions one at a time, so the time spent drawing is
+     * measured separately to avoid slowing down the timed runs.  The runs are
+     * deterministic, so the counts are the same as in the timed runs.
+     */
+    chip = chip8_new(chipopts);
+    chip8_load_from_bytes(chip, prog, len);
+    chip->profile = profile = chip8_profile_new();
+    bench_run(opts, chip);
+    for (int op = 0; op < CHIP8_PROFILE_OPS; op++)
+        res.instrs += profile->op_counts[op];
+    res.draws = profile->op_counts[OP_DRW - OP_INVALID];
+    if (res.draws != 0)
+        res.draw_nanos = (double)profile->draw_nanos / res.draws;
+    chip8_profile_destroy(profile);
+    chip8_destroy(chip);
+
+    printf("%s %s %" PRIu64 " %.6f %.0f %" PRIu64 " %.1f %.3f\n", name,
+        status_string(res.status), res.instrs, res.seconds,
+        res.seconds > 0 ? res.instrs / res.seconds : 0.0, res.draws,
+        res.draw_nanos, res.instrs > 0 ? res.allocs * 1e6 / res.instrs : 0.0);
+    return 0;
+}
+
+static int bench_file(struct progopts opts, const char *fname)
+{
+    struct chip8_rom *rom;
+    int retval;
+
+    if (!(rom = chip8_rom_open(fname)))
+        return 1;
+    retval = bench(opts, fname, rom->data, rom->len, false);
+    chip8_rom_close(rom);
+    return retval;
+}
+
+static int bench_dir(struct progopts opts, const char *dname)
+{
+    DIR *dir;
+    struct dirent *ent;
+    char **names = NULL;
+    size_t n_names = 0, cap = 0;
+    int retval = 0;
+
+    if (!(dir = opendir(dname))) {
+        log_error("Could not open directory '%s': %s", dname, strerror(errno));
+        return 1;
+    }
+    /* Collect the names first, so that the order doesn't depend on readdir */
+    while ((ent = readdir(dir))) {
+        size_t len;
+        char *path;
+        struct stat stats;
+
+        if (strchr(ent->d_name, '.'))
+            continue;
+        len = strlen(dname) + strlen(ent->d_name) + 2;
+        path = xmalloc(len);
+        snprintf(path, len, "%s/%s", dname, ent->d_name);
+        if (stat(path, &stats) != 0 || !S_ISREG(stats.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (n_names == cap)
+            names = xrealloc(names, (cap = cap ? 2 * cap : 32) * sizeof *names);
+        names[n_names++] = path;
+    }
+    closedir(dir);
+
+    if (n_names > 0)
+        qsort(names, n_names, sizeof *names, compare_strings);
+    for (size_t i = 0; i < n_names; i++) {
+        if (bench_file(opts, names[i]))
+            retval = 1;
+        free(names[i]);
+    }
+    free(names);
+    return retval;
+}
+
+static enum chip8_run_status bench_run(
+    struct progopts opts, struct chip8 *chip)
+{
+    for (unsigned long frame = 0; frame < opts.frames; frame++) {
+        enum chip8_run_status status;
+
+        /* Hold each key in turn for a few frames, with pauses in between */
+        chip->key_states = frame % 8 < 4 ? 1 << (frame / 8 % 16) : 0;
+        status = chip8_run_until_frame(chip);
+        if (status == CHIP8_RUN_ERROR || status == CHIP8_RUN_HALTED)
+            return status;
+    }
+    return CHIP8_RUN_FRAME_DONE;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *status_string(enum chip8_run_status status)
+{
+    switch (status) {
+    case CHIP8_RUN_ERROR:
+        return "error";
+    case CHIP8_RUN_HALTED:
+        return "halted";
+    default:
+        return "done";
+    }
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
@@ -7,22 +7,46 @@
  */
 #include <config.h>
 
+#include <dirent.h>
 #include <errno.h>
 #include <getopt.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "disassembler.h"
 #include "log.h"
 #include "memory.h"
+#include "pool.h"
+#include "trace.h"
+
+/**
+ * The size of the output buffer used by each thread in corpus mode.
+ *
+ * This is enough to hold the disassembly of even the largest program, so each
+ * output file is written all at once.
+ */
+#define CORPUS_BUFSIZE 65536
+/**
+ * The extension of the output files written in corpus mode.
+ */
+#define CORPUS_OUTPUTEXT ".c8"
 
 static const char *HELP =
     "A disassembler for Chip-8/Super-Chip programs.\n"
     "\n"
     "Options:\n"
-    "  -o, --output=OUTPUT    set output file name\n"
+    "  -c, --corpus           disassemble every program in the directory or\n"
+    "                         list of files FILE\n"
+    "  -j, --jobs=JOBS        set number of threads to use in corpus mode\n"
+    "  -o, --output=OUTPUT    set output file name (directory in corpus mode)\n"
     "  -q, --shift-quirks     enable shift quirks mode\n"
+    "  -t, --trace            format a trace written by chip8 instead\n"
     "  -v, --verbose          increase verbosity\n"
     "  -h, --help             show this help message and and exit\n"
     "  -V, --version          show version information and exit\n";
@@ -44,6 +68,19 @@ struct progopts {
      * Whether to use shift quirks mode (default false).
      */
     bool shift_quirks;
+    /**
+     * Whether the input is a trace rather than a program (default false).
+     */
+    bool trace;
+    /**
+     * Whether the input is a corpus of programs (default false).
+     */
+    bool corpus;
+    /**
+     * The number of threads to use in corpus mode (default: the number of
+     * processors).
+     */
+    unsigned long jobs;
     /**
      * The output file name.
      *
@@ -58,23 +95,154 @@ struct progopts {
     char *input;
 };
 
+/**
+ * The outcome of disassembling a single program of a corpus.
+ */
+struct corpus_result {
+    /**
+     * Whether the program was disassembled successfully.
+     */
+    bool ok;
+    /**
+     * The time (in nanoseconds) taken to read, disassemble and write the
+     * program.
+     */
+    uint64_t nanos;
+};
+
+/**
+ * Everything shared by the workers disassembling a corpus.
+ *
+ * Apart from `results` and `buffers` (where each program and worker has its
+ * own element), this is never modified while the corpus is being processed.
+ */
+struct corpus {
+    struct chip8disasm_options disopts;
+    /**
+     * The directory to which the disassemblies are written.
+     */
+    const char *outdir;
+    /**
+     * The file names of the programs.
+     */
+    char **inputs;
+    /**
+     * The names of the output files, one for each program.
+     */
+    char **outputs;
+    size_t n_inputs;
+    struct corpus_result *results;
+    /**
+     * The output buffers, `CORPUS_BUFSIZE` bytes for each worker.
+     */
+    char *buffers;
+};
+
+/**
+ * A file, identified by its device and inode numbers.
+ */
+struct file_id {
+    dev_t dev;
+    ino_t ino;
+};
+
+/**
+ * Compares two file IDs, for use with `qsort` and `bsearch`.
+ */
+static int compare_file_ids(const void *a, const void *b);
+/**
+ * Compares two strings through pointers to them, for use with `qsort`.
+ */
+static int compare_names(const void *a, const void *b);
+/**
+ * Compares two strings through pointers to pointers to them, for use with
+ * `qsort`.
+ */
+static int compare_name_refs(const void *a, const void *b);
+/**
+ * Adds a file name to a list of input files.
+ */
+static void corpus_add(struct corpus *corpus, char *fname, size_t *cap);
+/**
+ * Works out the names of the output files, making sure that no two programs
+ * have the same output file and that no output file is one of the programs.
+ *
+ * @return An error code.
+ */
+static int corpus_check_outputs(struct corpus *corpus);
+/**
+ * Disassembles a single program of the corpus.
+ *
+ * This has the signature required by `pool_run`.
+ */
+static void corpus_disassemble(size_t item, int worker, void *data);
+/**
+ * Returns the name of the output file for the given program, allocated on the
+ * heap.
+ *
+ * This is the base name of the program with its extension (if any) replaced
+ * by `CORPUS_OUTPUTEXT`, in the output directory.
+ */
+static char *corpus_output_name(const char *outdir, const char *input);
+/**
+ * Finds the programs in the given directory, in order of name.
+ *
+ * Hidden files and anything which isn't a regular file are skipped.
+ *
+ * @return An error code.
+ */
+static int corpus_read_dir(struct corpus *corpus, const char *dirname);
+/**
+ * Reads the names of the programs from the given file ('-' for standard
+ * input), one per line.
+ *
+ * @return An error code.
+ */
+static int corpus_read_list(struct corpus *corpus, const char *fname);
+/**
+ * Parses a positive integer argument.
+ *
+ * @param what A description of the argument to use in error messages.
+ * @return An error code.
+ */
+static int parse_count(const char *arg, const char *what, unsigned long *n);
 static struct progopts progopts_default(void);
 static int run(struct progopts opts);
+/**
+ * Disassembles the corpus of programs given as input.
+ */
+static int run_corpus(struct progopts opts);
+/**
+ * Formats the trace given as input.
+ */
+static int run_trace(struct progopts opts);
 
 int main(int argc, char **argv)
 {
     int option;
     struct progopts opts = progopts_default();
-    const struct option options[] = {{"output", required_argument, NULL, 'o'},
+    const struct option options[] = {{"corpus", no_argument, NULL, 'c'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"output", required_argument, NULL, 'o'},
         {"shift-quirks", no_argument, NULL, 'q'},
+        {"trace", no_argument, NULL, 't'},
         {"verbose", no_argument, NULL, 'v'}, {"help", no_argument, NULL, 'h'},
         {"version", no_argument, NULL, 'V'}, {0, 0, 0, 0}};
     int retval = 0;
 
     log_init(argc >= 1 ? argv[0] : "chip8disasm", stderr, LOG_WARNING);
 
-    while ((option = getopt_long(argc, argv, "o:qvhV", options, NULL)) != -1) {
+    while ((option = getopt_long(argc, argv, "cj:o:qtvhV", options, NULL)) != -1) {
         switch (option) {
+        case 'c':
+            opts.corpus = true;
+            break;
+        case 'j':
+            if (parse_count(optarg, "jobs", &opts.jobs)) {
+                retval = 2;
+                goto EXIT;
+            }
+            break;
         case 'o':
             free(opts.output);
             opts.output = xstrdup(optarg);
@@ -82,6 +250,9 @@ int main(int argc, char **argv)
         case 'q':
             opts.shift_quirks = true;
             break;
+        case 't':
+            opts.trace = true;
+            break;
         case 'v':
             opts.verbosity++;
             break;
@@ -118,10 +289,242 @@ EXIT:
     return retval;
 }
 
+static int compare_file_ids(const void *a, const void *b)
+{
+    const struct file_id *id1 = a, *id2 = b;
+
+    if (id1->dev != id2->dev)
+        return id1->dev < id2->dev ? -1 : 1;
+    if (id1->ino != id2->ino)
+        return id1->ino < id2->ino ? -1 : 1;
+    return 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int compare_name_refs(const void *a, const void *b)
+{
+    return strcmp(**(char *const *const *)a, **(char *const *const *)b);
+}
+
+static void corpus_add(struct corpus *corpus, char *fname, size_t *cap)
+{
+    if (corpus->n_inputs == *cap) {
+        *cap = *cap == 0 ? 64 : 2 * *cap;
+        corpus->inputs = xrealloc(corpus->inputs, *cap * sizeof *corpus->inputs);
+    }
+    corpus->inputs[corpus->n_inputs++] = fname;
+}
+
+static int corpus_check_outputs(struct corpus *corpus)
+{
+    size_t n = corpus->n_inputs, n_ids = 0;
+    char ***sorted = xmalloc(n * sizeof *sorted);
+    struct file_id *ids = xmalloc(n * sizeof *ids);
+    struct stat stats;
+    int retval = 0;
+
+    corpus->outputs = xcalloc(n, sizeof *corpus->outputs);
+    for (size_t i = 0; i < n; i++) {
+        corpus->outputs[i] =
+            corpus_output_name(corpus->outdir, corpus->inputs[i]);
+        sorted[i] = &corpus->outputs[i];
+    }
+
+    /* Any duplicates are next to each other once sorted */
+    qsort(sorted, n, sizeof *sorted, compare_name_refs);
+    for (size_t i = 1; i < n; i++)
+        if (strcmp(*sorted[i - 1], *sorted[i]) == 0) {
+            log_error("Programs '%s' and '%s' would both be written to '%s'",
+                corpus->inputs[sorted[i - 1] - corpus->outputs],
+                corpus->inputs[sorted[i] - corpus->outputs], *sorted[i]);
+            retval = 1;
+        }
+
+    /*
+     * The same file may be named in different ways, so the outputs which
+     * already exist are compared with the programs by inode.
+     */
+    for (size_t i = 0; i < n; i++)
+        if (stat(corpus->inputs[i], &stats) == 0)
+            ids[n_ids++] = (struct file_id){stats.st_dev, stats.st_ino};
+    qsort(ids, n_ids, sizeof *ids, compare_file_ids);
+    for (size_t i = 0; i < n; i++) {
+        struct file_id id;
+
+        if (stat(corpus->outputs[i], &stats) != 0)
+            continue;
+        id = (struct file_id){stats.st_dev, stats.st_ino};
+        if (bsearch(&id, ids, n_ids, sizeof *ids, compare_file_ids)) {
+            log_error("Output file '%s' for program '%s' is one of the programs",
+                corpus->outputs[i], corpus->inputs[i]);
+            retval = 1;
+        }
+    }
+
+    free(ids);
+    free(sorted);
+    return retval;
+}
+
+static void corpus_disassemble(size_t item, int worker, void *data)
+{
+    struct corpus *corpus = data;
+    struct corpus_result *res = &corpus->results[item];
+    const char *input = corpus->inputs[item];
+    const char *outname = corpus->outputs[item];
+    struct chip8disasm *disasm;
+    struct timespec start, end;
+    FILE *output;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    res->ok = false;
+
+    if ((disasm = chip8disasm_from_file(corpus->disopts, input)) == NULL) {
+        log_error("Could not disassemble input file '%s'", input);
+        goto EXIT_NOTHING_DONE;
+    }
+    if ((output = fopen(outname, "w")) == NULL) {
+        log_error("Could not open output file '%s': %s", outname, strerror(errno));
+        goto EXIT_DISASSEMBLED;
+    }
+    /* The disassembly is written in many small pieces, which this batches up */
+    setvbuf(output, corpus->buffers + (size_t)worker * CORPUS_BUFSIZE, _IOFBF,
+        CORPUS_BUFSIZE);
+
+    if (chip8disasm_dump(disasm, output) != 0)
+        log_error("Disassembly dump of '%s' failed", input);
+    else
+        res->ok = true;
+    if (fclose(output) != 0) {
+        log_error("Could not write output file '%s': %s", outname, strerror(errno));
+        res->ok = false;
+    }
+
+EXIT_DISASSEMBLED:
+    chip8disasm_destroy(disasm);
+EXIT_NOTHING_DONE:
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    res->nanos = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+        end.tv_nsec - start.tv_nsec;
+}
+
+static char *corpus_output_name(const char *outdir, const char *input)
+{
+    const char *base = strrchr(input, '/');
+    const char *ext;
+    size_t baselen, len;
+    char *buf;
+
+    base = base ? base + 1 : input;
+    ext = strrchr(base, '.');
+    /* A leading dot doesn't start an extension */
+    baselen = ext && ext != base ? (size_t)(ext - base) : strlen(base);
+    len = strlen(outdir) + 1 + baselen + strlen(CORPUS_OUTPUTEXT) + 1;
+    buf = xmalloc(len);
+    snprintf(buf, len, "%s/%.*s%s", outdir, (int)baselen, base,
+        CORPUS_OUTPUTEXT);
+
+    return buf;
+}
+
+static int corpus_read_dir(struct corpus *corpus, const char *dirname)
+{
+    DIR *dir;
+    struct dirent *entry;
+    size_t cap = 0;
+
+    if ((dir = opendir(dirname)) == NULL) {
+        log_error("Could not open directory '%s': %s", dirname, strerror(errno));
+        return 1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(dirname) + strlen(entry->d_name) + 2;
+        char *fname;
+        struct stat stats;
+
+        if (entry->d_name[0] == '.')
+            continue;
+        fname = xmalloc(len);
+        snprintf(fname, len, "%s/%s", dirname, entry->d_name);
+        if (stat(fname, &stats) != 0 || !S_ISREG(stats.st_mode)) {
+            free(fname);
+            continue;
+        }
+        corpus_add(corpus, fname, &cap);
+    }
+    closedir(dir);
+
+    /* The order of readdir is arbitrary, but the report should be stable */
+    if (corpus->n_inputs > 0)
+        qsort(corpus->inputs, corpus->n_inputs, sizeof *corpus->inputs,
+            compare_names);
+    return 0;
+}
+
+static int corpus_read_list(struct corpus *corpus, const char *fname)
+{
+    FILE *input;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    size_t cap = 0;
+    int retval = 0;
+
+    if (strcmp(fname, "-") == 0) {
+        input = stdin;
+    } else if ((input = fopen(fname, "r")) == NULL) {
+        log_error("Could not open input file '%s': %s", fname, strerror(errno));
+        return 1;
+    }
+    while ((len = getline(&line, &linecap, input)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len > 0)
+            corpus_add(corpus, xstrdup(line), &cap);
+    }
+    if (ferror(input)) {
+        log_error("Error reading from file '%s': %s", fname, strerror(errno));
+        retval = 1;
+    }
+
+    free(line);
+    if (input != stdin)
+        fclose(input);
+    return retval;
+}
+
+static int parse_count(const char *arg, const char *what, unsigned long *n)
+{
+    char *numend;
+
+    errno = 0;
+    *n = strtoul(arg, &numend, 10);
+    if (errno != 0) {
+        log_error("Error processing %s: %s", what, strerror(errno));
+        return 1;
+    } else if (*arg == '\0' || *numend != '\0' || *n == 0) {
+        log_error("Argument '%s' for %s is invalid", arg, what);
+        return 1;
+    }
+    return 0;
+}
+
 static struct progopts progopts_default(void)
 {
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+
     return (struct progopts){
-        .verbosity = 0, .shift_quirks = false, .input = NULL, .output = NULL};
+        .verbosity = 0,
+        .shift_quirks = false,
+        .trace = false,
+        .corpus = false,
+        .jobs = nprocs > 0 ? (unsigned long)nprocs : 1,
+        .input = NULL,
+        .output = NULL};
 }
 
 static int run(struct progopts opts)
@@ -138,6 +541,10 @@ static int run(struct progopts opts)
     else if (opts.verbosity >= 3)
         log_set_level(LOG_TRACE);
 
+    if (opts.trace)
+        return run_trace(opts);
+    if (opts.corpus)
+        return run_corpus(opts);
     if (opts.shift_quirks)
         disopts.shift_quirks = true;
 
@@ -168,3 +575,112 @@ EXIT_DISASM_CREATED:
 EXIT_NOTHING_DONE:
     return retval;
 }
+
+static int run_corpus(struct progopts opts)
+{
+    struct corpus corpus = {.disopts = chip8disasm_options_default()};
+    struct stat stats;
+    struct timespec start, end;
+    double elapsed;
+    size_t n_workers, n_failed = 0;
+    int retval = 0;
+
+    corpus.disopts.shift_quirks = opts.shift_quirks;
+    if (strcmp(opts.output, "-") == 0) {
+        log_error("Corpus mode needs an output directory (use -o)");
+        return 1;
+    }
+    corpus.outdir = opts.output;
+    if (mkdir(corpus.outdir, 0777) != 0 && errno != EEXIST) {
+        log_error("Could not create output directory '%s': %s", corpus.outdir,
+            strerror(errno));
+        return 1;
+    }
+
+    if (strcmp(opts.input, "-") != 0 && stat(opts.input, &stats) == 0 &&
+        S_ISDIR(stats.st_mode))
+        retval = corpus_read_dir(&corpus, opts.input);
+    else
+        retval = corpus_read_list(&corpus, opts.input);
+    if (retval)
+        goto EXIT_INPUTS_READ;
+    if (corpus.n_inputs == 0) {
+        log_warning("No programs found in '%s'", opts.input);
+        goto EXIT_INPUTS_READ;
+    }
+    if (corpus_check_outputs(&corpus)) {
+        retval = 1;
+        goto EXIT_OUTPUTS_NAMED;
+    }
+
+    n_workers = opts.jobs < corpus.n_inputs ? opts.jobs : corpus.n_inputs;
+    corpus.results = xcalloc(corpus.n_inputs, sizeof *corpus.results);
+    corpus.buffers = xmalloc(n_workers * CORPUS_BUFSIZE);
+
+    log_info("Disassembling %zu programs on %zu threads", corpus.n_inputs,
+        n_workers);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pool_run((int)n_workers, corpus.n_inputs, corpus_disassemble, &corpus)) {
+        log_error("Could not disassemble corpus");
+        retval = 1;
+        goto EXIT_RESULTS_CREATED;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("# status milliseconds file\n");
+    for (size_t i = 0; i < corpus.n_inputs; i++) {
+        const struct corpus_result *res = &corpus.results[i];
+
+        printf("%s %.3f %s\n", res->ok ? "ok" : "failed", res->nanos / 1e6,
+            corpus.inputs[i]);
+        if (!res->ok)
+            n_failed++;
+    }
+    printf("# programs %zu failed %zu seconds %.3f\n", corpus.n_inputs,
+        n_failed, elapsed);
+    if (n_failed > 0)
+        retval = 1;
+
+EXIT_RESULTS_CREATED:
+    free(corpus.results);
+    free(corpus.buffers);
+EXIT_OUTPUTS_NAMED:
+    for (size_t i = 0; i < corpus.n_inputs; i++)
+        free(corpus.outputs[i]);
+    free(corpus.outputs);
+EXIT_INPUTS_READ:
+    for (size_t i = 0; i < corpus.n_inputs; i++)
+        free(corpus.inputs[i]);
+    free(corpus.inputs);
+    return retval;
+}
+
+static int run_trace(struct progopts opts)
+{
+    FILE *input, *output;
+    int retval = 0;
+
+    if ((input = fopen(opts.input, "rb")) == NULL) {
+        log_error("Could not open input file '%s': %s", opts.input, strerror(errno));
+        return 1;
+    }
+    if (strcmp(opts.output, "-") == 0) {
+        output = stdout;
+    } else if ((output = fopen(opts.output, "w")) == NULL) {
+        log_error("Could not open output file '%s': %s", opts.output, strerror(errno));
+        retval = 1;
+        goto EXIT_INPUT_OPENED;
+    }
+
+    if (chip8_trace_format(input, output) != 0) {
+        log_error("Could not format trace");
+        retval = 1;
+    }
+
+    if (output != stdout)
+        fclose(output);
+EXIT_INPUT_OPENED:
+    fclose(input);
+    return retval;
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+/*
+ * Generates the instruction tables used by instruction.c.
+ *
+ * This is run as part of the build, so that decoding an opcode takes a single
+ * lookup in a table with an entry for every possible opcode, while the
+ * encoding of each operation is still specified only once (below).
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "log.h"
+
+static const char *USAGE = "Usage: chip8gentables OUTPUT\n";
+
+/**
+ * The number of operations (including `OP_INVALID`).
+ */
+#define N_OPS (OP_LD_REG_R - OP_INVALID + 1)
+/**
+ * The number of possible opcodes.
+ */
+#define N_OPCODES 0x10000
+
+/**
+ * The opcode bits of each argument, in the order of the `ARG_*` flags.
+ */
+static const uint16_t ARG_MASKS[] = {0x0F00, 0x00F0, 0x0FFF, 0x00FF, 0x000F};
+/**
+ * The names of the `ARG_*` flags, in order.
+ */
+static const char *const ARG_NAMES[] = {
+    "ARG_VX", "ARG_VY", "ARG_ADDR", "ARG_BYTE", "ARG_NIBBLE"};
+
+/**
+ * The arguments an operation takes.
+ */
+enum {
+    ARG_VX = 1 << 0,
+    ARG_VY = 1 << 1,
+    ARG_ADDR = 1 << 2,
+    ARG_BYTE = 1 << 3,
+    ARG_NIBBLE = 1 << 4,
+};
+
+/**
+ * The shift quirks modes in which an operation is used.
+ */
+enum mode {
+    MODE_BOTH = 0,
+    MODE_NORMAL,
+    MODE_QUIRKS,
+};
+
+/**
+ * The encoding of an operation.
+ */
+struct op_spec {
+    /**
+     * The opcode with all argument bits clear.
+     */
+    uint16_t base;
+    /**
+     * The arguments (`ARG_*` flags).
+     */
+    int args;
+    enum mode mode;
+    /**
+     * Any other bits of the opcode which may have any value (and are zero
+     * when encoding the operation).
+     */
+    uint16_t ignored;
+};
+
+/**
+ * The encoding of every operation, indexed by `op - OP_INVALID`.
+ *
+ * Every operation other than `OP_INVALID` (which is used for any opcode not
+ * matching one of the others) must have an entry.
+ */
+static const struct op_spec SPECS[N_OPS] = {
+    /* The second nibble of the 0 instructions is ignored. */
+    [OP_SCD - OP_INVALID] = {0x00C0, ARG_NIBBLE, MODE_BOTH, 0x0F00},
+    [OP_CLS - OP_INVALID] = {0x00E0, 0, MODE_BOTH, 0x0F00},
+    [OP_RET - OP_INVALID] = {0x00EE, 0, MODE_BOTH, 0x0F00},
+    [OP_SCR - OP_INVALID] = {0x00FB, 0, MODE_BOTH, 0x0F00},
+    [OP_SCL - OP_INVALID] = {0x00FC, 0, MODE_BOTH, 0x0F00},
+    [OP_EXIT - OP_INVALID] = {0x00FD, 0, MODE_BOTH, 0x0F00},
+    [OP_LOW - OP_INVALID] = {0x00FE, 0, MODE_BOTH, 0x0F00},
+    [OP_HIGH - OP_INVALID] = {0x00FF, 0, MODE_BOTH, 0x0F00},
+    [OP_JP - OP_INVALID] = {0x1000, ARG_ADDR, MODE_BOTH},
+    [OP_CALL - OP_INVALID] = {0x2000, ARG_ADDR, MODE_BOTH},
+    [OP_SE_BYTE - OP_INVALID] = {0x3000, ARG_VX | ARG_BYTE, MODE_BOTH},
+    [OP_SNE_BYTE - OP_INVALID] = {0x4000, ARG_VX | ARG_BYTE, MODE_BOTH},
+    [OP_SE_REG - OP_INVALID] = {0x5000, ARG_VX | ARG_VY, MODE_BOTH},
+    [OP_LD_BYTE - OP_INVALID] = {0x6000, ARG_VX | ARG_BYTE, MODE_BOTH},
+    [OP_ADD_BYTE - OP_INVALID] = {0x7000, ARG_VX | ARG_BYTE, MODE_BOTH},
+    [OP_LD_REG - OP_INVALID] = {0x8000, ARG_VX | ARG_VY, MODE_BOTH},
+    [OP_OR - OP_INVALID] = {0x8001, ARG_VX | ARG_VY, MODE_BOTH},
+    [OP_AND - OP_INVALID] = {0x8002, ARG_VX | ARG_VY, MODE_BOTH},
+    [OP_XOR - OP_INVALID] = {0x8003, ARG_VX | ARG_VY, MODE_BOTH},
+    [OP_ADD_REG - OP_INVALID] = {0x8004, ARG_VX | ARG_VY, MODE_BOTH},
+    [OP_SUB - OP_INVALID] = {0x8005, ARG_VX | ARG_VY, MODE_BOTH},
+    /*
+     * Without shift quirks, the Vy bits of the shift instructions are
+     * ignored.
+     */
+    [OP_SHR - OP_INVALID] = {0x8006, ARG_VX, MODE_NORMAL, 0x00F0},
+    [OP_SHR_QUIRK - OP_INVALID] = {0x8006, ARG_VX | ARG_VY, MODE_QUIRKS},
+    [OP_SUBN - OP_INVALID] = {0x8007, ARG_VX | ARG_VY, MODE_BOTH},
+    [OP_SHL - OP_INVALID] = {0x800E, ARG_VX, MODE_NORMAL, 0x00F0},
+    [OP_SHL_QUIRK - OP_INVALID] = {0x800E, ARG_VX | ARG_VY, MODE_QUIRKS},
+    [OP_SNE_REG - OP_INVALID] = {0x9000, ARG_VX | ARG_VY, MODE_BOTH},
+    [OP_LD_I - OP_INVALID] = {0xA000, ARG_ADDR, MODE_BOTH},
+    [OP_JP_V0 - OP_INVALID] = {0xB000, ARG_ADDR, MODE_BOTH},
+    [OP_RND - OP_INVALID] = {0xC000, ARG_VX | ARG_BYTE, MODE_BOTH},
+    [OP_DRW - OP_INVALID] = {0xD000, ARG_VX | ARG_VY | ARG_NIBBLE, MODE_BOTH},
+    [OP_SKP - OP_INVALID] = {0xE09E, ARG_VX, MODE_BOTH},
+    [OP_SKNP - OP_INVALID] = {0xE0A1, ARG_VX, MODE_BOTH},
+    [OP_LD_REG_DT - OP_INVALID] = {0xF007, ARG_VX, MODE_BOTH},
+    [OP_LD_KEY - OP_INVALID] = {0xF00A, ARG_VX, MODE_BOTH},
+    [OP_LD_DT_REG - OP_INVALID] = {0xF015, ARG_VX, MODE_BOTH},
+    [OP_LD_ST - OP_INVALID] = {0xF018, ARG_VX, MODE_BOTH},
+    [OP_ADD_I - OP_INVALID] = {0xF01E, ARG_VX, MODE_BOTH},
+    [OP_LD_F - OP_INVALID] = {0xF029, ARG_VX, MODE_BOTH},
+    [OP_LD_HF - OP_INVALID] = {0xF030, ARG_VX, MODE_BOTH},
+    [OP_LD_B - OP_INVALID] = {0xF033, ARG_VX, MODE_BOTH},
+    [OP_LD_DEREF_I_REG - OP_INVALID] = {0xF055, ARG_VX, MODE_BOTH},
+    [OP_LD_REG_DEREF_I - OP_INVALID] = {0xF065, ARG_VX, MODE_BOTH},
+    [OP_LD_R_REG - OP_INVALID] = {0xF075, ARG_VX, MODE_BOTH},
+    [OP_LD_REG_R - OP_INVALID] = {0xF085, ARG_VX, MODE_BOTH},
+};
+
+/**
+ * The operation of each opcode, indexed by shift quirks mode and opcode, as
+ * `op - OP_INVALID`.
+ */
+static uint8_t decode_ops[2][N_OPCODES];
+
+/**
+ * Fills in `decode_ops` from `SPECS`.
+ *
+ * @return An error code.
+ */
+static int fill_decode_ops(void);
+/**
+ * Writes the names of the given `ARG_*` flags (or 0 if there are none).
+ */
+static void write_args(FILE *out, int args);
+/**
+ * Writes the generated tables.
+ *
+ * @return An error code.
+ */
+static int write_tables(FILE *out);
+
+int main(int argc, char **argv)
+{
+    FILE *out;
+
+    log_init(argc >= 1 ? argv[0] : "chip8gentables", stderr, LOG_WARNING);
+    if (argc != 2) {
+        fputs(USAGE, stderr);
+        return 2;
+    }
+
+    if (fill_decode_ops())
+        return 1;
+    if ((out = fopen(argv[1], "w")) == NULL) {
+        log_error("Could not open output file '%s': %s", argv[1],
+            strerror(errno));
+        return 1;
+    }
+    if (write_tables(out)) {
+        fclose(out);
+        remove(argv[1]);
+        return 1;
+    }
+    if (fclose(out)) {
+        log_error("Could not close output file '%s': %s", argv[1],
+            strerror(errno));
+        remove(argv[1]);
+        return 1;
+    }
+    return 0;
+}
+
+static int fill_decode_ops(void)
+{
+    for (int op = 1; op < N_OPS; op++) {
+        uint16_t mask = SPECS[op].ignored;
+
+        if (SPECS[op].base == 0) {
+            log_error("No encoding given for operation %d",
+                op + OP_INVALID);
+            return 1;
+        }
+        for (size_t arg = 0; arg < sizeof ARG_MASKS / sizeof ARG_MASKS[0];
+             arg++)
+            if (SPECS[op].args & 1 << arg)
+                mask |= ARG_MASKS[arg];
+
+        for (int quirks = 0; quirks < 2; quirks++) {
+            if (SPECS[op].mode == (quirks ? MODE_NORMAL : MODE_QUIRKS))
+                continue;
+            /* Go through every combination of argument bits. */
+            for (uint32_t bits = 0; bits <= mask;
+                 bits = ((bits | ~mask) + 1) & mask) {
+                uint16_t opcode = SPECS[op].base | bits;
+
+                if (decode_ops[quirks][opcode] != 0) {
+                    log_error("Opcode %04X is used by operations %d and %d",
+                        (unsigned)opcode,
+                        decode_ops[quirks][opcode] + OP_INVALID,
+                        op + OP_INVALID);
+                    return 1;
+                }
+                decode_ops[quirks][opcode] = op;
+                if (bits == mask)
+                    break;
+            }
+        }
+    }
+    return 0;
+}
+
+static void write_args(FILE *out, int args)
+{
+    bool first = true;
+
+    for (size_t arg = 0; arg < sizeof ARG_NAMES / sizeof ARG_NAMES[0]; arg++)
+        if (args & 1 << arg) {
+            fprintf(out, "%s%s", first ? "" : " | ", ARG_NAMES[arg]);
+            first = false;
+        }
+    if (first)
+        fputs("0", out);
+}
+
+static int write_tables(FILE *out)
+{
+    fputs("/* Generated by chip8gentables; do not edit. */\n\n", out);
+
+    fprintf(out, "static const struct op_info OP_INFOS[%d] = {\n", N_OPS);
+    fputs("    {0x0000, ARG_OPCODE},\n", out);
+    for (int op = 1; op < N_OPS; op++) {
+        fprintf(out, "    {0x%04X, ", (unsigned)SPECS[op].base);
+        write_args(out, SPECS[op].args);
+        fputs("},\n", out);
+    }
+    fputs("};\n\n", out);
+
+    fprintf(out, "static const uint8_t DECODE_OPS[2][0x%X] = {\n", N_OPCODES);
+    for (int quirks = 0; quirks < 2; quirks++) {
+        fputs("    {\n", out);
+        for (long opcode = 0; opcode < N_OPCODES; opcode++)
+            fprintf(out, "%s%d,%s", opcode % 16 == 0 ? "        " : " ",
+                decode_ops[quirks][opcode], opcode % 16 == 15 ? "\n" : "");
+        fputs("    },\n", out);
+    }
+    fputs("};\n", out);
+
+    if (ferror(out)) {
+        log_error("Could not write tables: %s", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
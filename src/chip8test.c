@@ -15,10 +15,20 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "assembler.h"
 #include "interpreter.h"
+#include "lanes.h"
 #include "log.h"
+#include "profile.h"
+#include "replay.h"
+#include "rom.h"
+#include "snapshot.h"
+#include "trace.h"
 
 #define TEST_RUN(test) testing_run(#test, test)
 #define ASSERT(cond)                                                           \
@@ -40,12 +50,39 @@
 #define ASSERT_EQ_UINT(lhs, rhs) ASSERT_EQ((lhs), (rhs), "%u")
 
 static int n_failures;
+/**
+ * The dirty rows passed to the last call of `testing_draw`.
+ */
+static uint64_t testing_dirty_rows;
 
 static void testing_run(const char *name, int (*test)(void));
 static void testing_setup(void);
 static int testing_teardown(void);
 
 static struct chip8_options chip8_options_testing(void);
+/**
+ * A draw callback which records the rows it was given.
+ */
+static void testing_draw(const struct chip8 *chip, uint64_t dirty_rows);
+/**
+ * Runs a program with both dispatch methods, checking that the interpreters
+ * are in the same state after every frame.
+ *
+ * @param seed The seed for the key presses, which change every few frames.
+ * @return Zero if the states always matched.
+ */
+static int testing_dispatch_run(const uint8_t *prog, size_t len,
+    struct chip8_options opts, int frames, uint32_t seed);
+/**
+ * Checks that two interpreters are in the same state.
+ *
+ * @return Zero if they are.
+ */
+static int testing_same_state(const struct chip8 *a, const struct chip8 *b);
+/**
+ * Returns the next value of a xorshift generator with the given state.
+ */
+static uint32_t testing_rand(uint32_t *state);
 
 /**
  * Tests Chip-8 arithmetic instruction evaluation.
@@ -59,6 +96,10 @@ int test_asm(void);
  * Tests assembly instruction alignment.
  */
 int test_asm_align(void);
+/**
+ * Tests processing a whole buffer of assembly code at once.
+ */
+int test_asm_buffer(void);
 /**
  * Tests evaluation of expressions in assembler.
  */
@@ -71,6 +112,20 @@ int test_asm_fail(void);
  * Tests conditional assembly (IFDEF, etc.).
  */
 int test_asm_if(void);
+/**
+ * Tests including files in assembly code.
+ */
+int test_asm_include(void);
+/**
+ * Tests that many labels (enough to resize the label table several times) can
+ * be defined and referenced, including before they are defined.
+ */
+int test_asm_labels(void);
+/**
+ * Tests that running blocks of instructions gives the same results as
+ * stepping through them.
+ */
+int test_block(void);
 /**
  * Tests Chip-8 comparison instruction evaluation.
  */
@@ -79,18 +134,82 @@ int test_comparison(void);
  * Tests Chip-8 display instruction evaluation.
  */
 int test_display(void);
+/**
+ * Tests reporting of changed display rows to the draw callback.
+ */
+int test_display_flush(void);
+/**
+ * Tests that both dispatch methods give the same results on random programs
+ * and the included games.
+ */
+int test_dispatch(void);
+/**
+ * Tests that skipping idle loops gives the same results as running them.
+ */
+int test_idle(void);
+/**
+ * Tests decoding and encoding instructions.
+ */
+int test_instruction(void);
 /**
  * Tests the evaluation of various jump instructions.
  */
 int test_jp(void);
+/**
+ * Tests that running interpreters in lockstep gives the same results as
+ * running them separately.
+ */
+int test_lanes(void);
 /**
  * Tests Chip-8 memory instruction evaluation.
  */
 int test_ld(void);
+/**
+ * Tests counting executed instructions and reporting them.
+ */
+int test_profile(void);
 /**
  * Tests shift and load quirks mode behavior.
  */
 int test_quirks(void);
+/**
+ * Tests that replaying a recording gives the same results as the original
+ * run.
+ */
+int test_replay(void);
+/**
+ * Tests that an interpreter reset from a template (in storage of its own)
+ * behaves exactly like a newly created one.
+ */
+int test_reset(void);
+/**
+ * Tests that the random number generator is determined by its seed.
+ */
+int test_rnd(void);
+/**
+ * Tests loading games from files.
+ */
+int test_rom(void);
+/**
+ * Tests that modifications to already executed code take effect.
+ */
+int test_selfmod(void);
+/**
+ * Tests running multiple instructions at once.
+ */
+int test_run(void);
+/**
+ * Tests saving and restoring snapshots, and rewinding through them.
+ */
+int test_snapshot(void);
+/**
+ * Tests the behavior of the virtual timer.
+ */
+int test_timer(void);
+/**
+ * Tests recording and formatting a binary trace.
+ */
+int test_trace(void);
 
 int main(int argc, char **argv)
 {
@@ -99,14 +218,33 @@ int main(int argc, char **argv)
     TEST_RUN(test_arithmetic);
     TEST_RUN(test_asm);
     TEST_RUN(test_asm_align);
+    TEST_RUN(test_asm_buffer);
     TEST_RUN(test_asm_eval);
     TEST_RUN(test_asm_fail);
     TEST_RUN(test_asm_if);
+    TEST_RUN(test_asm_include);
+    TEST_RUN(test_asm_labels);
+    TEST_RUN(test_block);
     TEST_RUN(test_comparison);
     TEST_RUN(test_display);
+    TEST_RUN(test_display_flush);
+    TEST_RUN(test_dispatch);
+    TEST_RUN(test_idle);
+    TEST_RUN(test_instruction);
     TEST_RUN(test_jp);
+    TEST_RUN(test_lanes);
     TEST_RUN(test_ld);
+    TEST_RUN(test_profile);
     TEST_RUN(test_quirks);
+    TEST_RUN(test_replay);
+    TEST_RUN(test_reset);
+    TEST_RUN(test_rnd);
+    TEST_RUN(test_rom);
+    TEST_RUN(test_selfmod);
+    TEST_RUN(test_run);
+    TEST_RUN(test_snapshot);
+    TEST_RUN(test_timer);
+    TEST_RUN(test_trace);
     return testing_teardown();
 }
 
@@ -311,6 +449,44 @@ int test_asm_align(void)
     return 0;
 }
 
+int test_asm_buffer(void)
+{
+    const char source[] = "start: CLS\n\nloop:\r\n  JP loop ; comment, here\nDW start";
+    struct chip8asm *chipasm = chip8asm_new(chip8asm_options_default());
+    struct chip8asm_program *prog = chip8asm_program_new();
+    /* The buffer need not be null-terminated */
+    char *buf = malloc(sizeof source - 1);
+    FILE *log;
+    char msg[128];
+
+    ASSERT(chipasm != NULL && prog != NULL && buf != NULL);
+
+    memcpy(buf, source, sizeof source - 1);
+    ASSERT(!chip8asm_process_buffer(chipasm, buf, sizeof source - 1));
+    ASSERT(!chip8asm_emit(chipasm, prog));
+    ASSERT_EQ_UINT(prog->len, 6);
+    ASSERT_EQ_UINT(chip8asm_program_opcode(prog, 0), 0x00E0);
+    ASSERT_EQ_UINT(chip8asm_program_opcode(prog, 2), 0x1202);
+    ASSERT_EQ_UINT(chip8asm_program_opcode(prog, 4), 0x0200);
+    free(buf);
+    chip8asm_destroy(chipasm);
+
+    /* Errors must be reported on the right line */
+    chipasm = chip8asm_new(chip8asm_options_default());
+    ASSERT((log = tmpfile()) != NULL);
+    log_set_output(log);
+    ASSERT(chip8asm_process_buffer(chipasm, "CLS\n\nBOGUS V0\nCLS\n", 17));
+    log_set_output(stderr);
+    rewind(log);
+    ASSERT(fgets(msg, sizeof msg, log) != NULL);
+    ASSERT(strstr(msg, "On line 3: ") != NULL);
+    fclose(log);
+
+    chip8asm_program_destroy(prog);
+    chip8asm_destroy(chipasm);
+    return 0;
+}
+
 int test_asm_eval(void)
 {
     struct chip8asm *chipasm = chip8asm_new(chip8asm_options_default());
@@ -408,6 +584,159 @@ int test_asm_if(void)
     return 0;
 }
 
+int test_asm_include(void)
+{
+    char dir[] = "/tmp/chip8test-XXXXXX";
+    char main_name[64], sub_name[64], font_name[64], self_name[64];
+    struct chip8asm *chipasm = chip8asm_new(chip8asm_options_default());
+    struct chip8asm_program *prog = chip8asm_program_new();
+    FILE *file;
+
+    ASSERT(chipasm != NULL && prog != NULL);
+    ASSERT(mkdtemp(dir) != NULL);
+    snprintf(main_name, sizeof main_name, "%s/main.c8", dir);
+    snprintf(sub_name, sizeof sub_name, "%s/sub", dir);
+    snprintf(font_name, sizeof font_name, "%s/sub/font.c8", dir);
+    snprintf(self_name, sizeof self_name, "%s/self.c8", dir);
+    ASSERT(mkdir(sub_name, 0700) == 0);
+
+    ASSERT((file = fopen(main_name, "w")) != NULL);
+    fputs("JP start\nINCLUDE \"sub/font.c8\"\nstart: LD I, font\n"
+          "IFDEF missing\nINCLUDE missing.c8\nENDIF\n",
+        file);
+    fclose(file);
+    /* The included file's labels are visible to the rest of the program */
+    ASSERT((file = fopen(font_name, "w")) != NULL);
+    fputs("font: DB #F0\nDB #90\n", file);
+    fclose(file);
+
+    ASSERT(!chip8asm_process_file(chipasm, main_name));
+    ASSERT(!chip8asm_emit(chipasm, prog));
+    ASSERT_EQ_UINT(prog->len, 6);
+    ASSERT_EQ_UINT(chip8asm_program_opcode(prog, 0), 0x1204);
+    ASSERT_EQ_UINT(chip8asm_program_opcode(prog, 2), 0xF090);
+    ASSERT_EQ_UINT(chip8asm_program_opcode(prog, 4), 0xA202);
+    /* The skipped INCLUDE is not a dependency */
+    ASSERT(strcmp(chip8asm_file(chipasm, 0), main_name) == 0);
+    ASSERT(strcmp(chip8asm_file(chipasm, 1), font_name) == 0);
+    ASSERT(chip8asm_file(chipasm, 2) == NULL);
+    chip8asm_destroy(chipasm);
+
+    /* A file which includes itself must not recurse forever */
+    ASSERT((file = fopen(self_name, "w")) != NULL);
+    fputs("CLS\nINCLUDE self.c8\n", file);
+    fclose(file);
+    chipasm = chip8asm_new(chip8asm_options_default());
+    log_set_output(NULL);
+    ASSERT(chip8asm_process_file(chipasm, self_name) != 0);
+    log_set_output(stdout);
+
+    remove(self_name);
+    remove(font_name);
+    remove(main_name);
+    rmdir(sub_name);
+    rmdir(dir);
+    chip8asm_program_destroy(prog);
+    chip8asm_destroy(chipasm);
+    return 0;
+}
+
+int test_asm_labels(void)
+{
+    const int n_labels = 1000;
+    struct chip8asm *chipasm = chip8asm_new(chip8asm_options_default());
+    struct chip8asm_program *prog = chip8asm_program_new();
+    char line[64];
+
+    ASSERT(chipasm != NULL && prog != NULL);
+
+    /* Each word refers to the label of the word after it */
+    for (int i = 0; i < n_labels; i++) {
+        snprintf(line, sizeof line, "label_%d: DW label_%d + 1", i, i + 1);
+        ASSERT(!chip8asm_process_line(chipasm, line));
+    }
+    snprintf(line, sizeof line, "label_%d: DW label_0", n_labels);
+    ASSERT(!chip8asm_process_line(chipasm, line));
+    ASSERT(!chip8asm_emit(chipasm, prog));
+
+    ASSERT_EQ_UINT((unsigned)prog->len, (unsigned)(2 * (n_labels + 1)));
+    for (int i = 0; i < n_labels; i++)
+        ASSERT_EQ_UINT(chip8asm_program_opcode(prog, 2 * i),
+            CHIP8_PROG_START + 2 * (i + 1) + 1);
+    ASSERT_EQ_UINT(chip8asm_program_opcode(prog, 2 * n_labels), CHIP8_PROG_START);
+
+    /* Duplicates are still caught */
+    log_set_output(NULL);
+    ASSERT(chip8asm_process_line(chipasm, "label_500: DB 0"));
+    log_set_output(stderr);
+
+    chip8asm_program_destroy(prog);
+    chip8asm_destroy(chipasm);
+    return 0;
+}
+
+int test_block(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *stepped, *batched;
+    uint8_t prog[] = {
+        0x60, 0x05, /* LD V0, 5 */
+        0xF0, 0x15, /* LD DT, V0 */
+        0x61, 0x00, /* LD V1, 0 */
+        0x71, 0x03, /* ADD V1, 3 */
+        0x82, 0x10, /* LD V2, V1 */
+        0x82, 0x2E, /* SHL V2 */
+        0x83, 0x24, /* ADD V3, V2 */
+        0xF4, 0x07, /* LD V4, DT */
+        0x34, 0x00, /* SE V4, 0 */
+        0x12, 0x06, /* JP #206 */
+        0xA3, 0x00, /* LD I, #300 */
+        0xF3, 0x55, /* LD [I], V3 */
+        0x00, 0xFD, /* EXIT */
+    };
+
+    opts.virtual_timer = true;
+    opts.instrs_per_tick = 7;
+    stepped = chip8_new(opts);
+    batched = chip8_new(opts);
+    ASSERT(stepped != NULL && batched != NULL);
+    ASSERT(chip8_load_from_bytes(stepped, prog, sizeof prog) == 0);
+    ASSERT(chip8_load_from_bytes(batched, prog, sizeof prog) == 0);
+
+    while (!stepped->halted)
+        ASSERT(chip8_step(stepped) == 0);
+    ASSERT(chip8_run_cycles(batched, 100000) == CHIP8_RUN_HALTED);
+    ASSERT_EQ_UINT((unsigned)batched->cycles, (unsigned)stepped->cycles);
+    ASSERT_EQ_UINT(batched->timer_ticks, stepped->timer_ticks);
+    ASSERT_EQ_UINT(batched->pc, stepped->pc);
+    ASSERT_EQ_UINT(batched->reg_i, stepped->reg_i);
+    for (int i = 0; i < 16; i++)
+        ASSERT_EQ_UINT(batched->regs[i], stepped->regs[i]);
+    ASSERT(memcmp(batched->mem, stepped->mem, CHIP8_MEM_SIZE) == 0);
+
+    /* Modifying the middle of a block must be noticed */
+    batched->halted = false;
+    /* Replace SHL V2 with LD V2, #AA */
+    batched->regs[REG_V0] = 0x62;
+    batched->regs[REG_V1] = 0xAA;
+    batched->reg_i = 0x20A;
+    /* LD [I], V1 */
+    batched->mem[0x300] = 0xF1;
+    batched->mem[0x301] = 0x55;
+    chip8_mem_invalidate(batched, 0x300, 2);
+    batched->pc = 0x300;
+    ASSERT(chip8_run_cycles(batched, 1) == CHIP8_RUN_CYCLES_DONE);
+    ASSERT_EQ_UINT(batched->mem[0x20A], 0x62);
+    ASSERT_EQ_UINT(batched->mem[0x20B], 0xAA);
+    batched->pc = 0x204;
+    ASSERT(chip8_run_cycles(batched, 4) == CHIP8_RUN_CYCLES_DONE);
+    ASSERT_EQ_UINT(batched->regs[REG_V2], 0xAA);
+
+    chip8_destroy(stepped);
+    chip8_destroy(batched);
+    return 0;
+}
+
 int test_comparison(void)
 {
     struct chip8_options opts = chip8_options_testing();
@@ -445,7 +774,7 @@ int test_display(void)
 /* Compares the 8-byte-long row starting at (x, y) from the display */
 #define ASSERT_EQ_ROW(x, y, row) \
     for (int i = 0; i < 8; i++) \
-        ASSERT_EQ_UINT(chip->display[(x) + i][(y)], (row)[i]);
+        ASSERT_EQ_UINT(chip8_display_pixel(chip, (x) + i, (y)), (row)[i]);
 
     struct chip8 *chip = chip8_new(chip8_options_testing());
     /* The three rows of the sprite */
@@ -481,7 +810,7 @@ int test_display(void)
     /* There should be nothing left in the area we shifted from. */
     for (int x = 1; x < 5; x++)
         for (int y = 2; y <= 4; y++)
-            ASSERT_EQ_UINT(chip->display[x][y], 0);
+            ASSERT_EQ_UINT(chip8_display_pixel(chip, x, y), 0);
     ASSERT_EQ_ROW(5, 2, row1);
     ASSERT_EQ_ROW(5, 3, row2);
     ASSERT_EQ_ROW(5, 4, row3);
@@ -507,7 +836,7 @@ int test_display(void)
     chip8_execute_opcode(chip, 0x00E0);
     for (int i = 0; i < CHIP8_DISPLAY_WIDTH; i++)
         for (int j = 0; j < CHIP8_DISPLAY_HEIGHT; j++)
-            ASSERT_EQ_UINT(chip->display[i][j], 0);
+            ASSERT_EQ_UINT(chip8_display_pixel(chip, i, j), 0);
     /* DRW V0, V1, 0 */
     chip8_execute_opcode(chip, 0xD010);
     /* Now we should have a 16x16 sprite */
@@ -520,12 +849,279 @@ int test_display(void)
     ASSERT_EQ_ROW(1, 2, row_zero);
     ASSERT_EQ_ROW(9, 2, row_zero);
     ASSERT_EQ_ROW(1, 3, row_zero);
+    ASSERT_EQ_UINT(chip->regs[REG_VF], 1);
+
+    /* Sprites crossing the middle of the display */
+    /* LD V0, 60 */
+    chip8_execute_opcode(chip, 0x603C);
+    /* DRW V0, V1, 3 */
+    chip8_execute_opcode(chip, 0xD013);
+    ASSERT_EQ_UINT(chip->regs[REG_VF], 0);
+    ASSERT_EQ_ROW(60, 2, row1);
+    ASSERT_EQ_ROW(60, 3, row2);
+    ASSERT_EQ_ROW(60, 4, row3);
+    /* SCL */
+    chip8_execute_opcode(chip, 0x00FC);
+    ASSERT_EQ_ROW(56, 2, row1);
+    ASSERT_EQ_ROW(64, 2, row_zero);
+    /* SCR */
+    chip8_execute_opcode(chip, 0x00FB);
+    ASSERT_EQ_ROW(60, 2, row1);
+    /* LD V0, 62 */
+    chip8_execute_opcode(chip, 0x603E);
+    /* DRW V0, V1, 1 */
+    chip8_execute_opcode(chip, 0xD011);
+    ASSERT_EQ_UINT(chip->regs[REG_VF], 1);
+    ASSERT_EQ_UINT(chip8_display_pixel(chip, 62, 2), 0);
+    ASSERT_EQ_UINT(chip8_display_pixel(chip, 63, 2), 0);
+    ASSERT_EQ_UINT(chip8_display_pixel(chip, 64, 2), 1);
+    ASSERT_EQ_UINT(chip8_display_pixel(chip, 65, 2), 1);
+    ASSERT_EQ_UINT(chip8_display_pixel(chip, 67, 2), 0);
+    ASSERT_EQ_UINT(chip8_display_pixel(chip, 69, 2), 1);
+    /* Sprites are clipped at the right edge of the display */
+    /* CLS */
+    chip8_execute_opcode(chip, 0x00E0);
+    /* LD V0, 124 */
+    chip8_execute_opcode(chip, 0x607C);
+    /* DRW V0, V1, 1 */
+    chip8_execute_opcode(chip, 0xD011);
+    for (int x = 124; x < CHIP8_DISPLAY_WIDTH; x++)
+        ASSERT_EQ_UINT(chip8_display_pixel(chip, x, 2), row1[x - 124]);
+    for (int x = 0; x < 4; x++)
+        ASSERT_EQ_UINT(chip8_display_pixel(chip, x, 3), 0);
 
     chip8_destroy(chip);
     return 0;
 #undef ASSERT_EQ_ROW
 }
 
+int test_display_flush(void)
+{
+    struct chip8 *chip = chip8_new(chip8_options_testing());
+
+    ASSERT(chip != NULL);
+    chip->draw_callback = testing_draw;
+
+    /* Everything needs to be drawn at first */
+    chip8_display_flush(chip);
+    ASSERT(testing_dirty_rows == CHIP8_DISPLAY_ALL_ROWS);
+    testing_dirty_rows = 0;
+    chip8_display_flush(chip);
+    ASSERT(testing_dirty_rows == 0);
+
+    /* LD V0, 3 */
+    chip8_execute_opcode(chip, 0x6003);
+    /* LD V1, 2 */
+    chip8_execute_opcode(chip, 0x6102);
+    /* LD I, #0 (the 0 sprite is 5 rows) */
+    chip8_execute_opcode(chip, 0xA000);
+    /* DRW V0, V1, 5 */
+    chip8_execute_opcode(chip, 0xD015);
+    /* Nothing is drawn until the display is flushed */
+    ASSERT(testing_dirty_rows == 0);
+    chip8_display_flush(chip);
+    ASSERT(testing_dirty_rows == 0x7C);
+    /* SCR */
+    chip8_execute_opcode(chip, 0x00FB);
+    chip8_display_flush(chip);
+    ASSERT(testing_dirty_rows == CHIP8_DISPLAY_ALL_ROWS);
+
+    chip8_destroy(chip);
+    return 0;
+}
+
+int test_dispatch(void)
+{
+    /* These use every operation, in both resolutions */
+    static const char *const games[] = {"chip8/BLINKY", "chip8/BRIX",
+        "chip8/PONG", "chip8/MAZE", "chip8/TETRIS", "superchip/ALIEN",
+        "superchip/ANT", "superchip/CAR", "superchip/JOUST"};
+    /* The lowest bytes of the valid 0, E and F opcodes (apart from SCD) */
+    static const uint8_t sys[] = {0xE0, 0xEE, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF};
+    static const uint8_t key[] = {0x9E, 0xA1};
+    static const uint8_t misc[] = {0x07, 0x0A, 0x15, 0x18, 0x1E, 0x29, 0x30,
+        0x33, 0x55, 0x65, 0x75, 0x85};
+    struct chip8_options opts = chip8_options_testing();
+    const char *gamesdir = getenv("GAMESDIR");
+    uint32_t state = 1;
+
+    opts.virtual_timer = true;
+    opts.instrs_per_tick = 50;
+    opts.delay_draws = true;
+
+    /*
+     * Random opcodes mostly fail quickly, so the valid ones are favored,
+     * jumps and calls stay within the program, and the program loops.
+     */
+    for (int n = 0; n < 200; n++) {
+        uint8_t prog[256];
+        int res;
+
+        for (size_t i = 0; i < sizeof prog - 2; i += 2) {
+            uint16_t opcode = testing_rand(&state);
+            bool valid = testing_rand(&state) % 4 != 0;
+
+            switch (opcode >> 12) {
+            case 0x0:
+                if (valid && opcode & 0x80)
+                    opcode = (opcode & 0xFF0F) | 0x00C0;
+                else if (valid)
+                    opcode = (opcode & 0xFF00) | sys[opcode % sizeof sys];
+                break;
+            case 0x1:
+            case 0x2:
+            case 0xB:
+                opcode = (opcode & 0xF000) | CHIP8_PROG_START |
+                    (opcode & 0xFE);
+                break;
+            case 0xE:
+                if (valid)
+                    opcode = (opcode & 0xFF00) | key[opcode % sizeof key];
+                break;
+            case 0xF:
+                if (valid)
+                    opcode = (opcode & 0xFF00) | misc[opcode % sizeof misc];
+                break;
+            }
+            prog[i] = opcode >> 8;
+            prog[i + 1] = opcode & 0xFF;
+        }
+        /* JP #200 */
+        prog[sizeof prog - 2] = 0x12;
+        prog[sizeof prog - 1] = 0x00;
+        opts.shift_quirks = n % 2 != 0;
+        opts.load_quirks = n % 4 >= 2;
+        opts.seed = n;
+        /* Invalid instructions and errors are expected, so they're quiet */
+        log_set_output(NULL);
+        res = testing_dispatch_run(prog, sizeof prog, opts, 20, n);
+        log_set_output(stdout);
+        if (res != 0) {
+            log_info("Random program %d differs", n);
+            ASSERT(testing_dispatch_run(prog, sizeof prog, opts, 20, n) == 0);
+        }
+    }
+
+    if (!gamesdir) {
+        log_info("GAMESDIR is not set, so only random programs were tested");
+        return 0;
+    }
+    opts.instrs_per_tick = 100;
+    for (size_t i = 0; i < sizeof games / sizeof games[0]; i++) {
+        char fname[1024];
+        struct chip8_rom *rom;
+        int res;
+
+        snprintf(fname, sizeof fname, "%s/%s", gamesdir, games[i]);
+        ASSERT((rom = chip8_rom_open(fname)) != NULL);
+        opts.shift_quirks = opts.load_quirks = i >= 5;
+        opts.seed = i;
+        res = testing_dispatch_run(rom->data, rom->len, opts, 600, i);
+        chip8_rom_close(rom);
+        ASSERT(res == 0);
+    }
+
+    return 0;
+}
+
+int test_idle(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *stepped, *skipped;
+    uint8_t prog[] = {
+        0x60, 0x03, /* 200: LD V0, 3 */
+        0xF0, 0x15, /* 202: LD DT, V0 */
+        0x22, 0x18, /* 204: CALL #218 */
+        0x31, 0x00, /* 206: SE V1, 0 */
+        0x12, 0x04, /* 208: JP #204 */
+        0x72, 0x01, /* 20A: ADD V2, 1 */
+        0xE3, 0x9E, /* 20C: SKP V3 */
+        0x12, 0x0C, /* 20E: JP #20C */
+        0x32, 0x04, /* 210: SE V2, 4 */
+        0x12, 0x00, /* 212: JP #200 */
+        0x12, 0x14, /* 214: JP #214 */
+        0x00, 0x00,
+        0xF1, 0x07, /* 218: LD V1, DT */
+        0x00, 0xEE, /* 21A: RET */
+    };
+
+    opts.virtual_timer = true;
+    opts.instrs_per_tick = 50;
+    stepped = chip8_new(opts);
+    skipped = chip8_new(opts);
+    ASSERT(stepped != NULL && skipped != NULL);
+    ASSERT(chip8_load_from_bytes(stepped, prog, sizeof prog) == 0);
+    ASSERT(chip8_load_from_bytes(skipped, prog, sizeof prog) == 0);
+
+    for (int frame = 0; frame < 40; frame++) {
+        unsigned long ticks = stepped->timer_ticks;
+
+        /* V3 is never pressed until it is set to 3 below */
+        stepped->key_states = skipped->key_states = frame >= 30 ? 1 << 3 : 0;
+        if (frame == 20)
+            stepped->regs[REG_V3] = skipped->regs[REG_V3] = 3;
+        while (stepped->timer_ticks == ticks)
+            ASSERT(chip8_step(stepped) == 0);
+        ASSERT(chip8_run_until_frame(skipped) == CHIP8_RUN_FRAME_DONE);
+        ASSERT_EQ_UINT((unsigned)skipped->cycles, (unsigned)stepped->cycles);
+        ASSERT_EQ_UINT(skipped->pc, stepped->pc);
+        ASSERT_EQ_UINT(skipped->reg_dt, stepped->reg_dt);
+        ASSERT_EQ_UINT(skipped->stack_size, stepped->stack_size);
+        for (int i = 0; i < 16; i++)
+            ASSERT_EQ_UINT(skipped->regs[i], stepped->regs[i]);
+    }
+    /* The game must have reached the final loop */
+    ASSERT_EQ_UINT(skipped->regs[REG_V2], 4);
+    ASSERT_EQ_UINT(skipped->pc, 0x214);
+
+    chip8_destroy(stepped);
+    chip8_destroy(skipped);
+    return 0;
+}
+
+int test_instruction(void)
+{
+    struct chip8_instruction instr;
+
+    /* SHR V1, V2 */
+    instr = chip8_instruction_from_opcode(0x8126, true);
+    ASSERT(instr.op == OP_SHR_QUIRK);
+    ASSERT_EQ_UINT(instr.vx, REG_V1);
+    ASSERT_EQ_UINT(instr.vy, REG_V2);
+    /* SHR V1 (the Vy bits are ignored without shift quirks) */
+    instr = chip8_instruction_from_opcode(0x8126, false);
+    ASSERT(instr.op == OP_SHR);
+    ASSERT_EQ_UINT(instr.vx, REG_V1);
+    ASSERT_EQ_UINT(chip8_instruction_to_opcode(instr), 0x8106);
+    /* DRW V3, V4, 5 */
+    instr = chip8_instruction_from_opcode(0xD345, false);
+    ASSERT(instr.op == OP_DRW);
+    ASSERT_EQ_UINT(instr.nibble, 5);
+    ASSERT(!chip8_instruction_uses_addr(instr));
+    /* JP V0, #234 */
+    instr = chip8_instruction_from_opcode(0xB234, false);
+    ASSERT(instr.op == OP_JP_V0);
+    ASSERT_EQ_UINT(instr.addr, 0x234);
+    ASSERT(chip8_instruction_uses_addr(instr));
+    /* The opcode of an invalid instruction is kept as is */
+    instr = chip8_instruction_from_opcode(0x5121, false);
+    ASSERT(instr.op == OP_INVALID);
+    ASSERT_EQ_UINT(chip8_instruction_to_opcode(instr), 0x5121);
+
+    /* Every encoded instruction decodes to itself */
+    for (int quirks = 0; quirks < 2; quirks++)
+        for (uint32_t opcode = 0; opcode <= 0xFFFF; opcode++) {
+            uint16_t encoded = chip8_instruction_to_opcode(
+                chip8_instruction_from_opcode(opcode, quirks));
+
+            ASSERT_EQ_UINT(chip8_instruction_to_opcode(
+                               chip8_instruction_from_opcode(encoded, quirks)),
+                encoded);
+        }
+
+    return 0;
+}
+
 int test_jp(void)
 {
     struct chip8 *chip = chip8_new(chip8_options_testing());
@@ -547,12 +1143,120 @@ int test_jp(void)
     /* RET */
     chip8_execute_opcode(chip, 0x00EE);
     ASSERT_EQ_UINT(chip->pc, 0x402);
+    /* RET with nothing to return to */
+    ASSERT(chip8_execute_opcode(chip, 0x00EE) != 0);
+
+    /* Fill up the call stack */
+    for (int i = 0; i < CHIP8_STACK_DEPTH; i++) {
+        /* CALL #600 */
+        ASSERT(chip8_execute_opcode(chip, 0x2600) == 0);
+        ASSERT_EQ_UINT(chip->pc, 0x600);
+    }
+    /* CALL #600 */
+    ASSERT(chip8_execute_opcode(chip, 0x2600) != 0);
+    ASSERT_EQ_UINT(chip->pc, 0x600);
+    /* RET */
+    chip8_execute_opcode(chip, 0x00EE);
+    ASSERT_EQ_UINT(chip->pc, 0x602);
 
     chip8_destroy(chip);
 
     return 0;
 }
 
+int test_lanes(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *scalar[6], *lockstep[6];
+    enum chip8_run_status scalar_status[6], status[CHIP8_LANES];
+    struct chip8_lanes *lanes;
+    uint8_t prog[] = {
+        0xC1, 0x0F, /* 200: RND V1, #0F */
+        0x82, 0x10, /* 202: LD V2, V1 */
+        0x72, 0xF5, /* 204: ADD V2, #F5 */
+        0x83, 0x24, /* 206: ADD V3, V2 */
+        0x83, 0x15, /* 208: SUB V3, V1 */
+        0x84, 0x3E, /* 20A: SHL V4 */
+        0x74, 0x03, /* 20C: ADD V4, 3 */
+        0xE1, 0x9E, /* 20E: SKP V1 */
+        0x12, 0x14, /* 210: JP #214 */
+        0x13, 0x00, /* 212: JP #300 */
+        0x31, 0x05, /* 214: SE V1, 5 */
+        0xF1, 0x15, /* 216: LD DT, V1 */
+        0xF5, 0x07, /* 218: LD V5, DT */
+        0xA4, 0x00, /* 21A: LD I, #400 */
+        0xF1, 0x1E, /* 21C: ADD I, V1 */
+        0xF5, 0x33, /* 21E: LD B, V5 */
+        0x60, 0x71, /* 220: LD V0, #71 */
+        0x67, 0x01, /* 222: LD V7, 1 */
+        0x86, 0x10, /* 224: LD V6, V1 */
+        0x86, 0x72, /* 226: AND V6, V7 */
+        0x80, 0x64, /* 228: ADD V0, V6 */
+        0xA2, 0x30, /* 22A: LD I, #230 */
+        0xF0, 0x55, /* 22C: LD [I], V0 */
+        0x6A, 0x00, /* 22E: LD VA, 0 */
+        0x71, 0x01, /* 230: ADD V1, 1 (or ADD V2, 1, after the write above) */
+        0xD1, 0x25, /* 232: DRW V1, V2, 5 */
+        0x12, 0x00, /* 234: JP #200 */
+    };
+    uint8_t prog_key[] = {
+        0xF8, 0x0A, /* 300: LD V8, K */
+        0x12, 0x14, /* 302: JP #214 */
+    };
+
+    opts.virtual_timer = true;
+    opts.delay_draws = true;
+    opts.instrs_per_tick = 20;
+    for (int l = 0; l < 6; l++) {
+        scalar[l] = chip8_new(opts);
+        lockstep[l] = chip8_new(opts);
+        ASSERT(scalar[l] != NULL && lockstep[l] != NULL);
+        ASSERT(chip8_load_from_bytes(scalar[l], prog, sizeof prog) == 0);
+        ASSERT(chip8_load_from_bytes(lockstep[l], prog, sizeof prog) == 0);
+        memcpy(scalar[l]->mem + 0x300, prog_key, sizeof prog_key);
+        memcpy(lockstep[l]->mem + 0x300, prog_key, sizeof prog_key);
+        chip8_mem_invalidate(scalar[l], 0x300, sizeof prog_key);
+        chip8_mem_invalidate(lockstep[l], 0x300, sizeof prog_key);
+        scalar[l]->rand_state = lockstep[l]->rand_state = l + 1;
+    }
+    lanes = chip8_lanes_new(lockstep, 6);
+    ASSERT(lanes != NULL);
+
+    for (int frame = 0; frame < 200; frame++) {
+        for (int l = 0; l < 6; l++) {
+            /* Press a different key in each lane every few frames */
+            uint16_t keys = frame % (l + 2) == 0 ? 1 << ((frame + l) % 16) : 0;
+
+            scalar[l]->key_states = lockstep[l]->key_states = keys;
+            scalar_status[l] = chip8_run_until_frame(scalar[l]);
+        }
+        chip8_lanes_run_frame(lanes, status);
+
+        for (int l = 0; l < 6; l++) {
+            ASSERT_EQ_UINT(status[l], scalar_status[l]);
+            ASSERT_EQ_UINT(lockstep[l]->pc, scalar[l]->pc);
+            ASSERT_EQ_UINT(lockstep[l]->reg_i, scalar[l]->reg_i);
+            ASSERT_EQ_UINT(lockstep[l]->reg_dt, scalar[l]->reg_dt);
+            ASSERT_EQ_UINT(lockstep[l]->reg_st, scalar[l]->reg_st);
+            for (int i = 0; i < 16; i++)
+                ASSERT_EQ_UINT(lockstep[l]->regs[i], scalar[l]->regs[i]);
+            ASSERT_EQ_UINT((unsigned)lockstep[l]->cycles, (unsigned)scalar[l]->cycles);
+            ASSERT_EQ_UINT(lockstep[l]->timer_ticks, scalar[l]->timer_ticks);
+            ASSERT(memcmp(lockstep[l]->mem, scalar[l]->mem, CHIP8_MEM_SIZE) == 0);
+            ASSERT(chip8_display_hash(lockstep[l]) == chip8_display_hash(scalar[l]));
+        }
+    }
+    /* The lanes should have diverged (and come back together) many times */
+    ASSERT(lockstep[0]->cycles != lockstep[1]->cycles);
+
+    chip8_lanes_destroy(lanes);
+    for (int l = 0; l < 6; l++) {
+        chip8_destroy(scalar[l]);
+        chip8_destroy(lockstep[l]);
+    }
+    return 0;
+}
+
 int test_ld(void)
 {
     struct chip8_options opts = chip8_options_testing();
@@ -624,6 +1328,72 @@ int test_ld(void)
     return 0;
 }
 
+int test_profile(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip = chip8_new(opts);
+    struct chip8_profile *profile = chip8_profile_new();
+    uint8_t prog[] = {
+        0x60, 0x00, /* 200: LD V0, 0 */
+        0x70, 0x01, /* 202: ADD V0, 1 */
+        0x30, 0x0A, /* 204: SE V0, 10 */
+        0x12, 0x02, /* 206: JP #202 */
+        0xD0, 0x01, /* 208: DRW V0, V0, 1 */
+        0x00, 0xFD, /* 20A: EXIT */
+    };
+    uint8_t wait[] = {
+        0xF1, 0x0A, /* 200: LD V1, K */
+    };
+    char line[64];
+    FILE *file;
+
+    ASSERT(chip != NULL && profile != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    chip->profile = profile;
+    ASSERT(chip8_run_cycles(chip, 1000) == CHIP8_RUN_HALTED);
+    ASSERT_EQ_UINT(profile->pc_counts[0x200], 1);
+    ASSERT_EQ_UINT(profile->pc_counts[0x202], 10);
+    ASSERT_EQ_UINT(profile->pc_counts[0x204], 10);
+    ASSERT_EQ_UINT(profile->pc_counts[0x206], 9);
+    ASSERT_EQ_UINT(profile->pc_counts[0x208], 1);
+    ASSERT_EQ_UINT(profile->pc_counts[0x20A], 1);
+    ASSERT_EQ_UINT(profile->op_counts[OP_ADD_BYTE - OP_INVALID], 10);
+    ASSERT_EQ_UINT(profile->op_counts[OP_JP - OP_INVALID], 9);
+    ASSERT_EQ_UINT(profile->op_counts[OP_DRW - OP_INVALID], 1);
+    ASSERT_EQ_UINT(profile->op_counts[OP_CLS - OP_INVALID], 0);
+
+    /* The report can be written without a disassembly */
+    ASSERT((file = tmpfile()) != NULL);
+    ASSERT(chip8_profile_report(profile, chip, NULL, file) == 0);
+    rewind(file);
+    ASSERT(fgets(line, sizeof line, file) != NULL);
+    ASSERT(strcmp(line, "# 32 instructions executed\n") == 0);
+    fclose(file);
+    chip8_destroy(chip);
+
+    /* Waiting for a key takes as long as without a profile, but is counted */
+    opts.virtual_timer = true;
+    opts.instrs_per_tick = 8;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, wait, sizeof wait) == 0);
+    memset(profile, 0, sizeof *profile);
+    chip->profile = profile;
+    ASSERT(chip8_run_cycles(chip, 100) == CHIP8_RUN_WAITING_KEY);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 8);
+    ASSERT_EQ_UINT(chip->timer_ticks, 1);
+    ASSERT_EQ_UINT(profile->pc_counts[0x200], 8);
+    ASSERT(chip8_run_cycles(chip, 3) == CHIP8_RUN_WAITING_KEY);
+    ASSERT(chip8_run_until_frame(chip) == CHIP8_RUN_WAITING_KEY);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 16);
+    ASSERT_EQ_UINT(chip->timer_ticks, 2);
+    ASSERT_EQ_UINT(profile->pc_counts[0x200], 16);
+
+    chip8_profile_destroy(profile);
+    chip8_destroy(chip);
+    return 0;
+}
+
 int test_quirks(void)
 {
     struct chip8 *chip;
@@ -661,6 +1431,520 @@ int test_quirks(void)
     return 0;
 }
 
+int test_replay(void)
+{
+    uint8_t saved[CHIP8_SNAPSHOT_SIZE], replayed[CHIP8_SNAPSHOT_SIZE];
+    uint64_t frame_hashes[300], state_hash;
+    int frames = 0;
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip;
+    struct chip8_recorder *rec;
+    struct chip8_replay *replay;
+    FILE *file;
+    uint8_t prog[] = {
+        0xC1, 0x3F, /* 200: RND V1, #3F */
+        0xF2, 0x0A, /* 202: LD V2, K */
+        0xF2, 0x29, /* 204: LD F, V2 */
+        0xD1, 0x25, /* 206: DRW V1, V2, 5 */
+        0xE3, 0xA1, /* 208: SKNP V3 */
+        0x00, 0xFD, /* 20A: EXIT */
+        0x73, 0x01, /* 20C: ADD V3, 1 */
+        0x12, 0x00, /* 20E: JP #200 */
+    };
+    struct chip8_rom rom = {prog, sizeof prog, false};
+    struct chip8_rom other_rom = {prog, sizeof prog - 2, false};
+
+    opts.virtual_timer = true;
+    opts.instrs_per_tick = 7;
+    opts.seed = 1234;
+    ASSERT((file = tmpfile()) != NULL);
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    chip8_load_from_rom(chip, &rom);
+    ASSERT((rec = chip8_recorder_new(file, opts, &rom)) != NULL);
+    for (int frame = 0; frame < 300 && !chip->halted; frame++) {
+        /* Press some key every few frames, and key 1 at the end */
+        chip->key_states = frame % 5 < 2 ? 1 << (frame / 5 % 16) : 0;
+        if (frame == 299)
+            chip->key_states = 1 << 1;
+        ASSERT(chip8_recorder_run_frame(rec, chip) != CHIP8_RUN_ERROR);
+        frame_hashes[frames++] = chip8_display_hash(chip);
+    }
+    ASSERT(chip8_recorder_finish(rec, chip) == 0);
+    ASSERT(chip8_snapshot_save(chip, saved, sizeof saved) == 0);
+    state_hash = chip8_state_hash(chip);
+    chip8_destroy(chip);
+
+    rewind(file);
+    ASSERT((replay = chip8_replay_open(file)) != NULL);
+    fclose(file);
+    ASSERT(chip8_replay_matches(replay, &rom));
+    ASSERT(!chip8_replay_matches(replay, &other_rom));
+    /* The options are taken from the recording */
+    chip = chip8_new(chip8_replay_options(replay, chip8_options_testing()));
+    ASSERT(chip != NULL);
+    ASSERT_EQ_UINT(chip->opts.instrs_per_tick, 7);
+    chip8_load_from_rom(chip, &rom);
+    ASSERT(chip8_replay_run(replay, chip) != CHIP8_RUN_ERROR);
+    ASSERT(chip8_snapshot_save(chip, replayed, sizeof replayed) == 0);
+    ASSERT(memcmp(saved, replayed, sizeof saved) == 0);
+    ASSERT(chip8_state_hash(chip) == state_hash);
+    chip8_destroy(chip);
+
+    /* Replaying a frame at a time must give the same display at each frame */
+    chip = chip8_new(chip8_replay_options(replay, chip8_options_testing()));
+    ASSERT(chip != NULL);
+    chip8_load_from_rom(chip, &rom);
+    for (int frame = 0; frame < frames; frame++) {
+        ASSERT(!chip8_replay_finished(replay, chip));
+        ASSERT(chip8_replay_run_frame(replay, chip) != CHIP8_RUN_ERROR);
+        ASSERT(chip8_display_hash(chip) == frame_hashes[frame]);
+    }
+    ASSERT(chip8_replay_finished(replay, chip));
+    ASSERT(chip8_state_hash(chip) == state_hash);
+    chip8_replay_close(replay);
+    chip8_destroy(chip);
+
+    /* Opts without the virtual timer can't be replayed */
+    opts.virtual_timer = false;
+    ASSERT((file = tmpfile()) != NULL);
+    ASSERT(chip8_recorder_new(file, opts, &rom) == NULL);
+    ASSERT(chip8_replay_open(file) == NULL);
+    fclose(file);
+    return 0;
+}
+
+int test_reset(void)
+{
+    static struct chip8 reused;
+    const uint8_t prog[] = {
+        /* RND V0, #FF */
+        0xC0, 0xFF,
+        /* LD I, #300 */
+        0xA3, 0x00,
+        /* LD [I], V0 */
+        0xF0, 0x55,
+        /* DRW V0, V0, 1 */
+        0xD0, 0x01,
+        /* JP #200 */
+        0x12, 0x00,
+    };
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *templ, *fresh;
+
+    templ = chip8_new(opts);
+    ASSERT(templ != NULL);
+    ASSERT(chip8_load_from_bytes(templ, prog, sizeof prog) == 0);
+    opts.seed = 7;
+    fresh = chip8_new(opts);
+    ASSERT(fresh != NULL);
+    ASSERT(chip8_load_from_bytes(fresh, prog, sizeof prog) == 0);
+
+    /* The reused interpreter starts out dirty, as after an earlier run */
+    chip8_init_in_place(&reused, opts);
+    ASSERT(chip8_load_from_bytes(&reused, prog, sizeof prog) == 0);
+    ASSERT(chip8_run_cycles(&reused, 100) != CHIP8_RUN_ERROR);
+    chip8_reset(&reused, templ);
+    chip8_seed(&reused, 7);
+
+    ASSERT(chip8_run_cycles(fresh, 50) != CHIP8_RUN_ERROR);
+    ASSERT(chip8_run_cycles(&reused, 50) != CHIP8_RUN_ERROR);
+    ASSERT_EQ_UINT(reused.cycles, fresh->cycles);
+    ASSERT_EQ_UINT(reused.pc, fresh->pc);
+    ASSERT(memcmp(reused.regs, fresh->regs, sizeof fresh->regs) == 0);
+    ASSERT(memcmp(reused.mem, fresh->mem, sizeof fresh->mem) == 0);
+    ASSERT(chip8_display_hash(&reused) == chip8_display_hash(fresh));
+    /* The template itself is untouched */
+    ASSERT_EQ_UINT(templ->cycles, 0);
+    ASSERT_EQ_UINT(templ->mem[0x300], 0);
+
+    chip8_destroy(templ);
+    chip8_destroy(fresh);
+    return 0;
+}
+
+int test_rnd(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip, *same, *other;
+    unsigned seen[256] = {0};
+    bool differ = false;
+
+    opts.seed = 42;
+    chip = chip8_new(opts);
+    same = chip8_new(opts);
+    opts.seed = 43;
+    other = chip8_new(opts);
+    ASSERT(chip != NULL && same != NULL && other != NULL);
+
+    for (int i = 0; i < 4096; i++) {
+        chip->pc = same->pc = other->pc = 0x200;
+        /* RND V0, #FF */
+        chip8_execute_opcode(chip, 0xC0FF);
+        chip8_execute_opcode(same, 0xC0FF);
+        chip8_execute_opcode(other, 0xC0FF);
+        ASSERT_EQ_UINT(chip->regs[REG_V0], same->regs[REG_V0]);
+        if (chip->regs[REG_V0] != other->regs[REG_V0])
+            differ = true;
+        seen[chip->regs[REG_V0]]++;
+    }
+    ASSERT(differ);
+    /* Every value should come up (about 16 times each) */
+    for (int i = 0; i < 256; i++)
+        ASSERT(seen[i] > 0);
+
+    chip8_destroy(chip);
+    chip8_destroy(same);
+    chip8_destroy(other);
+    return 0;
+}
+
+int test_rom(void)
+{
+    static uint8_t big[CHIP8_PROG_SIZE + 1];
+    char fname[] = "/tmp/chip8test-XXXXXX";
+    struct chip8 *chip = chip8_new(chip8_options_testing());
+    struct chip8 *other = chip8_new(chip8_options_testing());
+    struct chip8_rom *rom;
+    FILE *file;
+    int fd;
+    uint8_t prog[] = {
+        0x60, 0x12, /* LD V0, #12 */
+        0x00, 0xFD, /* EXIT */
+    };
+
+    ASSERT(chip != NULL && other != NULL);
+    ASSERT((fd = mkstemp(fname)) != -1);
+    ASSERT(write(fd, prog, sizeof prog) == sizeof prog);
+    close(fd);
+
+    /* The same ROM can be loaded into several interpreters */
+    ASSERT((rom = chip8_rom_open(fname)) != NULL);
+    ASSERT_EQ_UINT(rom->len, sizeof prog);
+    chip8_load_from_rom(chip, rom);
+    chip8_load_from_rom(other, rom);
+    chip8_rom_close(rom);
+    ASSERT(memcmp(chip->mem + CHIP8_PROG_START, prog, sizeof prog) == 0);
+    ASSERT(memcmp(other->mem + CHIP8_PROG_START, prog, sizeof prog) == 0);
+    ASSERT(chip8_run_cycles(chip, 10) == CHIP8_RUN_HALTED);
+    ASSERT_EQ_UINT(chip->regs[REG_V0], 0x12);
+
+    /* Games which don't fit in memory are rejected */
+    big[CHIP8_PROG_SIZE] = 0xAB;
+    ASSERT((file = fopen(fname, "wb")) != NULL);
+    ASSERT(fwrite(big, 1, sizeof big, file) == sizeof big);
+    fclose(file);
+    ASSERT(chip8_rom_open(fname) == NULL);
+    ASSERT((file = fopen(fname, "rb")) != NULL);
+    ASSERT(chip8_load_from_file(other, file) != 0);
+    fclose(file);
+    ASSERT(memcmp(other->mem + CHIP8_PROG_START, prog, sizeof prog) == 0);
+    ASSERT(chip8_load_from_bytes(other, big, sizeof big) != 0);
+    ASSERT(chip8_load_from_bytes(other, big, sizeof big - 1) == 0);
+    ASSERT_EQ_UINT(other->mem[CHIP8_PROG_START], 0);
+
+    /* Empty games are fine */
+    ASSERT((file = fopen(fname, "wb")) != NULL);
+    fclose(file);
+    ASSERT((rom = chip8_rom_open(fname)) != NULL);
+    ASSERT_EQ_UINT(rom->len, 0);
+    chip8_load_from_rom(other, rom);
+    chip8_rom_close(rom);
+
+    remove(fname);
+    ASSERT(chip8_rom_open(fname) == NULL);
+    chip8_destroy(chip);
+    chip8_destroy(other);
+    return 0;
+}
+
+int test_selfmod(void)
+{
+    struct chip8 *chip = chip8_new(chip8_options_testing());
+    uint8_t prog[] = {
+        0x60, 0x6B, /* LD V0, #6B */
+        0x61, 0x42, /* LD V1, #42 */
+        0xA2, 0x0A, /* LD I, #20A */
+        0xF1, 0x55, /* LD [I], V1 */
+        0x00, 0xE0, /* CLS */
+        0x6A, 0xFF, /* LD VA, #FF */
+    };
+
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+
+    /* Execute the last instruction first so that it gets cached */
+    chip->pc = 0x20A;
+    chip8_step(chip);
+    ASSERT_EQ_UINT(chip->regs[REG_VA], 0xFF);
+    /* Now run the whole program, which overwrites it with LD VB, #42 */
+    chip->pc = 0x200;
+    for (int i = 0; i < 6; i++)
+        chip8_step(chip);
+    ASSERT_EQ_UINT(chip->regs[REG_VB], 0x42);
+    ASSERT_EQ_UINT(chip->pc, 0x20C);
+
+    /* LD B also writes to memory */
+    chip->regs[REG_V0] = 0x61;
+    chip->reg_i = 0x20A;
+    /* LD B, V0 */
+    chip->pc = 0x300;
+    chip8_execute_opcode(chip, 0xF033);
+    ASSERT_EQ_UINT(chip->mem[0x20A], 0);
+    ASSERT_EQ_UINT(chip->mem[0x20B], 9);
+    /* The result is 0x0009, which is not a valid instruction */
+    chip->pc = 0x20A;
+    ASSERT(chip8_current_instr(chip).op == OP_INVALID);
+
+    /* Reloading the program must restore the original instructions */
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    chip->regs[REG_VA] = 0;
+    chip->pc = 0x20A;
+    chip8_step(chip);
+    ASSERT_EQ_UINT(chip->regs[REG_VA], 0xFF);
+
+    chip8_destroy(chip);
+    return 0;
+}
+
+int test_run(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip;
+    uint8_t prog[] = {
+        0x70, 0x01, /* ADD V0, 1 */
+        0x30, 0x0A, /* SE V0, 10 */
+        0x12, 0x00, /* JP #200 */
+        0xF1, 0x0A, /* LD V1, K */
+        0x00, 0xFD, /* EXIT */
+    };
+
+    opts.virtual_timer = true;
+    opts.instrs_per_tick = 8;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+
+    ASSERT(chip8_run_cycles(chip, 5) == CHIP8_RUN_CYCLES_DONE);
+    ASSERT_EQ_UINT(chip->pc, 0x204);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 5);
+    ASSERT(chip8_run_until_frame(chip) == CHIP8_RUN_FRAME_DONE);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 8);
+    ASSERT_EQ_UINT(chip->timer_ticks, 1);
+    /* The loop runs for 29 instructions, then we wait for a key */
+    ASSERT(chip8_run_cycles(chip, 100) == CHIP8_RUN_WAITING_KEY);
+    ASSERT_EQ_UINT(chip->pc, 0x206);
+    ASSERT_EQ_UINT(chip->regs[REG_V0], 10);
+    /* The rest of the frame should have been skipped */
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 32);
+    ASSERT_EQ_UINT(chip->timer_ticks, 4);
+    ASSERT(chip8_run_cycles(chip, 3) == CHIP8_RUN_WAITING_KEY);
+    ASSERT_EQ_UINT((unsigned)chip->cycles, 35);
+    chip->key_states = 1 << 5;
+    ASSERT(chip8_run_until_frame(chip) == CHIP8_RUN_HALTED);
+    ASSERT_EQ_UINT(chip->regs[REG_V1], 5);
+    ASSERT(chip8_run_cycles(chip, 1) == CHIP8_RUN_HALTED);
+
+    chip8_destroy(chip);
+    return 0;
+}
+
+int test_snapshot(void)
+{
+    static uint8_t saved[40][CHIP8_SNAPSHOT_SIZE];
+    uint8_t buf[CHIP8_SNAPSHOT_SIZE];
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip, *copy;
+    struct chip8_rewind *rw, *small;
+    uint8_t prog[] = {
+        0xC1, 0x3F, /* 200: RND V1, #3F */
+        0xC2, 0x1F, /* 202: RND V2, #1F */
+        0xF1, 0x29, /* 204: LD F, V1 */
+        0xD1, 0x25, /* 206: DRW V1, V2, 5 */
+        0x23, 0x00, /* 208: CALL #300 */
+        0x12, 0x00, /* 20A: JP #200 */
+    };
+    uint8_t prog_sub[] = {
+        0x73, 0x01, /* 300: ADD V3, 1 */
+        0xA4, 0x00, /* 302: LD I, #400 */
+        0xF3, 0x33, /* 304: LD B, V3 */
+        0x00, 0xEE, /* 306: RET */
+    };
+
+    opts.virtual_timer = true;
+    opts.instrs_per_tick = 25;
+    chip = chip8_new(opts);
+    copy = chip8_new(opts);
+    ASSERT(chip != NULL && copy != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    memcpy(chip->mem + 0x300, prog_sub, sizeof prog_sub);
+    chip8_mem_invalidate(chip, 0x300, sizeof prog_sub);
+    chip->rand_state = 1;
+
+    /* The buffer must be large enough, and only real snapshots are loaded */
+    ASSERT(chip8_snapshot_save(chip, buf, sizeof buf - 1) != 0);
+    ASSERT(chip8_snapshot_save(chip, buf, sizeof buf) == 0);
+    ASSERT(chip8_snapshot_load(copy, buf, sizeof buf - 1) != 0);
+    buf[0] ^= 0xFF;
+    ASSERT(chip8_snapshot_load(copy, buf, sizeof buf) != 0);
+    ASSERT_EQ_UINT(copy->pc, 0x200);
+    ASSERT_EQ_UINT(copy->mem[0x300], 0);
+
+    /* Neither history is big enough to hold every frame */
+    rw = chip8_rewind_new(16, 1 << 20, 5);
+    small = chip8_rewind_new(40, 2048, 4);
+    ASSERT(rw != NULL && small != NULL);
+    for (int frame = 0; frame < 40; frame++) {
+        chip->key_states = 1 << (frame % 16);
+        ASSERT(chip8_snapshot_save(chip, saved[frame], CHIP8_SNAPSHOT_SIZE) == 0);
+        ASSERT(chip8_rewind_push(rw, chip) == 0);
+        ASSERT(chip8_rewind_push(small, chip) == 0);
+        ASSERT(chip8_run_until_frame(chip) == CHIP8_RUN_FRAME_DONE);
+    }
+    ASSERT(chip8_rewind_frames(rw) > 10 && chip8_rewind_frames(rw) <= 16);
+    ASSERT(chip8_rewind_frames(small) > 0 && chip8_rewind_frames(small) < 40);
+
+    /* Restoring a snapshot and running it must give the same results */
+    ASSERT(chip8_snapshot_load(copy, saved[10], CHIP8_SNAPSHOT_SIZE) == 0);
+    ASSERT_EQ_UINT(copy->dirty_rows, CHIP8_DISPLAY_ALL_ROWS);
+    ASSERT(chip8_run_until_frame(copy) == CHIP8_RUN_FRAME_DONE);
+    ASSERT(chip8_snapshot_save(copy, buf, sizeof buf) == 0);
+    /* The key states were saved before the frame was run */
+    copy->key_states = 1 << 11;
+    buf[CHIP8_SNAPSHOT_SIZE - 6] = copy->key_states >> 8;
+    buf[CHIP8_SNAPSHOT_SIZE - 5] = copy->key_states & 0xFF;
+    ASSERT(memcmp(buf, saved[11], CHIP8_SNAPSHOT_SIZE) == 0);
+
+    /* Rewinding goes back through the most recent frames in order */
+    for (int frame = 39, pushed = 0; chip8_rewind_frames(rw) > 0; frame--) {
+        ASSERT(chip8_rewind_pop(rw, copy) == 0);
+        ASSERT(chip8_snapshot_save(copy, buf, sizeof buf) == 0);
+        ASSERT(memcmp(buf, saved[frame], CHIP8_SNAPSHOT_SIZE) == 0);
+        /* New frames can be pushed after rewinding */
+        if (frame == 36 && !pushed) {
+            ASSERT(chip8_rewind_push(rw, copy) == 0);
+            frame++;
+            pushed = 1;
+        }
+    }
+    ASSERT(chip8_rewind_pop(rw, copy) != 0);
+    for (int frame = 39; chip8_rewind_frames(small) > 0; frame--) {
+        ASSERT(chip8_rewind_pop(small, copy) == 0);
+        ASSERT(chip8_snapshot_save(copy, buf, sizeof buf) == 0);
+        ASSERT(memcmp(buf, saved[frame], CHIP8_SNAPSHOT_SIZE) == 0);
+    }
+
+    chip8_rewind_destroy(rw);
+    chip8_rewind_destroy(small);
+    chip8_destroy(chip);
+    chip8_destroy(copy);
+    return 0;
+}
+
+int test_timer(void)
+{
+    struct chip8_options opts = chip8_options_testing();
+    struct chip8 *chip;
+
+    opts.virtual_timer = true;
+    opts.instrs_per_tick = 4;
+    opts.delay_draws = true;
+    chip = chip8_new(opts);
+    ASSERT(chip != NULL);
+
+    /* LD V0, #03 */
+    chip8_execute_opcode(chip, 0x6003);
+    /* LD DT, V0 */
+    chip8_execute_opcode(chip, 0xF015);
+    /* LD ST, V0 */
+    chip8_execute_opcode(chip, 0xF018);
+    ASSERT_EQ_UINT(chip->reg_dt, 3);
+    /* LD V1, DT */
+    chip8_execute_opcode(chip, 0xF107);
+    ASSERT_EQ_UINT(chip->regs[REG_V1], 3);
+    /* The fourth instruction ends the first tick */
+    ASSERT_EQ_UINT(chip->reg_dt, 2);
+    ASSERT_EQ_UINT(chip->reg_st, 2);
+    ASSERT_EQ_UINT(chip->timer_ticks, 1);
+
+    /* A delayed draw skips straight to the next tick */
+    /* LD V1, #00 */
+    chip8_execute_opcode(chip, 0x6100);
+    /* DRW V1, V1, 1 */
+    chip8_execute_opcode(chip, 0xD111);
+    ASSERT_EQ_UINT(chip->reg_dt, 1);
+    ASSERT_EQ_UINT(chip->timer_ticks, 2);
+    /* CLS */
+    for (int i = 0; i < 2; i++)
+        chip8_execute_opcode(chip, 0x00E0);
+    ASSERT_EQ_UINT(chip->reg_dt, 1);
+    chip8_execute_opcode(chip, 0x00E0);
+    ASSERT_EQ_UINT(chip->reg_dt, 0);
+    ASSERT_EQ_UINT(chip->reg_st, 0);
+    chip8_execute_opcode(chip, 0x00E0);
+    ASSERT_EQ_UINT(chip->reg_dt, 0);
+
+    chip8_destroy(chip);
+    return 0;
+}
+
+int test_trace(void)
+{
+    struct chip8 *chip = chip8_new(chip8_options_testing());
+    struct chip8_trace *trace = chip8_trace_new(5);
+    const struct chip8_trace_record *rec;
+    uint8_t prog[] = {
+        0x60, 0x00, /* 200: LD V0, 0 */
+        0x70, 0x01, /* 202: ADD V0, 1 */
+        0x30, 0x0A, /* 204: SE V0, 10 */
+        0x12, 0x02, /* 206: JP #202 */
+        0xD0, 0x01, /* 208: DRW V0, V0, 1 */
+        0x00, 0xFD, /* 20A: EXIT */
+    };
+    char line[80];
+    FILE *file, *text;
+
+    ASSERT(chip != NULL && trace != NULL);
+    ASSERT(chip8_load_from_bytes(chip, prog, sizeof prog) == 0);
+    chip->trace = trace;
+    ASSERT(chip8_run_cycles(chip, 1000) == CHIP8_RUN_HALTED);
+    /* Only the last 8 of the 32 instructions are kept */
+    ASSERT_EQ_UINT(chip8_trace_len(trace), 8);
+    ASSERT(trace->count == 32);
+    rec = &trace->records[28 & trace->mask];
+    ASSERT_EQ_UINT(rec->pc, 0x202);
+    ASSERT_EQ_UINT(rec->opcode, 0x7001);
+    ASSERT_EQ_UINT(rec->changed, 1 << REG_V0);
+    rec = &trace->records[31 & trace->mask];
+    ASSERT_EQ_UINT(rec->pc, 0x20A);
+    ASSERT_EQ_UINT(rec->changed, 0);
+
+    /* The saved trace starts with the oldest instruction kept */
+    ASSERT((file = tmpfile()) != NULL && (text = tmpfile()) != NULL);
+    ASSERT(chip8_trace_write(trace, false, file) == 0);
+    rewind(file);
+    ASSERT(chip8_trace_format(file, text) == 0);
+    rewind(text);
+    for (int i = 0; i < 2; i++)
+        ASSERT(fgets(line, sizeof line, text) != NULL);
+    ASSERT(strncmp(line, "24 206 1202 000 ", 16) == 0);
+    for (int i = 0; i < 4; i++)
+        ASSERT(fgets(line, sizeof line, text) != NULL);
+    ASSERT(strncmp(line, "28 202 7001 000 ", 16) == 0);
+    ASSERT(strstr(line, " V0\n") != NULL);
+    fclose(text);
+    /* Anything else is rejected */
+    rewind(file);
+    fputc('X', file);
+    rewind(file);
+    ASSERT(chip8_trace_format(file, stdout) != 0);
+    fclose(file);
+
+    chip8_trace_destroy(trace);
+    chip8_destroy(chip);
+    return 0;
+}
+
 static void testing_run(const char *name, int (*test)(void))
 {
     int res;
@@ -695,3 +1979,72 @@ static struct chip8_options chip8_options_testing(void)
     opts.delay_draws = false;
     return opts;
 }
+
+static void testing_draw(const struct chip8 *chip, uint64_t dirty_rows)
+{
+    (void)chip;
+    testing_dirty_rows = dirty_rows;
+}
+
+static int testing_dispatch_run(const uint8_t *prog, size_t len,
+    struct chip8_options opts, int frames, uint32_t seed)
+{
+    struct chip8 *chips[2];
+    enum chip8_run_status status[2];
+    uint16_t keys = 0;
+    int res = 0;
+
+    opts.dispatch = CHIP8_DISPATCH_SWITCH;
+    chips[0] = chip8_new(opts);
+    opts.dispatch = CHIP8_DISPATCH_TABLE;
+    chips[1] = chip8_new(opts);
+    seed = seed * 2 + 1;
+    for (int i = 0; i < 2; i++)
+        if (chip8_load_from_bytes(chips[i], prog, len) != 0)
+            res = 1;
+
+    for (int frame = 0; res == 0 && frame < frames; frame++) {
+        if (frame % 8 == 0)
+            keys = testing_rand(&seed) % 3 == 0 ? 0 : testing_rand(&seed);
+        for (int i = 0; i < 2; i++) {
+            chips[i]->key_states = keys;
+            status[i] = chip8_run_until_frame(chips[i]);
+        }
+        if (status[0] != status[1] || testing_same_state(chips[0], chips[1]))
+            res = 1;
+        else if (status[0] == CHIP8_RUN_ERROR || status[0] == CHIP8_RUN_HALTED)
+            break;
+    }
+
+    chip8_destroy(chips[0]);
+    chip8_destroy(chips[1]);
+    return res;
+}
+
+static int testing_same_state(const struct chip8 *a, const struct chip8 *b)
+{
+    ASSERT_EQ_UINT(a->pc, b->pc);
+    ASSERT_EQ_UINT(a->reg_i, b->reg_i);
+    ASSERT_EQ_UINT(a->reg_dt, b->reg_dt);
+    ASSERT_EQ_UINT(a->reg_st, b->reg_st);
+    ASSERT(memcmp(a->regs, b->regs, sizeof a->regs) == 0);
+    ASSERT(memcmp(a->rpl, b->rpl, sizeof a->rpl) == 0);
+    ASSERT_EQ_UINT(a->stack_size, b->stack_size);
+    ASSERT(memcmp(a->call_stack, b->call_stack,
+               a->stack_size * sizeof a->call_stack[0]) == 0);
+    ASSERT(memcmp(a->mem, b->mem, sizeof a->mem) == 0);
+    ASSERT(memcmp(a->display, b->display, sizeof a->display) == 0);
+    ASSERT(a->halted == b->halted && a->highres == b->highres);
+    ASSERT_EQ_UINT(a->key_states, b->key_states);
+    ASSERT_EQ_UINT(a->rand_state, b->rand_state);
+    ASSERT_EQ_UINT((unsigned)a->cycles, (unsigned)b->cycles);
+    return 0;
+}
+
+static uint32_t testing_rand(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
@@ -17,50 +17,89 @@
 #include "memory.h"
 
 /**
- * An ordered collection of jump and return points.
- *
- * This is a rather strange structure, so it is a good idea to go over a few
- * points.  A "jump" point is the address of a jump instruction, and a "return"
- * point is the address to which the jump instruction points.  Since any valid
- * instruction address in the Chip-8 is even (all instructions must be aligned
- * on a 16-bit boundary), this allows us to use pointer tagging to distinguish
- * these two types of address.  We declare that the address of a return point
- * will be unmodified, while the address of a jump point will have its lowest
- * bit set.
+ * The number of words in a bitmap with one bit for each byte of the program.
+ */
+#define BITMAP_WORDS (CHIP8_PROG_SIZE / 64)
+/**
+ * The largest number of possible targets a `JP V0` instruction can have for
+ * them to be followed.
  *
- * This decision is not arbitrary, and actually makes things easier to deal
- * with.  The goal of knowing where the jump and return points are is to be
- * able to detect sections of the program that should be disassembled as data
- * rather than as instructions.  Such a data section must be unreachable when
- * the program is executed, and in all normal programs a data section will be
- * precisely the area between a jump point and a return point (exclusive on
- * both ends).  Thus, it is advantageous to order return points after jump
- * points of the same address in order to make this detection easy (this
- * situation may occur if there is an infinite loop of some kind).
+ * If `V0` could have more values than this, too little is known about it for
+ * the targets to be trusted.
+ */
+#define MAX_JP_V0_TARGETS 64
+
+/**
+ * What is known about the value of a register at some point of a path.
  *
- * Naturally, this list should always be sorted in ascending order, and there
- * must be no duplicate elements.  We use a "vector" (in C++ terminology) since
- * a linked list or even a heap seem like overkill given the relatively small
- * number of points we could possibly be dealing with.
+ * The possible values are those from `lo` to `hi` (inclusive) which have all
+ * the bits in `ones` set and all the bits in `zeros` clear.  Keeping track of
+ * known bits as well as a range lets us follow masks (as in `AND V0, V1`) and
+ * shifts, which are how a jump table index is usually computed.
+ */
+struct value {
+    uint8_t lo;
+    uint8_t hi;
+    uint8_t zeros;
+    uint8_t ones;
+};
+
+/**
+ * A register about which nothing is known.
+ */
+static const struct value VALUE_UNKNOWN = {0x00, 0xFF, 0x00, 0x00};
+/**
+ * A register which holds a flag (such as `VF` after `ADD Vx, Vy`).
+ */
+static const struct value VALUE_FLAG = {0x00, 0x01, 0xFE, 0x00};
+
+/**
+ * The state of the control flow analysis of a program.
  *
- * Also, by convention, the addresses stored in this list should not include
- * the 512-byte interpreter area offset; that is, the address 0x200 in a
- * program will be represented as 0x0 in the list for the disassembler's
- * convenience.
+ * A "jump" point is the address of an unconditional jump (or return)
+ * instruction, and a "return" point is an address to which some jump or call
+ * instruction points.  In all normal programs, a data section is precisely the
+ * area after a jump point and before the next return point, since it must be
+ * unreachable when the program is executed.
  */
-struct jpret_list {
+struct analysis {
+    /**
+     * The addresses of instructions which some path has gone through.
+     */
+    uint64_t reachable[BITMAP_WORDS];
+    /**
+     * The jump points.
+     */
+    uint64_t jump_points[BITMAP_WORDS];
+    /**
+     * The return points, which are also the addresses that have been added to
+     * the worklist.
+     */
+    uint64_t return_points[BITMAP_WORDS];
+    /**
+     * The addresses that immediately follow a skip instruction.
+     *
+     * We should ignore all jump points that correspond to an address in here,
+     * since a conditional jump does not constitute a jump point.
+     * Additionally, we can ignore all return points that correspond to an
+     * address in here, since they do not add anything to the analysis.
+     */
+    uint64_t skipped[BITMAP_WORDS];
     /**
-     * The capacity of the list.
+     * The worklist of addresses to start searching at.
+     *
+     * Every (even) address is added at most once, so this can't overflow.
      */
-    size_t cap;
+    uint16_t starts[CHIP8_PROG_SIZE / 2];
     /**
-     * The length of the list.
+     * The number of addresses in the worklist.
      */
-    size_t len;
+    int n_starts;
     /**
-     * The actual list data (jump/return point addresses).
+     * Whether to warn about problems found along the way (only done in the
+     * last round, so each is reported once).
      */
-    uint16_t *data;
+    bool warn;
 };
 
 struct chip8disasm {
@@ -74,7 +113,8 @@ struct chip8disasm {
      * Keep in mind that this is only the program memory (it does not include
      * the reserved 512 bytes of interpreter memory), but that all the
      * addresses referred to by instructions in the program *will* be offset by
-     * these 512 bytes.
+     * these 512 bytes.  There is one extra zero byte at the end, so that the
+     * last byte of a program of odd length can be read as part of a word.
      */
     uint8_t *mem;
     /**
@@ -82,71 +122,123 @@ struct chip8disasm {
      */
     size_t proglen;
     /**
-     * The list of jump/return points.
-     */
-    struct jpret_list jpret_list;
-    /**
-     * The list of labelled locations.
+     * The labelled locations.
      *
      * Every address which is accessed or used by some instruction should be
-     * put in here, so that a nice label name can be displayed instead of an
+     * marked in here, so that a nice label name can be displayed instead of an
      * indecipherable address.
      */
-    struct jpret_list label_list;
+    uint64_t labels[BITMAP_WORDS];
+    /**
+     * The (even) addresses which are in data sections, and should be
+     * disassembled as data rather than as instructions.
+     */
+    uint64_t data[BITMAP_WORDS];
 };
 
 /**
- * Popuates the jpret_list and label_list with the addresses it can find.
+ * Finds the labels and data sections of the program.
  *
  * @return An error code.
  */
-static int chip8disasm_populate_lists(struct chip8disasm *disasm);
+static int chip8disasm_analyze(struct chip8disasm *disasm);
 
 /**
- * Initializes a new jpret_list with the given capacity.
- *
- * The capacity is allowed to be zero.
+ * Adds the given address to the worklist as a return point, if it hasn't been
+ * added already.
  */
-static void jpret_list_init(struct jpret_list *lst, size_t cap);
-
+static void analysis_add_start(struct analysis *an,
+    const struct chip8disasm *disasm, uint16_t addr);
 /**
- * Adds the given entry to the list.
+ * Adds the possible targets of a `JP V0` instruction to the worklist.
  *
- * This should be the address as it appears in the program (that is, including
- * the 512-byte offset), but with the lowest bit set according to whether it is
- * a jump or return address.
+ * @param addr The address operand of the instruction (including the 512-byte
+ * offset).
+ * @param v0 What is known about `V0` when the instruction is executed.
+ * @return Whether the targets could be determined.
  */
-static void jpret_list_add(struct jpret_list *lst, uint16_t addr);
+static bool analysis_add_jp_v0(struct analysis *an,
+    struct chip8disasm *disasm, uint16_t addr, struct value v0);
 /**
- * Clears the given list, freeing the list memory.
+ * Runs one round of the analysis, following every path from the start of the
+ * program.
  *
- * It's fine to pass NULL to this function; it will do nothing in that case.
+ * @param labels The labels found by the previous round, at which nothing is
+ * assumed about the registers.
+ * @return An error code.
  */
-static void jpret_list_clear(struct jpret_list *lst);
+static int analysis_run(struct analysis *an, struct chip8disasm *disasm,
+    const uint64_t *labels);
+
 /**
- * Finds the index of the given element in the list.
+ * Returns whether the bit for the given address is set.
  *
- * @return The index, or -1 if the element is not in the list.
+ * Like all other addresses in the disassembler's bookkeeping, the address
+ * does not include the 512-byte interpreter area offset.
  */
-static int jpret_list_find(const struct jpret_list *lst, uint16_t addr);
+static bool bitmap_get(const uint64_t *bitmap, uint16_t addr);
 /**
- * Finds the index of the first equal or greater element in the list.
- *
- * @return The index, or the length of the list if there was no such element.
+ * Sets the bit for the given address.
+ */
+static void bitmap_set(uint64_t *bitmap, uint16_t addr);
+
+/**
+ * Returns whether the given instruction never goes on to the one after it
+ * (unless skipped).
+ */
+static bool is_jump(struct chip8_instruction inst);
+/**
+ * Returns whether the given instruction may skip the one after it.
+ */
+static bool is_skip(struct chip8_instruction inst);
+
+/**
+ * Updates what is known about the registers after executing the given
+ * instruction.
+ */
+static void regs_execute(struct value *regs, struct chip8_instruction inst);
+/**
+ * Updates what is known about the registers, given whether the skip
+ * instruction skipped the next instruction.
+ */
+static void regs_skip(
+    struct value *regs, struct chip8_instruction skip, bool taken);
+
+/**
+ * Returns a value which is known to be the given constant.
  */
-static int jpret_list_find_ge(const struct jpret_list *lst, uint16_t addr);
+static struct value value_const(uint8_t c);
 /**
- * Grows the list, doubling its capacity.
+ * Returns whether the given number is a possible value.
  */
-static void jpret_list_grow(struct jpret_list *lst);
+static bool value_contains(struct value v, unsigned n);
 /**
- * Returns whether the given address is in a data section.
+ * Returns the number of possible values.
  */
-static bool jpret_list_in_data(const struct jpret_list *lst, uint16_t addr);
+static int value_count(struct value v);
 /**
- * Removes the list element at the specified index.
+ * Removes the given number from the possible values (if that can be
+ * represented).
  */
-static void jpret_list_remove(struct jpret_list *lst, size_t idx);
+static struct value value_exclude(struct value v, uint8_t n);
+/**
+ * Returns the possible values of a register which could be either of the given
+ * values.
+ */
+static struct value value_join(struct value a, struct value b);
+/**
+ * Returns the possible values of a register which must be both of the given
+ * values.
+ */
+static struct value value_meet(struct value a, struct value b);
+/**
+ * Shrinks the range of the value to the smallest one containing all the
+ * possible values.
+ *
+ * If there are no possible values (which should only happen on paths that
+ * can't be executed), the value is unknown instead.
+ */
+static struct value value_normalize(struct value v);
 
 struct chip8disasm *chip8disasm_from_file(
     struct chip8disasm_options opts, const char *fname)
@@ -167,7 +259,7 @@ struct chip8disasm *chip8disasm_from_file(
         log_error("Input program is too large");
         goto FAIL;
     }
-    disasm->mem = xmalloc(disasm->proglen);
+    disasm->mem = xcalloc(1, disasm->proglen + 1);
     /* Read in the program data */
     if ((input = fopen(fname, "r")) == NULL) {
         log_error("Could not open input file '%s': %s", fname, strerror(errno));
@@ -181,9 +273,7 @@ struct chip8disasm *chip8disasm_from_file(
     }
     fclose(input);
 
-    jpret_list_init(&disasm->jpret_list, 64);
-    jpret_list_init(&disasm->label_list, 64);
-    if (chip8disasm_populate_lists(disasm))
+    if (chip8disasm_analyze(disasm))
         goto FAIL;
 
     return disasm;
@@ -198,8 +288,6 @@ void chip8disasm_destroy(struct chip8disasm *disasm)
     if (!disasm)
         return;
     free(disasm->mem);
-    jpret_list_clear(&disasm->jpret_list);
-    jpret_list_clear(&disasm->label_list);
     free(disasm);
 }
 
@@ -212,7 +300,7 @@ int chip8disasm_dump(const struct chip8disasm *disasm, FILE *out)
         uint16_t opcode = ((uint16_t)disasm->mem[i] << 8) + disasm->mem[i + 1];
 
         /* Print label if necessary */
-        if (jpret_list_find(&disasm->label_list, i) != -1)
+        if (bitmap_get(disasm->labels, i))
             fprintf(out, "L%03X:   ", (unsigned)i);
         else
             fprintf(out, "        ");
@@ -221,7 +309,7 @@ int chip8disasm_dump(const struct chip8disasm *disasm, FILE *out)
             return 1;
         }
 
-        if (jpret_list_in_data(&disasm->jpret_list, i)) {
+        if (bitmap_get(disasm->data, i)) {
             /*
              * We need to be careful here: if a label is associated with the
              * second byte of this two-byte chunk, that indicates that we
@@ -229,7 +317,7 @@ int chip8disasm_dump(const struct chip8disasm *disasm, FILE *out)
              * Otherwise, we would end up with a label referenced in the
              * disassembly that doesn't exist.
              */
-            if (jpret_list_find(&disasm->label_list, i + 1) != -1) {
+            if (bitmap_get(disasm->labels, i + 1)) {
                 fprintf(out, "DB #%02X\nL%03X:   DB #%02X\n", disasm->mem[i], (unsigned)(i + 1), disasm->mem[i + 1]);
             } else {
                 fprintf(out, "DW #%04X\n", opcode);
@@ -241,7 +329,9 @@ int chip8disasm_dump(const struct chip8disasm *disasm, FILE *out)
              * label!
              */
             bool use_addr = chip8_instruction_uses_addr(instr) &&
-                jpret_list_find(&disasm->label_list, instr.addr - CHIP8_PROG_START) != -1;
+                instr.addr >= CHIP8_PROG_START &&
+                instr.addr - CHIP8_PROG_START < (int)disasm->proglen &&
+                bitmap_get(disasm->labels, instr.addr - CHIP8_PROG_START);
 
             /*
              * If the instruction uses an address, we need to construct the
@@ -261,121 +351,230 @@ int chip8disasm_dump(const struct chip8disasm *disasm, FILE *out)
     return 0;
 }
 
+bool chip8disasm_has_label(const struct chip8disasm *disasm, uint16_t addr)
+{
+    return addr >= CHIP8_PROG_START &&
+        addr - CHIP8_PROG_START < (int)disasm->proglen &&
+        bitmap_get(disasm->labels, addr - CHIP8_PROG_START);
+}
+
 struct chip8disasm_options chip8disasm_options_default(void)
 {
     return (struct chip8disasm_options){.shift_quirks = false};
 }
 
-static int chip8disasm_populate_lists(struct chip8disasm *disasm)
+static int chip8disasm_analyze(struct chip8disasm *disasm)
 {
     /*
      * OK, so basically what's happening here is this: we start off with a
-     * temporary list of addresses that contains only 0x0, the beginning of
-     * execution.  Then, until that temporary list is empty, we start looking
-     * at instructions in sequence, starting at one of the addresses in the
-     * list, and adding all the return points we find along the way to the
-     * temporary list.  When we find a jump point (note that we need to be
+     * worklist of addresses that contains only 0x0, the beginning of
+     * execution.  Then, until the worklist is empty, we start looking at
+     * instructions in sequence, starting at one of the addresses in the list,
+     * and adding the targets of all the jumps and calls we find along the way
+     * to the worklist.  When we find a jump point (note that we need to be
      * careful, since a jump instruction after an instruction like SE is not a
-     * jump point, being only conditional), we add it to the list in 'disasm'
-     * and continue to the next start of execution in our temporary list.
+     * jump point, being only conditional), we mark it and continue to the next
+     * start of execution in the worklist.
      *
      * The idea behind all of this is that we are effectively simulating
      * execution along all possible paths in order to see which instructions
-     * are reachable.  Of course, we can check to make sure that we don't check
-     * the same path twice, which should make things a little faster.
+     * are reachable.  Since each address is added to the worklist only once,
+     * and a path stops as soon as it reaches an instruction which another path
+     * has already gone through, the whole analysis takes linear time.
      *
-     * At the same time, we populate the label_list with all referenced
-     * addresses.
-     */
-    /* A list of addresses to start searching at. */
-    struct jpret_list starts;
-    /*
-     * A list of addresses that immediately follow a skip instruction.
+     * At the same time, we mark all referenced addresses as labels.
      *
-     * We should ignore all jump points that correspond to an address in this
-     * list, since a conditional jump does not constitute a jump point.
-     * Additionally, we can ignore all return points that correspond to an
-     * address in this list, since they do not add anything to the analysis.
+     * Along each path, we also keep track of what is known about the values
+     * of the registers (constants, ranges and known bits), which is enough
+     * to find the possible targets of a JP V0 instruction when it is used
+     * with a small jump table, as in:
+     *
+     *     AND V0, V1 ; with V1 = #03
+     *     SHL V0
+     *     JP V0, TABLE
+     *
+     * Those targets are then followed like any others.
      */
-    struct jpret_list skipped;
+    struct analysis *an = xcalloc(1, sizeof *an);
+    uint64_t labels[BITMAP_WORDS];
+    bool in_data = false;
+    bool settled = false;
     int retval = 0;
 
-    jpret_list_init(&starts, 64);
-    jpret_list_init(&skipped, 64);
     /*
-     * Remember that addresses in the list ignore the 512-byte interpreter
+     * Since the values of the registers along a path are only trusted up to
+     * the next label (which might be reached from anywhere), the analysis is
+     * repeated until no more labels are found, and then once more to issue
+     * any warnings.  This is rarely more than three rounds.
+     */
+    for (;;) {
+        memcpy(labels, disasm->labels, sizeof labels);
+        memset(an, 0, sizeof *an);
+        an->warn = settled;
+        if ((retval = analysis_run(an, disasm, labels)) != 0)
+            goto EXIT;
+        if (settled)
+            break;
+        settled = memcmp(labels, disasm->labels, sizeof labels) == 0;
+    }
+
+    /*
+     * Now we can find the data sections, ignoring any skipped jump/return
+     * points.  A jump point is considered to come after a return point at the
+     * same address (as in an infinite loop), so the data section starts after
+     * it.
+     */
+    for (uint16_t addr = 0; addr < disasm->proglen; addr += 2) {
+        bool jump = bitmap_get(an->jump_points, addr) &&
+            !bitmap_get(an->skipped, addr);
+        bool ret = bitmap_get(an->return_points, addr) &&
+            !bitmap_get(an->skipped, addr);
+
+        if (in_data && !ret)
+            bitmap_set(disasm->data, addr);
+        if (jump)
+            in_data = true;
+        else if (ret)
+            in_data = false;
+    }
+
+EXIT:
+    free(an);
+    return retval;
+}
+
+static bool analysis_add_jp_v0(struct analysis *an,
+    struct chip8disasm *disasm, uint16_t addr, struct value v0)
+{
+    if (value_count(v0) > MAX_JP_V0_TARGETS)
+        return false;
+    for (unsigned n = v0.lo; n <= v0.hi; n++) {
+        /* The interpreter rejects misaligned targets, so they can't happen. */
+        uint16_t target = addr + n - CHIP8_PROG_START;
+
+        if (!value_contains(v0, n) || target % 2 != 0)
+            continue;
+        if (target < disasm->proglen)
+            bitmap_set(disasm->labels, target);
+        analysis_add_start(an, disasm, target);
+    }
+    return true;
+}
+
+static void analysis_add_start(struct analysis *an,
+    const struct chip8disasm *disasm, uint16_t addr)
+{
+    if (addr >= disasm->proglen) {
+        if (an->warn)
+            log_warning("Control path went out of program bounds");
+        return;
+    }
+    if (bitmap_get(an->return_points, addr))
+        return;
+    bitmap_set(an->return_points, addr);
+    an->starts[an->n_starts++] = addr;
+}
+
+static int analysis_run(struct analysis *an, struct chip8disasm *disasm,
+    const uint64_t *labels)
+{
+    /*
+     * Remember that addresses in the analysis ignore the 512-byte interpreter
      * area, so the start-of-execution address is stored as 0x0.
      */
-    jpret_list_add(&starts, 0x0);
+    analysis_add_start(an, disasm, 0x0);
+
+    while (an->n_starts != 0) {
+        /*
+         * What is known about the registers along this path, which is nothing
+         * at first, since the start could be reached from anywhere.
+         */
+        struct value regs[16];
+        /* What was known before the instruction after a skip instruction */
+        struct value before_skipped[16];
+        /* The skip instruction before the current instruction, if any */
+        struct chip8_instruction skip;
+        bool after_skip = false;
 
-    while (starts.len != 0) {
-        uint16_t pc = starts.data[starts.len - 1];
+        for (int i = 0; i < 16; i++)
+            regs[i] = VALUE_UNKNOWN;
 
-        jpret_list_remove(&starts, starts.len - 1);
-        /* We can skip this path if we've already gone down it. */
-        if (jpret_list_find(&disasm->jpret_list, pc) != -1)
-            goto BREAK_FOR;
-        /* All the starting points of this loop are return points. */
-        if (jpret_list_find(&skipped, pc) == -1)
-            jpret_list_add(&disasm->jpret_list, pc);
+        uint16_t start = an->starts[--an->n_starts];
 
         /* Traverse the code from the starting point. */
-        for (;; pc += 2) {
+        for (uint16_t pc = start;; pc += 2) {
             struct chip8_instruction inst;
 
             if (pc >= disasm->proglen) {
-                log_warning("Control path went out of program bounds");
+                if (an->warn)
+                    log_warning("Control path went out of program bounds");
                 break;
             }
+            /*
+             * If another path has already gone through here, it has also gone
+             * on from here.  The exception is an instruction which was reached
+             * before the skip instruction in front of it was found, since this
+             * path might have to go on past it.
+             */
+            if (bitmap_get(an->reachable, pc) && !bitmap_get(an->skipped, pc))
+                break;
+            bitmap_set(an->reachable, pc);
             /* This is the instruction we're currently looking at */
             inst = chip8_instruction_from_opcode(((uint16_t)disasm->mem[pc] << 8) + disasm->mem[pc + 1],
                 disasm->opts.shift_quirks);
 
             /*
-             * Add to the label list if we need to.  Note that we need to check
-             * not only whether the instruction takes an address as an operand,
-             * but whether that address actually refers to a location in the
+             * Add a label if we need to.  Note that we need to check not only
+             * whether the instruction takes an address as an operand, but
+             * whether that address actually refers to a location in the
              * current file; if it doesn't refer to such a location, it
-             * shouldn't be added to the label list since it's just an address.
+             * shouldn't be labelled since it's just an address.
              */
             if (chip8_instruction_uses_addr(inst) &&
-                inst.addr - CHIP8_PROG_START < disasm->proglen) {
-                jpret_list_add(&disasm->label_list, inst.addr - CHIP8_PROG_START);
+                inst.addr >= CHIP8_PROG_START &&
+                inst.addr - CHIP8_PROG_START < (int)disasm->proglen) {
+                bitmap_set(disasm->labels, inst.addr - CHIP8_PROG_START);
+            }
+            if (after_skip) {
+                memcpy(before_skipped, regs, sizeof regs);
+                regs_skip(before_skipped, skip, true);
+                regs_skip(regs, skip, false);
             }
+            if (pc != start && bitmap_get(labels, pc))
+                for (int i = 0; i < 16; i++)
+                    regs[i] = VALUE_UNKNOWN;
 
             switch (inst.op) {
             case OP_RET:
             case OP_EXIT:
-                if (jpret_list_find(&skipped, pc) == -1) {
+                if (!bitmap_get(an->skipped, pc)) {
                     /*
                      * Remember that we shouldn't call something a "jump point"
                      * if it's only conditional.
                      */
-                    jpret_list_add(&disasm->jpret_list, pc | 1);
+                    bitmap_set(an->jump_points, pc);
                     goto BREAK_FOR;
                 }
                 break;
             case OP_CALL:
                 if (inst.addr % 2 != 0) {
                     log_error("Misaligned CALL operand encountered");
-                    retval = 1;
-                    goto EXIT;
+                    return 1;
                 }
                 /*
                  * CALL instructions always keep executing after RET in the
                  * subroutine, so they're not jump points.
                  */
-                jpret_list_add(&starts, inst.addr - CHIP8_PROG_START);
+                analysis_add_start(an, disasm, inst.addr - CHIP8_PROG_START);
                 break;
             case OP_JP:
                 if (inst.addr % 2 != 0) {
                     log_error("Misaligned JP operand encountered");
-                    retval = 1;
-                    goto EXIT;
+                    return 1;
                 }
-                jpret_list_add(&starts, inst.addr - CHIP8_PROG_START);
-                if (jpret_list_find(&skipped, pc) == -1) {
-                    jpret_list_add(&disasm->jpret_list, pc | 1);
+                analysis_add_start(an, disasm, inst.addr - CHIP8_PROG_START);
+                if (!bitmap_get(an->skipped, pc)) {
+                    bitmap_set(an->jump_points, pc);
                     goto BREAK_FOR;
                 }
                 break;
@@ -385,135 +584,249 @@ static int chip8disasm_populate_lists(struct chip8disasm *disasm)
             case OP_SNE_REG:
             case OP_SKP:
             case OP_SKNP:
-                jpret_list_add(&skipped, pc + 2);
+                if (pc + 2 < (int)disasm->proglen)
+                    bitmap_set(an->skipped, pc + 2);
                 break;
             case OP_JP_V0:
-                log_warning("The disassembler doesn't support JP V0 yet");
-                if (jpret_list_find(&skipped, pc) == -1) {
-                    jpret_list_add(&disasm->jpret_list, pc | 1);
+                if (!analysis_add_jp_v0(an, disasm, inst.addr, regs[REG_V0]) &&
+                    an->warn)
+                    log_warning("Could not determine the targets of JP V0 at "
+                                "L%03X", (unsigned)pc);
+                if (!bitmap_get(an->skipped, pc)) {
+                    bitmap_set(an->jump_points, pc);
                     goto BREAK_FOR;
                 }
                 break;
             default:
                 break;
             }
+
+            /*
+             * The next instruction can be reached by executing this one (unless
+             * it jumps away) or by skipping it, if the previous instruction was
+             * a skip instruction.  If neither is the case, it is reached from
+             * elsewhere (as after a skipped jump at the start of the path).
+             */
+            regs_execute(regs, inst);
+            for (int i = 0; i < 16; i++)
+                if (is_jump(inst))
+                    regs[i] = after_skip ? before_skipped[i] : VALUE_UNKNOWN;
+                else if (after_skip)
+                    regs[i] = value_join(regs[i], before_skipped[i]);
+            after_skip = is_skip(inst);
+            skip = inst;
         }
     BREAK_FOR:;
     }
 
-    /*
-     * Make sure that we don't have any skipped jump/return points in our list.
-     */
-    for (int i = 0; i < skipped.len; i++) {
-        int idx = jpret_list_find(&disasm->jpret_list, skipped.data[i]);
-        if (idx != -1)
-            jpret_list_remove(&disasm->jpret_list, idx);
-        idx = jpret_list_find(&disasm->jpret_list, skipped.data[i] | 1);
-        if (idx != -1)
-            jpret_list_remove(&disasm->jpret_list, idx);
-    }
-
-EXIT:
-    jpret_list_clear(&starts);
-    jpret_list_clear(&skipped);
-    return retval;
+    return 0;
 }
 
-static void jpret_list_init(struct jpret_list *lst, size_t cap)
+static bool bitmap_get(const uint64_t *bitmap, uint16_t addr)
 {
-    if (cap == 0)
-        lst->data = NULL;
-    else
-        lst->data = xmalloc(cap * sizeof *lst->data);
-
-    lst->cap = cap;
-    lst->len = 0;
+    return bitmap[addr / 64] >> (addr % 64) & 1;
 }
 
-static void jpret_list_add(struct jpret_list *lst, uint16_t addr)
+static void bitmap_set(uint64_t *bitmap, uint16_t addr)
 {
-    int pos = jpret_list_find_ge(lst, addr);
-
-    if (pos < (int)lst->len && lst->data[pos] == addr)
-        return; /* Nothing to do */
-    /* Try to grow the list if needed */
-    if (lst->len == lst->cap)
-        jpret_list_grow(lst);
-    /* Move the elements at the end of the list */
-    for (int i = lst->len; i > pos; i--)
-        lst->data[i] = lst->data[i - 1];
-    /* Finally, we can store our element */
-    lst->data[pos] = addr;
-    lst->len++;
+    bitmap[addr / 64] |= (uint64_t)1 << (addr % 64);
 }
 
-static void jpret_list_clear(struct jpret_list *lst)
+static bool is_jump(struct chip8_instruction inst)
 {
-    if (!lst)
-        return;
-    free(lst->data);
-    lst->cap = 0;
-    lst->len = 0;
+    return inst.op == OP_RET || inst.op == OP_EXIT || inst.op == OP_JP ||
+        inst.op == OP_JP_V0;
 }
 
-static int jpret_list_find(const struct jpret_list *lst, uint16_t addr)
+static bool is_skip(struct chip8_instruction inst)
 {
-    int ge = jpret_list_find_ge(lst, addr);
-
-    if (ge < lst->len && lst->data[ge] == addr)
-        return ge;
-    else
-        return -1;
+    return inst.op == OP_SE_BYTE || inst.op == OP_SNE_BYTE ||
+        inst.op == OP_SE_REG || inst.op == OP_SNE_REG || inst.op == OP_SKP ||
+        inst.op == OP_SKNP;
 }
 
-static int jpret_list_find_ge(const struct jpret_list *lst, uint16_t addr)
+static void regs_execute(struct value *regs, struct chip8_instruction inst)
 {
-    int start, end;
-
-    if (lst->len == 0)
-        return 0;
-
-    start = 0;
-    end = lst->len;
-    while (start < end) {
-        int mid = (start + end) / 2;
-
-        if (lst->data[mid] < addr)
-            start = mid + 1;
-        else if (lst->data[mid] > addr)
-            end = mid;
+    /*
+     * The operands of the instruction, for those that have them (the fields of
+     * the instruction are undefined otherwise)
+     */
+    struct value x, y;
+
+    switch (inst.op) {
+    case OP_CALL:
+        /* The subroutine could do anything. */
+        for (int i = 0; i < 16; i++)
+            regs[i] = VALUE_UNKNOWN;
+        break;
+    case OP_LD_BYTE:
+        regs[inst.vx] = value_const(inst.byte);
+        break;
+    case OP_ADD_BYTE:
+        x = regs[inst.vx];
+        if (x.lo == x.hi)
+            regs[inst.vx] = value_const(x.lo + inst.byte);
+        else if (x.hi + inst.byte <= 0xFF)
+            regs[inst.vx] = value_normalize((struct value){
+                x.lo + inst.byte, x.hi + inst.byte, 0x00, 0x00});
         else
-            return mid;
+            regs[inst.vx] = VALUE_UNKNOWN;
+        /* This comes last, since the carry replaces the sum if VX is VF */
+        regs[REG_VF] = VALUE_FLAG;
+        break;
+    case OP_LD_REG:
+        regs[inst.vx] = regs[inst.vy];
+        break;
+    case OP_OR:
+        x = regs[inst.vx];
+        y = regs[inst.vy];
+        regs[inst.vx] = value_normalize((struct value){x.lo > y.lo ? x.lo : y.lo,
+            0xFF, x.zeros & y.zeros, x.ones | y.ones});
+        break;
+    case OP_AND:
+        x = regs[inst.vx];
+        y = regs[inst.vy];
+        regs[inst.vx] = value_normalize((struct value){0x00,
+            x.hi < y.hi ? x.hi : y.hi, x.zeros | y.zeros, x.ones & y.ones});
+        break;
+    case OP_XOR:
+        x = regs[inst.vx];
+        y = regs[inst.vy];
+        regs[inst.vx] = value_normalize((struct value){0x00, 0xFF,
+            (x.zeros & y.zeros) | (x.ones & y.ones),
+            (x.zeros & y.ones) | (x.ones & y.zeros)});
+        break;
+    case OP_ADD_REG:
+    case OP_SUB:
+    case OP_SUBN:
+        regs[inst.vx] = VALUE_UNKNOWN;
+        regs[REG_VF] = VALUE_FLAG;
+        break;
+    case OP_SHR:
+    case OP_SHR_QUIRK:
+        x = regs[inst.op == OP_SHR ? inst.vx : inst.vy];
+        regs[inst.vx] = value_normalize((struct value){x.lo >> 1, x.hi >> 1,
+            x.zeros >> 1 | 0x80, x.ones >> 1});
+        regs[REG_VF] = VALUE_FLAG;
+        break;
+    case OP_SHL:
+    case OP_SHL_QUIRK:
+        x = regs[inst.op == OP_SHL ? inst.vx : inst.vy];
+        if (x.hi < 0x80)
+            regs[inst.vx] = value_normalize((struct value){x.lo << 1,
+                x.hi << 1, x.zeros << 1 | 0x01, x.ones << 1});
+        else
+            regs[inst.vx] = value_normalize((struct value){0x00, 0xFF,
+                x.zeros << 1 | 0x01, x.ones << 1});
+        regs[REG_VF] = VALUE_FLAG;
+        break;
+    case OP_RND:
+        regs[inst.vx] = value_normalize(
+            (struct value){0x00, inst.byte, ~inst.byte, 0x00});
+        break;
+    case OP_DRW:
+        regs[REG_VF] = VALUE_FLAG;
+        break;
+    case OP_LD_REG_DT:
+        regs[inst.vx] = VALUE_UNKNOWN;
+        break;
+    case OP_LD_KEY:
+        regs[inst.vx] = value_normalize((struct value){0x00, 0x0F, 0xF0, 0x00});
+        break;
+    case OP_LD_REG_DEREF_I:
+    case OP_LD_REG_R:
+        for (int i = 0; i <= (int)inst.vx; i++)
+            regs[i] = VALUE_UNKNOWN;
+        break;
+    default:
+        break;
     }
+}
 
-    return end;
+static void regs_skip(
+    struct value *regs, struct chip8_instruction skip, bool taken)
+{
+    struct value *x, *y;
+
+    switch (skip.op) {
+    case OP_SE_BYTE:
+    case OP_SNE_BYTE:
+        x = &regs[skip.vx];
+        *x = taken == (skip.op == OP_SE_BYTE) ? value_const(skip.byte)
+                                              : value_exclude(*x, skip.byte);
+        break;
+    case OP_SE_REG:
+    case OP_SNE_REG:
+        x = &regs[skip.vx];
+        y = &regs[skip.vy];
+        if (taken == (skip.op == OP_SE_REG)) {
+            *x = *y = value_meet(*x, *y);
+        } else if (y->lo == y->hi) {
+            *x = value_exclude(*x, y->lo);
+        } else if (x->lo == x->hi) {
+            *y = value_exclude(*y, x->lo);
+        }
+        break;
+    default:
+        break;
+    }
 }
 
-static void jpret_list_grow(struct jpret_list *lst)
+static struct value value_const(uint8_t c)
 {
-    size_t new_cap = lst->cap == 0 ? 1 : 2 * lst->cap;
-    uint16_t *new_data = xrealloc(lst->data, new_cap * sizeof *new_data);
+    return (struct value){c, c, ~c, c};
+}
 
-    lst->cap = new_cap;
-    lst->data = new_data;
+static bool value_contains(struct value v, unsigned n)
+{
+    return v.lo <= n && n <= v.hi && (n & v.zeros) == 0 &&
+        (n & v.ones) == v.ones;
 }
 
-static bool jpret_list_in_data(const struct jpret_list *lst, uint16_t addr)
+static int value_count(struct value v)
 {
-    int pos = jpret_list_find_ge(lst, addr);
+    int count = 0;
 
-    if (pos == 0)
-        return false;
+    for (unsigned n = v.lo; n <= v.hi; n++)
+        if (value_contains(v, n))
+            count++;
+    return count;
+}
 
-    return (lst->data[pos - 1] & 1) == 1 &&
-        (pos == lst->len || addr < lst->data[pos]);
+static struct value value_exclude(struct value v, uint8_t n)
+{
+    if (v.lo == n && n != 0xFF)
+        v.lo++;
+    else if (v.hi == n && n != 0x00)
+        v.hi--;
+    return value_normalize(v);
 }
 
-static void jpret_list_remove(struct jpret_list *lst, size_t idx)
+static struct value value_join(struct value a, struct value b)
 {
-    if (idx >= lst->len)
-        return;
-    for (size_t i = idx; i < lst->len - 1; i++)
-        lst->data[i] = lst->data[i + 1];
-    lst->len--;
+    return (struct value){a.lo < b.lo ? a.lo : b.lo, a.hi > b.hi ? a.hi : b.hi,
+        a.zeros & b.zeros, a.ones & b.ones};
+}
+
+static struct value value_meet(struct value a, struct value b)
+{
+    return value_normalize((struct value){a.lo > b.lo ? a.lo : b.lo,
+        a.hi < b.hi ? a.hi : b.hi, a.zeros | b.zeros, a.ones | b.ones});
+}
+
+static struct value value_normalize(struct value v)
+{
+    unsigned lo = v.lo, hi = v.hi;
+
+    while (lo <= hi && !value_contains(v, lo))
+        lo++;
+    if (lo > hi)
+        return VALUE_UNKNOWN;
+    while (!value_contains(v, hi))
+        hi--;
+    if (lo == hi)
+        return value_const(lo);
+    v.lo = lo;
+    v.hi = hi;
+    return v;
 }
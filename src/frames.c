@@ -0,0 +1,153 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "frames.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "memory.h"
+
+/**
+ * The number of nanoseconds in a second.
+ */
+#define NANOS_IN_SECOND 1000000000L
+
+struct chip8_frames {
+    /**
+     * The storage for the three frames.
+     */
+    struct chip8_frame buffers[3];
+    /**
+     * The frame being filled by the publishing thread.
+     */
+    struct chip8_frame *back;
+    /**
+     * The newest completed frame.
+     */
+    struct chip8_frame *middle;
+    /**
+     * The frame being read by the acquiring thread.
+     */
+    struct chip8_frame *front;
+    /**
+     * Whether `middle` has been published since it was last acquired.
+     */
+    bool fresh;
+    /**
+     * The number of frames published so far.
+     *
+     * This is only used by the publishing thread.
+     */
+    uint64_t n_published;
+    /**
+     * Protects `back`, `middle`, `front` and `fresh`.
+     */
+    pthread_mutex_t lock;
+    /**
+     * Signaled when a frame is published.
+     */
+    pthread_cond_t published;
+};
+
+struct chip8_frames *chip8_frames_new(void)
+{
+    struct chip8_frames *frames = xcalloc(1, sizeof *frames);
+    int err;
+
+    if ((err = pthread_mutex_init(&frames->lock, NULL)) != 0) {
+        log_error("Could not create frame lock: %s", strerror(err));
+        goto ERROR_ALLOCATED;
+    }
+    if ((err = pthread_cond_init(&frames->published, NULL)) != 0) {
+        log_error("Could not create frame condition: %s", strerror(err));
+        goto ERROR_LOCK_CREATED;
+    }
+    frames->back = &frames->buffers[0];
+    frames->middle = &frames->buffers[1];
+    frames->front = &frames->buffers[2];
+    frames->front->dirty_rows = CHIP8_DISPLAY_ALL_ROWS;
+    return frames;
+
+ERROR_LOCK_CREATED:
+    pthread_mutex_destroy(&frames->lock);
+ERROR_ALLOCATED:
+    free(frames);
+    return NULL;
+}
+
+void chip8_frames_destroy(struct chip8_frames *frames)
+{
+    if (!frames)
+        return;
+    pthread_cond_destroy(&frames->published);
+    pthread_mutex_destroy(&frames->lock);
+    free(frames);
+}
+
+void chip8_frames_publish(
+    struct chip8_frames *frames, const struct chip8 *chip, uint64_t dirty_rows)
+{
+    struct chip8_frame *back = frames->back;
+
+    memcpy(back->display, chip->display, sizeof back->display);
+    back->highres = chip->highres;
+    back->number = frames->n_published++;
+    back->dirty_rows = back->number == 0 ? CHIP8_DISPLAY_ALL_ROWS : dirty_rows;
+
+    pthread_mutex_lock(&frames->lock);
+    /* The rows changed in a frame which was never acquired still need drawing */
+    if (frames->fresh)
+        back->dirty_rows |= frames->middle->dirty_rows;
+    frames->back = frames->middle;
+    frames->middle = back;
+    frames->fresh = true;
+    pthread_cond_signal(&frames->published);
+    pthread_mutex_unlock(&frames->lock);
+}
+
+const struct chip8_frame *chip8_frames_acquire(
+    struct chip8_frames *frames, long wait_nanos, bool *fresh)
+{
+    struct chip8_frame *front;
+
+    pthread_mutex_lock(&frames->lock);
+    if (!frames->fresh && wait_nanos > 0) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait_nanos / NANOS_IN_SECOND;
+        deadline.tv_nsec += wait_nanos % NANOS_IN_SECOND;
+        if (deadline.tv_nsec >= NANOS_IN_SECOND) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= NANOS_IN_SECOND;
+        }
+        while (!frames->fresh &&
+            pthread_cond_timedwait(&frames->published, &frames->lock,
+                &deadline) != ETIMEDOUT)
+            ;
+    }
+    if ((*fresh = frames->fresh)) {
+        front = frames->middle;
+        frames->middle = frames->front;
+        frames->front = front;
+        frames->fresh = false;
+    }
+    front = frames->front;
+    pthread_mutex_unlock(&frames->lock);
+
+    return front;
+}
+
+bool chip8_frame_pixel(const struct chip8_frame *frame, int x, int y)
+{
+    return (frame->display[y][x / 64] >> (63 - x % 64)) & 1;
+}
@@ -8,6 +8,7 @@
 #include "interpreter.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +17,8 @@
 
 #include "log.h"
 #include "memory.h"
+#include "profile.h"
+#include "trace.h"
 
 /**
  * The address of the low-resolution hex digit sprites in memory.
@@ -45,11 +48,51 @@
  * The number of nanoseconds in a second.
  */
 #define NANOS_IN_SECOND 1000000000UL
+/**
+ * The initial value of a 64-bit FNV-1a hash.
+ */
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325
+/**
+ * The multiplier of a 64-bit FNV-1a hash.
+ */
+#define FNV_PRIME 0x100000001B3
+/**
+ * Marks a function parameter as intentionally unused.
+ */
+#define UNUSED(x) (void)(x)
+
+/**
+ * The state of the interpreter when it last took a backward jump, used to
+ * detect idle loops (such as those waiting for DT to reach 0).
+ *
+ * If the same jump is taken twice with the same state, and the loop neither
+ * draws nor writes to memory, then every further iteration of the loop must be
+ * the same until the next timer tick (or key change), so they can be skipped.
+ */
+struct idle_loop {
+    /**
+     * The address of the jump, or `CHIP8_MEM_SIZE` if there is none.
+     */
+    uint16_t pc;
+    /**
+     * The instruction count just after the jump.
+     */
+    uint64_t cycles;
+    uint8_t regs[16];
+    uint8_t rpl[8];
+    uint16_t reg_i;
+    uint8_t reg_dt;
+    uint8_t reg_st;
+    uint16_t key_states;
+    uint32_t rand_state;
+    int stack_size;
+    uint16_t call_stack[CHIP8_STACK_DEPTH];
+};
 
 /**
  * The low-resolution hex digit sprites.
  */
-static uint8_t chip8_hex_low[16][CHIP8_HEX_LOW_HEIGHT] = {
+static const uint8_t chip8_hex_low[16][CHIP8_HEX_LOW_HEIGHT] = {
     {0xF0, 0x90, 0x90, 0x90, 0xF0}, {0x20, 0x60, 0x20, 0x20, 0x70},
     {0xF0, 0x10, 0xF0, 0x80, 0xF0}, {0xF0, 0x10, 0xF0, 0x10, 0xF0},
     {0x90, 0x90, 0xF0, 0x10, 0x10}, {0xF0, 0x80, 0xF0, 0x10, 0xF0},
@@ -66,7 +109,7 @@ static uint8_t chip8_hex_low[16][CHIP8_HEX_LOW_HEIGHT] = {
  * I'm not entirely sure what the "official" versions of these are, so I made
  * my own, which aren't really the best.
  */
-static uint8_t chip8_hex_high[16][CHIP8_HEX_HIGH_HEIGHT] = {
+static const uint8_t chip8_hex_high[16][CHIP8_HEX_HIGH_HEIGHT] = {
     {0x3C, 0x42, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x42, 0x3C},
     {0x18, 0x28, 0x48, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x7F},
     {0x3C, 0x42, 0x81, 0x81, 0x02, 0x0C, 0x30, 0x40, 0x80, 0xFF},
@@ -86,13 +129,42 @@ static uint8_t chip8_hex_high[16][CHIP8_HEX_HIGH_HEIGHT] = {
 };
 
 /**
- * An element in the call stack.
+ * Executes a single instruction in a non-halted interpreter.
+ *
+ * @param trace Whether to log each instruction at the trace level.
+ * @return An error code.
  */
-struct chip8_call_node {
-    uint16_t call_addr;
-    struct chip8_call_node *next;
-};
-
+static int chip8_cycle(struct chip8 *chip, bool trace);
+/**
+ * Returns the number of instructions in the block starting at the program
+ * counter, computing it if necessary.
+ */
+static unsigned long chip8_block_len(struct chip8 *chip);
+/**
+ * Returns whether the given instruction may be part of a block.
+ */
+static bool chip8_block_allows(struct chip8_instruction instr);
+/**
+ * Executes the given number of instructions from the block at the program
+ * counter.
+ *
+ * @return An error code.
+ */
+static int chip8_block_run(struct chip8 *chip, unsigned long n);
+/**
+ * Decodes the instruction at the given address, bypassing the cache.
+ */
+static struct chip8_instruction chip8_decode(
+    const struct chip8 *chip, uint16_t addr);
+/**
+ * XORs a row of sprite data onto the display.
+ *
+ * @param bits The sprite row, with the leftmost pixel in the most significant
+ * bit.  Any part of the row which falls off the right edge of the display is
+ * discarded.
+ * @return Whether there was a collision.
+ */
+static bool chip8_draw_row(struct chip8 *chip, int x, int y, uint64_t bits);
 /**
  * Draws a (low-resolution) sprite at the given position.
  *
@@ -115,29 +187,356 @@ static void chip8_log_regs(const struct chip8 *chip);
  * Executes the given instruction in the interpreter.
  *
  * @param chip The interpreter to use for execution.
- * @param inst The instruction to execute.
+ * @param inst The instruction to execute, which must be the one at the
+ * program counter.  With table dispatch, only its opcode in memory is used.
  * @param[out] pc The new program counter value to use.
  *
  * @return An error code.
  */
 static int chip8_execute(
     struct chip8 *chip, struct chip8_instruction inst, uint16_t *pc);
+/**
+ * Executes the given instruction at the program counter, recording it in the
+ * interpreter's profile.
+ *
+ * @return An error code.
+ */
+static int chip8_profile_execute(
+    struct chip8 *chip, struct chip8_instruction inst);
+/**
+ * Returns the value of the monotonic clock in nanoseconds.
+ */
+static uint64_t chip8_profile_nanos(void);
+/**
+ * Executes the given instruction at the program counter, recording it in the
+ * interpreter's trace.
+ *
+ * @return An error code.
+ */
+static int chip8_trace_execute(
+    struct chip8 *chip, struct chip8_instruction inst);
+/**
+ * The implementations of each operation, which are shared by both dispatch
+ * methods of `chip8_execute`.
+ *
+ * Each executes the given instruction, setting `new_pc` if the instruction
+ * doesn't just advance to the next one.  Only the operands of the operation
+ * are read from `inst`.
+ *
+ * @param[in,out] new_pc The program counter value to use after execution,
+ * which is initially set to that of the next instruction.
+ * @return An error code.
+ */
+static inline int chip8_op_invalid(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_scd(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_cls(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ret(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_scr(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_scl(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_exit(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_low(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_high(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_jp(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_call(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_se_byte(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_sne_byte(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_se_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_byte(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_add_byte(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_or(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_and(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_xor(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_add_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_sub(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_shr(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_shr_quirk(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_subn(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_shl(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_shl_quirk(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_sne_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_i(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_jp_v0(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_rnd(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_drw(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_skp(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_sknp(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_reg_dt(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_key(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_dt_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_st(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_add_i(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_f(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_hf(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_b(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_deref_i_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_reg_deref_i(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_r_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+static inline int chip8_op_ld_reg_r(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc);
+/**
+ * Executes the given opcode, dispatching on its fields without decoding it
+ * first.
+ *
+ * @param[in,out] new_pc As for the operation implementations.
+ * @return An error code.
+ */
+static int chip8_dispatch_opcode(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+/**
+ * Executes the given operation, looked up in one of the tables below for an
+ * opcode, or reports the opcode as invalid if the operation is NULL.
+ *
+ * @param[in,out] new_pc As for the operation implementations.
+ * @return An error code.
+ */
+static int chip8_dispatch_op(struct chip8 *chip,
+    int (*op)(struct chip8 *, struct chip8_instruction, uint16_t *),
+    struct chip8_instruction inst, uint16_t opcode, uint16_t *new_pc);
+/**
+ * Executes an opcode whose highest nibble is that in the function name, for
+ * `chip8_dispatch_opcode`.
+ *
+ * The operands are extracted from the opcode directly, or, where the
+ * highest nibble is shared by several operations, after a lookup in one of
+ * the tables below.
+ *
+ * @param[in,out] new_pc As for the operation implementations.
+ * @return An error code.
+ */
+static int chip8_group_0(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_1(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_2(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_3(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_4(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_5(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_6(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_7(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_8(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_9(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_a(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_b(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_c(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_d(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_e(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+static int chip8_group_f(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc);
+
+/**
+ * The handlers of each opcode, indexed by its highest nibble.
+ */
+static int (*const chip8_group_handlers[16])(
+    struct chip8 *, uint16_t, uint16_t *) = {
+    chip8_group_0, chip8_group_1, chip8_group_2, chip8_group_3,
+    chip8_group_4, chip8_group_5, chip8_group_6, chip8_group_7,
+    chip8_group_8, chip8_group_9, chip8_group_a, chip8_group_b,
+    chip8_group_c, chip8_group_d, chip8_group_e, chip8_group_f,
+};
+/**
+ * The operations of the 0 opcodes, indexed by their lowest byte (the second
+ * nibble is ignored).  Missing entries are invalid.
+ */
+static int (*const chip8_sys_handlers[256])(
+    struct chip8 *, struct chip8_instruction, uint16_t *) = {
+    [0xC0] = chip8_op_scd, [0xC1] = chip8_op_scd, [0xC2] = chip8_op_scd,
+    [0xC3] = chip8_op_scd, [0xC4] = chip8_op_scd, [0xC5] = chip8_op_scd,
+    [0xC6] = chip8_op_scd, [0xC7] = chip8_op_scd, [0xC8] = chip8_op_scd,
+    [0xC9] = chip8_op_scd, [0xCA] = chip8_op_scd, [0xCB] = chip8_op_scd,
+    [0xCC] = chip8_op_scd, [0xCD] = chip8_op_scd, [0xCE] = chip8_op_scd,
+    [0xCF] = chip8_op_scd,
+    [0xE0] = chip8_op_cls,
+    [0xEE] = chip8_op_ret,
+    [0xFB] = chip8_op_scr,
+    [0xFC] = chip8_op_scl,
+    [0xFD] = chip8_op_exit,
+    [0xFE] = chip8_op_low,
+    [0xFF] = chip8_op_high,
+};
+/**
+ * The operations of the 8 opcodes, indexed by whether shift quirks are
+ * enabled and the lowest nibble.  Missing entries are invalid.
+ */
+static int (*const chip8_alu_handlers[2][16])(
+    struct chip8 *, struct chip8_instruction, uint16_t *) = {
+    {
+        [0x0] = chip8_op_ld_reg,
+        [0x1] = chip8_op_or,
+        [0x2] = chip8_op_and,
+        [0x3] = chip8_op_xor,
+        [0x4] = chip8_op_add_reg,
+        [0x5] = chip8_op_sub,
+        [0x6] = chip8_op_shr,
+        [0x7] = chip8_op_subn,
+        [0xE] = chip8_op_shl,
+    },
+    {
+        [0x0] = chip8_op_ld_reg,
+        [0x1] = chip8_op_or,
+        [0x2] = chip8_op_and,
+        [0x3] = chip8_op_xor,
+        [0x4] = chip8_op_add_reg,
+        [0x5] = chip8_op_sub,
+        [0x6] = chip8_op_shr_quirk,
+        [0x7] = chip8_op_subn,
+        [0xE] = chip8_op_shl_quirk,
+    },
+};
+/**
+ * The operations of the E opcodes, indexed by their lowest byte.  Missing
+ * entries are invalid.
+ */
+static int (*const chip8_key_handlers[256])(
+    struct chip8 *, struct chip8_instruction, uint16_t *) = {
+    [0x9E] = chip8_op_skp,
+    [0xA1] = chip8_op_sknp,
+};
+/**
+ * The operations of the F opcodes, indexed by their lowest byte.  Missing
+ * entries are invalid.
+ */
+static int (*const chip8_misc_handlers[256])(
+    struct chip8 *, struct chip8_instruction, uint16_t *) = {
+    [0x07] = chip8_op_ld_reg_dt,
+    [0x0A] = chip8_op_ld_key,
+    [0x15] = chip8_op_ld_dt_reg,
+    [0x18] = chip8_op_ld_st,
+    [0x1E] = chip8_op_add_i,
+    [0x29] = chip8_op_ld_f,
+    [0x30] = chip8_op_ld_hf,
+    [0x33] = chip8_op_ld_b,
+    [0x55] = chip8_op_ld_deref_i_reg,
+    [0x65] = chip8_op_ld_reg_deref_i,
+    [0x75] = chip8_op_ld_r_reg,
+    [0x85] = chip8_op_ld_reg_r,
+};
+
+/**
+ * Decrements the delay and sound timers by the given number of ticks.
+ */
+static void chip8_timer_tick(struct chip8 *chip, unsigned long elapsed);
+/**
+ * Executes instructions until one of the conditions in `chip8_run_status` is
+ * met.
+ *
+ * @param n The maximum number of instructions to execute.
+ * @param until_frame Whether to stop at the next timer tick.
+ */
+static enum chip8_run_status chip8_run(
+    struct chip8 *chip, unsigned long n, bool until_frame);
 /**
  * Updates the internal timer value and other internal timers.
  */
 static void chip8_timer_update(struct chip8 *chip);
+/**
+ * Advances the virtual timer by one tick.
+ */
+static void chip8_timer_virtual_tick(struct chip8 *chip);
 /**
  * Updates just the internal timer.
  */
 static void chip8_timer_update_ticks(struct chip8 *chip);
 /**
  * Delays (by sleeping) until the next tick has arrived.
+ *
+ * When using the virtual timer, this skips directly to the next tick instead.
  */
 static void chip8_wait_cycle(struct chip8 *chip);
 /**
- * Returns a random byte.
+ * Adds the given bytes to a 64-bit FNV-1a hash.
+ */
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *bytes, size_t len);
+/**
+ * Adds the given 16-bit value (as two big-endian bytes) to a 64-bit FNV-1a
+ * hash.
+ */
+static uint64_t hash_word(uint64_t hash, uint16_t word);
+/**
+ * Returns whether the given instruction rules out skipping the loop it is
+ * part of, because it draws or writes to memory.
+ */
+static bool idle_loop_breaks(struct chip8_instruction instr);
+/**
+ * Returns whether the interpreter has the state saved for the jump at the
+ * given address.
+ */
+static bool idle_loop_matches(
+    const struct idle_loop *idle, const struct chip8 *chip, uint16_t pc);
+/**
+ * Saves the state of the interpreter just after the jump at the given address.
+ */
+static void idle_loop_save(
+    struct idle_loop *idle, const struct chip8 *chip, uint16_t pc);
+/**
+ * Returns a random byte from the interpreter's random number generator.
+ */
+static uint8_t rand_byte(struct chip8 *chip);
+/**
+ * Returns the initial state of the random number generator for the given
+ * seed.
+ *
+ * The seed is hashed, so that nearby seeds give unrelated sequences.
  */
-static uint8_t rand_byte(void);
+static uint32_t rand_init(uint32_t seed);
 
 struct chip8_options chip8_options_default(void)
 {
@@ -146,21 +545,34 @@ struct chip8_options chip8_options_default(void)
         .enable_timer = true,
         .shift_quirks = false,
         .timer_freq = 60,
+        .virtual_timer = false,
+        .instrs_per_tick = DELAY_TICK_FRACTION,
+        .skip_idle = true,
+        .dispatch = CHIP8_DEFAULT_DISPATCH,
+        .seed = 0,
     };
 }
 
 struct chip8 *chip8_new(struct chip8_options opts)
 {
-    struct chip8 *chip = xcalloc(1, sizeof *chip);
+    struct chip8 *chip = xmalloc(sizeof *chip);
+
+    chip8_init_in_place(chip, opts);
+    return chip;
+}
 
+void chip8_init_in_place(struct chip8 *chip, struct chip8_options opts)
+{
+    memset(chip, 0, sizeof *chip);
     chip->opts = opts;
     /* Start program at beginning of usable memory */
     chip->pc = 0x200;
     chip->halted = false;
     chip->highres = false;
-    chip->needs_full_redraw = true;
-    chip8_timer_update_ticks(chip);
-    chip->call_stack = NULL;
+    chip->dirty_rows = CHIP8_DISPLAY_ALL_ROWS;
+    if (!opts.virtual_timer)
+        chip8_timer_update_ticks(chip);
+    chip->stack_size = 0;
     chip->key_states = 0;
 
     /* Load low-resolution hex sprites into memory */
@@ -169,126 +581,324 @@ struct chip8 *chip8_new(struct chip8_options opts)
     memcpy(
         chip->mem + CHIP8_HEX_HIGH_ADDR, chip8_hex_high, sizeof chip8_hex_high);
 
-    srand(time(NULL));
-
-    return chip;
+    chip->rand_state = rand_init(opts.seed);
 }
 
 void chip8_destroy(struct chip8 *chip)
 {
-    struct chip8_call_node *node = chip->call_stack, *oldnode;
-    while (node != NULL) {
-        oldnode = node;
-        node = node->next;
-        free(oldnode);
-    }
     free(chip);
 }
 
+void chip8_reset(struct chip8 *chip, const struct chip8 *templ)
+{
+    memcpy(chip, templ, sizeof *chip);
+    if (!chip->opts.virtual_timer)
+        chip8_timer_update_ticks(chip);
+}
+
+void chip8_seed(struct chip8 *chip, uint32_t seed)
+{
+    chip->opts.seed = seed;
+    chip->rand_state = rand_init(seed);
+}
+
+uint64_t chip8_display_hash(const struct chip8 *chip)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++) {
+        for (int w = 0; w < CHIP8_DISPLAY_ROW_WORDS; w++) {
+            for (int b = 56; b >= 0; b -= 8) {
+                hash ^= (chip->display[y][w] >> b) & 0xFF;
+                hash *= FNV_PRIME;
+            }
+        }
+    }
+    hash ^= chip->highres;
+    hash *= FNV_PRIME;
+    return hash;
+}
+
+uint64_t chip8_state_hash(const struct chip8 *chip)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    hash = hash_bytes(hash, chip->mem, sizeof chip->mem);
+    hash = hash_bytes(hash, chip->regs, sizeof chip->regs);
+    hash = hash_bytes(hash, chip->rpl, sizeof chip->rpl);
+    hash = hash_word(hash, chip->reg_i);
+    hash = hash_word(hash, chip->reg_dt << 8 | chip->reg_st);
+    hash = hash_word(hash, chip->pc);
+    hash = hash_word(hash, chip->halted);
+    hash = hash_word(hash, chip->stack_size);
+    for (int i = 0; i < chip->stack_size; i++)
+        hash = hash_word(hash, chip->call_stack[i]);
+    return hash;
+}
+
+bool chip8_display_pixel(const struct chip8 *chip, int x, int y)
+{
+    return (chip->display[y][x / 64] >> (63 - x % 64)) & 1;
+}
+
+void chip8_display_flush(struct chip8 *chip)
+{
+    if (chip->dirty_rows == 0)
+        return;
+    if (chip->draw_callback)
+        chip->draw_callback(chip, chip->dirty_rows);
+    chip->dirty_rows = 0;
+}
+
 struct chip8_instruction chip8_current_instr(struct chip8 *chip)
 {
-    /* The Chip-8 is big-endian */
-    uint16_t opcode = ((uint16_t)chip->mem[chip->pc] << 8) |
-        (uint16_t)chip->mem[chip->pc + 1];
-    return chip8_instruction_from_opcode(opcode, chip->opts.shift_quirks);
+    size_t slot = chip->pc / 2;
+
+    /*
+     * Misaligned instructions can't be cached, since the cache is indexed by
+     * word; they should never happen in practice anyways.
+     */
+    if (chip->pc % 2 != 0)
+        return chip8_decode(chip, chip->pc);
+    if (!chip->instr_valid[slot]) {
+        chip->instr_cache[slot] = chip8_decode(chip, chip->pc);
+        chip->instr_valid[slot] = true;
+    }
+    return chip->instr_cache[slot];
+}
+
+void chip8_mem_invalidate(struct chip8 *chip, uint16_t addr, size_t len)
+{
+    size_t end;
+
+    if (len == 0 || addr >= CHIP8_MEM_SIZE)
+        return;
+    end = addr + len > CHIP8_MEM_SIZE ? CHIP8_MEM_SIZE : addr + len;
+    /*
+     * A write to an odd address affects the instruction starting one byte
+     * before it, which is why the slot calculation rounds down.
+     */
+    memset(chip->instr_valid + addr / 2, 0, (end - 1) / 2 - addr / 2 + 1);
+
+    /*
+     * A block depends on its instructions and on the one which ended it, so
+     * we need to look back for any blocks which reach into the range.
+     */
+    for (int slot = (int)(addr / 2) - CHIP8_BLOCK_MAX; slot <= (int)((end - 1) / 2); slot++)
+        if (slot >= 0 && slot + chip->block_len[slot] > addr / 2)
+            chip->block_len[slot] = 0;
 }
 
 int chip8_execute_opcode(struct chip8 *chip, uint16_t opcode)
 {
     chip->mem[chip->pc] = (opcode & 0xFF00) >> 8;
     chip->mem[chip->pc + 1] = opcode & 0xFF;
+    chip8_mem_invalidate(chip, chip->pc, 2);
     return chip8_step(chip);
 }
 
-int chip8_load_from_bytes(struct chip8 *chip, uint8_t *bytes, size_t len)
+int chip8_load_from_bytes(struct chip8 *chip, const uint8_t *bytes, size_t len)
 {
-    int mempos = CHIP8_PROG_START;
-
-    while (len--) {
-        if (mempos >= CHIP8_MEM_SIZE) {
-            log_error("Input program is too big");
-            return -1;
-        }
-        chip->mem[mempos++] = *bytes++;
+    if (len > CHIP8_PROG_SIZE) {
+        log_error("Input program is too big");
+        return -1;
     }
+    if (len > 0)
+        memcpy(chip->mem + CHIP8_PROG_START, bytes, len);
+    chip8_mem_invalidate(chip, CHIP8_PROG_START, len);
 
     return 0;
 }
 
 int chip8_load_from_file(struct chip8 *chip, FILE *file)
 {
-    int c;
-    int mempos = CHIP8_PROG_START;
+    /* One byte more than fits, to tell whether the program is too big */
+    uint8_t buf[CHIP8_PROG_SIZE + 1];
+    size_t len = fread(buf, 1, sizeof buf, file);
 
-    while ((c = getc(file)) != EOF) {
-        if (mempos >= CHIP8_MEM_SIZE) {
-            log_error("Input program is too big");
-            return -1;
-        }
-        chip->mem[mempos++] = c;
-    }
     if (ferror(file)) {
-        log_error("Error reading from game file: ", strerror(errno));
+        log_error("Error reading from game file: %s", strerror(errno));
         return 1;
     }
-
-    return 0;
+    return chip8_load_from_bytes(chip, buf, len);
 }
 
 int chip8_step(struct chip8 *chip)
+{
+    if (chip->halted) {
+        log_warning("Attempted to execute an instruction in a halted interpreter");
+        return 0;
+    }
+    return chip8_cycle(chip, log_get_level() >= LOG_TRACE);
+}
+
+enum chip8_run_status chip8_run_cycles(struct chip8 *chip, unsigned long n)
+{
+    return chip8_run(chip, n, false);
+}
+
+enum chip8_run_status chip8_run_until_frame(struct chip8 *chip)
+{
+    return chip8_run(chip, chip->opts.instrs_per_tick, true);
+}
+
+static int chip8_cycle(struct chip8 *chip, bool trace)
 {
     struct chip8_instruction instr;
     char instr_fmt[100];
 
-    if (!chip->halted) {
-        if (chip->pc >= CHIP8_MEM_SIZE) {
-            log_error("Program counter went out of bounds");
-            chip->halted = true;
-        }
+    if (chip->pc >= CHIP8_MEM_SIZE - 1) {
+        log_error("Program counter went out of bounds");
+        chip->halted = true;
+        return 1;
+    }
 
-        instr = chip8_current_instr(chip);
-        if (log_get_level() >= LOG_TRACE) {
-            chip8_instruction_format(instr, NULL, instr_fmt, sizeof(instr_fmt));
-            log_trace("Executing instruction (PC %03X) %s", chip->pc, instr_fmt);
+    instr = chip8_current_instr(chip);
+    if (trace) {
+        chip8_instruction_format(instr, NULL, instr_fmt, sizeof(instr_fmt));
+        log_trace("Executing instruction (PC %03X) %s", chip->pc, instr_fmt);
+    }
+    if (chip->profile) {
+        if (chip8_profile_execute(chip, instr) != 0) {
+            log_error("Aborting execution");
+            return 1;
         }
-        if (chip8_execute(chip, instr, &chip->pc) != 0) {
+    } else if (chip->trace) {
+        if (chip8_trace_execute(chip, instr) != 0) {
             log_error("Aborting execution");
             return 1;
         }
+    } else if (chip8_execute(chip, instr, &chip->pc) != 0) {
+        log_error("Aborting execution");
+        return 1;
+    }
+    chip->cycles++;
+
+    if (chip->opts.virtual_timer) {
+        if (++chip->tick_instrs >= chip->opts.instrs_per_tick)
+            chip8_timer_virtual_tick(chip);
+    } else if (chip->opts.enable_timer) {
+        unsigned long nanos = NANOS_IN_SECOND / chip->opts.timer_freq / DELAY_TICK_FRACTION;
+        nanosleep(&(struct timespec){
+            .tv_sec = nanos / NANOS_IN_SECOND,
+            .tv_nsec = nanos % NANOS_IN_SECOND,
+        }, NULL);
+    }
+
+    return 0;
+}
+
+static unsigned long chip8_block_len(struct chip8 *chip)
+{
+    size_t start = chip->pc / 2, slot;
+
+    if (chip->pc % 2 != 0 || chip->pc >= CHIP8_MEM_SIZE)
+        return 0;
+    if (chip->block_len[start] != 0)
+        return chip->block_len[start] - 1;
 
-        if (chip->opts.enable_timer) {
-            unsigned long nanos = NANOS_IN_SECOND / chip->opts.timer_freq / DELAY_TICK_FRACTION;
-            nanosleep(&(struct timespec){
-                .tv_sec = nanos / NANOS_IN_SECOND,
-                .tv_nsec = nanos % NANOS_IN_SECOND,
-            }, NULL);
+    for (slot = start; slot < CHIP8_MEM_SIZE / 2 &&
+         slot - start < CHIP8_BLOCK_MAX; slot++) {
+        if (!chip->instr_valid[slot]) {
+            chip->instr_cache[slot] = chip8_decode(chip, 2 * slot);
+            chip->instr_valid[slot] = true;
         }
-    } else {
-        log_warning("Attempted to execute an instruction in a halted interpreter");
+        if (!chip8_block_allows(chip->instr_cache[slot]))
+            break;
+    }
+    chip->block_len[start] = slot - start + 1;
+    return slot - start;
+}
+
+static bool chip8_block_allows(struct chip8_instruction instr)
+{
+    if (chip8_instruction_is_control(instr))
+        return false;
+    switch (instr.op) {
+    /* These may wait for the next tick */
+    case OP_SCD:
+    case OP_SCR:
+    case OP_SCL:
+    case OP_DRW:
+    /* This may not advance the program counter */
+    case OP_LD_KEY:
+    /* These write to memory, possibly invalidating the block itself */
+    case OP_LD_B:
+    case OP_LD_DEREF_I_REG:
+    /* This logs a warning, so there's no point in hurrying */
+    case OP_INVALID:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static int chip8_block_run(struct chip8 *chip, unsigned long n)
+{
+    const struct chip8_instruction *instrs = chip->instr_cache + chip->pc / 2;
+    const bool traced = chip->trace != NULL;
+
+    for (unsigned long i = 0; i < n; i++)
+        if ((traced ? chip8_trace_execute(chip, instrs[i])
+                    : chip8_execute(chip, instrs[i], &chip->pc)) != 0) {
+            log_error("Aborting execution");
+            chip->cycles += i;
+            if (chip->opts.virtual_timer)
+                chip->tick_instrs += i;
+            return 1;
+        }
+    chip->cycles += n;
+    if (chip->opts.virtual_timer) {
+        chip->tick_instrs += n;
+        if (chip->tick_instrs >= chip->opts.instrs_per_tick)
+            chip8_timer_virtual_tick(chip);
     }
 
     return 0;
 }
 
+static struct chip8_instruction chip8_decode(
+    const struct chip8 *chip, uint16_t addr)
+{
+    /* The Chip-8 is big-endian */
+    uint16_t opcode = ((uint16_t)chip->mem[addr] << 8) |
+        (uint16_t)chip->mem[addr + 1];
+    return chip8_instruction_from_opcode(opcode, chip->opts.shift_quirks);
+}
+
+static bool chip8_draw_row(struct chip8 *chip, int x, int y, uint64_t bits)
+{
+    uint64_t *row = chip->display[y];
+    uint64_t masks[CHIP8_DISPLAY_ROW_WORDS] = {0};
+    int word = x / 64, shift = x % 64;
+    bool collision = false;
+
+    masks[word] = bits >> shift;
+    if (shift != 0 && word + 1 < CHIP8_DISPLAY_ROW_WORDS)
+        masks[word + 1] = bits << (64 - shift);
+
+    for (int w = 0; w < CHIP8_DISPLAY_ROW_WORDS; w++) {
+        collision = collision || (row[w] & masks[w]) != 0;
+        row[w] ^= masks[w];
+    }
+    if (bits != 0)
+        chip->dirty_rows |= (uint64_t)1 << y;
+
+    return collision;
+}
+
 static bool chip8_draw_sprite(struct chip8 *chip, int x, int y, uint16_t sprite_start, uint16_t sprite_len)
 {
     bool collision = false;
 
-    /*
-     * Low-resolution sprites are always 8 pixels wide. Here, j will be the
-     * column of the sprite to draw, so it is an index from the most significant
-     * byte of the sprite at row i.
-     */
-    for (int i = 0; i < sprite_len && y + i < CHIP8_DISPLAY_HEIGHT; i++)
-        for (int j = 0; j < 8 && x + j < CHIP8_DISPLAY_WIDTH; j++)
-            if (chip->mem[sprite_start + i] & (1 << (7 - j))) {
-                int dispx = x + j, dispy = y + i;
-                /* If the pixel on screen is set, we have a collision */
-                collision = collision || chip->display[dispx][dispy];
-                chip->display[dispx][dispy] = !chip->display[dispx][dispy];
-                if (chip->draw_callback)
-                    chip->draw_callback(dispx, dispy, chip->display[dispx][dispy], chip->highres);
-            }
+    if (x >= CHIP8_DISPLAY_WIDTH)
+        return false;
+    /* Low-resolution sprites are always 8 pixels wide */
+    for (int i = 0; i < sprite_len && y + i < CHIP8_DISPLAY_HEIGHT; i++) {
+        uint64_t bits = (uint64_t)chip->mem[sprite_start + i] << 56;
+        if (chip8_draw_row(chip, x, y + i, bits))
+            collision = true;
+    }
 
     return collision;
 }
@@ -297,346 +907,1091 @@ static bool chip8_draw_sprite_high(struct chip8 *chip, int x, int y, uint16_t sp
 {
     bool collision = false;
 
-    /*
-     * High-resolution sprites are always 16x16. Here, i is the row of the
-     * sprite to draw and j is the column.
-     */
-    for (int i = 0; i < 16 && y + i < CHIP8_DISPLAY_HEIGHT; i++)
-        for (int j = 0; j < 16 && x + j < CHIP8_DISPLAY_WIDTH; j++) {
-            int bytepos = sprite_start + 2 * i + j / 8;
-            int bitpos = 7 - j % 8;
-            if (chip->mem[bytepos] & (1 << bitpos)) {
-                int dispx = x + j, dispy = y + i;
-                /* If the pixel on screen is set, we have a collision */
-                collision = collision || chip->display[dispx][dispy];
-                chip->display[dispx][dispy] = !chip->display[dispx][dispy];
-                if (chip->draw_callback)
-                    chip->draw_callback(dispx, dispy, chip->display[dispx][dispy], chip->highres);
-            }
-        }
+    if (x >= CHIP8_DISPLAY_WIDTH)
+        return false;
+    /* High-resolution sprites are always 16x16 */
+    for (int i = 0; i < 16 && y + i < CHIP8_DISPLAY_HEIGHT; i++) {
+        uint64_t bits = (uint64_t)chip->mem[sprite_start + 2 * i] << 56 |
+            (uint64_t)chip->mem[sprite_start + 2 * i + 1] << 48;
+        if (chip8_draw_row(chip, x, y + i, bits))
+            collision = true;
+    }
 
     return collision;
 }
 
 static void chip8_log_regs(const struct chip8 *chip)
 {
-    log_message_begin(LOG_DEBUG);
-    log_message_part("Register values: ");
+    char buf[16 * sizeof "VX = XX; "];
+    size_t len = 0;
+
+    if (log_get_level() < LOG_DEBUG)
+        return;
+    /*
+     * The message is built up here rather than using a multi-part log message
+     * so that several interpreters can log from different threads.
+     */
     for (int i = 0; i < 16; i++)
-        log_message_part("V%X = %02X; ", i, chip->regs[i]);
-    log_message_part("DT = %02X; ST = %02X; I = %04X; PC = %04X", chip->reg_dt,
-        chip->reg_st, chip->reg_i, chip->pc);
-    log_message_end();
+        len += snprintf(
+            buf + len, sizeof buf - len, "V%X = %02X; ", i, chip->regs[i]);
+    log_debug("Register values: %sDT = %02X; ST = %02X; I = %04X; PC = %04X",
+        buf, chip->reg_dt, chip->reg_st, chip->reg_i, chip->pc);
 }
 
 static int chip8_execute(struct chip8 *chip, struct chip8_instruction inst, uint16_t *pc)
 {
     uint16_t new_pc;
+    int err = 0;
 
-    if (chip->opts.enable_timer)
+    if (chip->opts.enable_timer && !chip->opts.virtual_timer)
         chip8_timer_update(chip);
 
     new_pc = chip->pc + 2;
-    switch (inst.op) {
-    case OP_INVALID:
-        log_warning("Invalid instruction encountered and ignored (opcode 0x%hX)", inst.opcode);
-        break;
-    case OP_SCD:
-        if (chip->opts.delay_draws)
-            chip8_wait_cycle(chip);
-        for (int y = CHIP8_DISPLAY_HEIGHT - 1; y >= inst.nibble; y--)
-            for (int x = 0; x < CHIP8_DISPLAY_WIDTH; x++)
-                chip->display[x][y] = chip->display[x][y - inst.nibble];
-        for (int x = 0; x < CHIP8_DISPLAY_WIDTH; x++)
-            memset(chip->display[x], 0, inst.nibble);
-        chip->needs_full_redraw = true;
-        break;
-    case OP_CLS:
-        memset(chip->display, 0, sizeof chip->display);
-        chip->needs_full_redraw = true;
-        break;
-    case OP_RET:
-        if (chip->call_stack) {
-            struct chip8_call_node *node = chip->call_stack;
-            /* Be sure to increment PAST the caller address! */
-            uint16_t retval = node->call_addr + 2;
-            chip->call_stack = node->next;
-            free(node);
-            new_pc = retval;
-        } else {
-            log_error("Tried to return from subroutine, but there is nothing to return to");
-            chip8_log_regs(chip);
-            return 1;
-        }
-        break;
-    case OP_SCR:
-        if (chip->opts.delay_draws)
-            chip8_wait_cycle(chip);
-        for (int x = CHIP8_DISPLAY_WIDTH - 1; x >= 4; x--)
-            memcpy(&chip->display[x], &chip->display[x - 4], sizeof(chip->display[x]));
-        for (int x = 0; x < 4; x++)
-            memset(chip->display[x], 0, sizeof chip->display[x]);
-        chip->needs_full_redraw = true;
-        break;
-    case OP_SCL:
-        if (chip->opts.delay_draws)
-            chip8_wait_cycle(chip);
-        for (int x = 0; x < CHIP8_DISPLAY_WIDTH - 4; x++)
-            memcpy(&chip->display[x], &chip->display[x + 4], sizeof(chip->display[x]));
-        for (int x = CHIP8_DISPLAY_WIDTH - 4; x < CHIP8_DISPLAY_WIDTH; x++)
-            memset(chip->display[x], 0, sizeof chip->display[x]);
-        chip->needs_full_redraw = true;
-        break;
-    case OP_EXIT:
-        chip->halted = true;
-        break;
-    case OP_LOW:
-        chip->highres = false;
-        chip->needs_full_redraw = true;
-        break;
-    case OP_HIGH:
-        chip->highres = true;
-        chip->needs_full_redraw = true;
-        break;
-    case OP_JP:
-        if (inst.addr % 2 == 0) {
-            new_pc = inst.addr;
-        } else {
-            log_error("Attempted to jump to misaligned memory address 0x%03X", inst.addr);
-            chip8_log_regs(chip);
-            return 1;
-        }
-        break;
-    case OP_CALL:
-        if (inst.addr % 2 == 0) {
-            struct chip8_call_node *node = xmalloc(sizeof(*node));
-            node->call_addr = chip->pc;
-            node->next = chip->call_stack;
-            chip->call_stack = node;
-            new_pc = inst.addr;
-        } else {
-            log_error("Attempted to call subroutine at misaligned memory address 0x%hX", inst.addr);
-            chip8_log_regs(chip);
-            return 1;
-        }
-        break;
-    case OP_SE_BYTE:
-        if (chip->regs[inst.vx] == inst.byte)
-            new_pc = chip->pc + 4;
-        break;
-    case OP_SNE_BYTE:
-        if (chip->regs[inst.vx] != inst.byte)
-            new_pc = chip->pc + 4;
-        break;
-    case OP_SE_REG:
-        if (chip->regs[inst.vx] == chip->regs[inst.vy])
-            new_pc = chip->pc + 4;
-        break;
-    case OP_LD_BYTE:
-        chip->regs[inst.vx] = inst.byte;
-        break;
-    case OP_ADD_BYTE: {
-        /* Check for carry */
-        uint8_t carry = inst.byte > 255 - chip->regs[inst.vx];
-        chip->regs[inst.vx] += inst.byte;
-        chip->regs[REG_VF] = carry;
-    } break;
-    case OP_LD_REG:
-        chip->regs[inst.vx] = chip->regs[inst.vy];
-        break;
-    case OP_OR:
-        chip->regs[inst.vx] |= chip->regs[inst.vy];
-        break;
-    case OP_AND:
-        chip->regs[inst.vx] &= chip->regs[inst.vy];
-        break;
-    case OP_XOR:
-        chip->regs[inst.vx] ^= chip->regs[inst.vy];
-        break;
-    case OP_ADD_REG: {
-        /* Check for carry */
-        uint8_t carry = chip->regs[inst.vy] > 255 - chip->regs[inst.vx];
-        chip->regs[inst.vx] += chip->regs[inst.vy];
-        chip->regs[REG_VF] = carry;
-    } break;
-    case OP_SUB: {
-        /* Check for borrow */
-        uint8_t borrow = chip->regs[inst.vy] <= chip->regs[inst.vx];
-        chip->regs[inst.vx] -= chip->regs[inst.vy];
-        chip->regs[REG_VF] = borrow;
-    } break;
-    case OP_SHR: {
-        uint8_t low = chip->regs[inst.vx] & 0x1;
-        chip->regs[inst.vx] >>= 1;
-        chip->regs[REG_VF] = low;
-    } break;
-    case OP_SHR_QUIRK: {
-        uint8_t low = chip->regs[inst.vy] & 0x1;
-        chip->regs[inst.vx] = chip->regs[inst.vy] >> 1;
-        chip->regs[REG_VF] = low;
-    } break;
-    case OP_SUBN: {
-        /* Check for borrow */
-        uint8_t borrow = chip->regs[inst.vx] <= chip->regs[inst.vy];
-        chip->regs[inst.vx] = chip->regs[inst.vy] - chip->regs[inst.vx];
-        chip->regs[REG_VF] = borrow;
-    } break;
-    case OP_SHL: {
-        uint8_t high = (chip->regs[inst.vx] & 0x80) >> 7;
-        chip->regs[inst.vx] <<= 1;
-        chip->regs[REG_VF] = high;
-    } break;
-    case OP_SHL_QUIRK: {
-        uint8_t high = (chip->regs[inst.vy] & 0x80) >> 7;
-        chip->regs[inst.vx] = chip->regs[inst.vy] << 1;
-        chip->regs[REG_VF] = high;
-    } break;
-    case OP_SNE_REG:
-        if (chip->regs[inst.vx] != chip->regs[inst.vy])
-            new_pc = chip->pc + 4;
-        break;
-    case OP_LD_I:
-        chip->reg_i = inst.addr;
-        break;
-    case OP_JP_V0: {
-        uint32_t jpto = (uint32_t)inst.addr + chip->regs[REG_V0];
-        if (jpto % 2 == 0) {
-            if (jpto < CHIP8_MEM_SIZE) {
-                new_pc = jpto;
-            } else {
-                log_error("Attempted to jump to out of bounds memory "
-                          "address 0x%X",
-                    jpto);
-                chip8_log_regs(chip);
-                return 1;
-            }
-        } else {
-            log_error("Attempted to jump to misaligned memory address "
-                      "0x%X",
-                jpto);
-            chip8_log_regs(chip);
-            return 1;
-        }
-    } break;
-    case OP_RND:
-        chip->regs[inst.vx] = rand_byte() & inst.byte;
-        break;
-    case OP_DRW:
-        if (chip->opts.delay_draws)
-            chip8_wait_cycle(chip);
-        if (inst.nibble == 0)
-            chip->regs[REG_VF] = chip8_draw_sprite_high(chip, chip->regs[inst.vx], chip->regs[inst.vy], chip->reg_i);
-        else
-            chip->regs[REG_VF] = chip8_draw_sprite(chip, chip->regs[inst.vx], chip->regs[inst.vy], chip->reg_i, inst.nibble);
-        break;
-    case OP_SKP:
-        if (chip->key_states & (1 << (chip->regs[inst.vx] & 0xF)))
-            new_pc = chip->pc + 4;
-        break;
-    case OP_SKNP:
-        if (!(chip->key_states & (1 << (chip->regs[inst.vx] & 0xF))))
-            new_pc = chip->pc + 4;
-        break;
-    case OP_LD_REG_DT:
-        chip->regs[inst.vx] = chip->reg_dt;
-        break;
-    case OP_LD_KEY: {
-        int key;
-        /*
-         * Wait for key press; if none is pressed right now, we just wait until
-         * the next step to check for one
-         */
-        if (chip->key_states == 0) {
-            new_pc = chip->pc;
+    if (chip->opts.dispatch == CHIP8_DISPATCH_TABLE) {
+        /* The opcode is read again, so that it needn't be kept decoded */
+        err = chip8_dispatch_opcode(chip,
+            (uint16_t)chip->mem[chip->pc] << 8 | chip->mem[chip->pc + 1],
+            &new_pc);
+    } else {
+        switch (inst.op) {
+        case OP_INVALID:
+            err = chip8_op_invalid(chip, inst, &new_pc);
+            break;
+        case OP_SCD:
+            err = chip8_op_scd(chip, inst, &new_pc);
+            break;
+        case OP_CLS:
+            err = chip8_op_cls(chip, inst, &new_pc);
+            break;
+        case OP_RET:
+            err = chip8_op_ret(chip, inst, &new_pc);
+            break;
+        case OP_SCR:
+            err = chip8_op_scr(chip, inst, &new_pc);
+            break;
+        case OP_SCL:
+            err = chip8_op_scl(chip, inst, &new_pc);
+            break;
+        case OP_EXIT:
+            err = chip8_op_exit(chip, inst, &new_pc);
+            break;
+        case OP_LOW:
+            err = chip8_op_low(chip, inst, &new_pc);
+            break;
+        case OP_HIGH:
+            err = chip8_op_high(chip, inst, &new_pc);
+            break;
+        case OP_JP:
+            err = chip8_op_jp(chip, inst, &new_pc);
+            break;
+        case OP_CALL:
+            err = chip8_op_call(chip, inst, &new_pc);
+            break;
+        case OP_SE_BYTE:
+            err = chip8_op_se_byte(chip, inst, &new_pc);
+            break;
+        case OP_SNE_BYTE:
+            err = chip8_op_sne_byte(chip, inst, &new_pc);
+            break;
+        case OP_SE_REG:
+            err = chip8_op_se_reg(chip, inst, &new_pc);
+            break;
+        case OP_LD_BYTE:
+            err = chip8_op_ld_byte(chip, inst, &new_pc);
+            break;
+        case OP_ADD_BYTE:
+            err = chip8_op_add_byte(chip, inst, &new_pc);
+            break;
+        case OP_LD_REG:
+            err = chip8_op_ld_reg(chip, inst, &new_pc);
+            break;
+        case OP_OR:
+            err = chip8_op_or(chip, inst, &new_pc);
+            break;
+        case OP_AND:
+            err = chip8_op_and(chip, inst, &new_pc);
+            break;
+        case OP_XOR:
+            err = chip8_op_xor(chip, inst, &new_pc);
+            break;
+        case OP_ADD_REG:
+            err = chip8_op_add_reg(chip, inst, &new_pc);
+            break;
+        case OP_SUB:
+            err = chip8_op_sub(chip, inst, &new_pc);
+            break;
+        case OP_SHR:
+            err = chip8_op_shr(chip, inst, &new_pc);
+            break;
+        case OP_SHR_QUIRK:
+            err = chip8_op_shr_quirk(chip, inst, &new_pc);
+            break;
+        case OP_SUBN:
+            err = chip8_op_subn(chip, inst, &new_pc);
+            break;
+        case OP_SHL:
+            err = chip8_op_shl(chip, inst, &new_pc);
+            break;
+        case OP_SHL_QUIRK:
+            err = chip8_op_shl_quirk(chip, inst, &new_pc);
+            break;
+        case OP_SNE_REG:
+            err = chip8_op_sne_reg(chip, inst, &new_pc);
+            break;
+        case OP_LD_I:
+            err = chip8_op_ld_i(chip, inst, &new_pc);
+            break;
+        case OP_JP_V0:
+            err = chip8_op_jp_v0(chip, inst, &new_pc);
+            break;
+        case OP_RND:
+            err = chip8_op_rnd(chip, inst, &new_pc);
+            break;
+        case OP_DRW:
+            err = chip8_op_drw(chip, inst, &new_pc);
+            break;
+        case OP_SKP:
+            err = chip8_op_skp(chip, inst, &new_pc);
+            break;
+        case OP_SKNP:
+            err = chip8_op_sknp(chip, inst, &new_pc);
+            break;
+        case OP_LD_REG_DT:
+            err = chip8_op_ld_reg_dt(chip, inst, &new_pc);
+            break;
+        case OP_LD_KEY:
+            err = chip8_op_ld_key(chip, inst, &new_pc);
+            break;
+        case OP_LD_DT_REG:
+            err = chip8_op_ld_dt_reg(chip, inst, &new_pc);
+            break;
+        case OP_LD_ST:
+            err = chip8_op_ld_st(chip, inst, &new_pc);
+            break;
+        case OP_ADD_I:
+            err = chip8_op_add_i(chip, inst, &new_pc);
+            break;
+        case OP_LD_F:
+            err = chip8_op_ld_f(chip, inst, &new_pc);
+            break;
+        case OP_LD_HF:
+            err = chip8_op_ld_hf(chip, inst, &new_pc);
+            break;
+        case OP_LD_B:
+            err = chip8_op_ld_b(chip, inst, &new_pc);
+            break;
+        case OP_LD_DEREF_I_REG:
+            err = chip8_op_ld_deref_i_reg(chip, inst, &new_pc);
+            break;
+        case OP_LD_REG_DEREF_I:
+            err = chip8_op_ld_reg_deref_i(chip, inst, &new_pc);
+            break;
+        case OP_LD_R_REG:
+            err = chip8_op_ld_r_reg(chip, inst, &new_pc);
+            break;
+        case OP_LD_REG_R:
+            err = chip8_op_ld_reg_r(chip, inst, &new_pc);
             break;
         }
-        key = ffs(chip->key_states) - 1;
-        chip->regs[inst.vx] = key;
-        /* Now we need to clear it so that we don't read it twice */
-        chip->key_states &= ~(1 << key);
-    } break;
-    case OP_LD_DT_REG:
-        chip->reg_dt = chip->regs[inst.vx];
-        break;
-    case OP_LD_ST:
-        chip->reg_st = chip->regs[inst.vx];
-        break;
-    case OP_ADD_I:
-        chip->reg_i += chip->regs[inst.vx];
-        break;
-    case OP_LD_F:
-        chip->reg_i = CHIP8_HEX_LOW_ADDR +
-            CHIP8_HEX_LOW_HEIGHT * (chip->regs[inst.vx] & 0xF);
-        break;
-    case OP_LD_HF:
-        chip->reg_i = CHIP8_HEX_HIGH_ADDR +
-            CHIP8_HEX_HIGH_HEIGHT * (chip->regs[inst.vx] & 0xF);
-        break;
-    case OP_LD_B:
-        /* Note that register Vx is only a byte, so it's 3 digits or fewer */
-        chip->mem[chip->reg_i] = chip->regs[inst.vx] / 100;
-        chip->mem[chip->reg_i + 1] = (chip->regs[inst.vx] / 10) % 10;
-        chip->mem[chip->reg_i + 2] = chip->regs[inst.vx] % 10;
-        break;
-    case OP_LD_DEREF_I_REG: {
-        size_t cpy_len = sizeof(chip->regs[0]) * (inst.vx + 1);
-
-        if (chip->reg_i + cpy_len - 1 >= CHIP8_MEM_SIZE) {
-            log_error("Tried to write to out of bounds memory");
-            chip8_log_regs(chip);
-            return 1;
-        }
-        memcpy(chip->mem + chip->reg_i, chip->regs, cpy_len);
-        if (chip->opts.load_quirks)
-            chip->reg_i += cpy_len;
-    } break;
-    case OP_LD_REG_DEREF_I: {
-        size_t cpy_len = sizeof(chip->regs[0]) * (inst.vx + 1);
-
-        if (chip->reg_i + cpy_len - 1 >= CHIP8_MEM_SIZE) {
-            log_error("Tried to read from out of bounds memory");
-            chip8_log_regs(chip);
-            return 1;
-        }
-        memcpy(chip->regs, chip->mem + chip->reg_i, cpy_len);
-        if (chip->opts.load_quirks)
-            chip->reg_i += cpy_len;
-    } break;
-    case OP_LD_R_REG:
-        if (inst.vx > 7) {
-            log_error(
-                "Instruction LD R, V%X would store too much data (%X > 7)",
-                inst.vx, inst.vx);
-            chip8_log_regs(chip);
-            return 1;
-        }
-        memcpy(chip->rpl, chip->regs, inst.vx + 1);
-        break;
-    case OP_LD_REG_R:
-        if (inst.vx > 7) {
-            log_error(
-                "Instruction LD V%X, R would load too much data (%X > 7)");
+    }
+    if (err != 0)
+        return err;
+
+    if (pc)
+        *pc = new_pc;
+    return 0;
+}
+
+static int chip8_profile_execute(
+    struct chip8 *chip, struct chip8_instruction inst)
+{
+    struct chip8_profile *profile = chip->profile;
+    uint64_t start, wait_start;
+    int err;
+
+    profile->pc_counts[chip->pc]++;
+    profile->op_counts[inst.op - OP_INVALID]++;
+    if (inst.op != OP_DRW)
+        return chip->trace ? chip8_trace_execute(chip, inst)
+                           : chip8_execute(chip, inst, &chip->pc);
+
+    start = chip8_profile_nanos();
+    wait_start = profile->wait_nanos;
+    err = chip->trace ? chip8_trace_execute(chip, inst)
+                      : chip8_execute(chip, inst, &chip->pc);
+    profile->draw_nanos +=
+        chip8_profile_nanos() - start - (profile->wait_nanos - wait_start);
+    return err;
+}
+
+static uint64_t chip8_profile_nanos(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NANOS_IN_SECOND + ts.tv_nsec;
+}
+
+static int chip8_trace_execute(
+    struct chip8 *chip, struct chip8_instruction inst)
+{
+    struct chip8_trace *trace = chip->trace;
+    struct chip8_trace_record *rec =
+        &trace->records[trace->count++ & trace->mask];
+    uint8_t before[16];
+    uint16_t changed = 0;
+    int err;
+
+    rec->pc = chip->pc;
+    rec->opcode = (uint16_t)chip->mem[chip->pc] << 8 | chip->mem[chip->pc + 1];
+    rec->reg_i = chip->reg_i;
+    memcpy(before, chip->regs, sizeof before);
+    err = chip8_execute(chip, inst, &chip->pc);
+    /* Most instructions change at most one register, so compare in halves */
+    for (int half = 0; half < 16; half += 8) {
+        uint64_t old_regs, new_regs;
+
+        memcpy(&old_regs, before + half, 8);
+        memcpy(&new_regs, chip->regs + half, 8);
+        if (old_regs == new_regs)
+            continue;
+        for (int i = half; i < half + 8; i++)
+            changed |= (uint16_t)(before[i] != chip->regs[i]) << i;
+    }
+    rec->changed = changed;
+    return err;
+}
+
+static int chip8_dispatch_opcode(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    return chip8_group_handlers[opcode >> 12](chip, opcode, new_pc);
+}
+
+static int chip8_dispatch_op(struct chip8 *chip,
+    int (*op)(struct chip8 *, struct chip8_instruction, uint16_t *),
+    struct chip8_instruction inst, uint16_t opcode, uint16_t *new_pc)
+{
+    if (op == NULL) {
+        inst.opcode = opcode;
+        return chip8_op_invalid(chip, inst, new_pc);
+    }
+    return op(chip, inst, new_pc);
+}
+
+static int chip8_group_0(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.nibble = OPCODE2NIBBLE(opcode)};
+
+    return chip8_dispatch_op(chip, chip8_sys_handlers[OPCODE2BYTE(opcode)], inst, opcode, new_pc);
+}
+
+static int chip8_group_1(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.addr = OPCODE2ADDR(opcode)};
+
+    return chip8_op_jp(chip, inst, new_pc);
+}
+
+static int chip8_group_2(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.addr = OPCODE2ADDR(opcode)};
+
+    return chip8_op_call(chip, inst, new_pc);
+}
+
+static int chip8_group_3(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.vx = OPCODE2VX(opcode), .byte = OPCODE2BYTE(opcode)};
+
+    return chip8_op_se_byte(chip, inst, new_pc);
+}
+
+static int chip8_group_4(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.vx = OPCODE2VX(opcode), .byte = OPCODE2BYTE(opcode)};
+
+    return chip8_op_sne_byte(chip, inst, new_pc);
+}
+
+static int chip8_group_5(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.vx = OPCODE2VX(opcode),
+        .vy = OPCODE2VY(opcode)};
+
+    return chip8_dispatch_op(chip,
+        OPCODE2NIBBLE(opcode) == 0 ? chip8_op_se_reg : NULL, inst, opcode, new_pc);
+}
+
+static int chip8_group_6(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.vx = OPCODE2VX(opcode), .byte = OPCODE2BYTE(opcode)};
+
+    return chip8_op_ld_byte(chip, inst, new_pc);
+}
+
+static int chip8_group_7(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.vx = OPCODE2VX(opcode), .byte = OPCODE2BYTE(opcode)};
+
+    return chip8_op_add_byte(chip, inst, new_pc);
+}
+
+static int chip8_group_8(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.vx = OPCODE2VX(opcode),
+        .vy = OPCODE2VY(opcode)};
+
+    return chip8_dispatch_op(chip,
+        chip8_alu_handlers[chip->opts.shift_quirks][OPCODE2NIBBLE(opcode)], inst,
+        opcode, new_pc);
+}
+
+static int chip8_group_9(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.vx = OPCODE2VX(opcode),
+        .vy = OPCODE2VY(opcode)};
+
+    return chip8_dispatch_op(chip,
+        OPCODE2NIBBLE(opcode) == 0 ? chip8_op_sne_reg : NULL, inst, opcode, new_pc);
+}
+
+static int chip8_group_a(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.addr = OPCODE2ADDR(opcode)};
+
+    return chip8_op_ld_i(chip, inst, new_pc);
+}
+
+static int chip8_group_b(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.addr = OPCODE2ADDR(opcode)};
+
+    return chip8_op_jp_v0(chip, inst, new_pc);
+}
+
+static int chip8_group_c(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.vx = OPCODE2VX(opcode), .byte = OPCODE2BYTE(opcode)};
+
+    return chip8_op_rnd(chip, inst, new_pc);
+}
+
+static int chip8_group_d(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.vx = OPCODE2VX(opcode),
+        .vy = OPCODE2VY(opcode), .nibble = OPCODE2NIBBLE(opcode)};
+
+    return chip8_op_drw(chip, inst, new_pc);
+}
+
+static int chip8_group_e(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.vx = OPCODE2VX(opcode)};
+
+    return chip8_dispatch_op(chip, chip8_key_handlers[OPCODE2BYTE(opcode)], inst, opcode, new_pc);
+}
+
+static int chip8_group_f(
+    struct chip8 *chip, uint16_t opcode, uint16_t *new_pc)
+{
+    struct chip8_instruction inst = {.vx = OPCODE2VX(opcode)};
+
+    return chip8_dispatch_op(chip, chip8_misc_handlers[OPCODE2BYTE(opcode)], inst, opcode, new_pc);
+}
+
+static int chip8_op_invalid(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(chip);
+    UNUSED(new_pc);
+    log_warning("Invalid instruction encountered and ignored (opcode 0x%hX)", inst.opcode);
+    return 0;
+}
+
+static int chip8_op_scd(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    if (chip->opts.delay_draws)
+        chip8_wait_cycle(chip);
+    memmove(chip->display[inst.nibble], chip->display[0],
+        (CHIP8_DISPLAY_HEIGHT - inst.nibble) * sizeof chip->display[0]);
+    memset(chip->display[0], 0, inst.nibble * sizeof chip->display[0]);
+    chip->dirty_rows = CHIP8_DISPLAY_ALL_ROWS;
+    return 0;
+}
+
+static int chip8_op_cls(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(inst);
+    UNUSED(new_pc);
+    memset(chip->display, 0, sizeof chip->display);
+    chip->dirty_rows = CHIP8_DISPLAY_ALL_ROWS;
+    return 0;
+}
+
+static int chip8_op_ret(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(inst);
+    if (chip->stack_size > 0) {
+        /* Be sure to increment PAST the caller address! */
+        *new_pc = chip->call_stack[--chip->stack_size] + 2;
+    } else {
+        log_error("Tried to return from subroutine, but there is nothing to return to");
+        chip8_log_regs(chip);
+        return 1;
+    }
+    return 0;
+}
+
+static int chip8_op_scr(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(inst);
+    UNUSED(new_pc);
+    if (chip->opts.delay_draws)
+        chip8_wait_cycle(chip);
+    for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++) {
+        uint64_t *row = chip->display[y];
+        for (int w = CHIP8_DISPLAY_ROW_WORDS - 1; w > 0; w--)
+            row[w] = row[w] >> 4 | row[w - 1] << 60;
+        row[0] >>= 4;
+    }
+    chip->dirty_rows = CHIP8_DISPLAY_ALL_ROWS;
+    return 0;
+}
+
+static int chip8_op_scl(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(inst);
+    UNUSED(new_pc);
+    if (chip->opts.delay_draws)
+        chip8_wait_cycle(chip);
+    for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++) {
+        uint64_t *row = chip->display[y];
+        for (int w = 0; w < CHIP8_DISPLAY_ROW_WORDS - 1; w++)
+            row[w] = row[w] << 4 | row[w + 1] >> 60;
+        row[CHIP8_DISPLAY_ROW_WORDS - 1] <<= 4;
+    }
+    chip->dirty_rows = CHIP8_DISPLAY_ALL_ROWS;
+    return 0;
+}
+
+static int chip8_op_exit(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(inst);
+    UNUSED(new_pc);
+    chip->halted = true;
+    return 0;
+}
+
+static int chip8_op_low(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(inst);
+    UNUSED(new_pc);
+    chip->highres = false;
+    chip->dirty_rows = CHIP8_DISPLAY_ALL_ROWS;
+    return 0;
+}
+
+static int chip8_op_high(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(inst);
+    UNUSED(new_pc);
+    chip->highres = true;
+    chip->dirty_rows = CHIP8_DISPLAY_ALL_ROWS;
+    return 0;
+}
+
+static int chip8_op_jp(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(chip);
+    if (inst.addr % 2 == 0) {
+        *new_pc = inst.addr;
+    } else {
+        log_error("Attempted to jump to misaligned memory address 0x%03X", inst.addr);
+        chip8_log_regs(chip);
+        return 1;
+    }
+    return 0;
+}
+
+static int chip8_op_call(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    if (inst.addr % 2 != 0) {
+        log_error("Attempted to call subroutine at misaligned memory address 0x%hX", inst.addr);
+        chip8_log_regs(chip);
+        return 1;
+    } else if (chip->stack_size == CHIP8_STACK_DEPTH) {
+        log_error("Call stack overflow (maximum depth is %d)", CHIP8_STACK_DEPTH);
+        chip8_log_regs(chip);
+        return 1;
+    } else {
+        chip->call_stack[chip->stack_size++] = chip->pc;
+        *new_pc = inst.addr;
+    }
+    return 0;
+}
+
+static int chip8_op_se_byte(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    if (chip->regs[inst.vx] == inst.byte)
+        *new_pc = chip->pc + 4;
+    return 0;
+}
+
+static int chip8_op_sne_byte(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    if (chip->regs[inst.vx] != inst.byte)
+        *new_pc = chip->pc + 4;
+    return 0;
+}
+
+static int chip8_op_se_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    if (chip->regs[inst.vx] == chip->regs[inst.vy])
+        *new_pc = chip->pc + 4;
+    return 0;
+}
+
+static int chip8_op_ld_byte(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->regs[inst.vx] = inst.byte;
+    return 0;
+}
+
+static int chip8_op_add_byte(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    /* Check for carry */
+    uint8_t carry = inst.byte > 255 - chip->regs[inst.vx];
+
+    UNUSED(new_pc);
+
+    chip->regs[inst.vx] += inst.byte;
+    chip->regs[REG_VF] = carry;
+    return 0;
+}
+
+static int chip8_op_ld_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->regs[inst.vx] = chip->regs[inst.vy];
+    return 0;
+}
+
+static int chip8_op_or(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->regs[inst.vx] |= chip->regs[inst.vy];
+    return 0;
+}
+
+static int chip8_op_and(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->regs[inst.vx] &= chip->regs[inst.vy];
+    return 0;
+}
+
+static int chip8_op_xor(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->regs[inst.vx] ^= chip->regs[inst.vy];
+    return 0;
+}
+
+static int chip8_op_add_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    /* Check for carry */
+    uint8_t carry = chip->regs[inst.vy] > 255 - chip->regs[inst.vx];
+
+    UNUSED(new_pc);
+
+    chip->regs[inst.vx] += chip->regs[inst.vy];
+    chip->regs[REG_VF] = carry;
+    return 0;
+}
+
+static int chip8_op_sub(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    /* Check for borrow */
+    uint8_t borrow = chip->regs[inst.vy] <= chip->regs[inst.vx];
+
+    UNUSED(new_pc);
+
+    chip->regs[inst.vx] -= chip->regs[inst.vy];
+    chip->regs[REG_VF] = borrow;
+    return 0;
+}
+
+static int chip8_op_shr(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    uint8_t low = chip->regs[inst.vx] & 0x1;
+
+    UNUSED(new_pc);
+
+    chip->regs[inst.vx] >>= 1;
+    chip->regs[REG_VF] = low;
+    return 0;
+}
+
+static int chip8_op_shr_quirk(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    uint8_t low = chip->regs[inst.vy] & 0x1;
+
+    UNUSED(new_pc);
+
+    chip->regs[inst.vx] = chip->regs[inst.vy] >> 1;
+    chip->regs[REG_VF] = low;
+    return 0;
+}
+
+static int chip8_op_subn(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    /* Check for borrow */
+    uint8_t borrow = chip->regs[inst.vx] <= chip->regs[inst.vy];
+
+    UNUSED(new_pc);
+
+    chip->regs[inst.vx] = chip->regs[inst.vy] - chip->regs[inst.vx];
+    chip->regs[REG_VF] = borrow;
+    return 0;
+}
+
+static int chip8_op_shl(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    uint8_t high = (chip->regs[inst.vx] & 0x80) >> 7;
+
+    UNUSED(new_pc);
+
+    chip->regs[inst.vx] <<= 1;
+    chip->regs[REG_VF] = high;
+    return 0;
+}
+
+static int chip8_op_shl_quirk(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    uint8_t high = (chip->regs[inst.vy] & 0x80) >> 7;
+
+    UNUSED(new_pc);
+
+    chip->regs[inst.vx] = chip->regs[inst.vy] << 1;
+    chip->regs[REG_VF] = high;
+    return 0;
+}
+
+static int chip8_op_sne_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    if (chip->regs[inst.vx] != chip->regs[inst.vy])
+        *new_pc = chip->pc + 4;
+    return 0;
+}
+
+static int chip8_op_ld_i(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->reg_i = inst.addr;
+    return 0;
+}
+
+static int chip8_op_jp_v0(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    uint32_t jpto = (uint32_t)inst.addr + chip->regs[REG_V0];
+    if (jpto % 2 == 0) {
+        if (jpto < CHIP8_MEM_SIZE) {
+            *new_pc = jpto;
+        } else {
+            log_error("Attempted to jump to out of bounds memory "
+                      "address 0x%X",
+                jpto);
             chip8_log_regs(chip);
             return 1;
         }
-        memcpy(chip->regs, chip->rpl, inst.vx + 1);
-        break;
+    } else {
+        log_error("Attempted to jump to misaligned memory address "
+                  "0x%X",
+            jpto);
+        chip8_log_regs(chip);
+        return 1;
     }
+    return 0;
+}
 
-    if (pc)
-        *pc = new_pc;
+static int chip8_op_rnd(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->regs[inst.vx] = rand_byte(chip) & inst.byte;
     return 0;
 }
 
-static void chip8_timer_update(struct chip8 *chip)
+static int chip8_op_drw(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
 {
-    unsigned long old_ticks = chip->timer_ticks;
-    unsigned long elapsed;
+    UNUSED(new_pc);
+    if (chip->opts.delay_draws)
+        chip8_wait_cycle(chip);
+    if (inst.nibble == 0)
+        chip->regs[REG_VF] = chip8_draw_sprite_high(chip, chip->regs[inst.vx], chip->regs[inst.vy], chip->reg_i);
+    else
+        chip->regs[REG_VF] = chip8_draw_sprite(chip, chip->regs[inst.vx], chip->regs[inst.vy], chip->reg_i, inst.nibble);
+    return 0;
+}
 
-    chip8_timer_update_ticks(chip);
-    elapsed = chip->timer_ticks - old_ticks;
+static int chip8_op_skp(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    if (chip->key_states & (1 << (chip->regs[inst.vx] & 0xF)))
+        *new_pc = chip->pc + 4;
+    return 0;
+}
+
+static int chip8_op_sknp(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    if (!(chip->key_states & (1 << (chip->regs[inst.vx] & 0xF))))
+        *new_pc = chip->pc + 4;
+    return 0;
+}
+
+static int chip8_op_ld_reg_dt(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->regs[inst.vx] = chip->reg_dt;
+    return 0;
+}
+
+static int chip8_op_ld_key(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    int key;
+    /*
+     * Wait for key press; if none is pressed right now, we just wait until
+     * the next step to check for one
+     */
+    if (chip->key_states == 0) {
+        *new_pc = chip->pc;
+        return 0;
+    }
+    key = ffs(chip->key_states) - 1;
+    chip->regs[inst.vx] = key;
+    /* Now we need to clear it so that we don't read it twice */
+    chip->key_states &= ~(1 << key);
+    return 0;
+}
+
+static int chip8_op_ld_dt_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->reg_dt = chip->regs[inst.vx];
+    return 0;
+}
+
+static int chip8_op_ld_st(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->reg_st = chip->regs[inst.vx];
+    return 0;
+}
+
+static int chip8_op_add_i(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->reg_i += chip->regs[inst.vx];
+    return 0;
+}
+
+static int chip8_op_ld_f(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->reg_i = CHIP8_HEX_LOW_ADDR +
+        CHIP8_HEX_LOW_HEIGHT * (chip->regs[inst.vx] & 0xF);
+    return 0;
+}
+
+static int chip8_op_ld_hf(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    chip->reg_i = CHIP8_HEX_HIGH_ADDR +
+        CHIP8_HEX_HIGH_HEIGHT * (chip->regs[inst.vx] & 0xF);
+    return 0;
+}
+
+static int chip8_op_ld_b(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    if (chip->reg_i + 2 >= CHIP8_MEM_SIZE) {
+        log_error("Tried to write to out of bounds memory");
+        chip8_log_regs(chip);
+        return 1;
+    }
+    /* Note that register Vx is only a byte, so it's 3 digits or fewer */
+    chip->mem[chip->reg_i] = chip->regs[inst.vx] / 100;
+    chip->mem[chip->reg_i + 1] = (chip->regs[inst.vx] / 10) % 10;
+    chip->mem[chip->reg_i + 2] = chip->regs[inst.vx] % 10;
+    chip8_mem_invalidate(chip, chip->reg_i, 3);
+    return 0;
+}
+
+static int chip8_op_ld_deref_i_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    size_t cpy_len = sizeof(chip->regs[0]) * (inst.vx + 1);
+
+    UNUSED(new_pc);
+
+    if (chip->reg_i + cpy_len - 1 >= CHIP8_MEM_SIZE) {
+        log_error("Tried to write to out of bounds memory");
+        chip8_log_regs(chip);
+        return 1;
+    }
+    memcpy(chip->mem + chip->reg_i, chip->regs, cpy_len);
+    chip8_mem_invalidate(chip, chip->reg_i, cpy_len);
+    if (chip->opts.load_quirks)
+        chip->reg_i += cpy_len;
+    return 0;
+}
+
+static int chip8_op_ld_reg_deref_i(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    size_t cpy_len = sizeof(chip->regs[0]) * (inst.vx + 1);
+
+    UNUSED(new_pc);
+
+    if (chip->reg_i + cpy_len - 1 >= CHIP8_MEM_SIZE) {
+        log_error("Tried to read from out of bounds memory");
+        chip8_log_regs(chip);
+        return 1;
+    }
+    memcpy(chip->regs, chip->mem + chip->reg_i, cpy_len);
+    if (chip->opts.load_quirks)
+        chip->reg_i += cpy_len;
+    return 0;
+}
+
+static int chip8_op_ld_r_reg(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    if (inst.vx > 7) {
+        log_error(
+            "Instruction LD R, V%X would store too much data (%X > 7)",
+            inst.vx, inst.vx);
+        chip8_log_regs(chip);
+        return 1;
+    }
+    memcpy(chip->rpl, chip->regs, inst.vx + 1);
+    return 0;
+}
+
+static int chip8_op_ld_reg_r(
+    struct chip8 *chip, struct chip8_instruction inst, uint16_t *new_pc)
+{
+    UNUSED(new_pc);
+    if (inst.vx > 7) {
+        log_error(
+            "Instruction LD V%X, R would load too much data (%X > 7)",
+            inst.vx, inst.vx);
+        chip8_log_regs(chip);
+        return 1;
+    }
+    memcpy(chip->regs, chip->rpl, inst.vx + 1);
+    return 0;
+}
+
+static enum chip8_run_status chip8_run(
+    struct chip8 *chip, unsigned long n, bool until_frame)
+{
+    bool trace = log_get_level() >= LOG_TRACE;
+    /*
+     * Blocks skip the per-instruction checks, so they can only be used when
+     * we don't trace or sleep after each instruction.
+     */
+    bool use_blocks = !trace && !chip->profile &&
+        (chip->opts.virtual_timer || !chip->opts.enable_timer);
+    /* Skipped instructions would be missing from the trace */
+    bool skip_idle = chip->opts.skip_idle && use_blocks && !chip->trace;
+    /*
+     * Anything may have changed since the last call, so idle loops are only
+     * detected within a call.
+     */
+    struct idle_loop idle = {.pc = CHIP8_MEM_SIZE};
+    unsigned long start_ticks = chip->timer_ticks;
+    unsigned long done = 0;
+    bool waiting = false;
+    unsigned long wait_end = 0;
+
+    if (chip->halted)
+        return CHIP8_RUN_HALTED;
+    /*
+     * Without any timer, there is no way to tell when a frame ends, so we
+     * just use the number of instructions in a virtual tick.
+     */
+    if (until_frame && (chip->opts.virtual_timer || chip->opts.enable_timer))
+        n = ULONG_MAX;
+
+    while (done < n) {
+        uint16_t old_pc = chip->pc;
+        struct chip8_instruction instr;
+        bool was_waiting = waiting;
+
+        if (use_blocks) {
+            unsigned long len = chip8_block_len(chip);
+
+            if (len > n - done)
+                len = n - done;
+            /* Don't run past the next tick, since DT may be read */
+            if (chip->opts.virtual_timer &&
+                len > chip->opts.instrs_per_tick - chip->tick_instrs)
+                len = chip->opts.instrs_per_tick - chip->tick_instrs;
+            if (len != 0) {
+                if (chip8_block_run(chip, len) != 0)
+                    return CHIP8_RUN_ERROR;
+                done += len;
+                if (until_frame && chip->timer_ticks != start_ticks)
+                    return CHIP8_RUN_FRAME_DONE;
+                continue;
+            }
+        }
+
+        instr = chip8_current_instr(chip);
+        if (chip8_cycle(chip, trace) != 0)
+            return CHIP8_RUN_ERROR;
+        done++;
+        if (chip->halted)
+            return CHIP8_RUN_HALTED;
+        waiting = chip->pc == old_pc &&
+            chip8_current_instr(chip).op == OP_LD_KEY;
+        if (until_frame && chip->timer_ticks != start_ticks)
+            return waiting ? CHIP8_RUN_WAITING_KEY : CHIP8_RUN_FRAME_DONE;
+        if (waiting) {
+            /*
+             * The key states can't change until we return, so any further
+             * instructions in this call would be spent waiting.  Without a
+             * virtual timer, we can't tell how many that would be.
+             */
+            if (!chip->opts.virtual_timer)
+                return CHIP8_RUN_WAITING_KEY;
+            /*
+             * Otherwise they're skipped up to the next tick, or run one by
+             * one if they would be missing from a profile or trace.
+             */
+            if (!skip_idle) {
+                if (!was_waiting)
+                    wait_end = chip->timer_ticks + 1;
+                else if (chip->timer_ticks == wait_end)
+                    return CHIP8_RUN_WAITING_KEY;
+                continue;
+            }
+            {
+                unsigned long skip =
+                    chip->opts.instrs_per_tick - chip->tick_instrs;
 
-    /* Update internal timers */
+                if (skip > n - done)
+                    skip = n - done;
+                if (skip != 0) {
+                    chip->tick_instrs += skip;
+                    chip->cycles += skip;
+                    if (chip->tick_instrs >= chip->opts.instrs_per_tick)
+                        chip8_timer_virtual_tick(chip);
+                }
+            }
+            return CHIP8_RUN_WAITING_KEY;
+        }
+
+        if (!skip_idle)
+            continue;
+        if (idle_loop_breaks(instr)) {
+            idle.pc = CHIP8_MEM_SIZE;
+        } else if (instr.op == OP_JP && chip->pc <= old_pc) {
+            if (idle_loop_matches(&idle, chip, old_pc)) {
+                /*
+                 * Skip as many whole iterations as fit before the next tick,
+                 * which leaves the interpreter in exactly the state it would
+                 * have had after running them.
+                 */
+                unsigned long len = chip->cycles - idle.cycles;
+                unsigned long left = n - done;
+
+                if (chip->opts.virtual_timer &&
+                    left > chip->opts.instrs_per_tick - chip->tick_instrs)
+                    left = chip->opts.instrs_per_tick - chip->tick_instrs;
+                left -= left % len;
+                if (left != 0) {
+                    chip->cycles += left;
+                    done += left;
+                    if (chip->opts.virtual_timer) {
+                        chip->tick_instrs += left;
+                        if (chip->tick_instrs >= chip->opts.instrs_per_tick)
+                            chip8_timer_virtual_tick(chip);
+                    }
+                    if (until_frame && chip->timer_ticks != start_ticks)
+                        return CHIP8_RUN_FRAME_DONE;
+                }
+            }
+            idle_loop_save(&idle, chip, old_pc);
+        }
+    }
+
+    if (waiting)
+        return CHIP8_RUN_WAITING_KEY;
+    return until_frame ? CHIP8_RUN_FRAME_DONE : CHIP8_RUN_CYCLES_DONE;
+}
+
+static void chip8_timer_tick(struct chip8 *chip, unsigned long elapsed)
+{
     if (chip->reg_dt >= elapsed)
         chip->reg_dt -= elapsed;
     else
@@ -648,6 +2003,17 @@ static void chip8_timer_update(struct chip8 *chip)
         chip->reg_st = 0;
 }
 
+static void chip8_timer_update(struct chip8 *chip)
+{
+    unsigned long old_ticks = chip->timer_ticks;
+
+    chip8_timer_update_ticks(chip);
+    if (chip->timer_ticks != old_ticks) {
+        chip8_timer_tick(chip, chip->timer_ticks - old_ticks);
+        chip8_display_flush(chip);
+    }
+}
+
 static void chip8_timer_update_ticks(struct chip8 *chip)
 {
     struct timespec ts;
@@ -656,11 +2022,37 @@ static void chip8_timer_update_ticks(struct chip8 *chip)
     chip->timer_ticks = (ts.tv_sec + (double)ts.tv_nsec / NANOS_IN_SECOND) * chip->opts.timer_freq;
 }
 
+static void chip8_timer_virtual_tick(struct chip8 *chip)
+{
+    chip->timer_ticks++;
+    chip->tick_instrs = 0;
+    chip8_timer_tick(chip, 1);
+    chip8_display_flush(chip);
+}
+
 static void chip8_wait_cycle(struct chip8 *chip)
 {
     struct timespec now, wait, left;
     unsigned long waitnanos;
+    uint64_t start;
+
+    if (chip->profile) {
+        /* Avoid recursing back in here while profiling */
+        struct chip8_profile *profile = chip->profile;
 
+        chip->profile = NULL;
+        start = chip8_profile_nanos();
+        chip8_wait_cycle(chip);
+        profile->wait_nanos += chip8_profile_nanos() - start;
+        profile->waits++;
+        chip->profile = profile;
+        return;
+    }
+
+    if (chip->opts.virtual_timer) {
+        chip8_timer_virtual_tick(chip);
+        return;
+    }
     if (!chip->opts.enable_timer)
         return;
 
@@ -674,7 +2066,89 @@ static void chip8_wait_cycle(struct chip8 *chip)
     }
 }
 
-static uint8_t rand_byte(void)
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *bytes, size_t len)
 {
-    return (uint8_t)(255.0 * ((double)rand() / RAND_MAX));
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t hash_word(uint64_t hash, uint16_t word)
+{
+    const uint8_t bytes[] = {word >> 8, word & 0xFF};
+
+    return hash_bytes(hash, bytes, sizeof bytes);
+}
+
+static bool idle_loop_breaks(struct chip8_instruction instr)
+{
+    switch (instr.op) {
+    case OP_SCD:
+    case OP_SCR:
+    case OP_SCL:
+    case OP_DRW:
+    case OP_LD_B:
+    case OP_LD_DEREF_I_REG:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool idle_loop_matches(
+    const struct idle_loop *idle, const struct chip8 *chip, uint16_t pc)
+{
+    return idle->pc == pc && chip->cycles > idle->cycles &&
+        memcmp(idle->regs, chip->regs, sizeof idle->regs) == 0 &&
+        memcmp(idle->rpl, chip->rpl, sizeof idle->rpl) == 0 &&
+        idle->reg_i == chip->reg_i && idle->reg_dt == chip->reg_dt &&
+        idle->reg_st == chip->reg_st &&
+        idle->key_states == chip->key_states &&
+        idle->rand_state == chip->rand_state &&
+        idle->stack_size == chip->stack_size &&
+        memcmp(idle->call_stack, chip->call_stack,
+            chip->stack_size * sizeof chip->call_stack[0]) == 0;
+}
+
+static void idle_loop_save(
+    struct idle_loop *idle, const struct chip8 *chip, uint16_t pc)
+{
+    idle->pc = pc;
+    idle->cycles = chip->cycles;
+    memcpy(idle->regs, chip->regs, sizeof idle->regs);
+    memcpy(idle->rpl, chip->rpl, sizeof idle->rpl);
+    idle->reg_i = chip->reg_i;
+    idle->reg_dt = chip->reg_dt;
+    idle->reg_st = chip->reg_st;
+    idle->key_states = chip->key_states;
+    idle->rand_state = chip->rand_state;
+    idle->stack_size = chip->stack_size;
+    memcpy(idle->call_stack, chip->call_stack,
+        chip->stack_size * sizeof chip->call_stack[0]);
+}
+
+static uint8_t rand_byte(struct chip8 *chip)
+{
+    uint32_t x = chip->rand_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    chip->rand_state = x;
+    return x >> 24;
+}
+
+static uint32_t rand_init(uint32_t seed)
+{
+    uint32_t x = seed;
+
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    x ^= x >> 16;
+    /* The xorshift generator must never be seeded with zero */
+    return x ? x : 1;
 }
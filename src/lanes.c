@@ -0,0 +1,488 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "lanes.h"
+
+#include <stdlib.h>
+
+#include "log.h"
+#include "memory.h"
+
+/**
+ * Selects between two values using a mask which is either all ones (giving
+ * `new`) or all zeros (giving `old`).
+ *
+ * Writing updates this way rather than with a branch lets the compiler
+ * vectorize the loops over the lanes.
+ */
+#define LANES_SELECT(mask, new, old) (((new) & (mask)) | ((old) & ~(mask)))
+
+/**
+ * Copies the state of an interpreter into its lane.
+ */
+static void lanes_load(struct chip8_lanes *lanes, int lane);
+/**
+ * Copies the state of a lane back into its interpreter.
+ */
+static void lanes_store(struct chip8_lanes *lanes, int lane);
+/**
+ * Returns the opcode at the given address in a lane's memory.
+ */
+static uint16_t lanes_opcode(
+    const struct chip8_lanes *lanes, int lane, uint16_t addr);
+/**
+ * Returns the decoded form of the given opcode at the given address.
+ */
+static struct chip8_instruction lanes_decode(
+    struct chip8_lanes *lanes, uint16_t addr, uint16_t opcode);
+/**
+ * Returns whether the given instruction can be executed by
+ * `lanes_execute_masked`.
+ *
+ * These are the instructions which only touch the registers kept in
+ * structure-of-arrays form, and which can't fail or wait.
+ */
+static bool lanes_vectorizable(struct chip8_instruction instr);
+/**
+ * Executes an instruction at the given address on every lane in the mask.
+ *
+ * @param mask For each lane, 0xFF if the instruction should be executed and
+ * 0 otherwise.
+ */
+static void lanes_execute_masked(struct chip8_lanes *lanes,
+    struct chip8_instruction instr, uint16_t addr,
+    const uint8_t mask[CHIP8_LANES]);
+/**
+ * Executes the current instruction of a single lane using its interpreter.
+ *
+ * @param rest_of_frame Whether to run the rest of the lane's frame rather than
+ * a single instruction.
+ * @param start_ticks The value of each interpreter's `timer_ticks` at the
+ * start of the frame.
+ * @param[out] status Set to the lane's result if its frame is done.
+ */
+static void lanes_execute_single(struct chip8_lanes *lanes, int lane,
+    bool rest_of_frame, const unsigned long start_ticks[],
+    enum chip8_run_status status[]);
+/**
+ * Executes the next group of lanes which share a program counter.
+ *
+ * The group chosen is the one with the lowest program counter, since lanes
+ * which have fallen behind the others (for example, by taking a branch around
+ * some code) are likely to catch up with them there.
+ *
+ * @return Whether there were any active lanes.
+ */
+static bool lanes_step(struct chip8_lanes *lanes,
+    const unsigned long start_ticks[], enum chip8_run_status status[]);
+
+struct chip8_lanes *chip8_lanes_new(struct chip8 **chips, int n_chips)
+{
+    struct chip8_lanes *lanes = xcalloc(1, sizeof *lanes);
+
+    if (n_chips > CHIP8_LANES) {
+        log_error("Too many interpreters for a lane group (maximum is %d)", CHIP8_LANES);
+        free(lanes);
+        return NULL;
+    }
+    for (int l = 0; l < n_chips; l++) {
+        if (!chips[l]->opts.virtual_timer) {
+            log_error("Lane groups require the virtual timer");
+            free(lanes);
+            return NULL;
+        }
+        lanes->chips[l] = chips[l];
+    }
+    lanes->n_lanes = n_chips;
+
+    return lanes;
+}
+
+void chip8_lanes_destroy(struct chip8_lanes *lanes)
+{
+    free(lanes);
+}
+
+void chip8_lanes_run_frame(
+    struct chip8_lanes *lanes, enum chip8_run_status status[])
+{
+    unsigned long start_ticks[CHIP8_LANES] = {0};
+    bool loaded[CHIP8_LANES] = {false};
+
+    for (int l = 0; l < CHIP8_LANES; l++) {
+        lanes->active[l] = false;
+        if (l >= lanes->n_lanes)
+            continue;
+        if (lanes->stopped[l]) {
+            status[l] = CHIP8_RUN_ERROR;
+        } else if (lanes->chips[l]->halted) {
+            status[l] = CHIP8_RUN_HALTED;
+        } else {
+            lanes_load(lanes, l);
+            start_ticks[l] = lanes->chips[l]->timer_ticks;
+            lanes->active[l] = loaded[l] = true;
+        }
+    }
+
+    while (lanes_step(lanes, start_ticks, status))
+        ;
+
+    for (int l = 0; l < lanes->n_lanes; l++)
+        if (loaded[l])
+            lanes_store(lanes, l);
+}
+
+static void lanes_load(struct chip8_lanes *lanes, int lane)
+{
+    const struct chip8 *chip = lanes->chips[lane];
+
+    for (int r = 0; r < 16; r++)
+        lanes->regs[r][lane] = chip->regs[r];
+    lanes->reg_i[lane] = chip->reg_i;
+    lanes->pc[lane] = chip->pc;
+    lanes->reg_dt[lane] = chip->reg_dt;
+    lanes->reg_st[lane] = chip->reg_st;
+    lanes->key_states[lane] = chip->key_states;
+    lanes->tick_instrs[lane] = chip->tick_instrs;
+    lanes->cycles[lane] = chip->cycles;
+}
+
+static void lanes_store(struct chip8_lanes *lanes, int lane)
+{
+    struct chip8 *chip = lanes->chips[lane];
+
+    for (int r = 0; r < 16; r++)
+        chip->regs[r] = lanes->regs[r][lane];
+    chip->reg_i = lanes->reg_i[lane];
+    chip->pc = lanes->pc[lane];
+    chip->reg_dt = lanes->reg_dt[lane];
+    chip->reg_st = lanes->reg_st[lane];
+    chip->key_states = lanes->key_states[lane];
+    chip->tick_instrs = lanes->tick_instrs[lane];
+    chip->cycles = lanes->cycles[lane];
+}
+
+static uint16_t lanes_opcode(
+    const struct chip8_lanes *lanes, int lane, uint16_t addr)
+{
+    const uint8_t *mem = lanes->chips[lane]->mem;
+
+    return (uint16_t)mem[addr] << 8 | mem[addr + 1];
+}
+
+static struct chip8_instruction lanes_decode(
+    struct chip8_lanes *lanes, uint16_t addr, uint16_t opcode)
+{
+    bool shift_quirks = lanes->chips[0]->opts.shift_quirks;
+    size_t slot = addr / 2;
+
+    if (addr % 2 != 0)
+        return chip8_instruction_from_opcode(opcode, shift_quirks);
+    if (!lanes->instr_valid[slot] || lanes->instr_opcode[slot] != opcode) {
+        lanes->instr_cache[slot] =
+            chip8_instruction_from_opcode(opcode, shift_quirks);
+        lanes->instr_opcode[slot] = opcode;
+        lanes->instr_valid[slot] = true;
+    }
+    return lanes->instr_cache[slot];
+}
+
+static bool lanes_vectorizable(struct chip8_instruction instr)
+{
+    switch (instr.op) {
+    case OP_JP:
+        /* A misaligned jump is an error, which is left to the interpreter */
+        return instr.addr % 2 == 0;
+    case OP_SE_BYTE:
+    case OP_SNE_BYTE:
+    case OP_SE_REG:
+    case OP_SNE_REG:
+    case OP_SKP:
+    case OP_SKNP:
+    case OP_LD_BYTE:
+    case OP_ADD_BYTE:
+    case OP_LD_REG:
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+    case OP_ADD_REG:
+    case OP_SUB:
+    case OP_SHR:
+    case OP_SHR_QUIRK:
+    case OP_SUBN:
+    case OP_SHL:
+    case OP_SHL_QUIRK:
+    case OP_LD_I:
+    case OP_ADD_I:
+    case OP_LD_REG_DT:
+    case OP_LD_DT_REG:
+    case OP_LD_ST:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void lanes_execute_masked(struct chip8_lanes *lanes,
+    struct chip8_instruction instr, uint16_t addr,
+    const uint8_t mask[CHIP8_LANES])
+{
+    /*
+     * The register arguments are undefined for instructions which don't use
+     * them, so they're masked to keep the pointers in bounds.
+     */
+    uint8_t *vx = lanes->regs[instr.vx & 0xF];
+    uint8_t *vy = lanes->regs[instr.vy & 0xF];
+    uint8_t *vf = lanes->regs[REG_VF];
+    /* Whether each lane skips the next instruction (0 or 1) */
+    uint8_t skip[CHIP8_LANES] = {0};
+    uint16_t next_pc = addr + 2;
+
+    /*
+     * Each case is a separate loop so that the loops themselves are simple
+     * enough to vectorize.  VF is always written last, to match the
+     * interpreter when it is also the destination register.
+     */
+    switch (instr.op) {
+    case OP_JP:
+        next_pc = instr.addr;
+        break;
+    case OP_SE_BYTE:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            skip[l] = vx[l] == instr.byte;
+        break;
+    case OP_SNE_BYTE:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            skip[l] = vx[l] != instr.byte;
+        break;
+    case OP_SE_REG:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            skip[l] = vx[l] == vy[l];
+        break;
+    case OP_SNE_REG:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            skip[l] = vx[l] != vy[l];
+        break;
+    case OP_SKP:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            skip[l] = (lanes->key_states[l] >> (vx[l] & 0xF)) & 1;
+        break;
+    case OP_SKNP:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            skip[l] = !((lanes->key_states[l] >> (vx[l] & 0xF)) & 1);
+        break;
+    case OP_LD_BYTE:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            vx[l] = LANES_SELECT(mask[l], instr.byte, vx[l]);
+        break;
+    case OP_ADD_BYTE:
+        for (int l = 0; l < CHIP8_LANES; l++) {
+            uint8_t carry = instr.byte > 255 - vx[l];
+
+            vx[l] = LANES_SELECT(mask[l], (uint8_t)(vx[l] + instr.byte), vx[l]);
+            vf[l] = LANES_SELECT(mask[l], carry, vf[l]);
+        }
+        break;
+    case OP_LD_REG:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            vx[l] = LANES_SELECT(mask[l], vy[l], vx[l]);
+        break;
+    case OP_OR:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            vx[l] = LANES_SELECT(mask[l], vx[l] | vy[l], vx[l]);
+        break;
+    case OP_AND:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            vx[l] = LANES_SELECT(mask[l], vx[l] & vy[l], vx[l]);
+        break;
+    case OP_XOR:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            vx[l] = LANES_SELECT(mask[l], vx[l] ^ vy[l], vx[l]);
+        break;
+    case OP_ADD_REG:
+        for (int l = 0; l < CHIP8_LANES; l++) {
+            uint8_t carry = vy[l] > 255 - vx[l];
+
+            vx[l] = LANES_SELECT(mask[l], (uint8_t)(vx[l] + vy[l]), vx[l]);
+            vf[l] = LANES_SELECT(mask[l], carry, vf[l]);
+        }
+        break;
+    case OP_SUB:
+        for (int l = 0; l < CHIP8_LANES; l++) {
+            uint8_t borrow = vy[l] <= vx[l];
+
+            vx[l] = LANES_SELECT(mask[l], (uint8_t)(vx[l] - vy[l]), vx[l]);
+            vf[l] = LANES_SELECT(mask[l], borrow, vf[l]);
+        }
+        break;
+    case OP_SHR:
+        for (int l = 0; l < CHIP8_LANES; l++) {
+            uint8_t low = vx[l] & 0x1;
+
+            vx[l] = LANES_SELECT(mask[l], vx[l] >> 1, vx[l]);
+            vf[l] = LANES_SELECT(mask[l], low, vf[l]);
+        }
+        break;
+    case OP_SHR_QUIRK:
+        for (int l = 0; l < CHIP8_LANES; l++) {
+            uint8_t low = vy[l] & 0x1;
+
+            vx[l] = LANES_SELECT(mask[l], vy[l] >> 1, vx[l]);
+            vf[l] = LANES_SELECT(mask[l], low, vf[l]);
+        }
+        break;
+    case OP_SUBN:
+        for (int l = 0; l < CHIP8_LANES; l++) {
+            uint8_t borrow = vx[l] <= vy[l];
+
+            vx[l] = LANES_SELECT(mask[l], (uint8_t)(vy[l] - vx[l]), vx[l]);
+            vf[l] = LANES_SELECT(mask[l], borrow, vf[l]);
+        }
+        break;
+    case OP_SHL:
+        for (int l = 0; l < CHIP8_LANES; l++) {
+            uint8_t high = vx[l] >> 7;
+
+            vx[l] = LANES_SELECT(mask[l], (uint8_t)(vx[l] << 1), vx[l]);
+            vf[l] = LANES_SELECT(mask[l], high, vf[l]);
+        }
+        break;
+    case OP_SHL_QUIRK:
+        for (int l = 0; l < CHIP8_LANES; l++) {
+            uint8_t high = vy[l] >> 7;
+
+            vx[l] = LANES_SELECT(mask[l], (uint8_t)(vy[l] << 1), vx[l]);
+            vf[l] = LANES_SELECT(mask[l], high, vf[l]);
+        }
+        break;
+    case OP_LD_I:
+        for (int l = 0; l < CHIP8_LANES; l++) {
+            uint16_t mask16 = -(uint16_t)(mask[l] & 1);
+
+            lanes->reg_i[l] = LANES_SELECT(mask16, instr.addr, lanes->reg_i[l]);
+        }
+        break;
+    case OP_ADD_I:
+        for (int l = 0; l < CHIP8_LANES; l++) {
+            uint16_t mask16 = -(uint16_t)(mask[l] & 1);
+
+            lanes->reg_i[l] = LANES_SELECT(mask16,
+                (uint16_t)(lanes->reg_i[l] + vx[l]), lanes->reg_i[l]);
+        }
+        break;
+    case OP_LD_REG_DT:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            vx[l] = LANES_SELECT(mask[l], lanes->reg_dt[l], vx[l]);
+        break;
+    case OP_LD_DT_REG:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            lanes->reg_dt[l] = LANES_SELECT(mask[l], vx[l], lanes->reg_dt[l]);
+        break;
+    case OP_LD_ST:
+        for (int l = 0; l < CHIP8_LANES; l++)
+            lanes->reg_st[l] = LANES_SELECT(mask[l], vx[l], lanes->reg_st[l]);
+        break;
+    default:
+        break;
+    }
+
+    for (int l = 0; l < CHIP8_LANES; l++) {
+        uint16_t mask16 = -(uint16_t)(mask[l] & 1);
+
+        lanes->pc[l] = LANES_SELECT(
+            mask16, (uint16_t)(next_pc + 2 * skip[l]), lanes->pc[l]);
+        lanes->cycles[l] += mask[l] & 1;
+        lanes->tick_instrs[l] += mask[l] & 1;
+    }
+}
+
+static void lanes_execute_single(struct chip8_lanes *lanes, int lane,
+    bool rest_of_frame, const unsigned long start_ticks[],
+    enum chip8_run_status status[])
+{
+    struct chip8 *chip = lanes->chips[lane];
+    enum chip8_run_status result;
+    bool done;
+
+    lanes_store(lanes, lane);
+    if (rest_of_frame) {
+        result = chip8_run_until_frame(chip);
+        done = true;
+    } else {
+        result = chip8_run_cycles(chip, 1);
+        if (result == CHIP8_RUN_ERROR || result == CHIP8_RUN_HALTED) {
+            done = true;
+        } else if (chip->timer_ticks != start_ticks[lane]) {
+            result = CHIP8_RUN_FRAME_DONE;
+            done = true;
+        } else {
+            done = false;
+        }
+    }
+    lanes_load(lanes, lane);
+
+    if (result == CHIP8_RUN_ERROR)
+        lanes->stopped[lane] = true;
+    if (done) {
+        lanes->active[lane] = false;
+        status[lane] = result;
+    }
+}
+
+static bool lanes_step(struct chip8_lanes *lanes,
+    const unsigned long start_ticks[], enum chip8_run_status status[])
+{
+    unsigned long ipt = lanes->chips[0]->opts.instrs_per_tick;
+    uint8_t mask[CHIP8_LANES] = {0};
+    int singles[CHIP8_LANES];
+    int n_singles = 0;
+    bool any_masked = false;
+    int leader = -1;
+    uint16_t pc, opcode;
+    struct chip8_instruction instr;
+    bool vector;
+
+    for (int l = 0; l < lanes->n_lanes; l++)
+        if (lanes->active[l] && (leader < 0 || lanes->pc[l] < lanes->pc[leader]))
+            leader = l;
+    if (leader < 0)
+        return false;
+
+    pc = lanes->pc[leader];
+    if (pc >= CHIP8_MEM_SIZE - 1) {
+        /* Let the interpreter report the error */
+        lanes_execute_single(lanes, leader, false, start_ticks, status);
+        return true;
+    }
+    opcode = lanes_opcode(lanes, leader, pc);
+    instr = lanes_decode(lanes, pc, opcode);
+    vector = lanes_vectorizable(instr);
+
+    for (int l = leader; l < lanes->n_lanes; l++) {
+        if (!lanes->active[l] || lanes->pc[l] != pc ||
+            lanes_opcode(lanes, l, pc) != opcode)
+            continue;
+        /*
+         * The instruction which reaches the next tick is left to the
+         * interpreter, since it needs to update the timers.
+         */
+        if (vector && lanes->tick_instrs[l] + 1 < ipt) {
+            mask[l] = 0xFF;
+            any_masked = true;
+        } else {
+            singles[n_singles++] = l;
+        }
+    }
+
+    if (any_masked)
+        lanes_execute_masked(lanes, instr, pc, mask);
+    for (int i = 0; i < n_singles; i++)
+        lanes_execute_single(lanes, singles[i], instr.op == OP_LD_KEY,
+            start_ticks, status);
+
+    return true;
+}
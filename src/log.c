@@ -80,9 +80,12 @@ void log_message(enum log_level level, const char *fmt, ...)
     va_list args;
     va_start(args, fmt);
     if (log_output != NULL && level <= max_level) {
+        /* Keep messages from different threads from being interleaved */
+        flockfile(log_output);
         fprintf(log_output, "%s: %s: ", progname, log_level_string(level));
         vfprintf(log_output, fmt, args);
         putc('\n', log_output);
+        funlockfile(log_output);
     }
     va_end(args);
 }
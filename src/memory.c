@@ -12,9 +12,60 @@
 
 #include "log.h"
 
+/**
+ * The size of an ordinary arena block, in bytes.
+ */
+#define ARENA_BLOCK_SIZE 16384
+
+/**
+ * A type with the strictest alignment requirement of any basic type.
+ */
+union arena_align {
+    long l;
+    long long ll;
+    double d;
+    long double ld;
+    void *p;
+    void (*f)(void);
+};
+
+/**
+ * A block of memory belonging to an arena.
+ */
+struct arena_block {
+    /**
+     * The next (older) block.
+     */
+    struct arena_block *next;
+    /**
+     * The size of `data`, in bytes.
+     */
+    size_t size;
+    /**
+     * The number of bytes of `data` which have been allocated.
+     */
+    size_t used;
+    /**
+     * The memory of the block (flexible array member).
+     */
+    union arena_align data[];
+};
+
+#ifdef CHIP8_COUNT_ALLOCS
+/**
+ * The number of allocations made so far.
+ */
+static unsigned long n_allocs;
+#define COUNT_ALLOC() (n_allocs++)
+#else
+#define COUNT_ALLOC() ((void)0)
+#endif
+
 void *xcalloc(size_t n, size_t sz)
 {
     void *ret;
+
+    COUNT_ALLOC();
     if (n == 0 || sz == 0)
         die(2, "xcalloc: zero size allocation");
     ret = calloc(n, sz);
@@ -29,6 +80,8 @@ void *xcalloc(size_t n, size_t sz)
 void *xmalloc(size_t sz)
 {
     void *ret;
+
+    COUNT_ALLOC();
     if (sz == 0)
         die(2, "xmalloc: zero size allocation");
     ret = malloc(sz);
@@ -41,6 +94,8 @@ void *xmalloc(size_t sz)
 void *xrealloc(void *ptr, size_t sz)
 {
     void *ret;
+
+    COUNT_ALLOC();
     if (sz == 0)
         die(2, "xrealloc: zero size allocation");
     ret = realloc(ptr, sz);
@@ -53,8 +108,73 @@ void *xrealloc(void *ptr, size_t sz)
 char *xstrdup(const char *s)
 {
     char *ret = strdup(s);
+
+    COUNT_ALLOC();
     if (ret)
         return ret;
     else
         die(2, "xstrdup: out of memory");
 }
+
+void *arena_alloc(struct arena *arena, size_t sz)
+{
+    struct arena_block *block = arena->blocks;
+    void *ret;
+
+    /* Keep every allocation aligned */
+    sz = (sz + sizeof(union arena_align) - 1) / sizeof(union arena_align) *
+        sizeof(union arena_align);
+    if (sz > ARENA_BLOCK_SIZE / 4) {
+        /*
+         * Large allocations get a block of their own, placed behind the
+         * current one so that the rest of the current one isn't wasted.
+         */
+        struct arena_block *large = xmalloc(sizeof *large + sz);
+
+        large->size = large->used = sz;
+        if (block) {
+            large->next = block->next;
+            block->next = large;
+        } else {
+            large->next = NULL;
+            arena->blocks = large;
+        }
+        return large->data;
+    }
+    if (!block || block->size - block->used < sz) {
+        block = xmalloc(sizeof *block + ARENA_BLOCK_SIZE);
+        block->size = ARENA_BLOCK_SIZE;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    ret = (char *)block->data + block->used;
+    block->used += sz;
+    return ret;
+}
+
+char *arena_strndup(struct arena *arena, const char *s, size_t len)
+{
+    char *ret = arena_alloc(arena, len + 1);
+
+    memcpy(ret, s, len);
+    ret[len] = '\0';
+    return ret;
+}
+
+void arena_clear(struct arena *arena)
+{
+    while (arena->blocks) {
+        struct arena_block *next = arena->blocks->next;
+
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+#ifdef CHIP8_COUNT_ALLOCS
+unsigned long xalloc_count(void)
+{
+    return n_allocs;
+}
+#endif
@@ -0,0 +1,206 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "memory.h"
+
+struct pool;
+
+/**
+ * The state of a single worker thread.
+ */
+struct pool_worker {
+    /**
+     * The pool to which this worker belongs.
+     */
+    struct pool *pool;
+    /**
+     * The index of this worker.
+     */
+    int index;
+    /**
+     * The thread running this worker.
+     *
+     * This is meaningless for the first worker, which runs in the thread that
+     * called `pool_run`.
+     */
+    pthread_t thread;
+    /**
+     * Whether `thread` was successfully created.
+     */
+    bool started;
+    /**
+     * Protects `next` and `end`.
+     */
+    pthread_mutex_t lock;
+    /**
+     * The next item to be processed by this worker.
+     */
+    size_t next;
+    /**
+     * One past the last item to be processed by this worker.
+     *
+     * The owner of the range takes items from the front, while other workers
+     * steal them from the back.
+     */
+    size_t end;
+};
+
+/**
+ * The shared state of a pool.
+ */
+struct pool {
+    struct pool_worker *workers;
+    int n_workers;
+    pool_func func;
+    void *data;
+};
+
+/**
+ * Takes the next item from a worker's own range.
+ *
+ * @return Whether there was an item to take.
+ */
+static bool pool_take(struct pool_worker *worker, size_t *item);
+/**
+ * Steals half of the remaining items of another worker, replacing the range
+ * of the given worker (which must be empty).
+ *
+ * @return Whether any items were stolen.
+ */
+static bool pool_steal(struct pool_worker *worker);
+/**
+ * Processes items until there are none left to take or steal.
+ *
+ * This has the signature required by `pthread_create`.
+ */
+static void *pool_work(void *arg);
+
+int pool_run(int n_threads, size_t n_items, pool_func func, void *data)
+{
+    struct pool pool;
+    int n_locks = 0;
+    int err;
+    int retval = 0;
+
+    if (n_threads < 1)
+        n_threads = 1;
+    if ((size_t)n_threads > n_items)
+        n_threads = n_items > 0 ? (int)n_items : 1;
+
+    pool.workers = xcalloc(n_threads, sizeof *pool.workers);
+    pool.n_workers = n_threads;
+    pool.func = func;
+    pool.data = data;
+
+    for (int i = 0; i < n_threads; i++) {
+        struct pool_worker *worker = &pool.workers[i];
+
+        worker->pool = &pool;
+        worker->index = i;
+        worker->next = n_items * i / n_threads;
+        worker->end = n_items * (i + 1) / n_threads;
+        if ((err = pthread_mutex_init(&worker->lock, NULL)) != 0) {
+            log_error("Could not create worker lock: %s", strerror(err));
+            retval = 1;
+            goto EXIT_LOCKS_CREATED;
+        }
+        n_locks++;
+    }
+
+    /*
+     * A worker which can't be started isn't fatal, since its items will just
+     * be stolen by the others.
+     */
+    for (int i = 1; i < n_threads; i++) {
+        struct pool_worker *worker = &pool.workers[i];
+
+        if ((err = pthread_create(&worker->thread, NULL, pool_work, worker)) != 0)
+            log_warning("Could not start worker thread %d: %s", i, strerror(err));
+        else
+            worker->started = true;
+    }
+    pool_work(&pool.workers[0]);
+    for (int i = 1; i < n_threads; i++)
+        if (pool.workers[i].started)
+            pthread_join(pool.workers[i].thread, NULL);
+
+EXIT_LOCKS_CREATED:
+    for (int i = 0; i < n_locks; i++)
+        pthread_mutex_destroy(&pool.workers[i].lock);
+    free(pool.workers);
+    return retval;
+}
+
+static bool pool_take(struct pool_worker *worker, size_t *item)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->next < worker->end) {
+        *item = worker->next++;
+        found = true;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+static bool pool_steal(struct pool_worker *worker)
+{
+    struct pool *pool = worker->pool;
+
+    /* Start with the next worker so that thieves don't all pick the same one */
+    for (int i = 1; i < pool->n_workers; i++) {
+        struct pool_worker *victim =
+            &pool->workers[(worker->index + i) % pool->n_workers];
+        size_t next = 0, end = 0;
+
+        /*
+         * Only one lock is ever held at a time, so there's no possibility of
+         * deadlock; the stolen items are invisible to other thieves until
+         * they're placed in our range, but that just means someone else has to
+         * look elsewhere.
+         */
+        pthread_mutex_lock(&victim->lock);
+        if (victim->next < victim->end) {
+            end = victim->end;
+            next = end - (end - victim->next + 1) / 2;
+            victim->end = next;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (next < end) {
+            pthread_mutex_lock(&worker->lock);
+            worker->next = next;
+            worker->end = end;
+            pthread_mutex_unlock(&worker->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *pool_work(void *arg)
+{
+    struct pool_worker *worker = arg;
+    struct pool *pool = worker->pool;
+    size_t item;
+
+    do {
+        while (pool_take(worker, &item))
+            pool->func(item, worker->index, pool->data);
+    } while (pool_steal(worker));
+
+    return NULL;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "profile.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "memory.h"
+
+/**
+ * The number of instructions listed as hot spots.
+ */
+#define PROFILE_HOT_SPOTS 20
+
+/**
+ * The name of each operation, indexed by `op - OP_INVALID`.
+ */
+static const char *const op_names[CHIP8_PROFILE_OPS] = {
+    [OP_INVALID - OP_INVALID] = "(invalid)",
+    [OP_SCD - OP_INVALID] = "SCD nibble",
+    [OP_CLS - OP_INVALID] = "CLS",
+    [OP_RET - OP_INVALID] = "RET",
+    [OP_SCR - OP_INVALID] = "SCR",
+    [OP_SCL - OP_INVALID] = "SCL",
+    [OP_EXIT - OP_INVALID] = "EXIT",
+    [OP_LOW - OP_INVALID] = "LOW",
+    [OP_HIGH - OP_INVALID] = "HIGH",
+    [OP_JP - OP_INVALID] = "JP addr",
+    [OP_CALL - OP_INVALID] = "CALL addr",
+    [OP_SE_BYTE - OP_INVALID] = "SE Vx, byte",
+    [OP_SNE_BYTE - OP_INVALID] = "SNE Vx, byte",
+    [OP_SE_REG - OP_INVALID] = "SE Vx, Vy",
+    [OP_LD_BYTE - OP_INVALID] = "LD Vx, byte",
+    [OP_ADD_BYTE - OP_INVALID] = "ADD Vx, byte",
+    [OP_LD_REG - OP_INVALID] = "LD Vx, Vy",
+    [OP_OR - OP_INVALID] = "OR Vx, Vy",
+    [OP_AND - OP_INVALID] = "AND Vx, Vy",
+    [OP_XOR - OP_INVALID] = "XOR Vx, Vy",
+    [OP_ADD_REG - OP_INVALID] = "ADD Vx, Vy",
+    [OP_SUB - OP_INVALID] = "SUB Vx, Vy",
+    [OP_SHR - OP_INVALID] = "SHR Vx",
+    [OP_SHR_QUIRK - OP_INVALID] = "SHR Vx, Vy",
+    [OP_SUBN - OP_INVALID] = "SUBN Vx, Vy",
+    [OP_SHL - OP_INVALID] = "SHL Vx",
+    [OP_SHL_QUIRK - OP_INVALID] = "SHL Vx, Vy",
+    [OP_SNE_REG - OP_INVALID] = "SNE Vx, Vy",
+    [OP_LD_I - OP_INVALID] = "LD I, addr",
+    [OP_JP_V0 - OP_INVALID] = "JP V0, addr",
+    [OP_RND - OP_INVALID] = "RND Vx, byte",
+    [OP_DRW - OP_INVALID] = "DRW Vx, Vy, nibble",
+    [OP_SKP - OP_INVALID] = "SKP Vx",
+    [OP_SKNP - OP_INVALID] = "SKNP Vx",
+    [OP_LD_REG_DT - OP_INVALID] = "LD Vx, DT",
+    [OP_LD_KEY - OP_INVALID] = "LD Vx, K",
+    [OP_LD_DT_REG - OP_INVALID] = "LD DT, Vx",
+    [OP_LD_ST - OP_INVALID] = "LD ST, Vx",
+    [OP_ADD_I - OP_INVALID] = "ADD I, Vx",
+    [OP_LD_F - OP_INVALID] = "LD F, Vx",
+    [OP_LD_HF - OP_INVALID] = "LD HF, Vx",
+    [OP_LD_B - OP_INVALID] = "LD B, Vx",
+    [OP_LD_DEREF_I_REG - OP_INVALID] = "LD [I], Vx",
+    [OP_LD_REG_DEREF_I - OP_INVALID] = "LD Vx, [I]",
+    [OP_LD_R_REG - OP_INVALID] = "LD R, Vx",
+    [OP_LD_REG_R - OP_INVALID] = "LD Vx, R",
+};
+
+/**
+ * Formats the location of the given address relative to the nearest label at
+ * or before it (such as `L01A+4`).
+ *
+ * If there is no such label, the address itself is used.
+ */
+static void profile_location(const struct chip8disasm *disasm, uint16_t addr,
+    char *dest, size_t sz);
+/**
+ * Formats the instruction at the given address, using label names for its
+ * operand if possible.
+ */
+static void profile_format(const struct chip8 *chip,
+    const struct chip8disasm *disasm, uint16_t addr, char *dest, size_t sz);
+
+struct chip8_profile *chip8_profile_new(void)
+{
+    return xcalloc(1, sizeof(struct chip8_profile));
+}
+
+void chip8_profile_destroy(struct chip8_profile *profile)
+{
+    free(profile);
+}
+
+int chip8_profile_report(const struct chip8_profile *profile,
+    const struct chip8 *chip, const struct chip8disasm *disasm, FILE *out)
+{
+    uint16_t hot[PROFILE_HOT_SPOTS];
+    int n_hot = 0;
+    uint64_t total = 0;
+    double percent;
+    char location[16], instr[64];
+
+    for (int op = 0; op < CHIP8_PROFILE_OPS; op++)
+        total += profile->op_counts[op];
+    /* The percentage of the total represented by a count of 1 */
+    percent = total > 0 ? 100.0 / total : 0.0;
+
+    fprintf(out, "# %" PRIu64 " instructions executed\n", total);
+    fprintf(out, "# %" PRIu64 " DRW instructions took %.3f ms\n",
+        profile->op_counts[OP_DRW - OP_INVALID], profile->draw_nanos / 1e6);
+    fprintf(out, "# %" PRIu64 " waits for the timer took %.3f ms\n",
+        profile->waits, profile->wait_nanos / 1e6);
+
+    fprintf(out, "\n# operation count percent\n");
+    for (int op = 0; op < CHIP8_PROFILE_OPS; op++)
+        if (profile->op_counts[op] != 0)
+            fprintf(out, "%-20s %12" PRIu64 " %6.2f%%\n", op_names[op],
+                profile->op_counts[op], percent * profile->op_counts[op]);
+
+    /* Find the hot spots by insertion into a sorted list */
+    for (int addr = 0; addr < CHIP8_MEM_SIZE; addr++) {
+        uint64_t count = profile->pc_counts[addr];
+        int pos;
+
+        if (count == 0 ||
+            (n_hot == PROFILE_HOT_SPOTS && count <= profile->pc_counts[hot[n_hot - 1]]))
+            continue;
+        if (n_hot < PROFILE_HOT_SPOTS)
+            n_hot++;
+        for (pos = n_hot - 1; pos > 0 && profile->pc_counts[hot[pos - 1]] < count; pos--)
+            hot[pos] = hot[pos - 1];
+        hot[pos] = addr;
+    }
+    fprintf(out, "\n# address location count percent instruction\n");
+    for (int i = 0; i < n_hot; i++) {
+        uint64_t count = profile->pc_counts[hot[i]];
+
+        profile_location(disasm, hot[i], location, sizeof location);
+        profile_format(chip, disasm, hot[i], instr, sizeof instr);
+        fprintf(out, "%03X %-10s %12" PRIu64 " %6.2f%%  %s\n", hot[i], location,
+            count, percent * count, instr);
+    }
+
+    fprintf(out, "\n# address label count instruction\n");
+    for (int addr = 0; addr < CHIP8_MEM_SIZE; addr++) {
+        if (profile->pc_counts[addr] == 0)
+            continue;
+        if (disasm && chip8disasm_has_label(disasm, addr))
+            snprintf(location, sizeof location, "L%03X:",
+                (unsigned)(addr - CHIP8_PROG_START));
+        else
+            location[0] = '\0';
+        profile_format(chip, disasm, addr, instr, sizeof instr);
+        fprintf(out, "%03X %-6s %12" PRIu64 "  %s\n", addr, location,
+            profile->pc_counts[addr], instr);
+    }
+
+    if (ferror(out)) {
+        log_error("Could not write profile: %s", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static void profile_location(const struct chip8disasm *disasm, uint16_t addr,
+    char *dest, size_t sz)
+{
+    if (disasm)
+        for (int label = addr; label >= CHIP8_PROG_START; label--)
+            if (chip8disasm_has_label(disasm, label)) {
+                if (label == addr)
+                    snprintf(dest, sz, "L%03X", label - CHIP8_PROG_START);
+                else
+                    snprintf(dest, sz, "L%03X+%X", label - CHIP8_PROG_START,
+                        addr - label);
+                return;
+            }
+    snprintf(dest, sz, "%03X", addr);
+}
+
+static void profile_format(const struct chip8 *chip,
+    const struct chip8disasm *disasm, uint16_t addr, char *dest, size_t sz)
+{
+    uint16_t opcode = addr + 1 < CHIP8_MEM_SIZE
+        ? (uint16_t)chip->mem[addr] << 8 | chip->mem[addr + 1]
+        : 0;
+    struct chip8_instruction instr =
+        chip8_instruction_from_opcode(opcode, chip->opts.shift_quirks);
+    char label[8];
+    bool use_label = disasm && chip8_instruction_uses_addr(instr) &&
+        chip8disasm_has_label(disasm, instr.addr);
+
+    if (use_label)
+        snprintf(label, sizeof label, "L%03X", instr.addr - CHIP8_PROG_START);
+    chip8_instruction_format(instr, use_label ? label : NULL, dest, sz);
+}
@@ -0,0 +1,405 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "replay.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "memory.h"
+
+/**
+ * The magic bytes at the start of a log.
+ */
+#define REPLAY_MAGIC "C8RP"
+/**
+ * The version of the log format.
+ */
+#define REPLAY_VERSION 1
+/**
+ * The size of the header at the start of a log.
+ */
+#define REPLAY_HEADER_SIZE 24
+/**
+ * The flag set in the header if load quirks mode is enabled.
+ */
+#define REPLAY_LOAD_QUIRKS 0x1
+/**
+ * The flag set in the header if shift quirks mode is enabled.
+ */
+#define REPLAY_SHIFT_QUIRKS 0x2
+
+/**
+ * The types of records in a log.
+ */
+enum replay_record {
+    /**
+     * The key states changed.
+     */
+    REPLAY_KEYS,
+    /**
+     * The log ended.
+     */
+    REPLAY_END,
+};
+
+struct chip8_recorder {
+    FILE *file;
+    /**
+     * The instruction count at the time of the last record.
+     */
+    uint64_t cycles;
+    /**
+     * The key states at the end of the last frame.
+     */
+    uint16_t key_states;
+};
+
+/**
+ * A position in a log, with the record found there.
+ */
+struct replay_cursor {
+    /**
+     * The offset just past the record.
+     */
+    size_t pos;
+    /**
+     * The instruction count at which the record applies.
+     */
+    uint64_t cycles;
+    enum replay_record type;
+    /**
+     * The new key states, for `REPLAY_KEYS`.
+     */
+    uint16_t key_states;
+};
+
+struct chip8_replay {
+    /**
+     * The full contents of the log.
+     */
+    uint8_t *data;
+    size_t len;
+    uint8_t flags;
+    uint32_t seed;
+    uint32_t instrs_per_tick;
+    uint64_t rom_hash;
+    /**
+     * The next record to be applied by `chip8_replay_run_frame`.
+     */
+    struct replay_cursor next;
+};
+
+/**
+ * Reads the record after the given one (or the first record, if the position
+ * is that of the end of the header).
+ *
+ * @return An error code.
+ */
+static int cursor_advance(
+    const struct chip8_replay *replay, struct replay_cursor *cursor);
+/**
+ * Writes a record to the log.
+ */
+static void recorder_write(struct chip8_recorder *rec, uint64_t cycles,
+    enum replay_record type, uint16_t key_states);
+/**
+ * Returns a hash of the contents of the given game.
+ */
+static uint64_t rom_hash(const struct chip8_rom *rom);
+/**
+ * Returns the big-endian value of the given length starting at `p`.
+ */
+static uint64_t get_be(const uint8_t *p, int len);
+/**
+ * Writes a value in big-endian form with the given length.
+ */
+static void put_be(uint8_t *p, uint64_t val, int len);
+
+struct chip8_recorder *chip8_recorder_new(
+    FILE *file, struct chip8_options opts, const struct chip8_rom *rom)
+{
+    struct chip8_recorder *rec;
+    uint8_t header[REPLAY_HEADER_SIZE] = {0};
+
+    if (!opts.virtual_timer) {
+        log_error("Recording requires the virtual timer");
+        return NULL;
+    }
+    if (opts.instrs_per_tick > UINT32_MAX) {
+        log_error("Too many instructions per tick to record");
+        return NULL;
+    }
+
+    memcpy(header, REPLAY_MAGIC, 4);
+    header[4] = REPLAY_VERSION;
+    header[5] = (opts.load_quirks ? REPLAY_LOAD_QUIRKS : 0) |
+        (opts.shift_quirks ? REPLAY_SHIFT_QUIRKS : 0);
+    put_be(header + 8, opts.seed, 4);
+    put_be(header + 12, opts.instrs_per_tick, 4);
+    put_be(header + 16, rom_hash(rom), 8);
+    if (fwrite(header, 1, sizeof header, file) != sizeof header) {
+        log_error("Could not write replay header: %s", strerror(errno));
+        return NULL;
+    }
+
+    rec = xmalloc(sizeof *rec);
+    rec->file = file;
+    rec->cycles = 0;
+    rec->key_states = 0;
+    return rec;
+}
+
+enum chip8_run_status chip8_recorder_run_frame(
+    struct chip8_recorder *rec, struct chip8 *chip)
+{
+    enum chip8_run_status status;
+
+    if (chip->key_states != rec->key_states) {
+        recorder_write(rec, chip->cycles, REPLAY_KEYS, chip->key_states);
+        if (ferror(rec->file)) {
+            log_error("Could not write to replay: %s", strerror(errno));
+            return CHIP8_RUN_ERROR;
+        }
+    }
+    status = chip8_run_until_frame(chip);
+    rec->key_states = chip->key_states;
+    return status;
+}
+
+int chip8_recorder_finish(struct chip8_recorder *rec, const struct chip8 *chip)
+{
+    int retval = 0;
+
+    recorder_write(rec, chip->cycles, REPLAY_END, 0);
+    if (fflush(rec->file) != 0 || ferror(rec->file)) {
+        log_error("Could not write to replay: %s", strerror(errno));
+        retval = 1;
+    }
+    free(rec);
+    return retval;
+}
+
+struct chip8_replay *chip8_replay_open(FILE *file)
+{
+    struct chip8_replay *replay = xmalloc(sizeof *replay);
+    size_t cap = 4096;
+
+    replay->data = xmalloc(cap);
+    replay->len = 0;
+    for (;;) {
+        replay->len += fread(replay->data + replay->len, 1, cap - replay->len, file);
+        if (replay->len < cap)
+            break;
+        replay->data = xrealloc(replay->data, cap *= 2);
+    }
+    if (ferror(file)) {
+        log_error("Error reading from replay: %s", strerror(errno));
+        goto ERROR;
+    }
+
+    if (replay->len < REPLAY_HEADER_SIZE ||
+        memcmp(replay->data, REPLAY_MAGIC, 4) != 0) {
+        log_error("File is not a replay");
+        goto ERROR;
+    }
+    if (replay->data[4] != REPLAY_VERSION) {
+        log_error("Unsupported replay version %u", replay->data[4]);
+        goto ERROR;
+    }
+    replay->flags = replay->data[5];
+    replay->seed = get_be(replay->data + 8, 4);
+    replay->instrs_per_tick = get_be(replay->data + 12, 4);
+    replay->rom_hash = get_be(replay->data + 16, 8);
+    if (replay->instrs_per_tick == 0) {
+        log_error("Replay is corrupt (no instructions per tick)");
+        goto ERROR;
+    }
+    replay->next.pos = REPLAY_HEADER_SIZE;
+    replay->next.cycles = 0;
+    if (cursor_advance(replay, &replay->next))
+        goto ERROR;
+    return replay;
+
+ERROR:
+    chip8_replay_close(replay);
+    return NULL;
+}
+
+void chip8_replay_close(struct chip8_replay *replay)
+{
+    if (!replay)
+        return;
+    free(replay->data);
+    free(replay);
+}
+
+struct chip8_options chip8_replay_options(
+    const struct chip8_replay *replay, struct chip8_options opts)
+{
+    opts.virtual_timer = true;
+    opts.instrs_per_tick = replay->instrs_per_tick;
+    opts.load_quirks = replay->flags & REPLAY_LOAD_QUIRKS;
+    opts.shift_quirks = replay->flags & REPLAY_SHIFT_QUIRKS;
+    opts.seed = replay->seed;
+    return opts;
+}
+
+bool chip8_replay_matches(
+    const struct chip8_replay *replay, const struct chip8_rom *rom)
+{
+    return replay->rom_hash == rom_hash(rom);
+}
+
+enum chip8_run_status chip8_replay_run(
+    const struct chip8_replay *replay, struct chip8 *chip)
+{
+    struct replay_cursor cursor = {.pos = REPLAY_HEADER_SIZE, .cycles = 0};
+
+    for (;;) {
+        if (cursor_advance(replay, &cursor))
+            return CHIP8_RUN_ERROR;
+        while (chip->cycles < cursor.cycles) {
+            uint64_t left = cursor.cycles - chip->cycles;
+            enum chip8_run_status status =
+                chip8_run_cycles(chip, left < ULONG_MAX ? left : ULONG_MAX);
+
+            if (status == CHIP8_RUN_ERROR || status == CHIP8_RUN_HALTED) {
+                log_warning("Interpreter stopped before the end of the replay");
+                return status;
+            }
+        }
+
+        if (cursor.type == REPLAY_END)
+            return chip->halted ? CHIP8_RUN_HALTED : CHIP8_RUN_CYCLES_DONE;
+        chip->key_states = cursor.key_states;
+    }
+}
+
+enum chip8_run_status chip8_replay_run_frame(
+    struct chip8_replay *replay, struct chip8 *chip)
+{
+    struct replay_cursor *next = &replay->next;
+
+    for (;;) {
+        unsigned long frame_left =
+            chip->opts.instrs_per_tick - chip->tick_instrs;
+        enum chip8_run_status status;
+
+        while (next->type == REPLAY_KEYS && next->cycles <= chip->cycles) {
+            chip->key_states = next->key_states;
+            if (cursor_advance(replay, next))
+                return CHIP8_RUN_ERROR;
+        }
+        /*
+         * The recorder only writes records between frames, but a record
+         * within the frame must still be applied at the right instruction.
+         */
+        if (next->type == REPLAY_END ||
+            next->cycles - chip->cycles >= frame_left)
+            return chip8_run_until_frame(chip);
+        status = chip8_run_cycles(chip, next->cycles - chip->cycles);
+        if (status == CHIP8_RUN_ERROR || status == CHIP8_RUN_HALTED)
+            return status;
+    }
+}
+
+bool chip8_replay_finished(
+    const struct chip8_replay *replay, const struct chip8 *chip)
+{
+    return replay->next.type == REPLAY_END &&
+        chip->cycles >= replay->next.cycles;
+}
+
+static int cursor_advance(
+    const struct chip8_replay *replay, struct replay_cursor *cursor)
+{
+    size_t pos = cursor->pos;
+    uint64_t delta = 0;
+    int shift = 0;
+    uint8_t byte;
+
+    /* Read the instruction count */
+    do {
+        if (pos >= replay->len || shift >= 64)
+            goto CORRUPT;
+        byte = replay->data[pos++];
+        delta |= (uint64_t)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    if (pos >= replay->len)
+        goto CORRUPT;
+    cursor->type = replay->data[pos++];
+    cursor->cycles += delta;
+
+    if (cursor->type == REPLAY_KEYS) {
+        if (replay->len - pos < 2)
+            goto CORRUPT;
+        cursor->key_states = get_be(replay->data + pos, 2);
+        pos += 2;
+    } else if (cursor->type != REPLAY_END) {
+        goto CORRUPT;
+    }
+    cursor->pos = pos;
+    return 0;
+
+CORRUPT:
+    log_error("Replay is corrupt (at byte %zu)", pos);
+    return 1;
+}
+
+static void recorder_write(struct chip8_recorder *rec, uint64_t cycles,
+    enum replay_record type, uint16_t key_states)
+{
+    uint64_t delta = cycles - rec->cycles;
+
+    do {
+        uint8_t byte = delta & 0x7F;
+
+        delta >>= 7;
+        putc(delta != 0 ? byte | 0x80 : byte, rec->file);
+    } while (delta != 0);
+    putc(type, rec->file);
+    if (type == REPLAY_KEYS) {
+        putc(key_states >> 8, rec->file);
+        putc(key_states & 0xFF, rec->file);
+    }
+
+    rec->cycles = cycles;
+}
+
+static uint64_t rom_hash(const struct chip8_rom *rom)
+{
+    /* 64-bit FNV-1a */
+    uint64_t hash = 0xCBF29CE484222325;
+
+    for (size_t i = 0; i < rom->len; i++) {
+        hash ^= rom->data[i];
+        hash *= 0x100000001B3;
+    }
+    return hash;
+}
+
+static uint64_t get_be(const uint8_t *p, int len)
+{
+    uint64_t val = 0;
+
+    for (int i = 0; i < len; i++)
+        val = val << 8 | p[i];
+    return val;
+}
+
+static void put_be(uint8_t *p, uint64_t val, int len)
+{
+    for (int i = len - 1; i >= 0; i--) {
+        p[i] = val & 0xFF;
+        val >>= 8;
+    }
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "rom.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "memory.h"
+
+/**
+ * Reads the rest of the given file into a new buffer.
+ *
+ * @return An error code.
+ */
+static int rom_read(int fd, const char *fname, struct chip8_rom *rom);
+
+struct chip8_rom *chip8_rom_open(const char *fname)
+{
+    struct chip8_rom *rom = xmalloc(sizeof *rom);
+    struct stat st;
+    int fd;
+
+    rom->data = NULL;
+    rom->len = 0;
+    rom->mapped = false;
+
+    if ((fd = open(fname, O_RDONLY)) == -1) {
+        log_error("Could not open game file '%s': %s", fname, strerror(errno));
+        goto ERROR_NOTHING_OPENED;
+    }
+    if (fstat(fd, &st) == -1) {
+        log_error("Could not get information about game file '%s': %s", fname,
+            strerror(errno));
+        goto ERROR_FILE_OPENED;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        if (rom_read(fd, fname, rom))
+            goto ERROR_FILE_OPENED;
+    } else if (st.st_size > CHIP8_PROG_SIZE) {
+        log_error("Input program is too big");
+        goto ERROR_FILE_OPENED;
+    } else if (st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED) {
+            log_error("Could not map game file '%s': %s", fname,
+                strerror(errno));
+            goto ERROR_FILE_OPENED;
+        }
+        rom->data = map;
+        rom->len = st.st_size;
+        rom->mapped = true;
+    }
+
+    close(fd);
+    return rom;
+
+ERROR_FILE_OPENED:
+    close(fd);
+ERROR_NOTHING_OPENED:
+    free(rom);
+    return NULL;
+}
+
+void chip8_rom_close(struct chip8_rom *rom)
+{
+    if (!rom)
+        return;
+    if (rom->mapped)
+        munmap((void *)rom->data, rom->len);
+    else
+        free((void *)rom->data);
+    free(rom);
+}
+
+void chip8_load_from_rom(struct chip8 *chip, const struct chip8_rom *rom)
+{
+    if (rom->len > 0)
+        memcpy(chip->mem + CHIP8_PROG_START, rom->data, rom->len);
+    chip8_mem_invalidate(chip, CHIP8_PROG_START, rom->len);
+}
+
+static int rom_read(int fd, const char *fname, struct chip8_rom *rom)
+{
+    /* One extra byte so that we can tell if the file is too big */
+    uint8_t *buf = xmalloc(CHIP8_PROG_SIZE + 1);
+    size_t len = 0;
+    ssize_t n;
+
+    while (len <= CHIP8_PROG_SIZE &&
+        (n = read(fd, buf + len, CHIP8_PROG_SIZE + 1 - len)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error("Error reading from game file '%s': %s", fname,
+                strerror(errno));
+            free(buf);
+            return 1;
+        }
+        len += n;
+    }
+    if (len > CHIP8_PROG_SIZE) {
+        log_error("Input program is too big");
+        free(buf);
+        return 1;
+    }
+
+    rom->data = buf;
+    rom->len = len;
+    return 0;
+}
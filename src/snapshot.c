@@ -0,0 +1,574 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "snapshot.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "memory.h"
+
+/**
+ * The magic bytes at the start of a snapshot.
+ */
+#define SNAPSHOT_MAGIC "C8SN"
+/**
+ * The version of the snapshot format.
+ *
+ * This must be incremented whenever the format changes.
+ */
+#define SNAPSHOT_VERSION 1
+/**
+ * The minimum number of consecutive unchanged bytes which will end a run of
+ * changed bytes in an encoded snapshot.
+ *
+ * Shorter runs cost less to include in the changed run than to encode
+ * separately.
+ */
+#define REWIND_MIN_ZERO_RUN 3
+/**
+ * An upper bound on the size of an encoded snapshot.
+ *
+ * In the worst case, every run of changed bytes is separated by the minimum
+ * number of unchanged bytes, and each run costs two bytes of lengths.
+ */
+#define REWIND_ENCODED_MAX                                                     \
+    (CHIP8_SNAPSHOT_SIZE + 2 * (CHIP8_SNAPSHOT_SIZE / REWIND_MIN_ZERO_RUN) + 16)
+
+/**
+ * An entry in the rewind history.
+ */
+struct rewind_entry {
+    /**
+     * The offset of the encoded snapshot in the history's data buffer.
+     */
+    size_t offset;
+    /**
+     * The length of the encoded snapshot.
+     */
+    size_t len;
+    /**
+     * Whether this is a keyframe.
+     *
+     * If not, the snapshot is a delta from the nearest keyframe before it.
+     */
+    bool keyframe;
+};
+
+struct chip8_rewind {
+    /**
+     * The buffer holding the encoded snapshots.
+     *
+     * Each snapshot is stored contiguously, after the one before it; if there
+     * isn't enough room left at the end of the buffer, it is placed at the
+     * beginning instead.
+     */
+    uint8_t *data;
+    size_t capacity;
+    /**
+     * The entries, as a circular buffer starting at `first`.
+     *
+     * The oldest entry is always a keyframe.
+     */
+    struct rewind_entry *entries;
+    size_t max_frames;
+    size_t first;
+    size_t count;
+    unsigned keyframe_interval;
+    /**
+     * The number of deltas since the newest keyframe.
+     */
+    unsigned since_keyframe;
+    /**
+     * Whether the next snapshot must be a keyframe (because `keyframe` is not
+     * the newest keyframe in the history).
+     */
+    bool need_keyframe;
+    /**
+     * The newest keyframe, decoded.
+     */
+    uint8_t keyframe[CHIP8_SNAPSHOT_SIZE];
+    /**
+     * Space for a decoded snapshot.
+     */
+    uint8_t snapshot[CHIP8_SNAPSHOT_SIZE];
+    /**
+     * Space for an encoded snapshot.
+     */
+    uint8_t encoded[REWIND_ENCODED_MAX];
+};
+
+static void put_u8(uint8_t **p, uint8_t val);
+static void put_u16(uint8_t **p, uint16_t val);
+static void put_u32(uint8_t **p, uint32_t val);
+static void put_u64(uint8_t **p, uint64_t val);
+static uint8_t get_u8(const uint8_t **p);
+static uint16_t get_u16(const uint8_t **p);
+static uint32_t get_u32(const uint8_t **p);
+static uint64_t get_u64(const uint8_t **p);
+
+/**
+ * Returns a pointer to the entry at the given position (0 being the oldest).
+ */
+static struct rewind_entry *rewind_entry(struct chip8_rewind *rw, size_t pos);
+/**
+ * Removes the oldest keyframe from the history, along with all the deltas
+ * which depend on it.
+ */
+static void rewind_evict(struct chip8_rewind *rw);
+/**
+ * Run-length encodes the difference between a snapshot and a base snapshot.
+ *
+ * The encoding is a sequence of runs, each consisting of the number of
+ * unchanged bytes, the number of changed bytes and then the changed bytes
+ * (XORed with the base), where the numbers are variable-length integers.
+ *
+ * @param base The snapshot to compare against, or NULL to compare against a
+ * snapshot which is all zeros.
+ * @return The length of the encoded data.
+ */
+static size_t rewind_encode(
+    const uint8_t *snapshot, const uint8_t *base, uint8_t *dest);
+/**
+ * Decodes a snapshot encoded by `rewind_encode`.
+ *
+ * @param base The base snapshot, or NULL if the encoding was made against
+ * zeros.
+ * @return An error code.
+ */
+static int rewind_decode(
+    const uint8_t *src, size_t len, const uint8_t *base, uint8_t *dest);
+/**
+ * Writes a variable-length integer, returning its length.
+ */
+static size_t varint_put(uint8_t *dest, size_t val);
+/**
+ * Reads a variable-length integer, returning its length (or 0 if the input
+ * ends first).
+ */
+static size_t varint_get(const uint8_t *src, size_t len, size_t *val);
+
+int chip8_snapshot_save(const struct chip8 *chip, uint8_t *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    if (len < CHIP8_SNAPSHOT_SIZE) {
+        log_error("Snapshot buffer is too small (need %d bytes, got %zu)",
+            CHIP8_SNAPSHOT_SIZE, len);
+        return 1;
+    }
+
+    memcpy(p, SNAPSHOT_MAGIC, 4);
+    p += 4;
+    put_u8(&p, SNAPSHOT_VERSION);
+    put_u8(&p, 0);
+    put_u16(&p, CHIP8_STACK_DEPTH);
+
+    memcpy(p, chip->mem, CHIP8_MEM_SIZE);
+    p += CHIP8_MEM_SIZE;
+    for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++)
+        for (int w = 0; w < CHIP8_DISPLAY_ROW_WORDS; w++)
+            put_u64(&p, chip->display[y][w]);
+    memcpy(p, chip->regs, sizeof chip->regs);
+    p += sizeof chip->regs;
+    memcpy(p, chip->rpl, sizeof chip->rpl);
+    p += sizeof chip->rpl;
+    put_u16(&p, chip->reg_i);
+    put_u8(&p, chip->reg_dt);
+    put_u8(&p, chip->reg_st);
+    put_u16(&p, chip->pc);
+    put_u8(&p, chip->halted);
+    put_u8(&p, chip->highres);
+    put_u64(&p, chip->timer_ticks);
+    put_u64(&p, chip->tick_instrs);
+    put_u64(&p, chip->cycles);
+    put_u16(&p, chip->stack_size);
+    for (int i = 0; i < CHIP8_STACK_DEPTH; i++)
+        put_u16(&p, i < chip->stack_size ? chip->call_stack[i] : 0);
+    put_u16(&p, chip->key_states);
+    put_u32(&p, chip->rand_state);
+
+    return 0;
+}
+
+int chip8_snapshot_load(struct chip8 *chip, const uint8_t *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    const uint8_t *state;
+    int stack_size;
+
+    if (len < CHIP8_SNAPSHOT_SIZE) {
+        log_error("Snapshot is too short (expected %d bytes, got %zu)",
+            CHIP8_SNAPSHOT_SIZE, len);
+        return 1;
+    }
+    if (memcmp(p, SNAPSHOT_MAGIC, 4) != 0) {
+        log_error("Data is not a snapshot");
+        return 1;
+    }
+    p += 4;
+    if (get_u8(&p) != SNAPSHOT_VERSION) {
+        log_error("Unsupported snapshot version %u", buf[4]);
+        return 1;
+    }
+    p++;
+    if (get_u16(&p) != CHIP8_STACK_DEPTH) {
+        log_error("Snapshot has a different call stack depth (expected %d)",
+            CHIP8_STACK_DEPTH);
+        return 1;
+    }
+
+    /* Check the rest of the state before changing anything */
+    state = p;
+    p += CHIP8_MEM_SIZE + CHIP8_DISPLAY_HEIGHT * CHIP8_DISPLAY_ROW_WORDS * 8 +
+        sizeof chip->regs + sizeof chip->rpl + 2 + 1 + 1 + 2;
+    if (p[0] > 1 || p[1] > 1) {
+        log_error("Snapshot is corrupt (invalid flags)");
+        return 1;
+    }
+    p += 2 + 8 + 8 + 8;
+    if ((stack_size = get_u16(&p)) > CHIP8_STACK_DEPTH) {
+        log_error("Snapshot is corrupt (invalid call stack size)");
+        return 1;
+    }
+
+    p = state;
+    memcpy(chip->mem, p, CHIP8_MEM_SIZE);
+    p += CHIP8_MEM_SIZE;
+    for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++)
+        for (int w = 0; w < CHIP8_DISPLAY_ROW_WORDS; w++)
+            chip->display[y][w] = get_u64(&p);
+    memcpy(chip->regs, p, sizeof chip->regs);
+    p += sizeof chip->regs;
+    memcpy(chip->rpl, p, sizeof chip->rpl);
+    p += sizeof chip->rpl;
+    chip->reg_i = get_u16(&p);
+    chip->reg_dt = get_u8(&p);
+    chip->reg_st = get_u8(&p);
+    chip->pc = get_u16(&p);
+    chip->halted = get_u8(&p);
+    chip->highres = get_u8(&p);
+    chip->timer_ticks = get_u64(&p);
+    chip->tick_instrs = get_u64(&p);
+    chip->cycles = get_u64(&p);
+    chip->stack_size = get_u16(&p);
+    for (int i = 0; i < CHIP8_STACK_DEPTH; i++)
+        chip->call_stack[i] = get_u16(&p);
+    chip->key_states = get_u16(&p);
+    chip->rand_state = get_u32(&p);
+    /* A zero seed would make the generator return nothing but zeros */
+    if (chip->rand_state == 0)
+        chip->rand_state = 1;
+
+    chip8_mem_invalidate(chip, 0, CHIP8_MEM_SIZE);
+    chip->dirty_rows = CHIP8_DISPLAY_ALL_ROWS;
+    return 0;
+}
+
+struct chip8_rewind *chip8_rewind_new(
+    size_t max_frames, size_t capacity, unsigned keyframe_interval)
+{
+    struct chip8_rewind *rw = xmalloc(sizeof *rw);
+
+    rw->data = xmalloc(capacity);
+    rw->capacity = capacity;
+    rw->entries = xcalloc(max_frames, sizeof *rw->entries);
+    rw->max_frames = max_frames;
+    rw->first = 0;
+    rw->count = 0;
+    rw->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    rw->since_keyframe = 0;
+    rw->need_keyframe = true;
+
+    return rw;
+}
+
+void chip8_rewind_destroy(struct chip8_rewind *rw)
+{
+    if (!rw)
+        return;
+    free(rw->data);
+    free(rw->entries);
+    free(rw);
+}
+
+size_t chip8_rewind_frames(const struct chip8_rewind *rw)
+{
+    return rw->count;
+}
+
+int chip8_rewind_push(struct chip8_rewind *rw, const struct chip8 *chip)
+{
+    struct rewind_entry *entry;
+    bool keyframe;
+    size_t len, offset;
+
+    if (chip8_snapshot_save(chip, rw->snapshot, sizeof rw->snapshot))
+        return 1;
+
+    keyframe = rw->need_keyframe || rw->since_keyframe + 1 >= rw->keyframe_interval;
+    len = rewind_encode(rw->snapshot, keyframe ? NULL : rw->keyframe, rw->encoded);
+    if (len > rw->capacity) {
+        log_error("Rewind buffer is too small to hold a snapshot");
+        return 1;
+    }
+
+    /*
+     * Make room for the new entry.  The space between the end of the newest
+     * entry and the start of the oldest is free; if the new entry doesn't fit
+     * before the end of the buffer, it goes at the start, and anything left
+     * between the newest entry and the end of the buffer is abandoned.
+     */
+    for (;;) {
+        size_t head;
+        bool conflict;
+
+        if (rw->count == 0) {
+            offset = 0;
+            break;
+        }
+        entry = rewind_entry(rw, rw->count - 1);
+        head = entry->offset + entry->len;
+        entry = rewind_entry(rw, 0);
+        if (head + len <= rw->capacity) {
+            offset = head;
+            conflict = entry->offset >= head && entry->offset < head + len;
+        } else {
+            offset = 0;
+            conflict = entry->offset >= head || entry->offset < len;
+        }
+        if (!conflict && rw->count < rw->max_frames)
+            break;
+
+        rewind_evict(rw);
+        /*
+         * If the keyframe we were going to use was evicted, everything after
+         * it was too, so we have to start again with a new keyframe.
+         */
+        if (rw->count == 0 && !keyframe) {
+            keyframe = true;
+            len = rewind_encode(rw->snapshot, NULL, rw->encoded);
+            if (len > rw->capacity) {
+                rw->need_keyframe = true;
+                log_error("Rewind buffer is too small to hold a snapshot");
+                return 1;
+            }
+        }
+    }
+
+    entry = rewind_entry(rw, rw->count++);
+    entry->offset = offset;
+    entry->len = len;
+    entry->keyframe = keyframe;
+    memcpy(rw->data + offset, rw->encoded, len);
+    if (keyframe) {
+        memcpy(rw->keyframe, rw->snapshot, sizeof rw->keyframe);
+        rw->since_keyframe = 0;
+        rw->need_keyframe = false;
+    } else {
+        rw->since_keyframe++;
+    }
+
+    return 0;
+}
+
+int chip8_rewind_pop(struct chip8_rewind *rw, struct chip8 *chip)
+{
+    struct rewind_entry *newest, *key;
+    size_t key_pos;
+
+    if (rw->count == 0) {
+        log_debug("No more snapshots to rewind to");
+        return 1;
+    }
+    newest = rewind_entry(rw, rw->count - 1);
+    for (key_pos = rw->count - 1; !rewind_entry(rw, key_pos)->keyframe; key_pos--)
+        ;
+    key = rewind_entry(rw, key_pos);
+
+    if (rewind_decode(rw->data + key->offset, key->len, NULL, rw->keyframe))
+        goto CORRUPT;
+    if (newest != key &&
+        rewind_decode(rw->data + newest->offset, newest->len, rw->keyframe, rw->snapshot))
+        goto CORRUPT;
+    if (chip8_snapshot_load(chip, newest == key ? rw->keyframe : rw->snapshot,
+            CHIP8_SNAPSHOT_SIZE))
+        goto CORRUPT;
+
+    rw->count--;
+    if (newest == key) {
+        /* The keyframe before this one (if any) hasn't been decoded */
+        rw->need_keyframe = true;
+    } else {
+        rw->since_keyframe = rw->count - 1 - key_pos;
+        rw->need_keyframe = false;
+    }
+    return 0;
+
+CORRUPT:
+    /* This should never happen, but the history is useless if it does */
+    log_error("Rewind history is corrupt; discarding it");
+    rw->count = 0;
+    rw->need_keyframe = true;
+    return 1;
+}
+
+static void put_u8(uint8_t **p, uint8_t val)
+{
+    *(*p)++ = val;
+}
+
+static void put_u16(uint8_t **p, uint16_t val)
+{
+    put_u8(p, val >> 8);
+    put_u8(p, val & 0xFF);
+}
+
+static void put_u32(uint8_t **p, uint32_t val)
+{
+    put_u16(p, val >> 16);
+    put_u16(p, val & 0xFFFF);
+}
+
+static void put_u64(uint8_t **p, uint64_t val)
+{
+    put_u32(p, val >> 32);
+    put_u32(p, val & 0xFFFFFFFF);
+}
+
+static uint8_t get_u8(const uint8_t **p)
+{
+    return *(*p)++;
+}
+
+static uint16_t get_u16(const uint8_t **p)
+{
+    uint16_t high = get_u8(p);
+
+    return high << 8 | get_u8(p);
+}
+
+static uint32_t get_u32(const uint8_t **p)
+{
+    uint32_t high = get_u16(p);
+
+    return high << 16 | get_u16(p);
+}
+
+static uint64_t get_u64(const uint8_t **p)
+{
+    uint64_t high = get_u32(p);
+
+    return high << 32 | get_u32(p);
+}
+
+static struct rewind_entry *rewind_entry(struct chip8_rewind *rw, size_t pos)
+{
+    return &rw->entries[(rw->first + pos) % rw->max_frames];
+}
+
+static void rewind_evict(struct chip8_rewind *rw)
+{
+    do {
+        rw->first = (rw->first + 1) % rw->max_frames;
+        rw->count--;
+    } while (rw->count > 0 && !rewind_entry(rw, 0)->keyframe);
+}
+
+static size_t rewind_encode(
+    const uint8_t *snapshot, const uint8_t *base, uint8_t *dest)
+{
+    size_t len = 0;
+    size_t pos = 0;
+
+    while (pos < CHIP8_SNAPSHOT_SIZE) {
+        size_t zeros = 0, changed, end;
+
+        while (pos + zeros < CHIP8_SNAPSHOT_SIZE &&
+            snapshot[pos + zeros] == (base ? base[pos + zeros] : 0))
+            zeros++;
+        pos += zeros;
+        /*
+         * The changed run ends at the last changed byte before a long enough
+         * run of unchanged bytes (shorter ones are included in it).
+         */
+        end = pos;
+        for (size_t i = pos;
+             i < CHIP8_SNAPSHOT_SIZE && i - end < REWIND_MIN_ZERO_RUN; i++)
+            if (snapshot[i] != (base ? base[i] : 0))
+                end = i + 1;
+        changed = end - pos;
+
+        len += varint_put(dest + len, zeros);
+        len += varint_put(dest + len, changed);
+        for (size_t i = 0; i < changed; i++)
+            dest[len++] = snapshot[pos + i] ^ (base ? base[pos + i] : 0);
+        pos += changed;
+    }
+
+    return len;
+}
+
+static int rewind_decode(
+    const uint8_t *src, size_t len, const uint8_t *base, uint8_t *dest)
+{
+    size_t in = 0, pos = 0;
+
+    while (in < len) {
+        size_t zeros, changed, n;
+
+        if ((n = varint_get(src + in, len - in, &zeros)) == 0)
+            return 1;
+        in += n;
+        if ((n = varint_get(src + in, len - in, &changed)) == 0)
+            return 1;
+        in += n;
+        if (zeros > CHIP8_SNAPSHOT_SIZE - pos ||
+            changed > CHIP8_SNAPSHOT_SIZE - pos - zeros || changed > len - in)
+            return 1;
+
+        for (size_t i = 0; i < zeros; i++, pos++)
+            dest[pos] = base ? base[pos] : 0;
+        for (size_t i = 0; i < changed; i++, pos++)
+            dest[pos] = src[in++] ^ (base ? base[pos] : 0);
+    }
+
+    return pos == CHIP8_SNAPSHOT_SIZE ? 0 : 1;
+}
+
+static size_t varint_put(uint8_t *dest, size_t val)
+{
+    size_t len = 0;
+
+    do {
+        uint8_t byte = val & 0x7F;
+
+        val >>= 7;
+        dest[len++] = val != 0 ? byte | 0x80 : byte;
+    } while (val != 0);
+
+    return len;
+}
+
+static size_t varint_get(const uint8_t *src, size_t len, size_t *val)
+{
+    size_t n = 0;
+    int shift = 0;
+
+    *val = 0;
+    while (n < len && shift < 64) {
+        uint8_t byte = src[n++];
+
+        *val |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return n;
+        shift += 7;
+    }
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2018 Ian Johnson
+ *
+ * This is free software, distributed under the MIT license.  A copy of the
+ * license can be found in the LICENSE file in the project root, or at
+ * https://opensource.org/licenses/MIT.
+ */
+#include "trace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "log.h"
+#include "memory.h"
+
+/**
+ * The magic bytes at the start of a saved trace.
+ */
+#define TRACE_MAGIC "C8TR"
+/**
+ * The version of the trace format.
+ */
+#define TRACE_VERSION 1
+/**
+ * The size (in bytes) of the header of a saved trace.
+ */
+#define TRACE_HEADER_SIZE 16
+/**
+ * The size (in bytes) of a saved record.
+ */
+#define TRACE_RECORD_SIZE 8
+/**
+ * The flag indicating shift quirks mode.
+ */
+#define TRACE_FLAG_SHIFT_QUIRKS 0x01
+/**
+ * The number of records to save or read at once.
+ */
+#define TRACE_CHUNK_RECORDS 512
+
+/**
+ * Returns the big-endian value of the given length starting at `p`.
+ */
+static uint64_t get_be(const uint8_t *p, int len);
+/**
+ * Writes a value in big-endian form with the given length.
+ */
+static void put_be(uint8_t *p, uint64_t val, int len);
+
+struct chip8_trace *chip8_trace_new(size_t capacity)
+{
+    struct chip8_trace *trace = xmalloc(sizeof *trace);
+    size_t len = 1;
+
+    while (len < capacity)
+        len *= 2;
+    trace->records = xcalloc(len, sizeof *trace->records);
+    trace->mask = len - 1;
+    trace->count = 0;
+    return trace;
+}
+
+void chip8_trace_destroy(struct chip8_trace *trace)
+{
+    if (!trace)
+        return;
+    free(trace->records);
+    free(trace);
+}
+
+size_t chip8_trace_len(const struct chip8_trace *trace)
+{
+    return trace->count > trace->mask ? trace->mask + 1 : trace->count;
+}
+
+int chip8_trace_write(
+    const struct chip8_trace *trace, bool shift_quirks, FILE *out)
+{
+    uint8_t buf[TRACE_CHUNK_RECORDS * TRACE_RECORD_SIZE];
+    size_t len = chip8_trace_len(trace);
+    uint64_t first = trace->count - len;
+
+    memcpy(buf, TRACE_MAGIC, 4);
+    buf[4] = TRACE_VERSION;
+    buf[5] = shift_quirks ? TRACE_FLAG_SHIFT_QUIRKS : 0;
+    buf[6] = buf[7] = 0;
+    put_be(buf + 8, first, 8);
+    fwrite(buf, 1, TRACE_HEADER_SIZE, out);
+
+    for (size_t done = 0; done < len;) {
+        size_t n = len - done < TRACE_CHUNK_RECORDS ? len - done
+                                                    : TRACE_CHUNK_RECORDS;
+
+        for (size_t i = 0; i < n; i++) {
+            const struct chip8_trace_record *rec =
+                &trace->records[(first + done + i) & trace->mask];
+            uint8_t *p = buf + i * TRACE_RECORD_SIZE;
+
+            put_be(p, rec->pc, 2);
+            put_be(p + 2, rec->opcode, 2);
+            put_be(p + 4, rec->reg_i, 2);
+            put_be(p + 6, rec->changed, 2);
+        }
+        fwrite(buf, TRACE_RECORD_SIZE, n, out);
+        done += n;
+    }
+
+    if (ferror(out)) {
+        log_error("Could not write trace: %s", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int chip8_trace_format(FILE *in, FILE *out)
+{
+    uint8_t buf[TRACE_CHUNK_RECORDS * TRACE_RECORD_SIZE];
+    uint64_t index;
+    bool shift_quirks;
+    size_t n;
+
+    if (fread(buf, 1, TRACE_HEADER_SIZE, in) != TRACE_HEADER_SIZE ||
+        memcmp(buf, TRACE_MAGIC, 4) != 0) {
+        log_error("File is not a trace");
+        return 1;
+    }
+    if (buf[4] != TRACE_VERSION) {
+        log_error("Unsupported trace version %u", buf[4]);
+        return 1;
+    }
+    shift_quirks = buf[5] & TRACE_FLAG_SHIFT_QUIRKS;
+    index = get_be(buf + 8, 8);
+
+    fprintf(out, "# index pc opcode i instruction changed\n");
+    while ((n = fread(buf, TRACE_RECORD_SIZE, TRACE_CHUNK_RECORDS, in)) > 0) {
+        for (size_t i = 0; i < n; i++, index++) {
+            const uint8_t *p = buf + i * TRACE_RECORD_SIZE;
+            uint16_t opcode = get_be(p + 2, 2);
+            uint16_t changed = get_be(p + 6, 2);
+            char instr[64];
+
+            chip8_instruction_format(
+                chip8_instruction_from_opcode(opcode, shift_quirks), NULL,
+                instr, sizeof instr);
+            fprintf(out, "%" PRIu64 " %03X %04X %03X %-20s", index,
+                (unsigned)get_be(p, 2), opcode, (unsigned)get_be(p + 4, 2),
+                instr);
+            for (int reg = 0; reg < 16; reg++)
+                if (changed & 1 << reg)
+                    fprintf(out, " V%X", reg);
+            fputc('\n', out);
+        }
+    }
+
+    if (ferror(in)) {
+        log_error("Could not read trace: %s", strerror(errno));
+        return 1;
+    }
+    if (ferror(out)) {
+        log_error("Could not write trace: %s", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static uint64_t get_be(const uint8_t *p, int len)
+{
+    uint64_t val = 0;
+
+    for (int i = 0; i < len; i++)
+        val = val << 8 | p[i];
+    return val;
+}
+
+static void put_be(uint8_t *p, uint64_t val, int len)
+{
+    for (int i = len - 1; i >= 0; i--) {
+        p[i] = val & 0xFF;
+        val >>= 8;
+    }
+}
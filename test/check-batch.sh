@@ -0,0 +1,60 @@
+#!/bin/sh
+# Test that chip8batch gives the same results regardless of the number of
+# threads or the use of lockstep execution, and that the seed and input scripts are respected.
+
+# Copyright 2018 Ian Johnson
+
+# This is free software, distributed under the MIT license.  A copy of the
+# license can be found in the LICENSE file in the project root, or at
+# https://opensource.org/licenses/MIT.
+
+ROMFILE=$(mktemp)
+TMPFILE1=$(mktemp)
+TMPFILE2=$(mktemp)
+RETVAL=0
+
+cd "$TESTDIR"
+echo "Working in '$PWD'"
+echo "chip8asm is '$CHIP8ASM'"
+echo "chip8batch is '$CHIP8BATCH'"
+
+fail() {
+    echo "ERROR: $1"
+    RETVAL=1
+}
+
+"$CHIP8ASM" check-batch/random.c8 -o "$ROMFILE" || fail "assembly failed"
+
+"$CHIP8BATCH" -n 64 -j 1 -f 20 -i check-batch/inputs "$ROMFILE" >"$TMPFILE1" ||
+    fail "single-threaded batch failed"
+"$CHIP8BATCH" -n 64 -j 4 -f 20 -i check-batch/inputs "$ROMFILE" >"$TMPFILE2" ||
+    fail "multi-threaded batch failed"
+diff "$TMPFILE1" "$TMPFILE2" >/dev/null ||
+    fail "results depend on the number of threads"
+
+# Running in lockstep must not change anything
+"$CHIP8BATCH" -L -n 64 -j 4 -f 20 -i check-batch/inputs "$ROMFILE" >"$TMPFILE2" ||
+    fail "lockstep batch failed"
+diff "$TMPFILE1" "$TMPFILE2" >/dev/null ||
+    fail "results depend on whether lockstep execution is used"
+
+# Instances alternate between the two scripts, so exactly half should halt
+grep -q '^# instances 64 halted 32 errors 0 ' "$TMPFILE1" ||
+    fail "input scripts were not applied"
+
+# Every instance has a different seed, so the displays should all differ
+if [ "$(grep -v '^#' "$TMPFILE1" | awk '{ print $8 }' | sort -u | wc -l)" -ne 64 ]; then
+    fail "instances with different seeds had identical displays"
+fi
+
+"$CHIP8BATCH" -n 64 -j 4 -f 20 -s 2 -i check-batch/inputs "$ROMFILE" >"$TMPFILE2" ||
+    fail "batch with another seed failed"
+diff "$TMPFILE1" "$TMPFILE2" >/dev/null &&
+    fail "changing the base seed did not change the results"
+
+if [ $RETVAL -eq 0 ]; then
+    echo "batch results are consistent"
+fi
+
+rm "$ROMFILE" "$TMPFILE1" "$TMPFILE2"
+exit $RETVAL
@@ -10,7 +10,8 @@
 
 TMPFILE1=$(mktemp)
 TMPFILE2=$(mktemp)
-PROGS="db pathological"
+TMPDIR1=$(mktemp -d)
+PROGS="carry db jumptable pathological skiploop"
 RETVAL=0
 
 cd "$TESTDIR"
@@ -38,5 +39,47 @@ for prog in $PROGS; do
     fi
 done
 
+# Corpus mode must give the same disassembly for each program
+mkdir "$TMPDIR1/in"
+for prog in $PROGS; do
+    "$CHIP8ASM" check-disasm/${prog}.c8 -o "$TMPDIR1/in/${prog}.bin"
+done
+"$CHIP8DISASM" --corpus --jobs=2 "$TMPDIR1/in" -o "$TMPDIR1/out" >/dev/null
+if [ $? -ne 0 ]; then
+    echo "ERROR: corpus disassembly failed"
+    RETVAL=1
+fi
+for prog in $PROGS; do
+    diff "$TMPDIR1/out/${prog}.c8" check-disasm/${prog}.disasm.c8 >/dev/null
+    if [ $? -ne 0 ]; then
+        echo "ERROR: $prog corpus disassembly failed expectations"
+        RETVAL=1
+    else
+        echo "$prog corpus disassembly succeeded"
+    fi
+done
+
+# Programs which would be written to the same file must be refused
+for prog in $PROGS; do
+    echo "$TMPDIR1/in/${prog}.bin"
+done >"$TMPFILE1"
+cp "$TMPDIR1/in/${prog}.bin" "$TMPDIR1/${prog}.ch8"
+echo "$TMPDIR1/${prog}.ch8" >>"$TMPFILE1"
+if "$CHIP8DISASM" --corpus "$TMPFILE1" -o "$TMPDIR1/out" >/dev/null 2>&1; then
+    echo "ERROR: corpus disassembly with clashing output names succeeded"
+    RETVAL=1
+else
+    echo "corpus disassembly with clashing output names refused"
+fi
+
+# So must programs which would be overwritten
+if "$CHIP8DISASM" --corpus "$TMPDIR1/out" -o "$TMPDIR1/out" >/dev/null 2>&1; then
+    echo "ERROR: corpus disassembly overwriting its programs succeeded"
+    RETVAL=1
+else
+    echo "corpus disassembly overwriting its programs refused"
+fi
+
 rm "$TMPFILE1" "$TMPFILE2"
+rm -r "$TMPDIR1"
 exit $RETVAL
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Test that the hash mode of chip8 gives the expected frame hashes, so that
+# changes to the interpreter which affect the behavior of games are noticed.
+
+# Copyright 2018 Ian Johnson
+
+# This is free software, distributed under the MIT license.  A copy of the
+# license can be found in the LICENSE file in the project root, or at
+# https://opensource.org/licenses/MIT.
+
+ROMFILE=$(mktemp)
+TMPFILE=$(mktemp)
+RETVAL=0
+
+cd "$TESTDIR"
+echo "Working in '$PWD'"
+echo "chip8 is '$CHIP8'"
+echo "chip8asm is '$CHIP8ASM'"
+
+fail() {
+    echo "ERROR: $1"
+    RETVAL=1
+}
+
+"$CHIP8ASM" check-hash/scroll.c8 -o "$ROMFILE" || fail "assembly failed"
+
+"$CHIP8" --hash --frames 60 --seed 1 "$ROMFILE" >"$TMPFILE" ||
+    fail "hash mode failed"
+diff -u check-hash/scroll.hash "$TMPFILE" ||
+    fail "hashes differ from the expected ones"
+
+"$CHIP8" --hash --frames 60 --seed 2 "$ROMFILE" >"$TMPFILE" ||
+    fail "hash mode with another seed failed"
+diff check-hash/scroll.hash "$TMPFILE" >/dev/null &&
+    fail "changing the seed did not change the hashes"
+
+# The number of frames is required without a recording
+"$CHIP8" --hash "$ROMFILE" >/dev/null 2>&1 &&
+    fail "hash mode without a number of frames succeeded"
+
+if [ $RETVAL -eq 0 ]; then
+    echo "hashes are as expected"
+fi
+
+rm "$ROMFILE" "$TMPFILE"
+exit $RETVAL